@@ -0,0 +1,210 @@
+#include "Bundler.h"
+
+#include <algorithm>
+#include <string>
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+/* the reserved channel id of the bundle Connection, which no ordinary channel to a peer
+ * with bundling enabled may use
+ */
+const channel_id_type Bundler::bundle_channel_id{0xff,0xff};
+
+
+/* Bundler::Bundler() takes the size of the largest payload which fits in one packet to
+ * the peer, the bundle window in microseconds, the function to call with each frame
+ * received from the peer, and the function to call when the channels' Connections can
+ * push frames again after has_room() has reported that there is no room
+ */
+Bundler::Bundler(unsigned int max_payload, unsigned int window_micros,
+                 deliver_function deliver, wake_function wake_senders):
+  max_payload_(max_payload),
+  window_nanos_(static_cast<nanos_t>(window_micros)*1000),
+  deliver_(std::move(deliver)),
+  wake_senders_(std::move(wake_senders)),
+  event_fd_(eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)),
+  frame_bytes_(0),
+  senders_blocked_(false)
+{
+  if(max_payload_ <= frame_header_len){
+    throw BundlerError("Bundler: packets are too small to carry frames");
+  }
+  if(event_fd_ == -1){
+    throw BundlerError("Bundler: could not create eventfd");
+  }
+}
+
+
+Bundler::~Bundler()
+{
+  close(event_fd_);
+}
+
+
+/* Bundler::max_frame_data() gives the largest amount of data which push() accepts for
+ * one frame, which is what fits in a packet along with the frame header
+ */
+unsigned int Bundler::max_frame_data()
+{ return max_payload_-frame_header_len; }
+
+
+/* Bundler::has_room() reports whether push() may be called. If it reports that there is
+ * no room, wake_senders_ is called once there is.
+ */
+bool Bundler::has_room()
+{
+  const std::lock_guard<std::mutex> frames_lock_guard(frames_lock_);
+  if(frame_bytes_ < capacity){
+    return true;
+  }
+  senders_blocked_ = true;
+  return false;
+}
+
+
+/* Bundler::push() adds a frame holding count bytes of data for the channel channel_id,
+ * which must be no more than max_frame_data(). The bundle Connection is woken if this is
+ * the first frame waiting, so that it can work out when to send it, or if there is now a
+ * full packet's worth of frames.
+ */
+void Bundler::push(const channel_id_type& channel_id, const unsigned char* data,
+                   unsigned int count)
+{
+  if(count > max_frame_data()){
+    throw BundlerError("Bundler: frame of "+std::to_string(count)+" bytes is too long");
+  }
+
+  std::vector<unsigned char> frame(frame_header_len+count);
+  std::copy(channel_id.begin(),channel_id.end(),frame.begin());
+  frame[channel_id_size] = count & 0xff;
+  frame[channel_id_size+1] = (count >> 8) & 0xff;
+  std::copy(data,data+count,frame.begin()+frame_header_len);
+
+  std::unique_lock<std::mutex> frames_lock(frames_lock_);
+  bool was_empty = frames_.empty();
+  bool was_full_packet = (frame_bytes_ >= max_payload_);
+  frame_bytes_ += frame.size();
+  frames_.emplace_back(monotonic_nanos(),std::move(frame));
+  bool now_full_packet = (frame_bytes_ >= max_payload_);
+  frames_lock.unlock();
+  if(was_empty or (now_full_packet and not was_full_packet)){
+    ring();
+  }
+}
+
+
+/* Bundler::read_into() packs as many of the waiting frames as fit in count bytes into
+ * dest, starting at position offset, if it is time to send them (see ready() ), and
+ * returns the number of bytes used. As frames are never too long for a packet, the second
+ * element of the return value is always false.
+ */
+std::pair<unsigned int,bool> Bundler::read_into(std::vector<unsigned char>& dest,
+                                                std::vector<unsigned char>::size_type offset,
+                                                unsigned int count)
+{
+  if(dest.size() < offset+count){
+    throw BundlerError("Bundler: no room in buffer for read");
+  }
+
+  std::unique_lock<std::mutex> frames_lock(frames_lock_);
+  if(not ready(monotonic_nanos())){
+    return {0,false};
+  }
+  unsigned int used = 0;
+  while( (not frames_.empty()) and (used+frames_.front().second.size() <= count) ){
+    std::vector<unsigned char>& frame = frames_.front().second;
+    std::copy(frame.begin(),frame.end(),dest.begin()+offset+used);
+    used += frame.size();
+    frame_bytes_ -= frame.size();
+    frames_.pop_front();
+  }
+  bool wake_senders = senders_blocked_ and (frame_bytes_ < capacity);
+  if(wake_senders){
+    senders_blocked_ = false;
+  }
+  frames_lock.unlock();
+  if(wake_senders){
+    wake_senders_();
+  }
+  return {used,false};
+}
+
+
+/* Bundler::write() unpacks the frames in a packet of count bytes from the peer, and passes
+ * each to deliver_. A truncated frame can only come from a peer which does not frame its
+ * packets properly, so it is dropped along with anything after it. The return value is
+ * as for SeqPacketEndpoint::write(), and is always {count,false}, as the frames are
+ * always taken.
+ */
+std::pair<unsigned int,bool> Bundler::write(const unsigned char* data, unsigned int count)
+{
+  unsigned int pos = 0;
+  while(pos+frame_header_len <= count){
+    channel_id_type channel_id;
+    std::copy(data+pos,data+pos+channel_id_size,channel_id.begin());
+    unsigned int length = data[pos+channel_id_size] | (data[pos+channel_id_size+1] << 8);
+    pos += frame_header_len;
+    if(pos+length > count){
+      break;
+    }
+    deliver_(channel_id,data+pos,length);
+    pos += length;
+  }
+  return {count,false};
+}
+
+
+/* Bundler::data_waiting() reports whether it is time to send the waiting frames. It
+ * clears the eventfd first, so that the bundle Connection is only woken again for pushes
+ * after this check.
+ */
+bool Bundler::data_waiting()
+{
+  uint64_t discard;
+  while( (read(event_fd_,&discard,sizeof(discard)) == -1) and (errno == EINTR) ){}
+  const std::lock_guard<std::mutex> frames_lock_guard(frames_lock_);
+  return ready(monotonic_nanos());
+}
+
+
+/* Bundler::file_descriptor() gives the eventfd which wakes the bundle Connection */
+int Bundler::file_descriptor()
+{ return event_fd_; }
+
+
+/* Bundler::flush_due() returns the time (from monotonic_nanos() ) at which the oldest
+ * waiting frame has waited for the bundle window, or 0 if there are no frames waiting
+ */
+nanos_t Bundler::flush_due()
+{
+  const std::lock_guard<std::mutex> frames_lock_guard(frames_lock_);
+  if(frames_.empty()){
+    return 0;
+  }
+  return frames_.front().first+window_nanos_;
+}
+
+
+/* Bundler::ready() reports whether the waiting frames should be sent at time now, which is
+ * when there is a full packet's worth of them, or the oldest has waited for the bundle
+ * window. frames_lock_ must be held.
+ */
+bool Bundler::ready(nanos_t now)
+{
+  if(frames_.empty()){
+    return false;
+  }
+  return (frame_bytes_ >= max_payload_) or (now >= frames_.front().first+window_nanos_);
+}
+
+
+/* Bundler::ring() makes file_descriptor() readable, to wake the bundle Connection */
+void Bundler::ring()
+{
+  uint64_t one = 1;
+  while( (::write(event_fd_,&one,sizeof(one)) == -1) and (errno == EINTR) ){}
+}
@@ -0,0 +1,95 @@
+/* A Bundler lets the channels to one peer share packets. Rather than each channel's
+ * Connection sealing its own packet for every message, the channels to a peer which has
+ * bundling enabled (see "bundle_window" in the user manual) hand their data to the peer's
+ * Bundler as frames, and a single extra Connection for the peer, on the reserved channel
+ * bundle_channel_id in mode ChannelMode::bundle, carries as many frames as fit in one
+ * packet, under one outer header and one AEAD tag. This saves both bandwidth and
+ * encryption work when there are many channels with small messages.
+ *
+ * Each frame is the channel id (2 bytes), then the length of the data (2 bytes, using the
+ * little-endian convention), then the data, and frames never span packets. The frames
+ * waiting in the Bundler are only sent once there is a full packet's worth of them, or
+ * once the oldest has waited for the bundle window, so that a burst of small messages on
+ * several channels shares packets while a lone message is only held up for that long.
+ *
+ * The first group of public methods below is used by the channels' Connections, and the
+ * second by the bundle Connection, which uses them in the same way as a SeqPacketEndpoint
+ * (see Connection::read_from_user() etc.). On the receiving side, the bundle Connection
+ * passes each decrypted packet to write(), which unpacks the frames and hands each to the
+ * "deliver" function given to the constructor. All of the methods are thread safe.
+ */
+
+#ifndef BUNDLER_H
+#define BUNDLER_H
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "IDTypes.h"
+#include "LatencyHistogram.h"
+
+class Bundler
+{
+public:
+  typedef std::function<void(const channel_id_type& channel_id,
+                             const unsigned char* data, unsigned int count)> deliver_function;
+  typedef std::function<void()> wake_function;
+
+  Bundler(unsigned int max_payload, unsigned int window_micros,
+          deliver_function deliver, wake_function wake_senders);
+  ~Bundler();
+
+  /* We do not allow copying of a Bundler, as it owns the eventfd */
+  Bundler(const Bundler& other) = delete;
+  Bundler& operator=(const Bundler& other) = delete;
+
+  /* used by the Connections of the bundled channels */
+  unsigned int max_frame_data();
+  bool has_room();
+  void push(const channel_id_type& channel_id, const unsigned char* data, unsigned int count);
+
+  /* used by the bundle Connection */
+  std::pair<unsigned int,bool> read_into(std::vector<unsigned char>& dest,
+                                         std::vector<unsigned char>::size_type offset,
+                                         unsigned int count);
+  std::pair<unsigned int,bool> write(const unsigned char* data, unsigned int count);
+  bool data_waiting();
+  int file_descriptor();
+  nanos_t flush_due();
+
+  constexpr static unsigned int frame_header_len = 4;
+  /* the number of bytes of frames which may be waiting before has_room() reports that
+     there is no more room */
+  constexpr static unsigned int capacity = 1048576;
+  static const channel_id_type bundle_channel_id;
+
+private:
+  bool ready(nanos_t now);
+  void ring();
+
+  const unsigned int max_payload_;
+  const nanos_t window_nanos_;
+  deliver_function deliver_;
+  wake_function wake_senders_;
+  int event_fd_;
+  std::mutex frames_lock_;
+  /* frames_ holds the encoded frames waiting to be sent, each with the time (from
+     monotonic_nanos() ) at which it was pushed */
+  std::deque<std::pair<nanos_t,std::vector<unsigned char>>> frames_;
+  unsigned int frame_bytes_;
+  /* senders_blocked_ records that has_room() has reported no room, so wake_senders_ must
+     be called once read_into() has made some */
+  bool senders_blocked_;
+};
+
+
+class BundlerError: public std::runtime_error{
+public:
+  BundlerError(const std::string& what_arg): runtime_error(what_arg){}
+};
+
+#endif
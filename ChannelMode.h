@@ -0,0 +1,42 @@
+/* this header defines the type used to select how a user program exchanges data
+ * with a channel (i.e. with its Connection)
+ */
+
+#ifndef CHANNELMODE_H
+#define CHANNELMODE_H
+
+/* In "fifo" mode (the default), the channel has two fifos, one for each direction,
+ * which carry streams of bytes. Data written to the outward fifo is split into
+ * packets wherever the Connection happens to read it, so the user program has to
+ * do its own framing.
+ *
+ * In "seqpacket" mode, the channel has a single Unix domain socket of type
+ * SOCK_SEQPACKET (see SeqPacketIO.h), which carries messages. Each message sent by
+ * the user program is carried in one packet, and arrives at the peer's user program
+ * as one message, so it must fit in a single packet.
+ *
+ * In "shm" mode, the channel carries messages as in "seqpacket" mode, but through a
+ * pair of ring buffers in shared memory (see ShmIO.h and ShmChannel.h), for a user
+ * program on the same host which moves a lot of data. The channel's two fifos only
+ * carry wake-ups.
+ *
+ * In "local" mode, the channel has no files at all. It is for an application which links
+ * in libcryptocomms and runs a Session itself, and which exchanges messages with the
+ * Connection through a LocalChannel (see LocalChannel.h) obtained from the Session.
+ *
+ * "bundle" mode is not for user channels, and cannot be set in the config file. It is
+ * the mode of the extra Connection which a Session creates for each peer with bundling
+ * enabled, whose user is the peer's Bundler (see Bundler.h). Likewise, "probe" mode is
+ * the mode of the extra Connection for each peer with path MTU discovery enabled, whose
+ * user is the peer's PathProber (see PathProber.h).
+ */
+enum class ChannelMode{
+  fifo,
+  seqpacket,
+  shm,
+  local,
+  bundle,
+  probe
+};
+
+#endif
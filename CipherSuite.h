@@ -0,0 +1,19 @@
+/* this header defines the type used to select which AEAD cipher suite a
+ * Connection (and its CryptoUnit) uses to protect its packets
+ */
+
+#ifndef CIPHERSUITE_H
+#define CIPHERSUITE_H
+
+/* Both suites take a 32 byte key and a 12 byte initialization vector, and
+ * produce a 16 byte AEAD tag, so they are interchangeable as far as the packet
+ * format is concerned. AES-256 GCM is the default, and is the best choice on
+ * hardware with AES and carry-less multiply instructions. ChaCha20-Poly1305 is
+ * much faster on hardware without these instructions.
+ */
+enum class CipherSuite{
+  aes_256_gcm,
+  chacha20_poly1305
+};
+
+#endif
@@ -0,0 +1,240 @@
+#include "Compressor.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+
+namespace
+{
+  /* the number of bits in a hash of 4 bytes of input, which sets the size of the hash
+     table */
+  constexpr unsigned int hash_bits = 12;
+
+  /* the largest offset of a match, which must fit in 2 bytes */
+  constexpr unsigned int max_offset = 0xffff;
+
+
+  /* read_4() reads 4 bytes at data as a number, in whatever byte order the machine uses,
+     which is fine as it is only used to compare and hash them */
+  std::uint32_t read_4(const unsigned char* data)
+  {
+    std::uint32_t n;
+    std::memcpy(&n,data,sizeof(n));
+    return n;
+  }
+
+
+  /* hash_4() hashes 4 bytes of input, read by read_4() */
+  unsigned int hash_4(std::uint32_t n)
+  { return static_cast<std::uint32_t>(n*2654435761u) >> (32-hash_bits); }
+
+
+  /* extra_len_bytes() gives how many extra bytes are needed to encode len in a length
+     field of 4 bits */
+  unsigned int extra_len_bytes(unsigned int len)
+  { return (len < 15) ? 0 : (len-15)/255+1; }
+
+
+  /* put_extra_len() writes the extra bytes for len, which extra_len_bytes() says are
+     needed, at dest, and returns the position after them */
+  unsigned char* put_extra_len(unsigned char* dest, unsigned int len)
+  {
+    if(len < 15){
+      return dest;
+    }
+    len -= 15;
+    while(len >= 255){
+      *dest++ = 255;
+      len -= 255;
+    }
+    *dest++ = len;
+    return dest;
+  }
+
+
+  /* get_extra_len() adds the extra bytes of a length field which holds 15, read from
+     data at position pos (which is advanced past them), to len, and reports whether they
+     were all there in the count bytes at data */
+  bool get_extra_len(const unsigned char* data, unsigned int count, unsigned int& pos,
+                     unsigned int& len)
+  {
+    unsigned char byte;
+    do{
+      if(pos >= count){
+        return false;
+      }
+      byte = data[pos++];
+      len += byte;
+    } while(byte == 255);
+    return true;
+  }
+}
+
+
+Compressor::Compressor():
+  hash_table_(1u << hash_bits,0),
+  base_(0),
+  poor_samples_(0),
+  skip_(0),
+  next_skip_(min_skip)
+{}
+
+
+/* Compressor::compress() compresses the count bytes at data into dest, which must have
+ * room for count bytes, and returns the length of the compressed form. If the data is not
+ * worth compressing, either because compressing it does not save enough or because
+ * recent data has not compressed well (see Compressor.h), the return value is 0, and the
+ * data should be sent raw.
+ */
+unsigned int Compressor::compress(const unsigned char* data, unsigned int count,
+                                  unsigned char* dest)
+{
+  if(count == 0){
+    return 0;
+  }
+  if(skip_ > 0){
+    skip_--;
+    return 0;
+  }
+
+  unsigned int len = compress_block(data,count,dest,count-count/min_saving_fraction-1);
+  if(len == 0){
+    poor_samples_++;
+    if(poor_samples_ >= poor_samples_to_skip){
+      /* pause, and after the pause a single poor sample starts a longer one */
+      skip_ = next_skip_;
+      next_skip_ = (2*next_skip_ < max_skip) ? 2*next_skip_ : max_skip;
+      poor_samples_ = poor_samples_to_skip-1;
+    }
+    return 0;
+  }
+  poor_samples_ = 0;
+  next_skip_ = min_skip;
+  return len;
+}
+
+
+/* Compressor::decompress() decompresses the count bytes at data, which were produced by
+ * compress(), into dest, which has room for dest_size bytes, and returns the length of
+ * the result. If the data is not valid, or the result would not fit, the return value is
+ * 0.
+ */
+unsigned int Compressor::decompress(const unsigned char* data, unsigned int count,
+                                    unsigned char* dest, unsigned int dest_size)
+{
+  unsigned int in = 0;
+  unsigned int out = 0;
+  while(in < count){
+    unsigned char token = data[in++];
+
+    /* copy the literals */
+    unsigned int literal_len = token >> 4;
+    if( (literal_len == 15) and (not get_extra_len(data,count,in,literal_len)) ){
+      return 0;
+    }
+    if( (literal_len > count-in) or (literal_len > dest_size-out) ){
+      return 0;
+    }
+    std::copy(data+in,data+in+literal_len,dest+out);
+    in += literal_len;
+    out += literal_len;
+    if(in == count){
+      break; // the final sequence has only literals
+    }
+
+    /* copy the match, a byte at a time as it may overlap what it copies */
+    if(count-in < 2){
+      return 0;
+    }
+    unsigned int offset = data[in] | (data[in+1] << 8);
+    in += 2;
+    unsigned int match_len = token & 0x0f;
+    if( (match_len == 15) and (not get_extra_len(data,count,in,match_len)) ){
+      return 0;
+    }
+    match_len += min_match;
+    if( (offset == 0) or (offset > out) or (match_len > dest_size-out) ){
+      return 0;
+    }
+    for(unsigned int i=0; i<match_len; i++, out++){
+      dest[out] = dest[out-offset];
+    }
+  }
+  return out;
+}
+
+
+/* Compressor::compress_block() compresses the count bytes at data into dest, and returns
+ * the length of the compressed form, or 0 if that would be more than dest_limit bytes.
+ * The hash table is not cleared for each call: positions are recorded in it offset by
+ * base_, which moves on by count bytes each time, so those from earlier calls are below
+ * base_ and are ignored.
+ */
+unsigned int Compressor::compress_block(const unsigned char* data, unsigned int count,
+                                        unsigned char* dest, unsigned int dest_limit)
+{
+  if(count > std::numeric_limits<std::uint32_t>::max()-base_){
+    std::fill(hash_table_.begin(),hash_table_.end(),0);
+    base_ = 0;
+  }
+
+  unsigned char* out = dest;
+  unsigned char* out_end = dest+dest_limit;
+  unsigned int anchor = 0; // the start of the literals not yet written
+  unsigned int pos = 0;
+
+  /* emit() writes a sequence of the literals from anchor to pos and a match of
+     match_len bytes at offset (or only the literals, if match_len is 0), and reports
+     whether there was room for it */
+  auto emit = [&](unsigned int match_len, unsigned int offset){
+    unsigned int literal_len = pos-anchor;
+    unsigned int match_field = (match_len == 0) ? 0 : match_len-min_match;
+    std::size_t needed = 1+extra_len_bytes(literal_len)+literal_len;
+    if(match_len != 0){
+      needed += 2+extra_len_bytes(match_field);
+    }
+    if(needed > static_cast<std::size_t>(out_end-out)){
+      return false;
+    }
+    *out++ = (std::min(literal_len,15u) << 4) | std::min(match_field,15u);
+    out = put_extra_len(out,literal_len);
+    out = std::copy(data+anchor,data+pos,out);
+    if(match_len != 0){
+      *out++ = offset & 0xff;
+      *out++ = offset >> 8;
+      out = put_extra_len(out,match_field);
+    }
+    return true;
+  };
+
+  while(pos+min_match <= count){
+    std::uint32_t seq = read_4(data+pos);
+    std::uint32_t& entry = hash_table_[hash_4(seq)];
+    std::uint32_t candidate = entry;
+    entry = base_+pos;
+    if( (candidate >= base_) and (candidate-base_ < pos) and
+        (pos-(candidate-base_) <= max_offset) and (read_4(data+candidate-base_) == seq) ){
+      unsigned int match_pos = candidate-base_;
+      unsigned int match_len = min_match;
+      while( (pos+match_len < count) and (data[match_pos+match_len] == data[pos+match_len]) ){
+        match_len++;
+      }
+      if(not emit(match_len,pos-match_pos)){
+        base_ += count;
+        return 0;
+      }
+      pos += match_len;
+      anchor = pos;
+    }
+    else{
+      pos++;
+    }
+  }
+  pos = count;
+  base_ += count;
+  if(not emit(0,0)){
+    return 0;
+  }
+  return out-dest;
+}
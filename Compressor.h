@@ -0,0 +1,71 @@
+/* A Compressor compresses the payloads of the packets sent on a channel with compression
+ * enabled (see "compression" in the user manual), for channels carrying data such as text
+ * or telemetry over links where bandwidth is short. Compression happens before encryption,
+ * as encrypted data does not compress.
+ *
+ * The codec is an LZ77 codec in the style of LZ4, chosen for speed rather than ratio, so
+ * that it costs little CPU time compared to the encryption. The compressed form is a
+ * series of sequences, each made up of a token byte (whose high 4 bits give the number of
+ * literal bytes, and low 4 bits the length of the match less min_match), any extra bytes
+ * of the literal length, the literal bytes, the offset of the match (2 bytes, using the
+ * little-endian convention), and any extra bytes of the match length. A length field of
+ * 15 is followed by extra bytes which are added to it, up to and including the first
+ * which is not 255. The final sequence has only literals.
+ *
+ * With compression enabled, the payload of every packet on the channel starts with a flag
+ * byte, which is compressed_flag if the rest is compressed and raw_flag if it is not.
+ * A payload is sent raw if compressing it does not save at least 1/min_saving_fraction of
+ * its length. As data which is already compressed or encrypted does not compress, after
+ * poor_samples_to_skip such payloads in a row the Compressor stops trying for a while,
+ * sending the next payloads raw without looking at them, and then tries again with a
+ * sample. The length of these pauses doubles each time the sample also fails to compress,
+ * up to max_skip, so that an incompressible stream costs almost no CPU time.
+ */
+
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+class Compressor
+{
+public:
+  Compressor();
+
+  unsigned int compress(const unsigned char* data, unsigned int count, unsigned char* dest);
+  static unsigned int decompress(const unsigned char* data, unsigned int count,
+                                 unsigned char* dest, unsigned int dest_size);
+
+  constexpr static unsigned char raw_flag = 0;
+  constexpr static unsigned char compressed_flag = 1;
+  constexpr static unsigned int min_match = 4;
+  constexpr static unsigned int min_saving_fraction = 16;
+  constexpr static unsigned int poor_samples_to_skip = 4;
+  constexpr static unsigned int min_skip = 16;
+  constexpr static unsigned int max_skip = 4096;
+
+private:
+  unsigned int compress_block(const unsigned char* data, unsigned int count,
+                              unsigned char* dest, unsigned int dest_limit);
+
+  /* hash_table_ holds, for each hash of 4 bytes of input, the position at which they
+     were last seen, offset by base_ (see compress_block() ) */
+  std::vector<std::uint32_t> hash_table_;
+  std::uint32_t base_;
+  /* poor_samples_ counts the payloads in a row which did not compress well enough, skip_
+     is how many more payloads to send raw without trying, and next_skip_ is the length of
+     the next such pause */
+  unsigned int poor_samples_;
+  unsigned int skip_;
+  unsigned int next_skip_;
+};
+
+
+class CompressorError: public std::runtime_error{
+public:
+  CompressorError(const std::string& what_arg): runtime_error(what_arg){}
+};
+
+#endif
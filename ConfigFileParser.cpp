@@ -7,18 +7,26 @@
 #include <cctype>
 #include <set>
 
+#include "Bundler.h"
+#include "PathProber.h"
+#include "Fragmentation.h"
+
 
 namespace
 {
   const std::string self_name = "self";
 
   /* FilePeerConfig is a subclass of PeerConfig which ConfigFileParser
-     uses internally to allow for the storage of the segnum file path
-     for the "self" host, which belongs in a config file but not in a
+     uses internally to allow for the storage of the segnum file path, the
+     number of crypto workers, the metrics socket path and the hibernation
+     period for the "self" host, which belong in a config file but not in a
      PeerConfig */
   struct FilePeerConfig: public PeerConfig
   {
     std::string segnum_filepath;
+    unsigned int num_crypto_workers = 0;
+    std::string metrics_socket_path;
+    unsigned int hibernate_after_seconds = 0;
   };
 
   /* not_isspace() is a simple predicate to be passed to algorithms */
@@ -287,6 +295,267 @@ namespace
   }
 
 
+  /* parse_crypto_workers() parses value_string into the number of threads to use for
+   * parallel encryption and decryption
+   */
+  unsigned int parse_crypto_workers(const std::string& value_string)
+  {
+    int num_workers;
+    try{
+      num_workers = parse_integer(value_string,0,256);
+    }
+    catch(ConfigLineError& e){
+      throw ConfigLineError(std::string("invalid crypto_workers, ")+e.what());
+    }
+
+    return num_workers;
+  }
+
+
+  /* parse_hibernate_after() parses value_string into the time (in seconds) for which a
+   * channel is left unused before it is put to sleep
+   */
+  unsigned int parse_hibernate_after(const std::string& value_string)
+  {
+    int hibernate_after;
+    try{
+      hibernate_after = parse_integer(value_string,1,86400);
+    }
+    catch(ConfigLineError& e){
+      throw ConfigLineError(std::string("invalid hibernate_after, ")+e.what());
+    }
+
+    return hibernate_after;
+  }
+
+
+  /* parse_pipe_size() parses value_string into the capacity (in bytes) to request for the
+   * pipe buffers of the fifos of a channel
+   */
+  unsigned int parse_pipe_size(const std::string& value_string)
+  {
+    int pipe_size;
+    try{
+      /* the kernel does not allow pipe buffers smaller than one page, and we set an upper
+       * limit of 256 MiB, far above the default limit for unprivileged processes of 1 MiB
+       * (see /proc/sys/fs/pipe-max-size)
+       */
+      pipe_size = parse_integer(value_string,4096,268435456);
+    }
+    catch(ConfigLineError& e){
+      throw ConfigLineError(std::string("invalid pipe_size, ")+e.what());
+    }
+
+    return pipe_size;
+  }
+
+
+  /* parse_bundle_window() parses value_string into the bundle window for a peer, in
+   * microseconds
+   */
+  unsigned int parse_bundle_window(const std::string& value_string)
+  {
+    int window;
+    try{
+      /* a window of more than a second would hold data back for longer than any
+       * application could want
+       */
+      window = parse_integer(value_string,1,1000000);
+    }
+    catch(ConfigLineError& e){
+      throw ConfigLineError(std::string("invalid bundle_window, ")+e.what());
+    }
+
+    return window;
+  }
+
+
+  /* parse_coalesce_window() parses value_string into the time, in microseconds, for which
+   * data from the user may be held back to fill a packet, where "immediate" means 0
+   */
+  unsigned int parse_coalesce_window(const std::string& value_string)
+  {
+    if(value_string == "immediate"){
+      return 0;
+    }
+
+    int window;
+    try{
+      window = parse_integer(value_string,0,1000000);
+    }
+    catch(ConfigLineError& e){
+      throw ConfigLineError(std::string("invalid coalesce_window, ")+e.what());
+    }
+
+    return window;
+  }
+
+
+  /* parse_probe_max_size() parses value_string into the largest packet size to probe for
+   * when discovering the path MTU to a peer
+   */
+  unsigned int parse_probe_max_size(const std::string& value_string)
+  {
+    int probe_max_size;
+    try{
+      /* as for max_size, this is the size of a UDP payload */
+      probe_max_size = parse_integer(value_string,1,65507);
+    }
+    catch(ConfigLineError& e){
+      throw ConfigLineError(std::string("invalid probe_max_size, ")+e.what());
+    }
+
+    return probe_max_size;
+  }
+
+
+  /* parse_max_message_size() parses value_string into the length of the longest message
+   * which may be sent in fragments on a channel which keeps message boundaries
+   */
+  unsigned int parse_max_message_size(const std::string& value_string)
+  {
+    int max_message_size;
+    try{
+      max_message_size = parse_integer(value_string,1,Fragmenter::max_max_message_size);
+    }
+    catch(ConfigLineError& e){
+      throw ConfigLineError(std::string("invalid max_message_size, ")+e.what());
+    }
+
+    return max_message_size;
+  }
+
+
+  /* parse_on_off() parses value_string, which is "on" or "off", into whether the feature
+   * named by option_name (such as compression) is enabled
+   */
+  bool parse_on_off(const std::string& value_string, const std::string& option_name)
+  {
+    if(value_string == "on"){
+      return true;
+    }
+    if(value_string == "off"){
+      return false;
+    }
+    throw ConfigLineError("invalid "+option_name+", must be \"on\" or \"off\"");
+  }
+
+
+  /* split_channel_option() splits the value of an option which applies to a single
+   * channel into the channel id and the rest of the value, which are separated by
+   * whitespace, as in the line
+   * channel_pipe_size: 01a4 1048576
+   */
+  std::pair<channel_id_type,std::string> split_channel_option(const std::string& value_string,
+                                                              const std::string& option_name)
+  {
+    auto first_chunk_end = std::find_if(value_string.begin(),value_string.end(),isspace);
+    if(first_chunk_end == value_string.end()){
+      throw ConfigLineError("no whitespace in "+option_name);
+    }
+    auto second_chunk_start = std::find_if(first_chunk_end,value_string.end(),not_isspace);
+
+    channel_id_type channel_id;
+    try{
+      channel_id = parse_hex_string<channel_id_size>(std::string(value_string.begin(),
+                                                                 first_chunk_end));
+    }
+    catch(ConfigLineError& e){
+      throw ConfigLineError(std::string("error parsing channel id, ")+e.what());
+    }
+
+    return {channel_id,std::string(second_chunk_start,value_string.end())};
+  }
+
+
+  /* parse_channel_pipe_size() parses a channel id and a pipe size, separated by
+   * whitespace, as in the line
+   * channel_pipe_size: 01a4 1048576
+   */
+  channel_pipe_size_spec parse_channel_pipe_size(const std::string& value_string)
+  {
+    std::pair<channel_id_type,std::string> split =
+      split_channel_option(value_string,"channel_pipe_size");
+    return channel_pipe_size_spec{split.first,parse_pipe_size(split.second)};
+  }
+
+
+  /* parse_channel_coalesce_window() parses a channel id and the coalescing window for that
+   * channel, separated by whitespace, such as
+   * channel_coalesce_window: 01a4 immediate
+   */
+  channel_coalesce_window_spec parse_channel_coalesce_window(const std::string& value_string)
+  {
+    std::pair<channel_id_type,std::string> split =
+      split_channel_option(value_string,"channel_coalesce_window");
+    return channel_coalesce_window_spec{split.first,parse_coalesce_window(split.second)};
+  }
+
+
+  /* parse_channel_compression() parses a channel id and whether compression is enabled
+   * for that channel, separated by whitespace, such as
+   * channel_compression: 01a4 off
+   */
+  channel_compression_spec parse_channel_compression(const std::string& value_string)
+  {
+    std::pair<channel_id_type,std::string> split =
+      split_channel_option(value_string,"channel_compression");
+    return channel_compression_spec{split.first,parse_on_off(split.second,"compression")};
+  }
+
+
+  /* parse_channel_fec() parses a channel id and whether forward error correction is
+   * enabled for that channel, separated by whitespace, such as
+   * channel_fec: 01a4 on
+   */
+  channel_fec_spec parse_channel_fec(const std::string& value_string)
+  {
+    std::pair<channel_id_type,std::string> split =
+      split_channel_option(value_string,"channel_fec");
+    return channel_fec_spec{split.first,parse_on_off(split.second,"fec")};
+  }
+
+
+  /* parse_channel_mode() parses a channel id and the mode for that channel, separated by
+   * whitespace, as in the line
+   * channel_mode: 01a4 seqpacket
+   * The modes accepted are "fifo", "seqpacket", "shm" and "local".
+   */
+  channel_mode_spec parse_channel_mode(const std::string& value_string)
+  {
+    std::pair<channel_id_type,std::string> split =
+      split_channel_option(value_string,"channel_mode");
+    if(split.second == "fifo"){
+      return channel_mode_spec{split.first,ChannelMode::fifo};
+    }
+    if(split.second == "seqpacket"){
+      return channel_mode_spec{split.first,ChannelMode::seqpacket};
+    }
+    if(split.second == "shm"){
+      return channel_mode_spec{split.first,ChannelMode::shm};
+    }
+    if(split.second == "local"){
+      return channel_mode_spec{split.first,ChannelMode::local};
+    }
+    throw ConfigLineError("invalid channel mode \""+split.second+"\"");
+  }
+
+
+  /* parse_cipher_suite() parses value_string into the AEAD cipher suite to use with a peer.
+   * The suite names accepted are "aes-256-gcm" and "chacha20-poly1305".
+   */
+  CipherSuite parse_cipher_suite(const std::string& value_string)
+  {
+    if(value_string == "aes-256-gcm"){
+      return CipherSuite::aes_256_gcm;
+    }
+    if(value_string == "chacha20-poly1305"){
+      return CipherSuite::chacha20_poly1305;
+    }
+    throw ConfigLineError("invalid cipher suite \""+value_string+"\"");
+  }
+
+
   /* split_config_line() splits a config file line into an option name and an option
    * value. The split is made at the first colon which occurs in the line, and both
    * parts of the line are trimmed of whitespace.
@@ -397,6 +666,31 @@ namespace
   }
 
 
+  /* check_channel_options() checks that each of the settings given by an option which
+   * applies to a single channel (such as "channel_pipe_size") is for one of the peer's
+   * channels, whose ids are in channel_ids, and that no channel has been given more than
+   * one such setting.
+   */
+  template<typename T>
+  void check_channel_options(const std::vector<std::pair<channel_id_type,T>>& settings,
+                             const std::multiset<channel_id_type>& channel_ids,
+                             const std::string& option_name,
+                             const std::string& peer_name)
+  {
+    std::set<channel_id_type> setting_channel_ids;
+    for(auto& setting : settings){
+      if(channel_ids.count(setting.first) == 0){
+        throw std::runtime_error("ConfigFileParser: "+option_name+" for unknown channel for \""
+                                 +peer_name+"\"\n  ");
+      }
+      if(not setting_channel_ids.insert(setting.first).second){
+        throw std::runtime_error("ConfigFileParser: duplicated "+option_name+" for \""
+                                 +peer_name+"\"\n  ");
+      }
+    }
+  }
+
+
   /* parse_peer_config() parses the next peer configuration from parse_state
    * and stores it in peer_config. Each run of parse_peer_config() reads one
    * "configuration block", which consists of multiple lines specifying options.
@@ -458,8 +752,13 @@ namespace
         config_line_error("expected option \"name\"",line_num);
       }
 
-      /* forbid multiple occurrences of any option except "channel" */
-      if( (option_names_seen.count(option_name) != 0) and (option_name != "channel") ){
+      /* forbid multiple occurrences of any option except "channel", "channel_pipe_size",
+         "channel_mode", "channel_coalesce_window", "channel_compression" and
+         "channel_fec" */
+      if( (option_names_seen.count(option_name) != 0) and (option_name != "channel") and
+          (option_name != "channel_pipe_size") and (option_name != "channel_mode") and
+          (option_name != "channel_coalesce_window") and (option_name != "channel_compression") and
+          (option_name != "channel_fec") ){
         config_line_error("configuration option \""+option_name+"\" repeated",line_num);
       }
 
@@ -498,12 +797,105 @@ namespace
         else if(option_name == "max_size")
           peer_config.max_packet_size = parse_max_size(option_value);
 
+        else if( (option_name == "cipher") and (peer_config.name != self_name) )
+          peer_config.cipher_suite = parse_cipher_suite(option_value);
+
+        else if( (option_name == "cipher") and (peer_config.name == self_name) )
+          throw ConfigLineError("\"cipher\" not allowed for \""+self_name+"\"");
+
+        else if(option_name == "pipe_size")
+          peer_config.pipe_size = parse_pipe_size(option_value);
+
+        else if( (option_name == "channel_pipe_size") and (peer_config.name != self_name) )
+          peer_config.channel_pipe_sizes.push_back(parse_channel_pipe_size(option_value));
+
+        else if( (option_name == "channel_pipe_size") and (peer_config.name == self_name) )
+          throw ConfigLineError("\"channel_pipe_size\" not allowed for \""+self_name+"\"");
+
+        else if( (option_name == "channel_mode") and (peer_config.name != self_name) )
+          peer_config.channel_modes.push_back(parse_channel_mode(option_value));
+
+        else if( (option_name == "channel_mode") and (peer_config.name == self_name) )
+          throw ConfigLineError("\"channel_mode\" not allowed for \""+self_name+"\"");
+
+        else if( (option_name == "bundle_window") and (peer_config.name != self_name) )
+          peer_config.bundle_window_micros = parse_bundle_window(option_value);
+
+        else if( (option_name == "bundle_window") and (peer_config.name == self_name) )
+          throw ConfigLineError("\"bundle_window\" not allowed for \""+self_name+"\"");
+
+        else if( (option_name == "coalesce_window") and (peer_config.name != self_name) )
+          peer_config.coalesce_window_micros = parse_coalesce_window(option_value);
+
+        else if( (option_name == "coalesce_window") and (peer_config.name == self_name) )
+          throw ConfigLineError("\"coalesce_window\" not allowed for \""+self_name+"\"");
+
+        else if( (option_name == "channel_coalesce_window") and (peer_config.name != self_name) )
+          peer_config.channel_coalesce_windows.push_back(parse_channel_coalesce_window(option_value));
+
+        else if( (option_name == "channel_coalesce_window") and (peer_config.name == self_name) )
+          throw ConfigLineError("\"channel_coalesce_window\" not allowed for \""+self_name+"\"");
+
+        else if( (option_name == "probe_max_size") and (peer_config.name != self_name) )
+          peer_config.probe_max_size = parse_probe_max_size(option_value);
+
+        else if( (option_name == "probe_max_size") and (peer_config.name == self_name) )
+          throw ConfigLineError("\"probe_max_size\" not allowed for \""+self_name+"\"");
+
+        else if( (option_name == "max_message_size") and (peer_config.name != self_name) )
+          peer_config.max_message_size = parse_max_message_size(option_value);
+
+        else if( (option_name == "max_message_size") and (peer_config.name == self_name) )
+          throw ConfigLineError("\"max_message_size\" not allowed for \""+self_name+"\"");
+
+        else if( (option_name == "compression") and (peer_config.name != self_name) )
+          peer_config.compression = parse_on_off(option_value,"compression");
+
+        else if( (option_name == "compression") and (peer_config.name == self_name) )
+          throw ConfigLineError("\"compression\" not allowed for \""+self_name+"\"");
+
+        else if( (option_name == "channel_compression") and (peer_config.name != self_name) )
+          peer_config.channel_compressions.push_back(parse_channel_compression(option_value));
+
+        else if( (option_name == "channel_compression") and (peer_config.name == self_name) )
+          throw ConfigLineError("\"channel_compression\" not allowed for \""+self_name+"\"");
+
+        else if( (option_name == "fec") and (peer_config.name != self_name) )
+          peer_config.fec = parse_on_off(option_value,"fec");
+
+        else if( (option_name == "fec") and (peer_config.name == self_name) )
+          throw ConfigLineError("\"fec\" not allowed for \""+self_name+"\"");
+
+        else if( (option_name == "channel_fec") and (peer_config.name != self_name) )
+          peer_config.channel_fecs.push_back(parse_channel_fec(option_value));
+
+        else if( (option_name == "channel_fec") and (peer_config.name == self_name) )
+          throw ConfigLineError("\"channel_fec\" not allowed for \""+self_name+"\"");
+
         else if( (option_name == "segment_number_file") and (peer_config.name != self_name) )
           throw ConfigLineError("\"segment_number_file\" only allowed for \""+self_name+"\"");
 
         else if( (option_name == "segment_number_file") and (peer_config.name == self_name) )
           peer_config.segnum_filepath = option_value;
 
+        else if( (option_name == "crypto_workers") and (peer_config.name != self_name) )
+          throw ConfigLineError("\"crypto_workers\" only allowed for \""+self_name+"\"");
+
+        else if( (option_name == "crypto_workers") and (peer_config.name == self_name) )
+          peer_config.num_crypto_workers = parse_crypto_workers(option_value);
+
+        else if( (option_name == "metrics_socket") and (peer_config.name != self_name) )
+          throw ConfigLineError("\"metrics_socket\" only allowed for \""+self_name+"\"");
+
+        else if( (option_name == "metrics_socket") and (peer_config.name == self_name) )
+          peer_config.metrics_socket_path = option_value;
+
+        else if( (option_name == "hibernate_after") and (peer_config.name != self_name) )
+          throw ConfigLineError("\"hibernate_after\" only allowed for \""+self_name+"\"");
+
+        else if( (option_name == "hibernate_after") and (peer_config.name == self_name) )
+          peer_config.hibernate_after_seconds = parse_hibernate_after(option_value);
+
         else
           throw ConfigLineError("invalid option name \""+option_name+"\"");
 
@@ -546,6 +938,84 @@ namespace
       }
     }
 
+    /* check that no channel uses the channel id reserved for bundle packets */
+    if( (peer_config.bundle_window_micros != 0) and
+        (channel_ids.count(Bundler::bundle_channel_id) != 0) ){
+      throw std::runtime_error("ConfigFileParser: channel id ffff is reserved when bundling for \""
+                               +peer_config.name+"\"\n  ");
+    }
+
+    /* likewise for the channel id reserved for path MTU probes, and check that there is
+       something to probe for (if the peer's max_size is not given, the default is only
+       known later, so the Session checks this) */
+    if(peer_config.probe_max_size != 0){
+      if(channel_ids.count(PathProber::probe_channel_id) != 0){
+        throw std::runtime_error("ConfigFileParser: channel id fffe is reserved when probing for \""
+                                 +peer_config.name+"\"\n  ");
+      }
+      if( (peer_config.max_packet_size != -1) and
+          (peer_config.probe_max_size <= static_cast<unsigned int>(peer_config.max_packet_size)) ){
+        throw std::runtime_error("ConfigFileParser: probe_max_size not larger than max_size for \""
+                                 +peer_config.name+"\"\n  ");
+      }
+    }
+
+    /* check that fragmentation and bundling are not both enabled, as the fragments of a
+       message would have to fit in frames of bundle packets */
+    if( (peer_config.max_message_size != 0) and (peer_config.bundle_window_micros != 0) ){
+      throw std::runtime_error("ConfigFileParser: max_message_size not allowed with bundle_window "
+                               "for \""+peer_config.name+"\"\n  ");
+    }
+
+    /* likewise for compression, which is done packet by packet */
+    bool any_compression = peer_config.compression;
+    for(auto& cc : peer_config.channel_compressions){
+      any_compression = any_compression or cc.second;
+    }
+    if(any_compression and (peer_config.bundle_window_micros != 0)){
+      throw std::runtime_error("ConfigFileParser: compression not allowed with bundle_window "
+                               "for \""+peer_config.name+"\"\n  ");
+    }
+
+    /* and for forward error correction, which covers the packets sent by each channel */
+    bool any_fec = peer_config.fec;
+    for(auto& cf : peer_config.channel_fecs){
+      any_fec = any_fec or cf.second;
+    }
+    if(any_fec and (peer_config.bundle_window_micros != 0)){
+      throw std::runtime_error("ConfigFileParser: fec not allowed with bundle_window "
+                               "for \""+peer_config.name+"\"\n  ");
+    }
+
+    /* check that each channel_pipe_size, channel_mode, channel_coalesce_window,
+       channel_compression and channel_fec is for one of the peer's channels, and that no
+       channel has been given more than one of any of them */
+    check_channel_options(peer_config.channel_pipe_sizes,channel_ids,"channel_pipe_size",
+                          peer_config.name);
+    check_channel_options(peer_config.channel_modes,channel_ids,"channel_mode",
+                          peer_config.name);
+    check_channel_options(peer_config.channel_coalesce_windows,channel_ids,
+                          "channel_coalesce_window",peer_config.name);
+    check_channel_options(peer_config.channel_compressions,channel_ids,
+                          "channel_compression",peer_config.name);
+    check_channel_options(peer_config.channel_fecs,channel_ids,"channel_fec",
+                          peer_config.name);
+
+    /* check that channel_coalesce_window is only used for channels in fifo mode, as the
+       other modes send each message from the user in a packet of its own */
+    std::set<channel_id_type> non_fifo_channel_ids;
+    for(auto& cm : peer_config.channel_modes){
+      if(cm.second != ChannelMode::fifo){
+        non_fifo_channel_ids.insert(cm.first);
+      }
+    }
+    for(auto& ccw : peer_config.channel_coalesce_windows){
+      if(non_fifo_channel_ids.count(ccw.first) != 0){
+        throw std::runtime_error("ConfigFileParser: channel_coalesce_window for channel not "
+                                 "in fifo mode for \""+peer_config.name+"\"\n  ");
+      }
+    }
+
     /* check that no channel path has been repeated */
     std::multiset<std::string> channel_paths;
     std::transform(peer_config.channels.begin(), peer_config.channels.end(),
@@ -590,6 +1060,10 @@ ConfigFileParser::ConfigFileParser(const std::string& path)
        */
       default_max_packet_size = peer_config.max_packet_size;
       segnum_filepath = peer_config.segnum_filepath;
+      num_crypto_workers = peer_config.num_crypto_workers;
+      metrics_socket_path = peer_config.metrics_socket_path;
+      default_pipe_size = peer_config.pipe_size;
+      hibernate_after_seconds = peer_config.hibernate_after_seconds;
     }
     else{
       peer_configs.push_back(PeerConfig(peer_config));
@@ -23,6 +23,10 @@ public:
   in_port_t self_port;
   int default_max_packet_size; // a value of -1 here indicates no default max packet size set
   std::string segnum_filepath;
+  unsigned int num_crypto_workers; // 0 means no parallel crypto workers
+  std::string metrics_socket_path; // empty means no metrics socket
+  unsigned int default_pipe_size; // 0 means the kernel's default fifo capacity
+  unsigned int hibernate_after_seconds; // 0 means channels are never put to sleep
 };
 
 #endif
@@ -5,6 +5,7 @@
 #include <poll.h>
 
 #include "HKDFUnit.h"
+#include "Tracepoints.h"
 
 namespace
 {
@@ -12,6 +13,9 @@ namespace
      these should eventually become user-settable */
   constexpr char fifo_from_user_suffix[] = "_OUTWARD";
   constexpr char fifo_to_user_suffix[] = "_INWARD";
+  /* suffix for the file name of the socket which takes the place of the FIFOs in
+     seqpacket mode */
+  constexpr char seqpacket_suffix[] = "_SOCKET";
 
   constexpr unsigned int msgnum_len = 6;
   constexpr unsigned int segnum_len = 6;
@@ -21,6 +25,37 @@ namespace
      the message number (6 bytes), for a total of 24 bytes */
   constexpr unsigned int outer_header_len = 24;
 
+  /* when a Connection has a CryptoWorkerPool, each pass of move_data() handles up to
+     this many packets for each lane of the pool, so that the cost of handing work to
+     the pool is spread over several packets */
+  constexpr unsigned int packets_per_crypto_lane = 4;
+
+  /* bounds (in milliseconds) on the interval between the "hello" packets sent by a
+     closed Connection which has had start_handshake() called but has no data waiting
+     to be sent. The interval starts at the minimum, and doubles with each such "hello"
+     packet until it reaches the maximum. */
+  constexpr millis_timestamp_t min_hello_interval = 100;
+  constexpr millis_timestamp_t max_hello_interval = 5000;
+
+  /* the number of bytes of received data which a Connection stages when fifo_to_user_ is
+     full, beyond which it stops taking messages off its queue until the reader catches
+     up. This is a soft limit: a batch of messages which has been taken off the queue is
+     always processed in full, so it can be exceeded by up to one batch. */
+  constexpr metric_value_t max_pending_output = 1048576;
+
+  /* the most bytes of received packets which a Connection keeps in its queue waiting to
+     be processed. Packets arriving when the queue is this full are dropped, so that
+     neither a stalled reader (see max_pending_output) nor a flood of packets (which are
+     queued before they are authenticated) can make the queue grow without limit. */
+  constexpr std::size_t max_queued_bytes = 4194304;
+
+  /* the largest payload of a UDP packet, which bounds the length of the data in a
+     compressed payload from the peer */
+  constexpr unsigned int max_udp_payload = 65507;
+
+  /* the string appended to the "info" for deriving the keys of FEC report packets */
+  const std::string fec_report_label = "fec report";
+
 
   /* bytes_to_uint() converts "length" bytes from bytes_vector, beginning at position
      "offset", to an unsigned integer of type T, using the little-endian convention */
@@ -50,13 +85,27 @@ namespace
   }
 
 
-  /* fd_has_data() tests whether there is data waiting to be read on the file
-     descriptor fd */
-  bool fd_has_data(int fd)
+  /* cipher_suite_info_byte() gives the byte which identifies a (non-default) cipher suite
+     in the "info" used for key derivation, see the Connection constructor */
+  unsigned char cipher_suite_info_byte(CipherSuite suite)
+  {
+    switch(suite){
+    case CipherSuite::aes_256_gcm:
+      return 0x01;
+    case CipherSuite::chacha20_poly1305:
+      return 0x02;
+    }
+    throw std::runtime_error("Connection: unknown cipher suite");
+  }
+
+
+  /* fd_ready() tests whether any of the poll() events in "events" are currently reported
+     for the file descriptor fd, without waiting */
+  bool fd_ready(int fd, short events)
   {
     pollfd pfd;
     pfd.fd = fd;
-    pfd.events = POLLIN;
+    pfd.events = events;
 
     /* loop until poll() returns a non-error result */
     while(true){
@@ -70,7 +119,7 @@ namespace
         throw std::runtime_error("Connection: poll() reported an error");
       }
 
-      if((ret == 1) && (pfd.revents & POLLIN)){
+      if((ret == 1) && (pfd.revents & events)){
         return true;
       }
       return false;
@@ -78,6 +127,19 @@ namespace
   }
 
 
+  /* fd_has_data() tests whether there is data waiting to be read on the file
+     descriptor fd */
+  bool fd_has_data(int fd)
+  { return fd_ready(fd,POLLIN); }
+
+
+  /* fd_writable() tests whether a write to the file descriptor fd would make progress.
+     POLLERR is included, as it is how poll() reports that a fifo has no reader, in which
+     case a write fails straight away rather than blocking. */
+  bool fd_writable(int fd)
+  { return fd_ready(fd,POLLOUT | POLLERR); }
+
+
 }
 
 
@@ -91,7 +153,8 @@ Connection::Connection(const host_id_type& self_id,
                        in_port_t peer_port,
                        unsigned int max_packet_size,
                        const std::shared_ptr<UDPSocket>& udp_socket,
-                       const std::shared_ptr<SegmentNumGenerator>& segnumgen):
+                       const std::shared_ptr<SegmentNumGenerator>& segnumgen,
+                       const ConnectionSettings& settings):
   self_id_(self_id),
   peer_name_(peer_name),
   peer_id_(peer_id),
@@ -101,9 +164,22 @@ Connection::Connection(const host_id_type& self_id,
   max_packet_size_(max_packet_size),
   udp_socket_(udp_socket),
   segnumgen_(segnumgen),
+  crypto_pool_(settings.crypto_pool),
+  cipher_suite_(settings.cipher_suite),
+  dormant_(true),
+  batch_size_(1),
   rtt_tracker_(std::make_shared<RTTTracker>()),
-  fifo_from_user_(fifo_base_path+fifo_from_user_suffix),
-  fifo_to_user_(fifo_base_path+fifo_to_user_suffix),
+  channel_mode_(settings.channel_mode),
+  coalesce_window_nanos_(0),
+  held_len_(0),
+  held_since_(0),
+  fec_reports_sent_(0),
+  last_report_segnum_(0),
+  last_report_num_(0),
+  from_user_pipe_size_(0),
+  to_user_pipe_size_(0),
+  queued_bytes_(0),
+  intake_paused_(false),
   current_crypto_message_tracker_(rtt_tracker_),
   old_crypto_message_tracker_(rtt_tracker_),
   current_peer_segnum_(0),
@@ -111,7 +187,13 @@ Connection::Connection(const host_id_type& self_id,
   current_local_segnum_(segnumgen_->next_num()),
   old_local_segnum_(0),
   local_next_msgnum_(1),
-  last_hello_packet_sent_(0)
+  last_hello_packet_sent_(0),
+  handshake_wanted_(false),
+  hello_interval_(min_hello_interval),
+  reply_owed_(false),
+  pending_output_offset_(0),
+  pending_output_bytes_(0),
+  latencies_(settings.latencies)
 {
   /* We need to derive the sending and receiving keys to initialise the CryptoUnit.
      They are both derived by the HKDF expand operation using the shared secret (which
@@ -119,10 +201,21 @@ Connection::Connection(const host_id_type& self_id,
      different "info" parameters. The sending key is derived using the "info" formed
      by the concatenation self_id_|peer_id_|channel_id_, from which it follows that
      the receiving key (which is the peer's sending key) is derived using the "info"
-     formed by the concatenation peer_id_|self_id_|channel_id_. */
+     formed by the concatenation peer_id_|self_id_|channel_id_.
+
+     If a cipher suite other than the default AES-256 GCM is in use, a single byte
+     identifying the suite is appended to both "info" strings. This ties the keys to the
+     cipher suite, so that two peers which disagree about which suite to use derive
+     different keys and so reject each other's packets, rather than exchanging data
+     protected by one key under two different ciphers. */
+
+  unsigned int info_len = (2*host_id_size)+channel_id_size;
+  if(settings.cipher_suite != CipherSuite::aes_256_gcm){
+    info_len += 1;
+  }
 
   /* create the "info" for the sending key */
-  std::vector<unsigned char> send_info( (2*host_id_size)+channel_id_size );
+  std::vector<unsigned char> send_info(info_len);
   auto send_info_start = send_info.begin();
   std::copy(self_id_.begin(),self_id_.end(),send_info_start);
   std::copy(peer_id_.begin(),peer_id_.end(),send_info_start+host_id_size);
@@ -130,17 +223,128 @@ Connection::Connection(const host_id_type& self_id,
             send_info_start+(2*host_id_size));
 
   /* create the "info" for the receiving key */
-  std::vector<unsigned char> recv_info( (2*host_id_size)+channel_id_size );
+  std::vector<unsigned char> recv_info(info_len);
   auto recv_info_start = recv_info.begin();
   std::copy(peer_id_.begin(),peer_id_.end(),recv_info_start);
   std::copy(self_id_.begin(),self_id_.end(),recv_info_start+host_id_size);
   std::copy(channel_id_.begin(),channel_id_.end(),
             recv_info_start+(2*host_id_size));
 
-  /* create the CryptoUnit, with the sending key for encryption and the receiving
-     key for decryption */
-  crypto_unit_ = std::make_unique<CryptoUnit>(hkdf_expand(key,send_info),
-                                              hkdf_expand(key,recv_info));
+  /* append the cipher suite identifier for non-default suites */
+  if(settings.cipher_suite != CipherSuite::aes_256_gcm){
+    send_info.back() = recv_info.back() = cipher_suite_info_byte(settings.cipher_suite);
+  }
+
+  /* derive the sending key, for encryption, and the receiving key, for decryption. The
+     CryptoUnits which use them are only created by wake(), when the Connection is first
+     moved, so that a channel which is never used costs no cipher contexts. */
+  send_key_ = hkdf_expand(key,send_info);
+  recv_key_ = hkdf_expand(key,recv_info);
+
+  /* FEC report packets are authenticated with keys of their own, so that their
+     initialization vectors (see send_report() ) cannot coincide with those of packets
+     sealed with the channel's keys. Their "info" has fec_report_label appended. */
+  if(settings.fec){
+    send_info.insert(send_info.end(),fec_report_label.begin(),fec_report_label.end());
+    recv_info.insert(recv_info.end(),fec_report_label.begin(),fec_report_label.end());
+    fec_send_key_ = hkdf_expand(key,send_info);
+    fec_recv_key_ = hkdf_expand(key,recv_info);
+  }
+  if(crypto_pool_){
+    batch_size_ = crypto_pool_->num_lanes()*packets_per_crypto_lane;
+  }
+
+  /* create the user's end of the channel */
+  if(channel_mode_ == ChannelMode::bundle){
+    if(not settings.bundler){
+      throw std::runtime_error("Connection: bundle mode needs a Bundler");
+    }
+    bundle_endpoint_ = settings.bundler;
+  }
+  else if(channel_mode_ == ChannelMode::probe){
+    if(not settings.path_prober){
+      throw std::runtime_error("Connection: probe mode needs a PathProber");
+    }
+    probe_endpoint_ = settings.path_prober;
+  }
+  else if(channel_mode_ == ChannelMode::seqpacket){
+    seqpacket_endpoint_ = std::make_unique<SeqPacketEndpoint>(fifo_base_path+seqpacket_suffix);
+  }
+  else if(channel_mode_ == ChannelMode::shm){
+    shm_endpoint_ = std::make_unique<ShmEndpoint>(fifo_base_path,settings.fifo_pipe_size);
+    from_user_pipe_size_ = shm_endpoint_->ring_capacity();
+    to_user_pipe_size_ = shm_endpoint_->ring_capacity();
+  }
+  else if(channel_mode_ == ChannelMode::local){
+    /* a message must fit in a frame if the channel's data is bundled, or else in a
+       packet (less the flag byte if the channel is compressed, and the room needed by
+       repair packets if it has FEC) unless it can be sent in fragments */
+    unsigned int longest_message = settings.bundler ? settings.bundler->max_frame_data() :
+      (settings.max_message_size != 0) ? settings.max_message_size :
+      max_data_len(max_packet_size)-(settings.compression ? 1 : 0)-
+      (settings.fec ? FecEncoder::fec_overhead : 0);
+    local_channel_ = std::make_shared<LocalChannel>(longest_message,settings.fifo_pipe_size);
+  }
+  else{
+    fifo_from_user_ = std::make_unique<FifoFromUser>(fifo_base_path+fifo_from_user_suffix,
+                                                     settings.fifo_pipe_size);
+    fifo_to_user_ = std::make_unique<FifoToUser>(fifo_base_path+fifo_to_user_suffix,
+                                                 settings.fifo_pipe_size);
+    from_user_pipe_size_ = fifo_from_user_->pipe_size();
+    to_user_pipe_size_ = fifo_to_user_->pipe_size();
+    /* coalescing only applies to the byte streams of fifo mode, as in the other modes
+       each message from the user must be sent in a packet (or frame) of its own */
+    coalesce_window_nanos_ = static_cast<nanos_t>(settings.coalesce_window_micros)*1000;
+    /* likewise, only the byte streams of fifo mode can use whatever packet size the
+       PathProber finds, as in the other modes the packet size limits the length of a
+       message from the user */
+    if(settings.path_prober and (not settings.bundler)){
+      if(settings.path_prober->max_payload() > max_data_len(max_packet_size_)){
+        throw std::runtime_error("Connection: max_packet_size too small for PathProber");
+      }
+      path_prober_ = settings.path_prober;
+    }
+  }
+  if(channel_mode_ != ChannelMode::bundle){
+    bundler_ = settings.bundler;
+  }
+
+  /* fragmentation only applies to the modes which keep message boundaries, and not to
+     bundled channels, as a fragment would have to fit in a frame */
+  if(settings.max_message_size != 0){
+    if( (not (seqpacket_endpoint_ or shm_endpoint_ or local_channel_)) or bundler_ ){
+      throw std::runtime_error("Connection: max_message_size needs an unbundled channel in "
+                               "seqpacket, shm or local mode");
+    }
+    if(shm_endpoint_ and (settings.max_message_size > shm_endpoint_->max_message_size())){
+      throw std::runtime_error("Connection: max_message_size too large for shm ring");
+    }
+    fragmenter_ = std::make_unique<Fragmenter>(settings.max_message_size);
+    reassembler_ = std::make_unique<Reassembler>(settings.max_message_size,
+                                                 metrics_.reassembly_failures);
+  }
+
+  /* likewise, compression is done packet by packet, so it does not apply to bundled
+     channels (or to the internal bundle and probe channels) */
+  if(settings.compression){
+    if(bundler_ or bundle_endpoint_ or probe_endpoint_){
+      throw std::runtime_error("Connection: compression needs an unbundled channel");
+    }
+    compressor_ = std::make_unique<Compressor>();
+  }
+
+  /* FEC covers the packets which the Connection sends itself, so it does not apply to
+     bundled channels, nor to probe packets, which are meant to be lost if too large */
+  if(settings.fec){
+    if(bundler_ or bundle_endpoint_ or probe_endpoint_){
+      throw std::runtime_error("Connection: fec needs an unbundled channel");
+    }
+    if(max_packet_size_ <= outer_header_len+tag_len+FecEncoder::fec_overhead){
+      throw std::runtime_error("Connection: max_packet_size too small for fec");
+    }
+    fec_encoder_ = std::make_unique<FecEncoder>(max_packet_size_);
+    fec_decoder_ = std::make_unique<FecDecoder>(self_id_,channel_id_);
+  }
 }
 
 
@@ -153,6 +357,11 @@ Connection::Connection(const host_id_type& self_id,
  * fifo_to_user_, and then we attempt to pull one packet's worth of data out of
  * fifo_from_user_, encrypt it, and send it via udp_socket_. The loop runs for at most
  * loop_max passes, or until neither operation has any data to work with.
+ *
+ * If the Connection has a CryptoWorkerPool, each pass instead handles a batch of up
+ * to batch_size_ messages and batch_size_ packets' worth of FIFO data. The messages
+ * are all decrypted in parallel by open_messages() and then processed in order, and
+ * the FIFO data is all encrypted in parallel by send_data() and then sent in order.
  */
 void Connection::move_data(unsigned int loop_max)
 {
@@ -164,29 +373,142 @@ void Connection::move_data(unsigned int loop_max)
      move_data(). hello_packet_sent records whether a hello packet has been sent. */
   bool hello_packet_sent = false;
 
-  for(unsigned int i=0; (i<loop_max) and (not no_more_data); i++){
-    std::vector<unsigned char> fifo_data, msg_data;
+  std::vector<ReceivedUDPMessage> udp_messages;
+  std::vector<OpenedMessage> opened_messages;
+  std::vector<std::vector<unsigned char>> out_packets;
+
+  TRACEPOINT1(move_data_entry,loop_max);
+
+  /* A dormant Connection is only woken once it has something to do other than handle
+     received packets (see wake_wanted() ), or once a received packet is authenticated
+     (see handle_message() ), so that packets which merely carry its id cannot keep it
+     awake. Until then it authenticates them with a single temporary CryptoUnit. */
+  if(dormant_.load(std::memory_order_relaxed)){
+    if(wake_wanted()){
+      wake();
+    }
+    else if(crypto_units_.empty()){
+      crypto_units_.push_back(std::make_unique<CryptoUnit>(send_key_,recv_key_,cipher_suite_));
+    }
+  }
+  unsigned int pass = 0;
+  for(; (pass<loop_max) and (not no_more_data); pass++){
     no_more_data = true;
 
-     /* attempt to pull a UDP message off message_queue_... */
-    ReceivedUDPMessage udp_message{false,{},"",0}; // initialize udp_message to
-                                                   // an "invalid" state
+    /* write out any data staged in pending_output_ from earlier passes. While too much is
+       staged, we leave received messages on message_queue_ rather than decrypting them,
+       so that a slow reader holds up the data coming to it instead of causing it to be
+       lost. add_message() goes on queueing those which arrive meanwhile, and only drops
+       them once the queue holds max_queued_bytes. */
+    if(not pending_output_.empty()){
+      metric_value_t staged = pending_output_bytes_.load(std::memory_order_relaxed);
+      flush_pending_output();
+      if(pending_output_bytes_.load(std::memory_order_relaxed) < staged){
+        no_more_data = false;
+      }
+    }
+    bool intake_paused =
+      (pending_output_bytes_.load(std::memory_order_relaxed) >= max_pending_output);
+    if(intake_paused and (not intake_paused_)){
+      metrics_.intake_pauses.add();
+    }
+    intake_paused_ = intake_paused;
+
+     /* attempt to pull a batch of UDP messages off message_queue_... */
+    udp_messages.clear();
     {// new block to limit the scope of queue_lock_guard
       const std::lock_guard<std::mutex> queue_lock_guard(queue_lock_);
-      if(!message_queue_.empty()){
-        udp_message = message_queue_.front();
+      while( (not intake_paused) and (not message_queue_.empty()) and
+             (udp_messages.size() < batch_size_) ){
+        queued_bytes_ -= message_queue_.front().data.size();
+        udp_messages.push_back(std::move(message_queue_.front()));
         message_queue_.pop_front();
       }
     }
-    /* ...and if there was a message waiting, pass it to handle_message() for
-       processing */
-    if(udp_message.valid){
+    /* ...and if there were messages waiting, pass them to handle_message() for
+       processing, after decrypting them in parallel if we have a CryptoWorkerPool. If we
+       use FEC, the FEC packets are taken out first, and handled once the others have
+       been, so that fec_decoder_ has the ones which were authenticated. */
+    if(not udp_messages.empty()){
       no_more_data = false;
-      handle_message(udp_message.data);
+      if(fec_decoder_){
+        take_fec_packets(udp_messages);
+      }
+      if(latencies_){
+        nanos_t now = monotonic_nanos();
+        for(const auto& udp_message : udp_messages){
+          if( (udp_message.arrival_nanos != 0) and (udp_message.arrival_nanos <= now) ){
+            latencies_->record(PipelineStage::inbound_queue,now-udp_message.arrival_nanos);
+          }
+        }
+      }
+      if(crypto_pool_){
+        open_messages(udp_messages,opened_messages);
+      }
+      for(unsigned int j=0; j<udp_messages.size(); j++){
+        bool authenticated =
+          handle_message(udp_messages[j].data,crypto_pool_ ? &opened_messages[j] : nullptr);
+        if(fec_decoder_ and authenticated){
+          fec_decoder_->add(std::move(fec_copies_[j]));
+        }
+      }
+      if(fec_decoder_){
+        handle_fec_packets();
+      }
+    }
+
+    /* if no packet has woken the Connection, there is nothing else for it to do */
+    if(dormant_.load(std::memory_order_relaxed)){
+      continue;
+    }
+
+    /* write out up to batch_size_ of the frames for this channel which have arrived in
+       bundle packets, unless intake is paused as for message_queue_ */
+    if(bundler_ and (not intake_paused)){
+      std::vector<std::vector<unsigned char>> payloads;
+      {// new block to limit the scope of queue_lock_guard
+        const std::lock_guard<std::mutex> queue_lock_guard(queue_lock_);
+        while( (not bundled_input_.empty()) and (payloads.size() < batch_size_) ){
+          queued_bytes_ -= bundled_input_.front().size();
+          payloads.push_back(std::move(bundled_input_.front()));
+          bundled_input_.pop_front();
+        }
+      }
+      for(auto& payload : payloads){
+        write_to_user(payload.data(),payload.size());
+      }
+      if(not payloads.empty()){
+        no_more_data = false;
+      }
     }
 
     /* try to move some data from fifo_from_user_ to the network */
-    if(current_peer_segnum_ == 0){
+    if(bundler_){
+      /* The data is pushed to the Bundler as frames, up to batch_size_ of them, and the
+         bundle Connection sends them to the peer in its own packets. This Connection
+         never sends data itself, so it does not need to know the peer's segment
+         number. */
+      if(out_packets.empty()){
+        out_packets.emplace_back();
+      }
+      std::vector<unsigned char>& packet = out_packets[0];
+      packet.resize(max_packet_size_);
+      unsigned int num_frames = 0;
+      while( (num_frames < batch_size_) and bundler_->has_room() ){
+        nanos_t read_start = stage_start();
+        unsigned int data_len = read_from_user(packet,bundler_->max_frame_data());
+        if(data_len == 0){
+          break;
+        }
+        stage_end(PipelineStage::fifo_read,read_start);
+        bundler_->push(channel_id_,packet.data()+outer_header_len,data_len);
+        num_frames++;
+      }
+      if(num_frames > 0){
+        no_more_data = false;
+      }
+    }
+    else if(current_peer_segnum_ == 0){
       /* We need to know what segment number our peer is currently using to send data, as
          otherwise any data we send will not be accepted. If current_peer_segnum_ is 0,
          then we do not know the peer's current segment number. If there is data waiting to
@@ -194,29 +516,81 @@ void Connection::move_data(unsigned int loop_max)
          response which will contain their current segment number (this packet will also
          inform the peer of our current segment number). We only send one "hello packet"
          per invocation of move_data(). */
-      if( (not hello_packet_sent) and \
-          fd_has_data(fifo_from_user_.file_descriptor()) ){
-        udp_socket_->send(create_packet(std::vector<unsigned char>{}),
-                          peer_ip_addr_,peer_port_);
-        last_hello_packet_sent_ = epoch_time_millis();
-        hello_packet_sent = true;
+      if(not hello_packet_sent){
+        /* If start_handshake() has been called, we also send "hello" packets when there is
+           no data waiting, but only at intervals of hello_interval_, which grows with each
+           such packet so that a peer which is down is not sent a steady stream of them. */
+        millis_timestamp_t now = epoch_time_millis();
+        bool data_waiting = user_data_waiting();
+        bool handshake_hello = handshake_wanted_ and
+          (now >= last_hello_packet_sent_+hello_interval_);
+        if(data_waiting or handshake_hello){
+          send_packet(create_packet(std::vector<unsigned char>{}));
+          metrics_.hello_packets_sent.add();
+          TRACEPOINT1(hello_sent,current_local_segnum_);
+          last_hello_packet_sent_ = now;
+          hello_packet_sent = true;
+          if( (not data_waiting) and (hello_interval_ < max_hello_interval) ){
+            hello_interval_ = std::min(2*hello_interval_,max_hello_interval);
+          }
+        }
       }
     }
     else{
-      /* attempt to pull one packet's worth of data out of fifo_from_user, and if
-         there is some data available, we encapsulate it in an encrypted packet and
-         send it via udp_socket_ */
-      fifo_data = fifo_from_user_.read(max_packet_size_-(outer_header_len+tag_len));
-      if(fifo_data.size() > 0){
+      /* attempt to pull up to batch_size_ packets' worth of data out of fifo_from_user,
+         and if there is some data available, we encapsulate it in encrypted packets and
+         send them via udp_socket_. The data is read straight into the payloads of the
+         packets in out_packets, and then encrypted in place. The buffers in out_packets
+         are reused for each pass of the loop, so they are only allocated once. */
+      unsigned int num_packets = 0;
+      while(num_packets < batch_size_){
+        if(out_packets.size() == num_packets){
+          out_packets.emplace_back();
+        }
+        std::vector<unsigned char>& packet = out_packets[num_packets];
+        packet.resize(max_packet_size_);
+        nanos_t read_start = stage_start();
+        unsigned int data_len = compressor_ ? read_compressed(packet,current_max_data_len()) :
+          read_from_user(packet,current_max_data_len());
+        if(data_len == 0){
+          break;
+        }
+        stage_end(PipelineStage::fifo_read,read_start);
+        packet.resize(outer_header_len+data_len+tag_len);
+        num_packets++;
+      }
+      if(num_packets > 0){
         no_more_data = false;
-        udp_socket_->send(create_packet(fifo_data),
-                          peer_ip_addr_,
-                          peer_port_);
+        send_data(out_packets,num_packets);
+        reply_owed_ = false; // any packet confirms our segment number to the peer
       }
     }
 
   }
 
+  /* if the peer is owed a packet to confirm our segment number, and we have not sent it
+     any data above, send it an empty packet */
+  if(reply_owed_ and (current_peer_segnum_ != 0)){
+    send_packet(create_packet(std::vector<unsigned char>{}));
+    reply_owed_ = false;
+  }
+
+  /* if the packets sent have left a group part-built for too long, send its repair
+     packet now rather than waiting for the group to fill up */
+  if(fec_encoder_){
+    nanos_t fec_flush_due = fec_encoder_->flush_due();
+    if( (fec_flush_due != 0) and (fec_flush_due <= monotonic_nanos()) ){
+      send_repair();
+    }
+  }
+
+  /* a Connection which is still dormant drops the CryptoUnit which it used to try the
+     packets received */
+  if(dormant_.load(std::memory_order_relaxed)){
+    crypto_units_.clear();
+  }
+
+  TRACEPOINT1(move_data_exit,pass);
 }
 
 
@@ -225,50 +599,174 @@ void Connection::move_data(unsigned int loop_max)
  */
 bool Connection::is_data()
 {
-  /* check if there are any messages in message_queue_ */
+  /* check if staged data can be written to fifo_to_user_. If it cannot, and so much is
+     staged that move_data() will not take any messages off message_queue_, then those
+     messages do not count as data to be processed. */
+  bool intake_paused = false;
+  if(not pending_output_.empty()){
+    if(user_can_take(pending_output_.front().size()-pending_output_offset_)){
+      return true;
+    }
+    intake_paused = (pending_output_bytes_.load(std::memory_order_relaxed) >= max_pending_output);
+  }
+
+  /* check if there are any messages in message_queue_, or frames in bundled_input_ */
   {// new block to limit the scope of queue_lock_guard
     const std::lock_guard<std::mutex> queue_lock_guard(queue_lock_);
-    if(!message_queue_.empty()){
+    if( (not intake_paused) and
+        ( (not message_queue_.empty()) or (not bundled_input_.empty()) ) ){
       return true;
     }
   }
 
-  /* check if there is any data to be read on fifo_from_user_ */
+  /* check if there is any data to be read on fifo_from_user_. If the channel's data is
+     bundled, that can only be read if the Bundler has room for it (and otherwise the
+     Bundler will have the Session enqueue this Connection once it has room). */
+  if(bundler_){
+    return bundler_->has_room() and user_data_waiting();
+  }
   if(current_peer_segnum_ == 0){
     /* if the Connection is "closed", then we cannot process any data waiting on the
        FIFO */
     return false;
   }
 
-  return fd_has_data(fifo_from_user_.file_descriptor());
+  return user_data_waiting();
 }
 
 
 /* Connection::add_message(const ReceivedUDPMessage&) adds a UDP
- * message to the incoming message queue, message_queue_ (by copying)
+ * message to the incoming message queue, message_queue_ (by copying),
+ * unless it has to be dropped (see queue_has_room() )
  */
 void Connection::add_message(const ReceivedUDPMessage& msg)
 {
   const std::lock_guard<std::mutex> queue_lock_guard(queue_lock_);
-  message_queue_.push_back(msg);
+  if(queue_has_room(msg.data.size())){
+    message_queue_.push_back(msg);
+  }
 }
 
 
 /* Connection::add_message(const ReceivedUDPMessage&&) adds a UDP
- * message to the incoming message queue, message_queue_ (by moving)
+ * message to the incoming message queue, message_queue_ (by moving),
+ * unless it has to be dropped (see queue_has_room() )
  */
 void Connection::add_message(ReceivedUDPMessage&& msg)
 {
   const std::lock_guard<std::mutex> queue_lock_guard(queue_lock_);
-  message_queue_.push_back(std::move(msg));
+  if(queue_has_room(msg.data.size())){
+    message_queue_.push_back(std::move(msg));
+  }
+}
+
+
+/* Connection::queue_has_room() tests whether a message of "size" bytes can be added to
+ * message_queue_ (or a frame to bundled_input_), which it cannot if they already hold
+ * max_queued_bytes between them (whether or not move_data() is taking messages off them). If it can, the message is counted in
+ * queued_bytes_, and if not, it is counted as dropped. queue_lock_ must be held.
+ */
+bool Connection::queue_has_room(std::size_t size)
+{
+  if(queued_bytes_+size > max_queued_bytes){
+    metrics_.messages_dropped.add();
+    return false;
+  }
+  queued_bytes_ += size;
+  return true;
 }
 
 
+/* Connection::add_bundled_payload() adds the data of a frame for this channel from a
+ * bundle packet (see Bundler.h) to bundled_input_, to be written to the user by
+ * move_data(), unless it has to be dropped. The frames count towards max_queued_bytes
+ * along with the messages in message_queue_ (see queue_has_room() ).
+ */
+void Connection::add_bundled_payload(const unsigned char* data, unsigned int count)
+{
+  const std::lock_guard<std::mutex> queue_lock_guard(queue_lock_);
+  if(queue_has_room(count)){
+    bundled_input_.emplace_back(data,data+count);
+  }
+}
+
+
+/* Connection::uses_bundler() reports whether the Connection's channel is carried in
+ * frames by bundler, and so drains the frames for it given to add_bundled_payload()
+ */
+bool Connection::uses_bundler(const Bundler* bundler) const
+{ return bundler_ and (bundler_.get() == bundler); }
+
+
 /* Connection::from_user_fifo_fd() returns the file descriptor for the
- * Connection's FromUserFifo
+ * Connection's FromUserFifo, or in seqpacket mode for its SeqPacketEndpoint
+ * (which only changes during move_data() ), or in shm mode for the doorbell
+ * of its ShmEndpoint, or in local mode for the eventfd of its LocalChannel, or
+ * in bundle mode for the eventfd of its Bundler, or in probe mode for the eventfd of its
+ * PathProber
  */
 int Connection::from_user_fifo_fd()
-{ return fifo_from_user_.file_descriptor(); }
+{
+  if(bundle_endpoint_){
+    return bundle_endpoint_->file_descriptor();
+  }
+  if(probe_endpoint_){
+    return probe_endpoint_->file_descriptor();
+  }
+  if(seqpacket_endpoint_){
+    return seqpacket_endpoint_->file_descriptor();
+  }
+  if(shm_endpoint_){
+    return shm_endpoint_->file_descriptor();
+  }
+  if(local_channel_){
+    return local_channel_->file_descriptor();
+  }
+  return fifo_from_user_->file_descriptor();
+}
+
+
+/* Connection::to_user_fifo_fd() returns the file descriptor for the
+ * Connection's ToUserFifo, or in seqpacket mode for its SeqPacketEndpoint.
+ * In shm and local modes there is nothing to poll() on for room to write, as
+ * the user program rings the doorbell given by from_user_fifo_fd() once it has
+ * made room, and in bundle and probe modes the Bundler or PathProber always takes the
+ * data, so the return value is -1, which poll() ignores.
+ */
+int Connection::to_user_fifo_fd()
+{
+  if(seqpacket_endpoint_){
+    return seqpacket_endpoint_->file_descriptor();
+  }
+  if(shm_endpoint_ or local_channel_ or bundle_endpoint_ or probe_endpoint_){
+    return -1;
+  }
+  return fifo_to_user_->file_descriptor();
+}
+
+
+/* Connection::output_pending() reports whether the Connection has received data staged
+ * for writing to its ToUserFifo, in which case it should be given the chance to move
+ * data again once that fifo becomes writable
+ */
+bool Connection::output_pending()
+{ return pending_output_bytes_.load(std::memory_order_relaxed) != 0; }
+
+
+/* Connection::user_input_blocked() reports whether the channel's data is bundled and the
+ * Bundler has no room for more, in which case data waiting on the "from user" fifo cannot
+ * be moved, and the Bundler will have the Session enqueue the Connection once it has room
+ */
+bool Connection::user_input_blocked()
+{ return bundler_ and (not bundler_->has_room()); }
+
+
+/* Connection::local_channel() returns the Connection's LocalChannel, through which an
+ * application in the same process uses a channel in local mode (it is null in other
+ * modes)
+ */
+std::shared_ptr<LocalChannel> Connection::local_channel()
+{ return local_channel_; }
 
 
 /* Connection::open_status() reports whether the Connection is "open",
@@ -282,6 +780,218 @@ std::pair<bool,millis_timestamp_t> Connection::open_status()
 { return {current_peer_segnum_ != 0, last_hello_packet_sent_}; }
 
 
+/* Connection::start_handshake() tells the Connection to exchange segment numbers with
+ * its peer as soon as possible, rather than waiting until there is data on the "from
+ * user" FIFO. Once this has been called, a closed Connection sends "hello" packets
+ * whenever move_data() is called and handshake_due() has passed, whether or not there
+ * is any data waiting. This means that the Connection is usually open before the first
+ * data arrives, which saves that data from waiting for a round trip to the peer.
+ */
+void Connection::start_handshake()
+{
+  handshake_wanted_ = true;
+  hello_interval_ = min_hello_interval;
+}
+
+
+/* Connection::hibernate() puts the Connection to sleep if it has nothing in hand, such as
+ * received messages or data held back or staged for the user, releasing its CryptoUnits
+ * (and so their cipher contexts) and its working buffers, which wake() creates again from
+ * the keys when the Connection is next moved with data from the user or an authenticated
+ * packet (see move_data() ). Its segment numbers and the records of the
+ * message numbers it has seen are kept, so it stays open, and packets replayed from before
+ * it slept are still rejected. It returns whether the Connection is now dormant. The bundle
+ * and probe Connections, which serve all of a peer's channels, never sleep.
+ *
+ * This must not be called while move_data() is running.
+ */
+bool Connection::hibernate()
+{
+  if(dormant_.load(std::memory_order_relaxed)){
+    return true;
+  }
+  if( bundle_endpoint_ or probe_endpoint_ or (not pending_output_.empty()) or
+      (held_len_ != 0) or reply_owed_ or (flush_due() != 0) ){
+    return false;
+  }
+  {// new block to limit the scope of queue_lock_guard
+    const std::lock_guard<std::mutex> queue_lock_guard(queue_lock_);
+    if( (not message_queue_.empty()) or (not bundled_input_.empty()) ){
+      return false;
+    }
+  }
+
+  /* swapping with an empty vector releases a vector's memory, which clear() does not */
+  crypto_units_.clear();
+  fec_report_unit_.reset();
+  std::vector<unsigned char>().swap(held_packet_);
+  std::vector<unsigned char>().swap(uncompressed_);
+  std::vector<unsigned char>().swap(decompressed_);
+  std::vector<unsigned char>().swap(reassembled_);
+  dormant_ = true;
+  TRACEPOINT1(hibernate,current_local_segnum_);
+  return true;
+}
+
+
+/* Connection::dormant() reports whether the Connection is asleep (see hibernate() ), or
+ * has not been woken yet. It is safe to call this from any thread.
+ */
+bool Connection::dormant()
+{ return dormant_.load(std::memory_order_relaxed); }
+
+
+/* Connection::wake_wanted() reports whether a dormant Connection has anything to do other
+ * than handle received packets, which is the case if there is data from the user, or
+ * frames from the peer's Bundler, or a "hello" packet is due
+ */
+bool Connection::wake_wanted()
+{
+  millis_timestamp_t hello_due = handshake_due();
+  if( (hello_due != 0) and (hello_due <= epoch_time_millis()) ){
+    return true;
+  }
+  {// new block to limit the scope of queue_lock_guard
+    const std::lock_guard<std::mutex> queue_lock_guard(queue_lock_);
+    if(not bundled_input_.empty()){
+      return true;
+    }
+  }
+  return user_data_waiting();
+}
+
+
+/* Connection::wake() creates the CryptoUnits and working buffers of a dormant
+ * Connection, and does nothing if the Connection is awake. The CryptoUnits use the
+ * sending key for encryption and the receiving key for decryption. An OpenSSL cipher
+ * context cannot be used by two threads at once, so if we have a CryptoWorkerPool we need
+ * a separate CryptoUnit for each of its lanes.
+ */
+void Connection::wake()
+{
+  if(not dormant_.load(std::memory_order_relaxed)){
+    return;
+  }
+  unsigned int num_crypto_units = crypto_pool_ ? crypto_pool_->num_lanes() : 1;
+  std::vector<std::unique_ptr<CryptoUnit>> crypto_units;
+  for(unsigned int i=0; i<num_crypto_units; i++){
+    crypto_units.push_back(std::make_unique<CryptoUnit>(send_key_,recv_key_,cipher_suite_));
+  }
+  crypto_units_ = std::move(crypto_units);
+  if(fec_encoder_){
+    fec_report_unit_ = std::make_unique<CryptoUnit>(fec_send_key_,fec_recv_key_,cipher_suite_);
+  }
+  if(coalesce_window_nanos_ != 0){
+    held_packet_.resize(max_packet_size_);
+  }
+  if(compressor_){
+    uncompressed_.resize(max_packet_size_);
+    decompressed_.resize(max_udp_payload);
+  }
+  dormant_ = false;
+  TRACEPOINT1(wake,current_local_segnum_);
+}
+
+
+/* Connection::handshake_due() returns the time (in milliseconds since the UNIX epoch)
+ * after which move_data() should be called so that the Connection can send a "hello"
+ * packet as part of a handshake started by start_handshake(). A value of 0 means that
+ * no such "hello" packet is needed, because the Connection is open or start_handshake()
+ * has not been called.
+ */
+millis_timestamp_t Connection::handshake_due()
+{
+  if( (not handshake_wanted_) or (current_peer_segnum_ != 0) ){
+    return 0;
+  }
+  return last_hello_packet_sent_+hello_interval_;
+}
+
+
+/* Connection::flush_due() returns the time (from monotonic_nanos() ) after which
+ * move_data() should be called so that the Connection can send data which it is holding
+ * back to share a packet with more data. This is when the data in held_packet_ has waited
+ * for the coalescing window, or in bundle mode when the Bundler's oldest frame has waited
+ * for the bundle window, or in probe mode when the PathProber has a probe to send or has
+ * waited long enough for a probe to be acknowledged. It is also when a part-built FEC
+ * group should have its repair packet sent. A value of 0 means that no data is being held
+ * back, or that the bundle or probe Connection is closed.
+ */
+nanos_t Connection::flush_due()
+{
+  if(bundle_endpoint_ or probe_endpoint_){
+    /* a closed bundle or probe Connection cannot send anything, and will be moved again
+       when it opens */
+    if(current_peer_segnum_ == 0){
+      return 0;
+    }
+    return bundle_endpoint_ ? bundle_endpoint_->flush_due() : probe_endpoint_->flush_due();
+  }
+  nanos_t due = (held_len_ != 0) ? held_since_+coalesce_window_nanos_ : 0;
+  if(fec_encoder_){
+    nanos_t fec_flush_due = fec_encoder_->flush_due();
+    if( (fec_flush_due != 0) and ( (due == 0) or (fec_flush_due < due) ) ){
+      due = fec_flush_due;
+    }
+  }
+  return due;
+}
+
+
+/* Connection::metrics() reports the Connection's counters, the number of messages
+ * waiting in message_queue_, and the capacities of the fifos. It is safe to call this
+ * from any thread.
+ */
+ConnectionMetricsSnapshot Connection::metrics()
+{
+  metric_value_t queue_depth;
+  {// new block to limit the scope of queue_lock_guard
+    const std::lock_guard<std::mutex> queue_lock_guard(queue_lock_);
+    queue_depth = message_queue_.size();
+  }
+  ConnectionMetricsSnapshot cms = metrics_.snapshot(queue_depth);
+  cms.outward_pipe_size = from_user_pipe_size_;
+  cms.inward_pipe_size = to_user_pipe_size_;
+  cms.pending_output = pending_output_bytes_.load(std::memory_order_relaxed);
+  cms.max_packet_size = (probe_endpoint_ ? probe_endpoint_->max_payload() :
+                         current_max_data_len())+(outer_header_len+tag_len);
+  if(fec_encoder_){
+    cms.max_packet_size += FecEncoder::fec_overhead; // the size of the repair packets
+    cms.fec_group_size = fec_encoder_->group_size();
+  }
+  return cms;
+}
+
+
+/* Connection::peer_name() and Connection::channel_id() report which peer and channel
+ * the Connection is for
+ */
+const std::string& Connection::peer_name()
+{ return peer_name_; }
+
+const channel_id_type& Connection::channel_id()
+{ return channel_id_; }
+
+
+/* Connection::max_data_len() gives the most data which fits in the payload of a packet
+ * of max_packet_size bytes, after the outer header and the AEAD tag
+ */
+unsigned int Connection::max_data_len(unsigned int max_packet_size)
+{ return max_packet_size-(outer_header_len+tag_len); }
+
+
+/* Connection::current_max_data_len() gives the most data which the Connection puts in the
+ * payload of a packet, which is what the PathProber has found gets through to the peer if
+ * there is one, or else what fits in a packet of max_packet_size_ bytes, less the extra
+ * length of the repair packets if the Connection uses FEC
+ */
+unsigned int Connection::current_max_data_len()
+{
+  unsigned int len = path_prober_ ? path_prober_->max_payload() : max_data_len(max_packet_size_);
+  return fec_encoder_ ? len-FecEncoder::fec_overhead : len;
+}
+
+
 /* Connection::unpack_header() extracts the various entities encoded in the
  * outer header of a packet.
  */
@@ -344,6 +1054,22 @@ Connection::unpack_header(const std::vector<unsigned char>& message_bytes)
 std::vector<unsigned char>
 Connection::create_packet(const std::vector<unsigned char>& data_bytes,
                           SegmentNumGenerator::segnum_t peer_segnum)
+{
+  std::vector<unsigned char> packet(data_bytes.size() + (outer_header_len+tag_len));
+  fill_packet_header(packet,peer_segnum);
+  std::copy(data_bytes.begin(),data_bytes.end(),packet.begin()+outer_header_len);
+  seal_packet(packet,*crypto_units_[0]);
+  return packet;
+}
+
+
+/* Connection::fill_packet_header() fills in the outer header of packet, using up one
+ * message number. packet must already have its final size, with room for the header,
+ * the payload and the AEAD tag. The payload is left to be encrypted by seal_packet().
+ * The peer_segnum argument is as for create_packet().
+ */
+void Connection::fill_packet_header(std::vector<unsigned char>& packet,
+                                    SegmentNumGenerator::segnum_t peer_segnum)
 {
   /* If local_next_msgnum_ has gone beyond the range of values which can
      fit in a 6 byte value, get a new segment number. The maximum message
@@ -354,8 +1080,6 @@ Connection::create_packet(const std::vector<unsigned char>& data_bytes,
     local_next_msgnum_ = 1;
   }
 
-  std::vector<unsigned char> packet(data_bytes.size() +
-                                    (outer_header_len+tag_len));
   std::vector<unsigned char>::size_type offset = 0;
 
   /* copy in our id as the sender's id */
@@ -390,48 +1114,661 @@ Connection::create_packet(const std::vector<unsigned char>& data_bytes,
             packet.begin()+offset);
   offset += msgnum_len;
   local_next_msgnum_++;
+}
+
+
+/* Connection::seal_packet() encrypts the payload of packet in place, and appends the
+ * AEAD tag, using crypto_unit. The header of packet must already have been filled in by
+ * fill_packet_header(). This only touches packet, so it is safe to seal different packets
+ * at the same time using different CryptoUnits.
+ */
+void Connection::seal_packet(std::vector<unsigned char>& packet,
+                             CryptoUnit& crypto_unit)
+{
+  /* the additional data is the byte string representing the peer segment number */
+  auto peer_segnum_start = packet.begin()+host_id_size+channel_id_size;
+  nanos_t encrypt_start = stage_start();
+  std::vector<unsigned char> peer_segnum_bytes(peer_segnum_start,
+                                               peer_segnum_start+segnum_len);
 
   /* create the AEAD initialization vector by concatenating the byte strings
      representing our segment number and the message number */
   CryptoUnit::iv_t iv;
-  std::copy(packet.begin()+host_id_size+channel_id_size+segnum_len,
+  std::copy(peer_segnum_start+segnum_len,
             packet.begin()+outer_header_len,
             iv.begin());
 
-  crypto_unit_->encrypt(data_bytes, peer_segnum_bytes,
-                       iv, packet, outer_header_len);
-  return packet;
+  unsigned int data_len = packet.size()-(outer_header_len+tag_len);
+  crypto_unit.encrypt_in_place(packet, outer_header_len, data_len,
+                               peer_segnum_bytes, iv);
+  stage_end(PipelineStage::encrypt,encrypt_start);
+  TRACEPOINT1(encrypt,data_len);
+}
+
+
+/* Connection::send_data() turns the first num_packets elements of packets, which hold
+ * plaintext payloads (with room for the header before and the AEAD tag after), into
+ * encrypted packets, and sends them, in order, via udp_socket_. If the Connection has a
+ * CryptoWorkerPool, the message numbers are assigned in order first, then the packets
+ * are encrypted in parallel, and then they are all sent. num_packets must not be 0.
+ */
+void Connection::send_data(std::vector<std::vector<unsigned char>>& packets,
+                           unsigned int num_packets)
+{
+  if(not crypto_pool_){
+    for(unsigned int j=0; j<num_packets; j++){
+      fill_packet_header(packets[j]);
+      seal_packet(packets[j],*crypto_units_[0]);
+      send_packet(packets[j]);
+    }
+    return;
+  }
+
+  for(unsigned int j=0; j<num_packets; j++){
+    fill_packet_header(packets[j]);
+  }
+
+  /* task k seals packets k, k+num_tasks, k+2*num_tasks, ... using crypto_units_[k] */
+  unsigned int num_tasks = std::min<unsigned int>(crypto_units_.size(),num_packets);
+  crypto_pool_->run(num_tasks,
+                    [&](unsigned int k){
+                      for(unsigned int j=k; j<num_packets; j+=num_tasks){
+                        seal_packet(packets[j],*crypto_units_[k]);
+                      }
+                    });
+
+  for(unsigned int j=0; j<num_packets; j++){
+    send_packet(packets[j]);
+  }
+}
+
+
+/* Connection::send_packet() sends a packet to the peer, and if the Connection uses FEC,
+ * adds it to the group being built, sending the group's repair packet if it is complete
+ */
+void Connection::send_packet(const std::vector<unsigned char>& packet)
+{
+  transmit(packet);
+  if(fec_encoder_ and fec_encoder_->add(packet)){
+    send_repair();
+  }
+}
+
+
+/* Connection::send_repair() sends the repair packet of the FEC group being built, which
+ * must not be empty, and counts it
+ */
+void Connection::send_repair()
+{
+  transmit(fec_encoder_->repair_packet());
+  metrics_.fec_repairs_sent.add();
+}
+
+
+/* Connection::take_fec_packets() takes the FEC packets out of a batch of received
+ * messages and into fec_packets_, to be handled by handle_fec_packets() once the others
+ * have been. As the others are decrypted in place, copies of them as they were received
+ * are put in fec_copies_ (in the same order), for fec_decoder_ to keep once they have been
+ * authenticated, in case they are needed to rebuild a packet.
+ */
+void Connection::take_fec_packets(std::vector<ReceivedUDPMessage>& messages)
+{
+  fec_packets_.clear();
+  unsigned int num_kept = 0;
+  for(unsigned int j=0; j<messages.size(); j++){
+    std::vector<unsigned char>& data = messages[j].data;
+    if(FecDecoder::is_fec_packet(data)){
+      metrics_.packets_in.add();
+      metrics_.bytes_in.add(data.size());
+      fec_packets_.push_back(std::move(data));
+      continue;
+    }
+    if(num_kept != j){
+      messages[num_kept] = std::move(messages[j]);
+    }
+    num_kept++;
+  }
+  messages.resize(num_kept);
+
+  if(fec_copies_.size() < num_kept){
+    fec_copies_.resize(num_kept);
+  }
+  for(unsigned int j=0; j<num_kept; j++){
+    fec_copies_[j].assign(messages[j].data.begin(),messages[j].data.end());
+  }
+}
+
+
+/* Connection::handle_fec_packets() handles the FEC packets taken out of a batch of
+ * received messages by take_fec_packets(). Report packets which are authenticated are
+ * passed to fec_encoder_. Repair packets are passed to fec_decoder_, and any packet one
+ * lets it rebuild is handled like any other received packet, and kept by fec_decoder_
+ * if it is authenticated. A repair packet may bring a report on the losses due (see
+ * Fec.h), which is then sent.
+ */
+void Connection::handle_fec_packets()
+{
+  for(std::vector<unsigned char>& data : fec_packets_){
+    if(FecDecoder::packet_type(data) == FecEncoder::report_type){
+      if(open_report(data)){
+        fec_encoder_->report(data);
+      }
+      continue;
+    }
+    if(FecDecoder::packet_type(data) != FecEncoder::repair_type){
+      continue;
+    }
+    std::vector<unsigned char> recovered;
+    if(fec_decoder_->recover(data,recovered)){
+      std::vector<unsigned char> recovered_copy(recovered);
+      if(handle_message(recovered)){
+        metrics_.fec_packets_recovered.add();
+        fec_decoder_->add(std::move(recovered_copy));
+      }
+    }
+    if(fec_decoder_->report_due() and fec_report_unit_){
+      send_report();
+    }
+  }
+  fec_packets_.clear();
+}
+
+
+/* Connection::send_report() sends the peer a report packet from fec_decoder_ (see Fec.h),
+ * with an AEAD tag made by fec_report_unit_ over its contents. The initialization vector
+ * is our segment number followed by the report's number, which is never repeated with the
+ * same segment number.
+ */
+void Connection::send_report()
+{
+  std::vector<unsigned char> report =
+    fec_decoder_->report_packet(current_local_segnum_,++fec_reports_sent_);
+  CryptoUnit::iv_t iv;
+  std::copy(report.begin()+FecEncoder::report_iv_offset,
+            report.begin()+FecEncoder::report_iv_offset+iv.size(),iv.begin());
+  std::vector<unsigned char> ad(report.begin(),report.begin()+FecEncoder::report_header_len);
+  fec_report_unit_->encrypt_in_place(report,FecEncoder::report_header_len,0,ad,iv);
+  transmit(report);
+}
+
+
+/* Connection::open_report() checks the AEAD tag of a report packet from the peer, and
+ * reports whether it is valid. A report is only accepted if it carries the peer's
+ * confirmed current segment number, so none are accepted before the Connection is open,
+ * and if its number is greater than that of the last report accepted with that segment
+ * number, so that it cannot be replayed. A dormant Connection ignores reports.
+ */
+bool Connection::open_report(std::vector<unsigned char>& report)
+{
+  if( (report.size() != FecEncoder::report_len) or (not fec_report_unit_) ){
+    return false;
+  }
+  SegmentNumGenerator::segnum_t segnum =
+    bytes_to_uint<SegmentNumGenerator::segnum_t>(report,FecEncoder::report_iv_offset,
+                                                 segnum_len);
+  std::uint_least64_t report_num =
+    bytes_to_uint<std::uint_least64_t>(report,FecEncoder::report_iv_offset+segnum_len,
+                                       msgnum_len);
+  if( (segnum == 0) or (segnum != current_peer_segnum_) ){
+    metrics_.bad_segnums.add();
+    return false;
+  }
+  if( (segnum == last_report_segnum_) and (report_num <= last_report_num_) ){
+    metrics_.replays_rejected.add();
+    return false;
+  }
+
+  CryptoUnit::iv_t iv;
+  std::copy(report.begin()+FecEncoder::report_iv_offset,
+            report.begin()+FecEncoder::report_iv_offset+iv.size(),iv.begin());
+  std::vector<unsigned char> ad(report.begin(),report.begin()+FecEncoder::report_header_len);
+  if(not fec_report_unit_->decrypt_in_place(report,FecEncoder::report_header_len,tag_len,
+                                            ad,iv)){
+    metrics_.auth_failures.add();
+    return false;
+  }
+  last_report_segnum_ = segnum;
+  last_report_num_ = report_num;
+  return true;
+}
+
+
+/* Connection::transmit() sends a packet to the peer via udp_socket_, and counts it */
+void Connection::transmit(const std::vector<unsigned char>& packet)
+{
+  nanos_t send_start = stage_start();
+  udp_socket_->send(packet,peer_ip_addr_,peer_port_);
+  stage_end(PipelineStage::udp_send,send_start);
+  metrics_.packets_out.add();
+  metrics_.bytes_out.add(packet.size());
+}
+
+
+/* Connection::user_data_waiting() reports whether there is data from the user waiting to
+ * be read. In seqpacket mode, a user program waiting to connect is accepted first, as it
+ * has not sent any data yet as far as the Connection can tell.
+ */
+bool Connection::user_data_waiting()
+{
+  if(fragmenter_ and fragmenter_->sending()){
+    return true;
+  }
+  if(bundle_endpoint_){
+    return bundle_endpoint_->data_waiting();
+  }
+  if(probe_endpoint_){
+    return probe_endpoint_->data_waiting();
+  }
+  if(seqpacket_endpoint_){
+    return seqpacket_endpoint_->data_waiting();
+  }
+  if(shm_endpoint_){
+    return shm_endpoint_->data_waiting();
+  }
+  if(local_channel_){
+    return local_channel_->data_waiting();
+  }
+  return fd_has_data(fifo_from_user_->file_descriptor());
+}
+
+
+/* Connection::user_can_take() reports whether a write of count bytes to the user would
+ * make progress, which in shm and local modes means that there is room for it (and in
+ * bundle and probe modes is always the case)
+ */
+bool Connection::user_can_take(unsigned int count)
+{
+  if(bundle_endpoint_ or probe_endpoint_){
+    return true;
+  }
+  if(shm_endpoint_){
+    return shm_endpoint_->has_room(count);
+  }
+  if(local_channel_){
+    return local_channel_->has_room(count);
+  }
+  return fd_writable(to_user_fifo_fd());
+}
+
+
+/* Connection::read_from_user() reads up to max_data_len bytes of data from the user into
+ * the payload of packet, which must be max_packet_size_ bytes long, and returns the number
+ * of bytes read. max_data_len is one packet's worth, or less if the data is to go in a
+ * frame of a bundle packet. In the other modes this is a single message from the user (or
+ * a fragment of one, see read_fragmented() ), and messages which are longer than
+ * max_data_len are discarded (and counted).
+ */
+unsigned int Connection::read_from_user(std::vector<unsigned char>& packet,
+                                        unsigned int max_data_len)
+{
+  if(fifo_from_user_ and (coalesce_window_nanos_ != 0)){
+    return read_coalesced(packet,max_data_len);
+  }
+  if(fifo_from_user_){
+    return fifo_from_user_->read_into(packet,outer_header_len,max_data_len);
+  }
+  if(fragmenter_){
+    return read_fragmented(packet,max_data_len);
+  }
+  return read_message(packet,outer_header_len,max_data_len);
+}
+
+
+/* Connection::read_compressed() is read_from_user() for a Connection with a Compressor.
+ * Up to max_data_len-1 bytes from the user are read into uncompressed_, and then put in
+ * the payload of packet after the flag byte, compressed if the Compressor finds that
+ * worthwhile.
+ */
+unsigned int Connection::read_compressed(std::vector<unsigned char>& packet,
+                                         unsigned int max_data_len)
+{
+  unsigned int data_len = read_from_user(uncompressed_,max_data_len-1);
+  if(data_len == 0){
+    return 0;
+  }
+  const unsigned char* data = uncompressed_.data()+outer_header_len;
+  unsigned char* payload = packet.data()+outer_header_len;
+
+  nanos_t compress_start = monotonic_nanos();
+  unsigned int payload_len = compressor_->compress(data,data_len,payload+1);
+  metrics_.compression_nanos.add(monotonic_nanos()-compress_start);
+  if(payload_len != 0){
+    payload[0] = Compressor::compressed_flag;
+  }
+  else{
+    payload[0] = Compressor::raw_flag;
+    std::copy(data,data+data_len,payload+1);
+    payload_len = data_len;
+  }
+  metrics_.compression_bytes_in.add(data_len);
+  metrics_.compression_bytes_out.add(payload_len+1);
+  return payload_len+1;
+}
+
+
+/* Connection::read_message() reads a single message of up to count bytes from the user
+ * into dest, starting at position offset, in the modes other than fifo mode, and returns
+ * its length. Messages which are longer than count are discarded (and counted).
+ */
+unsigned int Connection::read_message(std::vector<unsigned char>& dest,
+                                      std::vector<unsigned char>::size_type offset,
+                                      unsigned int count)
+{
+  while(true){
+    std::pair<unsigned int,bool> read_result =
+      seqpacket_endpoint_ ? seqpacket_endpoint_->read_into(dest,offset,count) :
+      shm_endpoint_ ? shm_endpoint_->read_into(dest,offset,count) :
+      local_channel_ ? local_channel_->read_into(dest,offset,count) :
+      bundle_endpoint_ ? bundle_endpoint_->read_into(dest,offset,count) :
+      probe_endpoint_->read_into(dest,offset,count);
+    if(not read_result.second){
+      return read_result.first;
+    }
+    metrics_.messages_too_long.add();
+  }
+}
+
+
+/* Connection::read_fragmented() is read_from_user() for a Connection with a Fragmenter.
+ * A whole message from the user, of up to the channel's maximum message size, is read into
+ * the Fragmenter's buffer, and it is then passed on with its fragment header, in one
+ * packet if it fits or else in fragments over this and the following calls (during which
+ * user_data_waiting() reports that there is data waiting).
+ */
+unsigned int Connection::read_fragmented(std::vector<unsigned char>& packet,
+                                         unsigned int max_data_len)
+{
+  if(not fragmenter_->sending()){
+    std::vector<unsigned char>& message = fragmenter_->buffer();
+    unsigned int length = read_message(message,0,message.size());
+    if(length == 0){
+      return 0;
+    }
+    if(fragmenter_->start(length,max_data_len)){
+      metrics_.messages_fragmented.add();
+    }
+  }
+  return fragmenter_->next_packet(packet,outer_header_len,max_data_len);
+}
+
+
+/* Connection::read_coalesced() is read_from_user() for a fifo mode Connection with a
+ * coalescing window. Data read from fifo_from_user_ is added to held_packet_, and is only
+ * passed on, by swapping held_packet_ with packet, once there is max_data_len bytes of it
+ * or the first of it has waited for coalesce_window_nanos_. Until then the return value
+ * is 0, and flush_due() gives the time at which the data is due to be passed on. If
+ * max_data_len has fallen since the data was read (as the PathProber has found that
+ * packets that large no longer get through), the data beyond max_data_len stays held.
+ */
+unsigned int Connection::read_coalesced(std::vector<unsigned char>& packet,
+                                        unsigned int max_data_len)
+{
+  if(held_len_ < max_data_len){
+    unsigned int data_len = fifo_from_user_->read_into(held_packet_,outer_header_len+held_len_,
+                                                       max_data_len-held_len_);
+    if( (held_len_ == 0) and (data_len != 0) ){
+      held_since_ = monotonic_nanos();
+    }
+    held_len_ += data_len;
+  }
+  if( (held_len_ == 0) or
+      ( (held_len_ < max_data_len) and
+        (monotonic_nanos() < held_since_+coalesce_window_nanos_) ) ){
+    return 0;
+  }
+
+  std::swap(packet,held_packet_);
+  held_packet_.resize(max_packet_size_);
+  unsigned int data_len = std::min(held_len_,max_data_len);
+  held_len_ -= data_len;
+  auto excess_start = packet.begin()+outer_header_len+data_len;
+  std::copy(excess_start,excess_start+held_len_,held_packet_.begin()+outer_header_len);
+  if(data_len < max_data_len){
+    metrics_.coalesce_timeouts.add();
+  }
+  return data_len;
+}
+
+
+/* Connection::write_to_endpoint() writes count bytes at data to fifo_to_user_, or in
+ * the other modes sends them as one message via seqpacket_endpoint_, shm_endpoint_,
+ * local_channel_, bundle_endpoint_ or probe_endpoint_. The return value is as for
+ * FifoToUser::write().
+ */
+std::pair<unsigned int,bool> Connection::write_to_endpoint(const unsigned char* data,
+                                                           unsigned int count)
+{
+  if(bundle_endpoint_){
+    return bundle_endpoint_->write(data,count);
+  }
+  if(probe_endpoint_){
+    return probe_endpoint_->write(data,count);
+  }
+  if(seqpacket_endpoint_){
+    return seqpacket_endpoint_->write(data,count);
+  }
+  if(shm_endpoint_){
+    return shm_endpoint_->write(data,count);
+  }
+  if(local_channel_){
+    return local_channel_->write(data,count);
+  }
+  return fifo_to_user_->write(data,count);
+}
+
+
+/* Connection::write_to_user() writes data_len bytes of received data at data, which is
+ * the plaintext of a received packet or a frame from a bundle packet, to fifo_to_user_.
+ * Whatever cannot be written because the fifo is
+ * full is staged in pending_output_, to be written by flush_pending_output() once the
+ * reader has made room, and if there is already staged data then the new data is staged
+ * behind it, so the reader always sees the data in order. Data is only discarded if the
+ * fifo has no reader at all.
+ */
+void Connection::write_to_user(const unsigned char* data, unsigned int data_len)
+{
+  if(data_len == 0){
+    /* an empty packet only confirms segment numbers, and must not become an empty
+       message in the modes which keep message boundaries */
+    return;
+  }
+  unsigned int written = 0;
+  if(pending_output_.empty() or flush_pending_output()){
+    nanos_t write_start = stage_start();
+    std::pair<unsigned int,bool> write_result = write_to_endpoint(data,data_len);
+    stage_end(PipelineStage::fifo_write,write_start);
+    if(write_result.second){
+      metrics_.fifo_broken_pipes.add();
+      return;
+    }
+    written = write_result.first;
+    if(written == data_len){
+      return;
+    }
+    metrics_.fifo_short_writes.add();
+  }
+  pending_output_.emplace_back(data+written,data+data_len);
+  pending_output_bytes_.fetch_add(data_len-written,std::memory_order_relaxed);
+}
+
+
+/* Connection::deliver_to_user() passes the data_len bytes of received data at data to
+ * write_to_user(), after decompressing it if the channel has a Compressor, and after
+ * taking off the fragment header if the channel has a Reassembler, in which case a
+ * fragment is only passed on once it completes a message. Compressed data which cannot be
+ * decompressed is discarded, though as it has been authenticated that can only happen if
+ * the peer does not have compression enabled for the channel.
+ */
+void Connection::deliver_to_user(const unsigned char* data, unsigned int data_len)
+{
+  if( compressor_ and (data_len != 0) ){
+    if(data[0] == Compressor::compressed_flag){
+      nanos_t decompress_start = monotonic_nanos();
+      data_len = Compressor::decompress(data+1,data_len-1,decompressed_.data(),
+                                        decompressed_.size());
+      metrics_.compression_nanos.add(monotonic_nanos()-decompress_start);
+      if(data_len == 0){
+        return;
+      }
+      data = decompressed_.data();
+    }
+    else{
+      data++;
+      data_len--;
+    }
+  }
+
+  if( (not reassembler_) or (data_len == 0) ){
+    write_to_user(data,data_len);
+  }
+  else if(data[0] == Fragmenter::whole_flag){
+    write_to_user(data+1,data_len-1);
+  }
+  else if(reassembler_->add(data,data_len,reassembled_)){
+    write_to_user(reassembled_.data(),reassembled_.size());
+  }
+}
+
+
+/* Connection::flush_pending_output() writes as much of the data staged in pending_output_
+ * to fifo_to_user_ as the fifo will take, and reports whether all of it was written. If
+ * the fifo turns out to have no reader, the staged data can never be delivered, so it is
+ * discarded.
+ */
+bool Connection::flush_pending_output()
+{
+  while(not pending_output_.empty()){
+    std::vector<unsigned char>& front = pending_output_.front();
+    unsigned int count = front.size()-pending_output_offset_;
+    std::pair<unsigned int,bool> write_result =
+      write_to_endpoint(front.data()+pending_output_offset_,count);
+    if(write_result.second){
+      metrics_.fifo_broken_pipes.add();
+      pending_output_.clear();
+      pending_output_offset_ = 0;
+      pending_output_bytes_.store(0,std::memory_order_relaxed);
+      return true;
+    }
+    pending_output_bytes_.fetch_sub(write_result.first,std::memory_order_relaxed);
+    if(write_result.first < count){
+      pending_output_offset_ += write_result.first;
+      return false;
+    }
+    pending_output_.pop_front();
+    pending_output_offset_ = 0;
+  }
+  return true;
 }
 
 
-/* Connection::handle_message() processes a received message.
+/* Connection::open_messages() decrypts, in parallel using crypto_pool_, those of
+ * the received messages which look like they could be legitimate and which
+ * handle_message() would want to decrypt. On return, opened has one element for
+ * each element of messages, recording the result of any decryption, which should
+ * then be passed to handle_message() along with the message. The Connection's
+ * state is only read (never modified) while the decryptions are running.
  */
-void Connection::handle_message(std::vector<unsigned char>& message_data)
+void Connection::open_messages(std::vector<ReceivedUDPMessage>& messages,
+                               std::vector<OpenedMessage>& opened)
 {
+  opened.clear();
+  opened.resize(messages.size(),OpenedMessage{false,false});
+
+  std::vector<unsigned int> to_open;
+  for(unsigned int j=0; j<messages.size(); j++){
+    const std::vector<unsigned char>& message_data = messages[j].data;
+    if( message_data.size() < (outer_header_len+tag_len) ){
+      continue;
+    }
+    MessageOuterHeader msg_oh = unpack_header(message_data);
+    bool msg_my_segnum_good = (msg_oh.my_segnum != 0) and \
+      ( (msg_oh.my_segnum == current_local_segnum_) or (msg_oh.my_segnum == old_local_segnum_) );
+    if( (msg_oh.peer_segnum != 0) and msg_my_segnum_good ){
+      to_open.push_back(j);
+    }
+  }
+
+  if(to_open.empty()){
+    return;
+  }
+
+  /* task k opens messages to_open[k], to_open[k+num_tasks], ... using crypto_units_[k] */
+  unsigned int num_tasks = std::min<unsigned int>(crypto_units_.size(),to_open.size());
+  crypto_pool_->run(num_tasks,
+                    [&](unsigned int k){
+                      for(unsigned int j=k; j<to_open.size(); j+=num_tasks){
+                        std::vector<unsigned char>& message_data = messages[to_open[j]].data;
+                        OpenedMessage& om = opened[to_open[j]];
+                        MessageOuterHeader msg_oh = unpack_header(message_data);
+                        nanos_t decrypt_start = stage_start();
+                        om.good_decrypt =
+                          crypto_units_[k]->decrypt_in_place(message_data,
+                                                             outer_header_len,
+                                                             message_data.size()-outer_header_len,
+                                                             std::vector<unsigned char>(msg_oh.ad.begin(),
+                                                                                        msg_oh.ad.end()),
+                                                             msg_oh.iv);
+                        stage_end(PipelineStage::decrypt,decrypt_start);
+                        TRACEPOINT2(decrypt,static_cast<unsigned int>(message_data.size()),
+                                    om.good_decrypt ? 1 : 0);
+                        om.opened = true;
+                      }
+                    });
+}
+
+
+/* Connection::handle_message() processes a received message. Messages are decrypted in
+ * place, so that the plaintext can be written to fifo_to_user_ straight from
+ * message_data. If opened is not null and records that the message has already been
+ * decrypted by open_messages(), the result of that decryption is used rather than
+ * decrypting the message again. The return value reports whether the message was
+ * authenticated.
+ */
+bool Connection::handle_message(std::vector<unsigned char>& message_data,
+                                OpenedMessage* opened)
+{
+  metrics_.packets_in.add();
+  metrics_.bytes_in.add(message_data.size());
+
   /* a legitimate message must have at least an outer header and an AEAD tag */
   if( message_data.size() < (outer_header_len+tag_len) ){
-    return;
+    return false;
   }
 
   MessageOuterHeader msg_oh = unpack_header(message_data);
   if(msg_oh.peer_segnum == 0){
     /* no legitimate message would ever have a sender's segment number of 0 */
-    return;
+    metrics_.bad_segnums.add();
+    return false;
   }
 
   /* We wrap the decryption logic in a lambda expression to avoid code duplication
-     below. Note that the "good_decrypt" parameter of CryptoUnit::decrypt() is
-     an output parameter taken by reference, which is used to record the success
-     of the decryption.  */
+     below. The "good_decrypt" parameter is an output parameter taken by reference,
+     which is used to record the success of the decryption. On success, the plaintext
+     is in message_data between the outer header and the AEAD tag. */
   auto do_decryption = [&](bool& good_decrypt)
   {
-    return crypto_unit_->decrypt(message_data,
-                                std::vector<unsigned char>(msg_oh.ad.begin(),
-                                                           msg_oh.ad.end()),
-                                msg_oh.iv,
-                                outer_header_len,
-                                message_data.size()-outer_header_len,
-                                good_decrypt);
+    if( (opened != nullptr) and opened->opened ){
+      good_decrypt = opened->good_decrypt;
+    }
+    else{
+      nanos_t decrypt_start = stage_start();
+      good_decrypt = crypto_units_[0]->decrypt_in_place(message_data,
+                                                        outer_header_len,
+                                                        message_data.size()-outer_header_len,
+                                                        std::vector<unsigned char>(msg_oh.ad.begin(),
+                                                                                   msg_oh.ad.end()),
+                                                        msg_oh.iv);
+      stage_end(PipelineStage::decrypt,decrypt_start);
+      TRACEPOINT2(decrypt,static_cast<unsigned int>(message_data.size()),good_decrypt ? 1 : 0);
+    }
+    if(not good_decrypt){
+      metrics_.auth_failures.add();
+      TRACEPOINT2(auth_failure,msg_oh.peer_segnum,msg_oh.msgnum);
+    }
+    else{
+      wake(); // an authenticated packet wakes a dormant Connection (see move_data() )
+    }
   };
 
   /* We only accept packets whose header contains a receiver segment number which is
@@ -453,7 +1790,8 @@ void Connection::handle_message(std::vector<unsigned char>& message_data)
     ( (msg_oh.my_segnum == current_local_segnum_) or (msg_oh.my_segnum == old_local_segnum_) );
   if(not msg_my_segnum_good){
     if(msg_oh.peer_segnum <= current_peer_segnum_){
-      return;
+      metrics_.bad_segnums.add();
+      return false;
     }
     bool good_decrypt;
     do_decryption(good_decrypt);
@@ -462,11 +1800,9 @@ void Connection::handle_message(std::vector<unsigned char>& message_data)
          as the receiver segment number in our empty packet so that the peer will accept
          the packet, but we don't "confirm" this peer segment number yet (see below) since
          we have not yet seen it in a packet with our current segment number */
-      udp_socket_->send(create_packet({},msg_oh.peer_segnum),
-                        peer_ip_addr_,
-                        peer_port_);
+      send_packet(create_packet({},msg_oh.peer_segnum));
     }
-    return;
+    return good_decrypt;
   }
 
   /* At this point, we know that the packet's header contains our current or previous segment
@@ -493,15 +1829,16 @@ void Connection::handle_message(std::vector<unsigned char>& message_data)
        has not then decrypt it, write the data to the FIFO, and log the message number */
     if(not cmt.have_seen_msgnum(msg_oh.msgnum)){
       bool good_decrypt;
-      std::vector<unsigned char> plaintext_data =
-        do_decryption(good_decrypt);
+      do_decryption(good_decrypt);
       if(good_decrypt){
         cmt.log_msgnum(msg_oh.msgnum);
-        fifo_to_user_.write(plaintext_data);
+        deliver_to_user(message_data.data()+outer_header_len,
+                        message_data.size()-(outer_header_len+tag_len));
       }
+      return good_decrypt;
     }
-
-    return;
+    metrics_.replays_rejected.add();
+    return false;
   }
 
   /* At this point, we must have a packet which contains a peer segment number which is not one
@@ -513,8 +1850,7 @@ void Connection::handle_message(std::vector<unsigned char>& message_data)
      valid. */
   if(msg_oh.peer_segnum > current_peer_segnum_){
     bool good_decrypt;
-    std::vector<unsigned char> plaintext_data =
-      do_decryption(good_decrypt);
+    do_decryption(good_decrypt);
     if(good_decrypt){
       /* we now want to confirm this new peer segment number, which we do by moving the existing
          peer segment number to old_peer_segnum_ (and copying its CryptoMessageTracker to
@@ -524,11 +1860,45 @@ void Connection::handle_message(std::vector<unsigned char>& message_data)
       old_crypto_message_tracker_ = current_crypto_message_tracker_;
       current_peer_segnum_ = msg_oh.peer_segnum;
       current_crypto_message_tracker_.reset();
+      TRACEPOINT2(segnum_confirmed,old_peer_segnum_,current_peer_segnum_);
+
+      /* If the packet is empty, the peer may well have no data to send us, and so may not
+         learn that we have confirmed its segment number, or what our segment number is
+         (this happens when the peer is initiating communication, perhaps after a restart).
+         So we make sure that the peer gets a packet from us in reply. This cannot cause
+         an endless exchange of packets, as a reply is only owed when a new peer segment
+         number is confirmed, which happens only once for each segment number. */
+      if(message_data.size() == outer_header_len+tag_len){
+        reply_owed_ = true;
+      }
+      hello_interval_ = min_hello_interval;
 
       // now handle the message itself
       current_crypto_message_tracker_.log_msgnum(msg_oh.msgnum);
-      fifo_to_user_.write(plaintext_data);
+      deliver_to_user(message_data.data()+outer_header_len,
+                      message_data.size()-(outer_header_len+tag_len));
     }
+    return good_decrypt;
   }
+  metrics_.bad_segnums.add();
+  return false;
+}
+
 
+/* Connection::stage_start() and Connection::stage_end() time a stage of the packet
+ * pipeline: stage_start() gives the time to be passed to stage_end(), which records the
+ * time since then in latencies_. If latencies_ is null, neither reads the clock. As
+ * latencies_ is never modified, these are safe to call from crypto_pool_ tasks.
+ */
+nanos_t Connection::stage_start()
+{
+  return latencies_ ? monotonic_nanos() : 0;
+}
+
+
+void Connection::stage_end(PipelineStage stage, nanos_t start)
+{
+  if(latencies_){
+    latencies_->record(stage,monotonic_nanos()-start);
+  }
 }
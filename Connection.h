@@ -12,6 +12,7 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <atomic>
 #include <deque>
 #include <mutex>
 #include <memory>
@@ -22,12 +23,44 @@
 #include "IDTypes.h"
 #include "UDPSocket.h"
 #include "FifoIO.h"
+#include "SeqPacketIO.h"
+#include "ShmIO.h"
+#include "LocalChannel.h"
+#include "Bundler.h"
+#include "PathProber.h"
+#include "Fragmentation.h"
+#include "Compressor.h"
+#include "Fec.h"
+#include "ChannelMode.h"
 #include "SecretKey.h"
 #include "SegmentNumGenerator.h"
 #include "RTTTracker.h"
 #include "CryptoUnit.h"
+#include "CipherSuite.h"
+#include "CryptoWorkerPool.h"
 #include "EpochTime.h"
 #include "CryptoMessageTracker.h"
+#include "Metrics.h"
+#include "LatencyHistogram.h"
+
+/* ConnectionSettings holds the options of a Connection which vary from channel to
+ * channel, or which only some Connections use. The defaults give a plain fifo mode
+ * channel using AES-256 GCM, encrypting on the connection worker thread.
+ */
+struct ConnectionSettings
+{
+  CipherSuite cipher_suite = CipherSuite::aes_256_gcm;
+  std::shared_ptr<CryptoWorkerPool> crypto_pool = nullptr;
+  std::shared_ptr<PipelineLatencies> latencies = nullptr;
+  unsigned int fifo_pipe_size = 0;
+  ChannelMode channel_mode = ChannelMode::fifo;
+  std::shared_ptr<Bundler> bundler = nullptr;
+  unsigned int coalesce_window_micros = 0;
+  std::shared_ptr<PathProber> path_prober = nullptr;
+  unsigned int max_message_size = 0;
+  bool compression = false;
+  bool fec = false;
+};
 
 class Connection
 {
@@ -42,13 +75,29 @@ public:
              in_port_t peer_port,
              unsigned int max_packet_size,
              const std::shared_ptr<UDPSocket>& udp_socket,
-             const std::shared_ptr<SegmentNumGenerator>& segnumgen);
+             const std::shared_ptr<SegmentNumGenerator>& segnumgen,
+             const ConnectionSettings& settings = ConnectionSettings());
   void move_data(unsigned int loop_max);
   bool is_data();
   void add_message(const ReceivedUDPMessage& msg);
   void add_message(ReceivedUDPMessage&& msg);
+  void add_bundled_payload(const unsigned char* data, unsigned int count);
+  bool uses_bundler(const Bundler* bundler) const;
   int from_user_fifo_fd();
+  int to_user_fifo_fd();
+  bool output_pending();
+  bool user_input_blocked();
+  std::shared_ptr<LocalChannel> local_channel();
   std::pair<bool,millis_timestamp_t> open_status();
+  void start_handshake();
+  bool hibernate();
+  bool dormant();
+  millis_timestamp_t handshake_due();
+  nanos_t flush_due();
+  ConnectionMetricsSnapshot metrics();
+  const std::string& peer_name();
+  const channel_id_type& channel_id();
+  static unsigned int max_data_len(unsigned int max_packet_size);
 
 private:
   host_id_type self_id_;
@@ -60,13 +109,102 @@ private:
   unsigned int max_packet_size_;
   std::shared_ptr<UDPSocket> udp_socket_;
   std::shared_ptr<SegmentNumGenerator> segnumgen_;
-  std::unique_ptr<CryptoUnit> crypto_unit_;
+  std::shared_ptr<CryptoWorkerPool> crypto_pool_;
+  /* send_key_ and recv_key_ are the keys derived for the channel, from which wake()
+     creates the CryptoUnits using cipher_suite_. dormant_ records that the Connection has
+     no CryptoUnits or working buffers (apart from the one CryptoUnit which move_data()
+     uses to try received packets), as it has not been woken yet or has been put to sleep
+     by hibernate(). It is atomic as it is also read by dormant(). */
+  SecretKey send_key_;
+  SecretKey recv_key_;
+  CipherSuite cipher_suite_;
+  std::atomic<bool> dormant_;
+  /* crypto_units_ holds one CryptoUnit for each lane of crypto_pool_ (or just one
+     CryptoUnit if there is no crypto_pool_), all using the same keys. crypto_units_[0]
+     is the one used outside of calls to CryptoWorkerPool::run(). */
+  std::vector<std::unique_ptr<CryptoUnit>> crypto_units_;
+  /* batch_size_ is the maximum number of received messages, and the maximum number of
+     packets' worth of data from fifo_from_user_, handled in each pass of move_data() */
+  unsigned int batch_size_;
   std::shared_ptr<RTTTracker> rtt_tracker_;
 
-  FifoFromUser fifo_from_user_;
-  FifoToUser fifo_to_user_;
+  /* the user's end of the channel is either the two fifos, or (in seqpacket mode) a
+     SeqPacketEndpoint, or (in shm mode) a ShmEndpoint, or (in local mode) a LocalChannel
+     shared with the application, or (in bundle mode) the peer's Bundler, or (in probe
+     mode) the peer's PathProber, and only those for the channel_mode_ in use are
+     created */
+  ChannelMode channel_mode_;
+  std::unique_ptr<FifoFromUser> fifo_from_user_;
+  std::unique_ptr<FifoToUser> fifo_to_user_;
+  std::unique_ptr<SeqPacketEndpoint> seqpacket_endpoint_;
+  std::unique_ptr<ShmEndpoint> shm_endpoint_;
+  std::shared_ptr<LocalChannel> local_channel_;
+  std::shared_ptr<Bundler> bundle_endpoint_;
+  std::shared_ptr<PathProber> probe_endpoint_;
+  /* bundler_ is the peer's Bundler if the channel's data is carried in bundle packets
+     (see Bundler.h), in which case data from the user is pushed to it as frames, and
+     the frames for this channel from the peer are queued in bundled_input_ (which is
+     guarded by queue_lock_) */
+  std::shared_ptr<Bundler> bundler_;
+  std::deque<std::vector<unsigned char>> bundled_input_;
+  /* path_prober_ is the peer's PathProber if the peer has path MTU discovery enabled and
+     the channel is in fifo mode, in which case the packets sent are as large as it has
+     found will get through (and max_packet_size_ is the largest it will probe for) */
+  std::shared_ptr<PathProber> path_prober_;
+  /* In fifo mode, data from the user may be held back in held_packet_ (whose payload
+     holds held_len_ bytes of it, the first of which was read at held_since_) for up to
+     coalesce_window_nanos_, so that a user program which writes a little at a time does
+     not cause a packet to be sent for each write. A value of 0 in coalesce_window_nanos_
+     means that data is sent as soon as it is read. */
+  nanos_t coalesce_window_nanos_;
+  std::vector<unsigned char> held_packet_;
+  unsigned int held_len_;
+  nanos_t held_since_;
+  /* In seqpacket, shm and local modes, messages from the user longer than a packet can
+     carry are sent in fragments by fragmenter_, and reassembled by reassembler_ at the
+     other end (see Fragmentation.h), if the channel has a maximum message size. The
+     message completed by the latest fragment is put in reassembled_. */
+  std::unique_ptr<Fragmenter> fragmenter_;
+  std::unique_ptr<Reassembler> reassembler_;
+  std::vector<unsigned char> reassembled_;
+  /* compressor_ is created if the channel has compression enabled (see Compressor.h), in
+     which case the data from the user is read into uncompressed_ and compressed from
+     there into the packet, and compressed payloads from the peer are decompressed into
+     decompressed_ */
+  std::unique_ptr<Compressor> compressor_;
+  std::vector<unsigned char> uncompressed_;
+  std::vector<unsigned char> decompressed_;
+  /* fec_encoder_ and fec_decoder_ are created if the channel has forward error correction
+     enabled (see Fec.h), in which case fec_encoder_ sends repair packets for the packets
+     sent, and fec_decoder_ rebuilds lost packets from the peer's repair packets */
+  std::unique_ptr<FecEncoder> fec_encoder_;
+  std::unique_ptr<FecDecoder> fec_decoder_;
+  /* FEC report packets are authenticated by fec_report_unit_, which wake() creates from
+     fec_send_key_ and fec_recv_key_. fec_reports_sent_ numbers the reports we send, and
+     last_report_segnum_ and last_report_num_ identify the last report from the peer which
+     was accepted, so that reports cannot be replayed. fec_packets_ holds the FEC packets
+     taken out of a batch of received messages, and fec_copies_ copies of the others as
+     they were received (see take_fec_packets() ). */
+  SecretKey fec_send_key_;
+  SecretKey fec_recv_key_;
+  std::unique_ptr<CryptoUnit> fec_report_unit_;
+  std::uint_least64_t fec_reports_sent_;
+  SegmentNumGenerator::segnum_t last_report_segnum_;
+  std::uint_least64_t last_report_num_;
+  std::vector<std::vector<unsigned char>> fec_packets_;
+  std::vector<std::vector<unsigned char>> fec_copies_;
+  /* the capacities of the fifos, as granted by the kernel (0 in seqpacket and local
+     modes, and the ring capacity in shm mode) */
+  metric_value_t from_user_pipe_size_;
+  metric_value_t to_user_pipe_size_;
   std::deque<ReceivedUDPMessage> message_queue_;
   std::mutex queue_lock_;
+  /* queued_bytes_ is the total size of the messages in message_queue_ and the frames in
+     bundled_input_ (which it is guarded by queue_lock_ along with), and intake_paused_ records that move_data() has
+     stopped taking messages off the queue because too much data is staged in
+     pending_output_, so that only the start of each pause is counted */
+  std::size_t queued_bytes_;
+  bool intake_paused_;
   CryptoMessageTracker current_crypto_message_tracker_;
   CryptoMessageTracker old_crypto_message_tracker_;
   /* a value of 0 in current_peer_segnum_ or old_peer_segnum_
@@ -80,6 +218,27 @@ private:
   SegmentNumGenerator::segnum_t old_local_segnum_;
   CryptoMessageTracker::msgnum_t local_next_msgnum_;
   millis_timestamp_t last_hello_packet_sent_;
+  /* handshake_wanted_ records whether the Connection should send "hello" packets while
+     it is closed even if there is no data waiting on fifo_from_user_ (see
+     start_handshake() ), and hello_interval_ is the current interval between such
+     packets */
+  bool handshake_wanted_;
+  millis_timestamp_t hello_interval_;
+  /* reply_owed_ records that we have confirmed a new peer segment number from an empty
+     packet, so the peer needs a packet from us to confirm our segment number in turn */
+  bool reply_owed_;
+  /* pending_output_ stages received data which could not yet be written to
+     fifo_to_user_ because it was full, in the order in which it must be written.
+     pending_output_offset_ is how much of the front element has already been written,
+     and pending_output_bytes_ is the total still to be written (this is atomic as it
+     is also read by metrics() and output_pending() ). */
+  std::deque<std::vector<unsigned char>> pending_output_;
+  std::vector<unsigned char>::size_type pending_output_offset_;
+  std::atomic<metric_value_t> pending_output_bytes_;
+  ConnectionMetrics metrics_;
+  /* latencies_, if not null, is where the Connection records the time taken by the
+     stages of the packet pipeline which it carries out */
+  std::shared_ptr<PipelineLatencies> latencies_;
 
   struct MessageOuterHeader
   {
@@ -96,10 +255,53 @@ private:
     std::array<unsigned char,6> ad;
   };
 
+  /* OpenedMessage records the result of decrypting a received message (in place) ahead
+     of its processing by handle_message() */
+  struct OpenedMessage
+  {
+    bool opened;
+    bool good_decrypt;
+  };
+
+  bool wake_wanted();
+  void wake();
   MessageOuterHeader unpack_header(const std::vector<unsigned char>& message_bytes);
   std::vector<unsigned char> create_packet(const std::vector<unsigned char>& data_bytes,
                                            SegmentNumGenerator::segnum_t peer_segnum = 0);
-  void handle_message(std::vector<unsigned char>& message_data);
+  void fill_packet_header(std::vector<unsigned char>& packet,
+                          SegmentNumGenerator::segnum_t peer_segnum = 0);
+  void seal_packet(std::vector<unsigned char>& packet,
+                   CryptoUnit& crypto_unit);
+  void open_messages(std::vector<ReceivedUDPMessage>& messages,
+                     std::vector<OpenedMessage>& opened);
+  void send_data(std::vector<std::vector<unsigned char>>& packets,
+                 unsigned int num_packets);
+  void send_packet(const std::vector<unsigned char>& packet);
+  void transmit(const std::vector<unsigned char>& packet);
+  void send_repair();
+  void take_fec_packets(std::vector<ReceivedUDPMessage>& messages);
+  void handle_fec_packets();
+  void send_report();
+  bool open_report(std::vector<unsigned char>& report);
+  bool queue_has_room(std::size_t size);
+  bool user_data_waiting();
+  bool user_can_take(unsigned int count);
+  unsigned int current_max_data_len();
+  unsigned int read_from_user(std::vector<unsigned char>& packet, unsigned int max_data_len);
+  unsigned int read_coalesced(std::vector<unsigned char>& packet, unsigned int max_data_len);
+  unsigned int read_compressed(std::vector<unsigned char>& packet, unsigned int max_data_len);
+  unsigned int read_fragmented(std::vector<unsigned char>& packet, unsigned int max_data_len);
+  unsigned int read_message(std::vector<unsigned char>& dest,
+                            std::vector<unsigned char>::size_type offset,
+                            unsigned int count);
+  std::pair<unsigned int,bool> write_to_endpoint(const unsigned char* data, unsigned int count);
+  void write_to_user(const unsigned char* data, unsigned int data_len);
+  void deliver_to_user(const unsigned char* data, unsigned int data_len);
+  bool flush_pending_output();
+  bool handle_message(std::vector<unsigned char>& message_data,
+                      OpenedMessage* opened = nullptr);
+  nanos_t stage_start();
+  void stage_end(PipelineStage stage, nanos_t start);
 };
 
 #endif
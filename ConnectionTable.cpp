@@ -0,0 +1,164 @@
+#include "ConnectionTable.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace
+{
+  /* the number of slots in the hash table to begin with, as a power of 2 */
+  constexpr unsigned int initial_slot_bits = 4;
+}
+
+
+ConnectionTable::ConnectionTable():
+  live_(0),
+  slots_(1u << initial_slot_bits,Slot{{},no_index}),
+  slot_bits_(initial_slot_bits)
+{}
+
+
+/* ConnectionTable::make_id() gives the id of the Connection for the channel with id
+ * channel_id to the peer with id peer_id
+ */
+ConnectionTable::connection_id_type ConnectionTable::make_id(const host_id_type& peer_id,
+                                                             const channel_id_type& channel_id)
+{
+  connection_id_type id;
+  std::copy(peer_id.begin(),peer_id.end(),id.begin());
+  std::copy(channel_id.begin(),channel_id.end(),id.begin()+host_id_size);
+  return id;
+}
+
+
+/* ConnectionTable::insert() adds a record for the Connection with the given id, which
+ * must not already have one, and returns its index. The record's Connection is left to
+ * be created by the caller. The record of a retired index is used again if one is neither
+ * queued, nor being worked on, nor being read, and otherwise a record is added, which may move the others.
+ * The caller must hold the Session's session_lock_, which is why no thread may keep a
+ * reference to a record across releasing the lock.
+ */
+ConnectionTable::index_type ConnectionTable::insert(const connection_id_type& id)
+{
+  if(find(id) != no_index){
+    throw std::runtime_error("ConnectionTable: connection id inserted twice");
+  }
+  if(2*(live_+1) > slots_.size()){
+    grow();
+  }
+
+  auto free_it = std::find_if(free_indices_.begin(),free_indices_.end(),
+                              [this](index_type i)
+                              { return (not records_[i].queued) and (not records_[i].working) and
+                                       (records_[i].readers == 0); });
+  index_type index;
+  if(free_it != free_indices_.end()){
+    index = *free_it;
+    free_indices_.erase(free_it);
+    records_[index] = Record{id,nullptr,false,false,false,0,0};
+  }
+  else{
+    index = records_.size();
+    records_.push_back(Record{id,nullptr,false,false,false,0,0});
+  }
+  live_++;
+  std::vector<Slot>::size_type mask = slots_.size()-1;
+  std::vector<Slot>::size_type s = first_slot(id.data());
+  while(slots_[s].index != no_index){
+    s = (s+1) & mask;
+  }
+  slots_[s] = Slot{id,index};
+  return index;
+}
+
+
+/* ConnectionTable::remove() marks the record with the given index as retired, so that
+ * find() no longer gives it. Its Connection is left to be destroyed by the caller, and the
+ * index is left for insert() to use again.
+ */
+void ConnectionTable::remove(index_type index)
+{
+  Record& record = records_[index];
+  if(record.retired){
+    return;
+  }
+  record.retired = true;
+  live_--;
+  free_indices_.push_back(index);
+
+  std::vector<Slot>::size_type mask = slots_.size()-1;
+  std::vector<Slot>::size_type gap = first_slot(record.id.data());
+  while(slots_[gap].index != index){
+    gap = (gap+1) & mask;
+  }
+
+  /* close up the run of slots after the one emptied, by moving back each id whose search
+     would otherwise stop at the gap before reaching it */
+  for(std::vector<Slot>::size_type s = (gap+1) & mask; slots_[s].index != no_index;
+      s = (s+1) & mask){
+    std::vector<Slot>::size_type home = first_slot(slots_[s].id.data());
+    if( ((s-home) & mask) >= ((s-gap) & mask) ){
+      slots_[gap] = slots_[s];
+      gap = s;
+    }
+  }
+  slots_[gap].index = no_index;
+}
+
+
+/* ConnectionTable::find() gives the index of the record for the Connection whose id is
+ * in the connection_id_size bytes at id (such as the start of a received packet), or
+ * no_index if there is no such Connection
+ */
+ConnectionTable::index_type ConnectionTable::find(const unsigned char* id) const
+{
+  std::vector<Slot>::size_type mask = slots_.size()-1;
+  for(std::vector<Slot>::size_type s = first_slot(id); ; s = (s+1) & mask){
+    const Slot& slot = slots_[s];
+    if(slot.index == no_index){
+      return no_index;
+    }
+    if(std::equal(slot.id.begin(),slot.id.end(),id)){
+      return slot.index;
+    }
+  }
+}
+
+
+ConnectionTable::index_type ConnectionTable::find(const connection_id_type& id) const
+{ return find(id.data()); }
+
+
+/* ConnectionTable::first_slot() gives the slot at which the search for id starts, from a
+ * multiplicative hash of its bytes
+ */
+std::vector<ConnectionTable::Slot>::size_type
+ConnectionTable::first_slot(const unsigned char* id) const
+{
+  std::uint64_t n = 0;
+  for(int i=0; i<connection_id_size; i++){
+    n = (n << 8) | id[i];
+  }
+  return static_cast<std::uint64_t>(n*0x9e3779b97f4a7c15u) >> (64-slot_bits_);
+}
+
+
+/* ConnectionTable::grow() doubles the number of slots, and puts the ids of the records
+ * which have not been removed back in
+ */
+void ConnectionTable::grow()
+{
+  slot_bits_++;
+  slots_.assign(std::vector<Slot>::size_type(1) << slot_bits_,Slot{{},no_index});
+  std::vector<Slot>::size_type mask = slots_.size()-1;
+  for(index_type index=0; index<records_.size(); index++){
+    if(records_[index].retired){
+      continue;
+    }
+    std::vector<Slot>::size_type s = first_slot(records_[index].id.data());
+    while(slots_[s].index != no_index){
+      s = (s+1) & mask;
+    }
+    slots_[s] = Slot{records_[index].id,index};
+  }
+}
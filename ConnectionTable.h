@@ -0,0 +1,96 @@
+/* ConnectionTable holds the Connections of a Session, each in a record together with the
+ * Session's scheduling state for it. The records are packed contiguously, and each is known
+ * by its index, which never changes while it is in use, so that the connection worker
+ * threads, the fifo monitoring thread and the queue of Connections waiting for a worker
+ * can all refer to a Connection by its index without looking it up.
+ *
+ * A Connection has to be looked up by its id (the peer's host id followed by the channel
+ * id) only when a packet arrives for it, which find() does with an open-addressing hash
+ * table using linear probing. Each slot of the table holds an id along with the index of
+ * its record, so that a lookup normally touches a single cache line, and the table is kept
+ * at most half full.
+ *
+ * When the Session is reloaded, Connections which are no longer wanted are removed. A
+ * removed record can no longer be found by its id, and is marked as retired. Its index is
+ * used again by insert() only once the record is neither queued, nor being worked on, nor
+ * being read, as the queue, the connection worker threads and the readers of the
+ * Connections' counters are the only holders of an index which do not drop it when the
+ * Connection is removed. So an index which is still held never comes
+ * to refer to a different Connection, and the table does not grow without bound across
+ * reloads. As insert() and remove() may be called while the Session's threads are running,
+ * the table and the records are guarded by the Session's lock, and a reference to a record
+ * must not be kept once it has been released.
+ */
+
+#ifndef CONNECTIONTABLE_H
+#define CONNECTIONTABLE_H
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "IDTypes.h"
+#include "Connection.h"
+#include "EpochTime.h"
+
+class ConnectionTable
+{
+public:
+  constexpr static int connection_id_size = host_id_size+channel_id_size;
+  typedef std::array<unsigned char,connection_id_size> connection_id_type;
+  typedef std::uint_least32_t index_type;
+
+  /* Record holds a Connection, and records whether it is being worked on by a connection
+     worker thread, whether it is waiting in the Session's queue for one, whether it has
+     been removed, how many threads are reading its counters without holding the
+     Session's lock (see Session::metrics() ), and when (from monotonic_nanos() ) it was
+     last moved */
+  struct Record
+  {
+    connection_id_type id;
+    std::unique_ptr<Connection> conn;
+    bool working;
+    bool queued;
+    bool retired;
+    unsigned int readers;
+    nanos_t last_moved;
+  };
+
+  ConnectionTable();
+
+  static connection_id_type make_id(const host_id_type& peer_id,
+                                    const channel_id_type& channel_id);
+  index_type insert(const connection_id_type& id);
+  void remove(index_type index);
+  index_type find(const unsigned char* id) const;
+  index_type find(const connection_id_type& id) const;
+  Record& operator[](index_type index)
+  { return records_[index]; }
+  index_type size() const
+  { return records_.size(); }
+  index_type live() const
+  { return live_; }
+
+  constexpr static index_type no_index = 0xffffffff;
+
+private:
+  /* Slot holds the id and the index of a record, or an index of no_index if it is
+     empty */
+  struct Slot
+  {
+    connection_id_type id;
+    index_type index;
+  };
+
+  std::vector<Record> records_;
+  index_type live_; // the number of records which have not been removed
+  std::vector<index_type> free_indices_; // the indices of the retired records, oldest first
+  std::vector<Slot> slots_; // the number of slots is a power of 2
+  unsigned int slot_bits_;
+
+  std::vector<Slot>::size_type first_slot(const unsigned char* id) const;
+  void grow();
+};
+
+#endif
@@ -3,6 +3,21 @@
 #include <openssl/conf.h>
 #include <openssl/err.h>
 
+namespace
+{
+  /* cipher_for_suite() returns the OpenSSL cipher which implements the given suite */
+  const EVP_CIPHER* cipher_for_suite(CipherSuite suite)
+  {
+    switch(suite){
+    case CipherSuite::aes_256_gcm:
+      return EVP_aes_256_gcm();
+    case CipherSuite::chacha20_poly1305:
+      return EVP_chacha20_poly1305();
+    }
+    throw std::runtime_error("CryptoUnit: unknown cipher suite");
+  }
+}
+
 
 /* NOTE 1 -- This code here is based on OpenSSL 1.1.1, but works with OpenSSL
  * version 3.
@@ -16,16 +31,20 @@
  * uses for encryption and decryption. Note that these contexts are stored in unique_ptrs
  * with a customized deleter, so they will be properly released even if this constructor
  * throws an error. The enc_key parameter holds the key to use for encrypting, while the
- * dec_key parameter holds the key to use for decrypting.
+ * dec_key parameter holds the key to use for decrypting. The suite parameter selects
+ * the AEAD cipher used for both.
  */
-CryptoUnit::CryptoUnit(const SecretKey& enc_key, const SecretKey& dec_key)
+CryptoUnit::CryptoUnit(const SecretKey& enc_key, const SecretKey& dec_key,
+                       CipherSuite suite)
 {
+  const EVP_CIPHER* cipher = cipher_for_suite(suite);
+
   enc_cipher_ctx = std::unique_ptr<EVP_CIPHER_CTX,CryptoUnitDeleter>(EVP_CIPHER_CTX_new());
   if(nullptr == enc_cipher_ctx.get()){
     throw std::runtime_error("CryptoUnit: EVP_CIPHER_CTX_new failed for encryption context");
   }
 
-  if(1 != EVP_EncryptInit_ex(enc_cipher_ctx.get(), EVP_aes_256_gcm(), NULL, enc_key.data(), NULL)){
+  if(1 != EVP_EncryptInit_ex(enc_cipher_ctx.get(), cipher, NULL, enc_key.data(), NULL)){
     throw std::runtime_error("CryptoUnit: EVP_EncryptInit_ex failed to set cipher and key");
   }
 
@@ -34,7 +53,7 @@ CryptoUnit::CryptoUnit(const SecretKey& enc_key, const SecretKey& dec_key)
     throw std::runtime_error("CryptoUnit: EVP_CIPHER_CTX_new failed for decryption context");
   }
 
-  if(1 != EVP_DecryptInit_ex(dec_cipher_ctx.get(), EVP_aes_256_gcm(), NULL, dec_key.data(), NULL)){
+  if(1 != EVP_DecryptInit_ex(dec_cipher_ctx.get(), cipher, NULL, dec_key.data(), NULL)){
     throw std::runtime_error("CryptoUnit: EVP_DecryptInit_ex failed to set cipher and key");
   }
 }
@@ -50,6 +69,42 @@ void CryptoUnit::encrypt(const std::vector<unsigned char>& plaintext,
                          const iv_t& iv,
                          std::vector<unsigned char>& dest,
                          std::vector<unsigned char>::size_type dest_offset)
+{
+  if(dest.size() < dest_offset+plaintext.size()+tag_size){
+    throw std::runtime_error("CryptoUnit: no room for the ciphertext and tag");
+  }
+  encrypt_span(plaintext.data(),plaintext.size(),additional,iv,dest.data()+dest_offset);
+}
+
+
+/* CryptoUnit::encrypt_in_place() encrypts the "length" bytes of plaintext which begin at
+ * offset "offset" in buffer, as for CryptoUnit::encrypt(), overwriting them with the
+ * ciphertext. The AEAD tag is written to the 16 bytes after the ciphertext, which must
+ * already be part of buffer. This saves copying the plaintext when it has been read
+ * straight into the buffer which will hold the ciphertext.
+ */
+void CryptoUnit::encrypt_in_place(std::vector<unsigned char>& buffer,
+                                  std::vector<unsigned char>::size_type offset,
+                                  std::vector<unsigned char>::size_type length,
+                                  const std::vector<unsigned char>& additional,
+                                  const iv_t& iv)
+{
+  if(buffer.size() < offset+length+tag_size){
+    throw std::runtime_error("CryptoUnit: no room for the ciphertext and tag");
+  }
+  encrypt_span(buffer.data()+offset,length,additional,iv,buffer.data()+offset);
+}
+
+
+/* CryptoUnit::encrypt_span() does the work of encrypt() and encrypt_in_place(). It
+ * encrypts the "length" bytes at "plaintext", writing the ciphertext to "dest" followed
+ * by the AEAD tag. OpenSSL allows plaintext and dest to be the same.
+ */
+void CryptoUnit::encrypt_span(const unsigned char* plaintext,
+                              std::size_t length,
+                              const std::vector<unsigned char>& additional,
+                              const iv_t& iv,
+                              unsigned char* dest)
 {
   // set the encryption context's iv
   if(1 != EVP_EncryptInit_ex(enc_cipher_ctx.get(), NULL, NULL, NULL, iv.data()))
@@ -89,16 +144,16 @@ void CryptoUnit::encrypt(const std::vector<unsigned char>& plaintext,
     }
 
     // if we have encrypted all the data, exit
-    if( (not doing_additional) and (total_done == plaintext.size()) ){
+    if( (not doing_additional) and (total_done == length) ){
       break;
     }
 
     int len_out;
     int processing_result = doing_additional ?
-      EVP_EncryptUpdate(enc_cipher_ctx.get(), NULL, &len_out, &additional.at(total_done),
+      EVP_EncryptUpdate(enc_cipher_ctx.get(), NULL, &len_out, additional.data()+total_done,
                         additional.size()-total_done) :
-      EVP_EncryptUpdate(enc_cipher_ctx.get(), &dest.at(dest_offset+total_done), &len_out,
-                        &plaintext.at(total_done), plaintext.size()-total_done);
+      EVP_EncryptUpdate(enc_cipher_ctx.get(), dest+total_done, &len_out,
+                        plaintext+total_done, length-total_done);
 
     if(1 != processing_result){
       throw std::runtime_error("CryptoUnit: EVP_EncryptUpdate failed");
@@ -113,10 +168,10 @@ void CryptoUnit::encrypt(const std::vector<unsigned char>& plaintext,
   }
 
   /* According to the OpenSSL documentation EncryptFinal_ex() is used to write out any remaining
-   * ciphertext to the buffer. This is unnecessary with stream ciphers like GCM, and so we pass
-   * NULL as the buffer. However, we retain the call to EVP_EncryptFinal_ex() because the examples
-   * which I've seen all have it before the subsequent call to EVP_CIPHER_CTX_ctrl() to get the
-   * AEAD tag, and the documentation seems to suggest that it should be there.
+   * ciphertext to the buffer. This is unnecessary with stream ciphers like GCM and ChaCha20, and
+   * so we pass NULL as the buffer. However, we retain the call to EVP_EncryptFinal_ex() because
+   * the examples which I've seen all have it before the subsequent call to EVP_CIPHER_CTX_ctrl()
+   * to get the AEAD tag, and the documentation seems to suggest that it should be there.
    */
   int len_out;
   if(1 != EVP_EncryptFinal_ex(enc_cipher_ctx.get(), NULL, &len_out)){
@@ -124,8 +179,8 @@ void CryptoUnit::encrypt(const std::vector<unsigned char>& plaintext,
   }
 
   /* append the AEAD tag to the ciphertext */
-  if(1 != EVP_CIPHER_CTX_ctrl(enc_cipher_ctx.get(), EVP_CTRL_GCM_GET_TAG, 16,
-			      &dest.at(dest_offset+plaintext.size()))){
+  if(1 != EVP_CIPHER_CTX_ctrl(enc_cipher_ctx.get(), EVP_CTRL_AEAD_GET_TAG, tag_size,
+			      dest+length)){
     throw std::runtime_error("CryptoUnit: EVP_CIPHER_CTX_ctrl failed to get tag from encryption");
   }
 
@@ -154,20 +209,63 @@ std::vector<unsigned char> CryptoUnit::decrypt(const std::vector<unsigned char>&
                                                std::vector<unsigned char>::size_type src_offset,
                                                std::vector<unsigned char>::size_type length,
                                                bool& good_tag)
+{
+  if( (length < tag_size) or (ciphertext_and_tag.size() < src_offset+length) ){
+    throw std::runtime_error("CryptoUnit: ciphertext and tag out of range");
+  }
+
+  std::vector<unsigned char> plaintext(length-tag_size);
+  good_tag = decrypt_span(ciphertext_and_tag.data()+src_offset,length-tag_size,
+                          additional,iv,plaintext.data());
+  if(not good_tag){
+    return std::vector<unsigned char>();
+  }
+  return plaintext;
+}
+
+
+/* CryptoUnit::decrypt_in_place() authenticates and decrypts the ciphertext and AEAD tag
+ * which begins at offset "offset" in buffer and has length "length" bytes (including the
+ * AEAD tag), as for CryptoUnit::decrypt(), but overwrites the ciphertext with the
+ * plaintext rather than returning a new vector. The return value records whether the
+ * AEAD tag was valid. If it was not, the bytes which held the ciphertext hold garbage
+ * and must be discarded.
+ */
+bool CryptoUnit::decrypt_in_place(std::vector<unsigned char>& buffer,
+                                  std::vector<unsigned char>::size_type offset,
+                                  std::vector<unsigned char>::size_type length,
+                                  const std::vector<unsigned char>& additional,
+                                  const iv_t& iv)
+{
+  if( (length < tag_size) or (buffer.size() < offset+length) ){
+    throw std::runtime_error("CryptoUnit: ciphertext and tag out of range");
+  }
+  return decrypt_span(buffer.data()+offset,length-tag_size,additional,iv,
+                      buffer.data()+offset);
+}
+
+
+/* CryptoUnit::decrypt_span() does the work of decrypt() and decrypt_in_place(). It
+ * decrypts the "length" bytes of ciphertext at "ciphertext", which are followed by the
+ * AEAD tag, writing the plaintext to "dest", and returns whether the tag was valid.
+ * OpenSSL allows ciphertext and dest to be the same.
+ */
+bool CryptoUnit::decrypt_span(const unsigned char* ciphertext,
+                              std::size_t length,
+                              const std::vector<unsigned char>& additional,
+                              const iv_t& iv,
+                              unsigned char* dest)
 {
   // set the decryption context's iv
   if(1 != EVP_DecryptInit_ex(dec_cipher_ctx.get(), NULL, NULL, NULL, iv.data())){
     throw std::runtime_error("CryptoUnit: EVP_DecryptInit_ex failed to set iv");
   }
 
-  int ciphertext_size = length-16;
-  std::vector<unsigned char> plaintext(ciphertext_size);
-
   /* We add the additional data to the decryption context, and then perform the decryption.
    * Both of these operations are done via calls to EVP_DecryptUpdate(), and OpenSSL requires
    * all additional data to be added before any decryption is done. The structure of the loop
-   * used here is exactly the same as the corresponding loop in CryptoUnit::encrypt(), so see
-   * the long comment block before that loop for an explanation.
+   * used here is exactly the same as the corresponding loop in CryptoUnit::encrypt_span(), so
+   * see the long comment block before that loop for an explanation.
    */
   unsigned int total_done = 0;
   unsigned int num_zero_returns = 0;
@@ -187,16 +285,16 @@ std::vector<unsigned char> CryptoUnit::decrypt(const std::vector<unsigned char>&
     }
 
     // if we have decrypted all the data, exit
-    if( (not doing_additional) and (total_done == plaintext.size()) ){
+    if( (not doing_additional) and (total_done == length) ){
       break;
     }
 
     int len_out;
     int processing_result = doing_additional ?
-      EVP_DecryptUpdate(dec_cipher_ctx.get(), NULL, &len_out, &additional.at(total_done),
+      EVP_DecryptUpdate(dec_cipher_ctx.get(), NULL, &len_out, additional.data()+total_done,
                         additional.size()-total_done) :
-      EVP_DecryptUpdate(dec_cipher_ctx.get(), &plaintext.at(total_done), &len_out,
-                        &ciphertext_and_tag.at(src_offset+total_done), ciphertext_size-total_done);
+      EVP_DecryptUpdate(dec_cipher_ctx.get(), dest+total_done, &len_out,
+                        ciphertext+total_done, length-total_done);
 
     if(1 != processing_result){
       throw std::runtime_error("CryptoUnit: EVP_DecryptUpdate failed");
@@ -211,21 +309,14 @@ std::vector<unsigned char> CryptoUnit::decrypt(const std::vector<unsigned char>&
   }
 
   /* pass the AEAD tag to dec_cipher_ctx for checking below */
-  unsigned char* tag_start =
-    const_cast<unsigned char*>(&ciphertext_and_tag.at(src_offset+ciphertext_size));
-  if(1 != EVP_CIPHER_CTX_ctrl(dec_cipher_ctx.get(), EVP_CTRL_GCM_SET_TAG, 16, tag_start)){
+  unsigned char* tag_start = const_cast<unsigned char*>(ciphertext+length);
+  if(1 != EVP_CIPHER_CTX_ctrl(dec_cipher_ctx.get(), EVP_CTRL_AEAD_SET_TAG, tag_size, tag_start)){
     throw std::runtime_error("CryptoUnit: EVP_CIPHER_CTX_ctrl failed to set the tag for decryption");
   }
 
   /* EVP_DecryptFinal_ex() checks the AEAD tag */
   int len_out;
-  if(1 != EVP_DecryptFinal_ex(dec_cipher_ctx.get(), NULL, &len_out)){
-    good_tag = false;
-    return std::vector<unsigned char>();
-  }
-
-  good_tag = true;
-  return plaintext;
+  return (1 == EVP_DecryptFinal_ex(dec_cipher_ctx.get(), NULL, &len_out));
 }
 
 
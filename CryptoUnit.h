@@ -1,5 +1,6 @@
 /* A class to wrap the encryption/decryption/authentication functionality of
- * AES_256_GCM AEAD provided by OpenSSL.
+ * the AEAD cipher suites provided by OpenSSL which Cryptocomms supports, namely
+ * AES_256_GCM and CHACHA20_POLY1305 (see CipherSuite.h).
  */
 
 #ifndef CRYPTOUNIT_H
@@ -9,9 +10,11 @@
 #include <stdexcept>
 #include <memory>
 #include <array>
+#include <cstddef>
 #include <openssl/evp.h>
 
 #include "SecretKey.h"
+#include "CipherSuite.h"
 
 /* Note that CryptoUnit does not store the secret key directly in itself, but
  * only indirectly via the enc_cipher_ctx and dec_cipher_ctx members. Thus there
@@ -23,8 +26,11 @@ public:
   /* we only support the recommended iv length of 12 bytes, so we may as well make
      a type to represent this */
   typedef std::array<unsigned char,12> iv_t;
+  /* the length of the AEAD tag which follows each ciphertext */
+  constexpr static unsigned int tag_size = 16;
 
-  CryptoUnit(const SecretKey& enc_key, const SecretKey& dec_key);
+  CryptoUnit(const SecretKey& enc_key, const SecretKey& dec_key,
+             CipherSuite suite = CipherSuite::aes_256_gcm);
 
   /* We do not want to allow copying, as there is no good way to do this, since we
    * do not want the EVP_CIPHER_CTX objects pointed to by enc_ciphertext_ctx and
@@ -45,6 +51,16 @@ public:
                                      std::vector<unsigned char>::size_type offset,
                                      std::vector<unsigned char>::size_type length,
                                      bool& good_tag);
+  void encrypt_in_place(std::vector<unsigned char>& buffer,
+                        std::vector<unsigned char>::size_type offset,
+                        std::vector<unsigned char>::size_type length,
+                        const std::vector<unsigned char>& additional,
+                        const iv_t& iv);
+  bool decrypt_in_place(std::vector<unsigned char>& buffer,
+                        std::vector<unsigned char>::size_type offset,
+                        std::vector<unsigned char>::size_type length,
+                        const std::vector<unsigned char>& additional,
+                        const iv_t& iv);
 
 private:
   /* CryptoUnitDeleter is used to customize the behaviour of the unique_ptrs holding
@@ -59,6 +75,17 @@ private:
      of CryptoUnitDeleter) */
   std::unique_ptr<EVP_CIPHER_CTX,CryptoUnitDeleter> enc_cipher_ctx;
   std::unique_ptr<EVP_CIPHER_CTX,CryptoUnitDeleter> dec_cipher_ctx;
+
+  void encrypt_span(const unsigned char* plaintext,
+                    std::size_t length,
+                    const std::vector<unsigned char>& additional,
+                    const iv_t& iv,
+                    unsigned char* dest);
+  bool decrypt_span(const unsigned char* ciphertext,
+                    std::size_t length,
+                    const std::vector<unsigned char>& additional,
+                    const iv_t& iv,
+                    unsigned char* dest);
 };
 
 #endif
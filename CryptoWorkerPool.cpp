@@ -0,0 +1,154 @@
+#include "CryptoWorkerPool.h"
+
+#include <stdexcept>
+
+
+/* CryptoWorkerPool::CryptoWorkerPool() starts num_workers worker threads. A pool
+ * with no worker threads is allowed, in which case run() simply runs every task
+ * on the calling thread.
+ */
+CryptoWorkerPool::CryptoWorkerPool(unsigned int num_workers):
+  stopping_(false)
+{
+  for(unsigned int i=0; i<num_workers; i++){
+    workers_.push_back(std::thread(&CryptoWorkerPool::worker_thread_func,this));
+  }
+}
+
+
+CryptoWorkerPool::~CryptoWorkerPool()
+{
+  {
+    const std::lock_guard<std::mutex> pool_lock_guard(lock_);
+    stopping_ = true;
+  }
+  work_condvar_.notify_all();
+
+  for(auto& t : workers_){
+    t.join();
+  }
+}
+
+
+/* CryptoWorkerPool::num_lanes() reports how many tasks a call to run() can have
+ * in progress at once, which is the number of worker threads plus one for the
+ * calling thread.
+ */
+unsigned int CryptoWorkerPool::num_lanes()
+{ return workers_.size()+1; }
+
+
+/* CryptoWorkerPool::run() calls task(i) for each i in [0,num_tasks), spread across
+ * the worker threads and the calling thread, and returns once all of these calls
+ * have returned. Distinct tasks may run concurrently, so they must not touch the
+ * same mutable state. If any task throws, run() throws a std::runtime_error once
+ * all the tasks have finished.
+ */
+void CryptoWorkerPool::run(unsigned int num_tasks,
+                           const std::function<void(unsigned int)>& task)
+{
+  if(num_tasks == 0){
+    return;
+  }
+
+  Batch batch{&task,num_tasks,0,num_tasks,0,false};
+  std::unique_lock<std::mutex> pool_unique_lock(lock_);
+
+  /* Offer the batch to the workers only if there is more than one task, as the
+     calling thread would otherwise do all the work anyway. We wake at most as many
+     workers as there are tasks which the calling thread will not start itself. */
+  bool shared = (num_tasks > 1) and (not workers_.empty());
+  if(shared){
+    batches_.push_back(&batch);
+    pool_unique_lock.unlock();
+    if(num_tasks-1 >= workers_.size()){
+      work_condvar_.notify_all();
+    }
+    else{
+      for(unsigned int i=0; i<num_tasks-1; i++){
+        work_condvar_.notify_one();
+      }
+    }
+    pool_unique_lock.lock();
+  }
+
+  /* the calling thread takes tasks until there are none left to start... */
+  while(run_one_task(batch,pool_unique_lock)){}
+
+  /* ...then waits for the workers to finish any tasks they have started, and to
+     let go of the batch */
+  while( (batch.num_unfinished > 0) or (batch.num_workers_attached > 0) ){
+    done_condvar_.wait(pool_unique_lock);
+  }
+
+  if(batch.failed){
+    throw std::runtime_error("CryptoWorkerPool: a task threw an exception");
+  }
+}
+
+
+/* CryptoWorkerPool::worker_thread_func() is the function run by each worker thread.
+ * Workers sleep until a batch is offered, and then help to run its tasks.
+ */
+void CryptoWorkerPool::worker_thread_func()
+{
+  std::unique_lock<std::mutex> pool_unique_lock(lock_);
+
+  while(true){
+    while(batches_.empty() and (not stopping_)){
+      work_condvar_.wait(pool_unique_lock);
+    }
+
+    if(stopping_){
+      return;
+    }
+
+    Batch& batch = *(batches_.front());
+    batch.num_workers_attached++;
+    while(run_one_task(batch,pool_unique_lock)){}
+    batch.num_workers_attached--;
+
+    done_condvar_.notify_all();
+  }
+}
+
+
+/* CryptoWorkerPool::run_one_task() claims the next unstarted task in batch and runs
+ * it with lock_ released. It returns false if there were no tasks left to start.
+ * held_lock must hold lock_ when this is called, and does so again on return. Once
+ * the last task of a batch has been claimed, the batch is withdrawn from batches_
+ * so that idle workers stop picking it up.
+ */
+bool CryptoWorkerPool::run_one_task(Batch& batch, std::unique_lock<std::mutex>& held_lock)
+{
+  if(batch.next_task == batch.num_tasks){
+    return false;
+  }
+
+  unsigned int task_index = batch.next_task++;
+  if( (batch.next_task == batch.num_tasks) and (not batches_.empty()) ){
+    for(auto it=batches_.begin(); it!=batches_.end(); it++){
+      if(*it == &batch){
+        batches_.erase(it);
+        break;
+      }
+    }
+  }
+
+  held_lock.unlock();
+  bool task_failed = false;
+  try{
+    (*batch.task)(task_index);
+  }
+  catch(...){
+    task_failed = true;
+  }
+  held_lock.lock();
+
+  batch.num_unfinished--;
+  batch.failed = batch.failed or task_failed;
+  if(batch.num_unfinished == 0){
+    done_condvar_.notify_all();
+  }
+  return true;
+}
@@ -0,0 +1,67 @@
+/* CryptoWorkerPool is a small fixed-size pool of threads which Connections can
+ * use to spread the encryption and decryption of a batch of packets across
+ * several cores. Without a CryptoWorkerPool, all of the cryptographic work for
+ * a single Connection is done serially on whichever Session worker thread is
+ * running its move_data() method, so one busy Connection can use at most one
+ * core.
+ *
+ * The only operation is run(), which runs a set of independent tasks in parallel
+ * and returns when they have all finished. The calling thread also runs tasks,
+ * so a pool with N worker threads provides up to N+1 "lanes" of parallelism.
+ * Tasks are identified by an index, which callers typically use to select some
+ * per-lane state (such as one of several CryptoUnits) that no other task in the
+ * same run() call will touch.
+ */
+
+#ifndef CRYPTOWORKERPOOL_H
+#define CRYPTOWORKERPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+class CryptoWorkerPool
+{
+public:
+  CryptoWorkerPool(unsigned int num_workers);
+  ~CryptoWorkerPool();
+  unsigned int num_lanes();
+  void run(unsigned int num_tasks, const std::function<void(unsigned int)>& task);
+
+  /* A CryptoWorkerPool owns threads which refer to it, so it can be neither copied
+   * nor moved.
+   */
+  CryptoWorkerPool(const CryptoWorkerPool&) = delete;
+  CryptoWorkerPool& operator=(const CryptoWorkerPool&) = delete;
+  CryptoWorkerPool(CryptoWorkerPool&&) = delete;
+  CryptoWorkerPool& operator=(CryptoWorkerPool&&) = delete;
+
+private:
+  /* Batch records the progress of one call to run(). It lives on the stack of
+     the thread which called run(), which does not return until every task has
+     finished and no worker holds a pointer to the Batch. */
+  struct Batch
+  {
+    const std::function<void(unsigned int)>* task;
+    unsigned int num_tasks;
+    unsigned int next_task;
+    unsigned int num_unfinished;
+    unsigned int num_workers_attached;
+    bool failed;
+  };
+
+  std::vector<std::thread> workers_;
+  std::deque<Batch*> batches_;
+  std::mutex lock_;
+  std::condition_variable work_condvar_;
+  std::condition_variable done_condvar_;
+  bool stopping_;
+
+  void worker_thread_func();
+  bool run_one_task(Batch& batch, std::unique_lock<std::mutex>& held_lock);
+};
+
+#endif
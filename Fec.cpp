@@ -0,0 +1,339 @@
+#include "Fec.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace
+{
+  /* the connection id (the sender id and the channel id) at the start of every packet */
+  constexpr unsigned int connection_id_size = host_id_size+channel_id_size;
+
+  /* the positions of the sender's segment number and the message number in the outer
+     header of a packet (see Connection.cpp), and their lengths */
+  constexpr unsigned int segnum_offset = 12;
+  constexpr unsigned int msgnum_offset = 18;
+  constexpr unsigned int number_len = 6;
+
+  /* the positions of the fields of FEC packets (see Fec.h) */
+  constexpr unsigned int type_offset = 18;
+  constexpr unsigned int group_segnum_offset = 19;
+  constexpr unsigned int group_msgnum_offset = 25;
+  constexpr unsigned int group_count_offset = 31;
+  constexpr unsigned int length_xor_offset = 32;
+  constexpr unsigned int repair_header_len = 34;
+  constexpr unsigned int report_packets_offset = 31;
+  constexpr unsigned int report_lost_offset = 35;
+
+  /* a group is sized so that this many of its packets are lost, on average */
+  constexpr double target_group_losses = 0.25;
+
+
+  /* put_uint() writes the length byte little-endian number n at dest */
+  void put_uint(unsigned char* dest, std::uint_least64_t n, unsigned int length)
+  {
+    for(unsigned int i=0; i<length; i++){
+      dest[i] = (n >> (8*i)) & 0xff;
+    }
+  }
+
+
+  /* get_uint() reads a length byte little-endian number from data */
+  std::uint_least64_t get_uint(const unsigned char* data, unsigned int length)
+  {
+    std::uint_least64_t n = 0;
+    for(unsigned int i=0; i<length; i++){
+      n |= static_cast<std::uint_least64_t>(data[i]) << (8*i);
+    }
+    return n;
+  }
+
+
+  /* xor_into() XORs the count bytes at src into those at dest, 8 bytes at a time where it
+     can, which compilers turn into vector instructions where the target has them */
+  void xor_into(unsigned char* dest, const unsigned char* src, unsigned int count)
+  {
+    unsigned int i = 0;
+    for(; i+8 <= count; i+=8){
+      std::uint64_t d, s;
+      std::memcpy(&d,dest+i,8);
+      std::memcpy(&s,src+i,8);
+      d ^= s;
+      std::memcpy(dest+i,&d,8);
+    }
+    for(; i<count; i++){
+      dest[i] ^= src[i];
+    }
+  }
+}
+
+
+/* FecEncoder::FecEncoder() takes the size of the largest packet which will be added */
+FecEncoder::FecEncoder(unsigned int max_packet_size):
+  count_(0),
+  segnum_(0),
+  next_msgnum_(0),
+  length_xor_(0),
+  started_(0),
+  loss_estimate_(0.0),
+  group_size_(max_group_size)
+{
+  repair_.reserve(max_packet_size+fec_overhead);
+}
+
+
+/* FecEncoder::add() adds a packet which has just been sent to the group being built,
+ * and reports whether the group is now complete, in which case repair_packet() should
+ * be sent. A packet which does not follow on from the rest of the group (because the
+ * sender's segment number has changed) starts a new group, and the old one is dropped.
+ */
+bool FecEncoder::add(const std::vector<unsigned char>& packet)
+{
+  if(packet.size() < msgnum_offset+number_len){
+    return false;
+  }
+  std::uint_least64_t segnum = get_uint(packet.data()+segnum_offset,number_len);
+  std::uint_least64_t msgnum = get_uint(packet.data()+msgnum_offset,number_len);
+  if( (count_ != 0) and ( (segnum != segnum_) or (msgnum != next_msgnum_) ) ){
+    count_ = 0;
+  }
+
+  if(count_ == 0){
+    repair_.assign(repair_header_len,0);
+    std::copy(packet.begin(),packet.begin()+connection_id_size,repair_.begin());
+    repair_[type_offset] = repair_type;
+    put_uint(repair_.data()+group_segnum_offset,segnum,number_len);
+    put_uint(repair_.data()+group_msgnum_offset,msgnum,number_len);
+    segnum_ = segnum;
+    length_xor_ = 0;
+    started_ = monotonic_nanos();
+  }
+
+  /* the repair packet grows (with zeros) to cover the longest packet */
+  unsigned int body_len = packet.size()-connection_id_size;
+  if(repair_.size() < repair_header_len+body_len){
+    repair_.resize(repair_header_len+body_len,0);
+  }
+  xor_into(repair_.data()+repair_header_len,packet.data()+connection_id_size,body_len);
+  length_xor_ ^= packet.size();
+  next_msgnum_ = msgnum+1;
+  count_++;
+  return count_ >= group_size_.load(std::memory_order_relaxed);
+}
+
+
+/* FecEncoder::flush_due() returns the time (from monotonic_nanos() ) at which the group
+ * being built should be closed early and its repair packet sent, or 0 if the group is
+ * empty
+ */
+nanos_t FecEncoder::flush_due()
+{
+  return (count_ == 0) ? 0 : started_+max_group_wait_nanos;
+}
+
+
+/* FecEncoder::repair_packet() closes the group being built, which must not be empty,
+ * and gives its repair packet, which stays valid until the next call to add()
+ */
+const std::vector<unsigned char>& FecEncoder::repair_packet()
+{
+  repair_[group_count_offset] = count_;
+  put_uint(repair_.data()+length_xor_offset,length_xor_,2);
+  count_ = 0;
+  return repair_;
+}
+
+
+/* FecEncoder::report() takes a report packet from the peer's FecDecoder, which must
+ * already have been authenticated, updates the estimate of the loss rate, and sizes the
+ * groups to suit it (see Fec.h). The return value reports whether the packet was a valid
+ * report.
+ */
+bool FecEncoder::report(const std::vector<unsigned char>& report_packet)
+{
+  if(report_packet.size() != FecEncoder::report_len){
+    return false;
+  }
+  std::uint_least64_t packets = get_uint(report_packet.data()+report_packets_offset,4);
+  std::uint_least64_t lost = get_uint(report_packet.data()+report_lost_offset,4);
+  if( (packets == 0) or (lost > packets) ){
+    return false;
+  }
+
+  /* each report counts for as much as all the earlier ones together */
+  loss_estimate_ = (loss_estimate_+static_cast<double>(lost)/packets)/2;
+  unsigned int group_size = max_group_size;
+  if(loss_estimate_*(max_group_size+1) > target_group_losses){
+    /* a group and its repair packet lose target_group_losses packets on average */
+    double fitting = target_group_losses/loss_estimate_-1;
+    group_size = (fitting < min_group_size) ? min_group_size : static_cast<unsigned int>(fitting);
+  }
+  group_size_.store(group_size,std::memory_order_relaxed);
+  return true;
+}
+
+
+/* FecEncoder::group_size() gives the number of packets in each group. It is safe to call
+ * this from any thread.
+ */
+unsigned int FecEncoder::group_size()
+{ return group_size_.load(std::memory_order_relaxed); }
+
+
+/* FecDecoder::FecDecoder() takes the ids which go at the start of the report packets,
+ * which are those of the Connection which sends them
+ */
+FecDecoder::FecDecoder(const host_id_type& self_id, const channel_id_type& channel_id):
+  window_(window_slots,Slot{false,0,0,{}}),
+  groups_(0),
+  packets_(0),
+  lost_(0),
+  counted_segnum_(0),
+  counted_msgnum_(0),
+  report_(FecEncoder::report_len,0)
+{
+  std::copy(self_id.begin(),self_id.end(),report_.begin());
+  std::copy(channel_id.begin(),channel_id.end(),report_.begin()+host_id_size);
+  report_[type_offset] = FecEncoder::report_type;
+}
+
+
+/* FecDecoder::is_fec_packet() reports whether a received packet is an FEC packet, that
+ * is, whether its sender's segment number is 0
+ */
+bool FecDecoder::is_fec_packet(const std::vector<unsigned char>& packet)
+{
+  if(packet.size() <= type_offset){
+    return false;
+  }
+  return get_uint(packet.data()+segnum_offset,number_len) == 0;
+}
+
+
+/* FecDecoder::packet_type() gives the type of an FEC packet (see Fec.h) */
+unsigned char FecDecoder::packet_type(const std::vector<unsigned char>& packet)
+{ return packet[type_offset]; }
+
+
+/* FecDecoder::add() keeps a copy of a received packet, which is not an FEC packet, in
+ * case it is needed to rebuild another packet of its group. The packet must be as it was
+ * received (before it was decrypted in place), but must only be added once it has been
+ * authenticated.
+ */
+void FecDecoder::add(const std::vector<unsigned char>& packet)
+{
+  add(std::vector<unsigned char>(packet));
+}
+
+
+/* FecDecoder::add(std::vector<unsigned char>&&) is as add(), but takes the packet's
+ * contents rather than copying them, leaving packet holding some other vector's contents
+ */
+void FecDecoder::add(std::vector<unsigned char>&& packet)
+{
+  if(packet.size() < msgnum_offset+number_len){
+    return;
+  }
+  std::uint_least64_t msgnum = get_uint(packet.data()+msgnum_offset,number_len);
+  Slot& slot = window_[msgnum % window_slots];
+  slot.in_use = true;
+  slot.segnum = get_uint(packet.data()+segnum_offset,number_len);
+  slot.msgnum = msgnum;
+  slot.packet.swap(packet);
+}
+
+
+/* FecDecoder::recover() takes a repair packet, counts how many packets of its group are
+ * missing, and if exactly one is, rebuilds it in recovered, and returns true. The group
+ * is only counted towards the next report if it is newer than the last group counted and
+ * at least one of its packets has been added, so that repair packets which have been
+ * forged or replayed do not count.
+ */
+bool FecDecoder::recover(const std::vector<unsigned char>& repair_packet,
+                         std::vector<unsigned char>& recovered)
+{
+  if(repair_packet.size() <= repair_header_len){
+    return false;
+  }
+  unsigned int count = repair_packet[group_count_offset];
+  if( (count == 0) or (count > FecEncoder::max_group_size) ){
+    return false;
+  }
+  std::uint_least64_t segnum = get_uint(repair_packet.data()+group_segnum_offset,number_len);
+  std::uint_least64_t first_msgnum = get_uint(repair_packet.data()+group_msgnum_offset,
+                                              number_len);
+  unsigned int length = get_uint(repair_packet.data()+length_xor_offset,2);
+
+  /* find the missing packets */
+  unsigned int missing = 0;
+  std::uint_least64_t missing_msgnum = 0;
+  for(unsigned int i=0; i<count; i++){
+    const Slot& slot = window_[(first_msgnum+i) % window_slots];
+    if( (not slot.in_use) or (slot.segnum != segnum) or (slot.msgnum != first_msgnum+i) ){
+      missing++;
+      missing_msgnum = first_msgnum+i;
+    }
+  }
+  if( (missing < count) and
+      ( (segnum > counted_segnum_) or
+        ( (segnum == counted_segnum_) and (first_msgnum > counted_msgnum_) ) ) ){
+    groups_++;
+    packets_ += count;
+    lost_ += missing;
+    counted_segnum_ = segnum;
+    counted_msgnum_ = first_msgnum;
+  }
+  if(missing != 1){
+    return false;
+  }
+
+  /* the missing packet is the XOR of the repair packet and the others */
+  unsigned int body_len = repair_packet.size()-repair_header_len;
+  recovered.resize(connection_id_size+body_len);
+  std::copy(repair_packet.begin(),repair_packet.begin()+connection_id_size,recovered.begin());
+  std::copy(repair_packet.begin()+repair_header_len,repair_packet.end(),
+            recovered.begin()+connection_id_size);
+  for(unsigned int i=0; i<count; i++){
+    if(first_msgnum+i == missing_msgnum){
+      continue;
+    }
+    const std::vector<unsigned char>& packet = window_[(first_msgnum+i) % window_slots].packet;
+    if(packet.size() > recovered.size()){
+      return false;
+    }
+    xor_into(recovered.data()+connection_id_size,packet.data()+connection_id_size,
+             packet.size()-connection_id_size);
+    length ^= packet.size();
+  }
+  if( (length < msgnum_offset+number_len) or (length > recovered.size()) ){
+    return false;
+  }
+  recovered.resize(length);
+  return (get_uint(recovered.data()+segnum_offset,number_len) == segnum) and
+    (get_uint(recovered.data()+msgnum_offset,number_len) == missing_msgnum);
+}
+
+
+/* FecDecoder::report_due() reports whether enough repair packets have been seen since
+ * the last report for another to be sent
+ */
+bool FecDecoder::report_due()
+{ return (groups_ >= report_groups) and (packets_ > 0); }
+
+
+/* FecDecoder::report_packet() gives a report packet for the repair packets counted since
+ * the last report, and starts counting afresh. The report packet carries the given sender's
+ * segment number and report number, and is left for the caller to fill in its AEAD tag.
+ */
+const std::vector<unsigned char>&
+FecDecoder::report_packet(std::uint_least64_t segnum, std::uint_least64_t report_num)
+{
+  put_uint(report_.data()+FecEncoder::report_iv_offset,segnum,number_len);
+  put_uint(report_.data()+FecEncoder::report_iv_offset+number_len,report_num,number_len);
+  put_uint(report_.data()+report_packets_offset,packets_,4);
+  put_uint(report_.data()+report_lost_offset,lost_,4);
+  groups_ = 0;
+  packets_ = 0;
+  lost_ = 0;
+  return report_;
+}
@@ -0,0 +1,134 @@
+/* Forward error correction (FEC) lets a channel make up for the loss of a packet without
+ * the data having to be sent again, which is worthwhile on lossy links with a long round
+ * trip time (and as cryptocomms has no retransmission, a lost packet otherwise means that
+ * its data is lost). For a peer with "fec" enabled (see the user manual), the FecEncoder
+ * of each Connection divides the packets it sends into groups with consecutive message
+ * numbers, and after each group sends a repair packet holding the XOR of the group's
+ * packets. The peer's FecDecoder keeps copies of the packets it has received recently
+ * (only once they have been authenticated, so that a forged packet cannot displace a
+ * genuine one), and if all but one of a group's packets arrive, it rebuilds the missing
+ * one from the others and the repair packet. A rebuilt packet is then processed like any
+ * other, so it is authenticated and checked against replays as usual.
+ *
+ * FEC packets are told apart from the others by a sender's segment number of 0, which no
+ * other packet has. They start with the connection id (the sender id and the channel id),
+ * followed by 12 zero bytes in place of the two segment numbers, and a type byte, which
+ * is repair_type or report_type. A repair packet continues with the sender's segment
+ * number and the message number of the first packet of its group (6 bytes each), the
+ * number of packets in the group (1 byte), the XOR of their lengths (2 bytes), and the
+ * XOR of the packets after their connection ids (each padded with zeros to the length of
+ * the longest). As the packets XORed are already encrypted, repair packets need no
+ * encryption of their own. A repair packet is fec_overhead bytes longer than the longest
+ * packet in its group, so Connections using FEC put that much less data in a packet.
+ *
+ * The group size adapts to the loss rate seen by the peer. After every report_groups
+ * repair packets, the FecDecoder sends a report packet giving the number of packets in
+ * those groups and how many of them were missing. Only groups which are newer than the
+ * last one counted, and which have at least one packet which has been authenticated, are
+ * counted, so that forged or replayed repair packets cannot make up losses. The FecEncoder
+ * keeps a running estimate of the loss rate from the reports, and sizes the groups so
+ * that a group loses a quarter of a packet on average, between min_group_size and
+ * max_group_size packets, as XOR parity can only rebuild one lost packet in a group. A
+ * group which has not filled up within max_group_wait_nanos of its first packet is closed
+ * early, so that the last packets of a burst are covered without delay.
+ *
+ * A report packet continues after its type byte with the sender's segment number and a
+ * report number (6 bytes each), the number of packets and the number missing (4 bytes
+ * each), and an AEAD tag (16 bytes) over the report_header_len bytes before it. The tag is
+ * made by the Connection, with keys of its own (see the cryptographic specification), as
+ * a report must come from the peer for the FecEncoder to act on it. Repair packets are
+ * not authenticated, but a forged one can at worst rebuild a packet which then fails
+ * authentication.
+ */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "IDTypes.h"
+#include "LatencyHistogram.h"
+
+class FecEncoder
+{
+public:
+  FecEncoder(unsigned int max_packet_size);
+
+  bool add(const std::vector<unsigned char>& packet);
+  nanos_t flush_due();
+  const std::vector<unsigned char>& repair_packet();
+  bool report(const std::vector<unsigned char>& report_packet);
+  unsigned int group_size();
+
+  constexpr static unsigned char repair_type = 1;
+  constexpr static unsigned char report_type = 2;
+  /* the position in a report packet of the sender's segment number followed by the report
+     number, which are used as the initialization vector of its AEAD tag, the length of
+     the part of it covered by the tag, and its whole length */
+  constexpr static unsigned int report_iv_offset = 19;
+  constexpr static unsigned int report_header_len = 39;
+  constexpr static unsigned int report_len = report_header_len+16;
+  constexpr static unsigned int fec_overhead = 28;
+  constexpr static unsigned int min_group_size = 2;
+  constexpr static unsigned int max_group_size = 32;
+  constexpr static nanos_t max_group_wait_nanos = 2000000;
+
+private:
+  /* repair_ holds the repair packet for the group being built, which has count_ packets
+     so far, the first of which was added at started_. group_size_ is atomic so that it
+     can be read for the metrics from any thread. */
+  std::vector<unsigned char> repair_;
+  unsigned int count_;
+  std::uint_least64_t segnum_;
+  std::uint_least64_t next_msgnum_;
+  unsigned int length_xor_;
+  nanos_t started_;
+  double loss_estimate_;
+  std::atomic<unsigned int> group_size_;
+};
+
+
+class FecDecoder
+{
+public:
+  FecDecoder(const host_id_type& self_id, const channel_id_type& channel_id);
+
+  static bool is_fec_packet(const std::vector<unsigned char>& packet);
+  static unsigned char packet_type(const std::vector<unsigned char>& packet);
+  void add(const std::vector<unsigned char>& packet);
+  void add(std::vector<unsigned char>&& packet);
+  bool recover(const std::vector<unsigned char>& repair_packet,
+               std::vector<unsigned char>& recovered);
+  bool report_due();
+  const std::vector<unsigned char>& report_packet(std::uint_least64_t segnum,
+                                                  std::uint_least64_t report_num);
+
+  constexpr static unsigned int report_groups = 8;
+  constexpr static unsigned int window_slots = 2*FecEncoder::max_group_size;
+
+private:
+  /* Slot holds a copy of the packet received with the message number msgnum from the
+     sender's segment number segnum, if in_use is set. The packet with message number n
+     goes in slot n % window_slots. */
+  struct Slot
+  {
+    bool in_use;
+    std::uint_least64_t segnum;
+    std::uint_least64_t msgnum;
+    std::vector<unsigned char> packet;
+  };
+  std::vector<Slot> window_;
+  /* the number of repair packets counted since the last report, and the number of packets
+     in their groups, and of those missing, and the sender's segment number and first
+     message number of the last group counted */
+  unsigned int groups_;
+  std::uint_least32_t packets_;
+  std::uint_least32_t lost_;
+  std::uint_least64_t counted_segnum_;
+  std::uint_least64_t counted_msgnum_;
+  std::vector<unsigned char> report_;
+};
+
+#endif
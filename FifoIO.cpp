@@ -79,6 +79,36 @@ namespace
     return fd;
   }
 
+
+  /* set_pipe_size() sets the capacity of the pipe buffer of the fifo open on fd to at
+   * least pipe_size bytes, if pipe_size is not 0, returning false if the kernel refuses.
+   * This happens for an unprivileged process if pipe_size is larger than the limit in
+   * /proc/sys/fs/pipe-max-size.
+   */
+  bool set_pipe_size(int fd, unsigned int pipe_size)
+  {
+    return (pipe_size == 0) or (fcntl(fd,F_SETPIPE_SZ,pipe_size) != -1);
+  }
+
+
+  /* pipe_size_error() gives the error thrown when set_pipe_size() fails */
+  std::runtime_error pipe_size_error(const std::string& path, unsigned int pipe_size)
+  {
+    return std::runtime_error("FifoIO: could not set pipe size of "+path+" to "
+                              +std::to_string(pipe_size));
+  }
+
+
+  /* get_pipe_size() gives the capacity of the pipe buffer of the fifo open on fd */
+  unsigned int get_pipe_size(int fd, const std::string& path)
+  {
+    int size = fcntl(fd,F_GETPIPE_SZ);
+    if(size == -1){
+      throw FifoIOError("FifoIO: could not get pipe size of "+path);
+    }
+    return size;
+  }
+
 }
 
 
@@ -94,7 +124,7 @@ namespace
  * preventing us from using poll() to listen for incoming data. Keeping write_fd_
  * open prevents this.
  */
-FifoFromUser::FifoFromUser(const std::string& path):
+FifoFromUser::FifoFromUser(const std::string& path, unsigned int pipe_size):
   path_(path)
 {
   /* Note that we do not need to do any error handling with these file descriptors,
@@ -102,6 +132,12 @@ FifoFromUser::FifoFromUser(const std::string& path):
      error. */
   fd_ = open_fifo(path,FifoMode::read);
   write_fd_ = open_fifo(path,FifoMode::write);
+
+  if(not set_pipe_size(fd_,pipe_size)){
+    close(fd_);
+    close(write_fd_);
+    throw pipe_size_error(path,pipe_size);
+  }
 }
 
 
@@ -137,16 +173,32 @@ FifoFromUser::~FifoFromUser()
  * no more data waiting in the fifo, or the write end of the fifo is closed.
  */
 std::vector<unsigned char> FifoFromUser::read(unsigned int count)
+{
+  std::vector<unsigned char> data(count);
+  data.resize(read_into(data,0,count));
+  return data;
+}
+
+
+/* FifoFromUser::read_into() reads up to count bytes from the underlying fifo, as for
+ * FifoFromUser::read(), but places them directly in dest starting at position offset
+ * (dest must have room for them), and returns the number of bytes read. This allows
+ * the data to be read straight into the buffer where it will be used, such as a packet
+ * which is then encrypted in place.
+ */
+unsigned int FifoFromUser::read_into(std::vector<unsigned char>& dest,
+                                     std::vector<unsigned char>::size_type offset,
+                                     unsigned int count)
 {
   if(fd_ == -1){
     throw std::runtime_error("FifoIO: FifoFromUser read after move");
   }
 
-  if(read_buff_.size() < count){
-    read_buff_.resize(count);
+  if(dest.size() < offset+count){
+    throw std::runtime_error("FifoIO: no room in buffer for read from fifo "+path_);
   }
 
-  /* keep making reads from the fifo into read_buff_ until one of the following
+  /* keep making reads from the fifo into dest until one of the following
    * occurs: we get enough bytes; the read would block if it were a blocking fifo
    * (meaning that the write end of the fifo is open but there is no data to read);
    * the fifo is at end-of-file (meaning that the write end of the fifo is closed)
@@ -154,7 +206,7 @@ std::vector<unsigned char> FifoFromUser::read(unsigned int count)
   ssize_t total_read = 0;
   ssize_t ret;
   while(total_read < count){
-    ret = ::read(fd_,read_buff_.data()+total_read,count-total_read);
+    ret = ::read(fd_,dest.data()+offset+total_read,count-total_read);
     if(ret == -1){
       if(errno == EINTR){
         continue;
@@ -173,7 +225,7 @@ std::vector<unsigned char> FifoFromUser::read(unsigned int count)
     total_read += ret;
   }
 
-  return std::vector<unsigned char>(read_buff_.begin(),read_buff_.begin()+total_read);
+  return total_read;
 }
 
 
@@ -183,6 +235,12 @@ int FifoFromUser::file_descriptor()
 }
 
 
+unsigned int FifoFromUser::pipe_size()
+{
+  return get_pipe_size(fd_,path_);
+}
+
+
 /* FifoToUser::FifoToUser() opens a non-blocking fifo for writing. We have to work around the
  * restriction that POSIX does not allow us to open a fifo for writing unless it is already open
  * for reading. We do this by first opening the fifo for reading, then opening it for writing, and
@@ -192,13 +250,13 @@ int FifoFromUser::file_descriptor()
  * necessary, as we want to be able to attempt to write to a fifo even if it might not be open
  * for reading.
  */
-FifoToUser::FifoToUser(const std::string& path):
+FifoToUser::FifoToUser(const std::string& path, unsigned int pipe_size):
   path_(path)
 {
-  /* sigpipe_off_ is a static member of FifoToUser which is initialized to false */
-  if(not sigpipe_off_){
+  /* sigpipe_off_ is a static member of FifoToUser which is initialized to false. It is
+     atomic as a Session creates its Connections on several threads at once. */
+  if(not sigpipe_off_.exchange(true)){
     signal(SIGPIPE, SIG_IGN);
-    sigpipe_off_ = true;
   }
 
   /* Note that we do not need to do any error handling with these file descriptors,
@@ -207,6 +265,11 @@ FifoToUser::FifoToUser(const std::string& path):
   int fd = open_fifo(path,FifoMode::read);
   fd_ = open_fifo(path,FifoMode::write);
   close(fd);
+
+  if(not set_pipe_size(fd_,pipe_size)){
+    close(fd_);
+    throw pipe_size_error(path,pipe_size);
+  }
 }
 
 
@@ -243,6 +306,17 @@ FifoToUser::~FifoToUser()
  * was detected (this is useful for a caller who might want to retry the write later).
  */
 std::pair<unsigned int,bool> FifoToUser::write(const std::vector<unsigned char>& data)
+{
+  return write(data.data(),data.size());
+}
+
+
+/* FifoToUser::write(const unsigned char*,unsigned int) writes the count bytes at data to
+ * the underlying fifo, as for FifoToUser::write(const std::vector<unsigned char>&). This
+ * allows data to be written straight from a larger buffer, such as a packet which has been
+ * decrypted in place, without first being copied into a vector of its own.
+ */
+std::pair<unsigned int,bool> FifoToUser::write(const unsigned char* data, unsigned int count)
 {
   if(fd_ == -1){
     throw std::runtime_error("FifoIO: FifoToUser write after move");
@@ -253,8 +327,8 @@ std::pair<unsigned int,bool> FifoToUser::write(const std::vector<unsigned char>&
    */
   unsigned int total_written = 0;
   ssize_t ret;
-  while(total_written < data.size()){
-    ret = ::write(fd_,data.data()+total_written,data.size()-total_written);
+  while(total_written < count){
+    ret = ::write(fd_,data+total_written,count-total_written);
     if(ret == -1){
       if(errno == EINTR){
         continue;
@@ -284,4 +358,10 @@ int FifoToUser::file_descriptor()
 }
 
 
-bool FifoToUser::sigpipe_off_ = false;
+unsigned int FifoToUser::pipe_size()
+{
+  return get_pipe_size(fd_,path_);
+}
+
+
+std::atomic<bool> FifoToUser::sigpipe_off_(false);
@@ -1,11 +1,17 @@
 /* FifoFromUser and FifoToUser are simple wrappers for the read and write ends
  * of a fifo (i.e. a named pipe), respectively. They also support getting the
  * underlying file descriptor of the fifo to allow poll() based non-blocking IO.
+ *
+ * Both constructors take an optional pipe_size, which if non-zero is the capacity
+ * (in bytes) to request for the fifo's pipe buffer in place of the kernel default
+ * (usually 64 KiB). The kernel rounds this up to a power of two number of pages, and
+ * pipe_size() reports the resulting capacity.
  */
 
 #ifndef FIFOIO_H
 #define FIFOIO_H
 
+#include <atomic>
 #include <string>
 #include <vector>
 #include <stdexcept>
@@ -14,7 +20,7 @@
 class FifoFromUser
 {
 public:
-  FifoFromUser(const std::string& path);
+  FifoFromUser(const std::string& path, unsigned int pipe_size = 0);
   FifoFromUser(FifoFromUser&& other);
   FifoFromUser& operator=(FifoFromUser&& other);
   ~FifoFromUser();
@@ -27,14 +33,17 @@ public:
   FifoFromUser& operator=(const FifoFromUser& other) = delete;
 
   std::vector<unsigned char> read(unsigned int count);
+  unsigned int read_into(std::vector<unsigned char>& dest,
+                         std::vector<unsigned char>::size_type offset,
+                         unsigned int count);
   int file_descriptor();
+  unsigned int pipe_size();
 
 private:
   int fd_;
   int write_fd_; // see the comments before the definition of the
                  // parameterized constructor for the reason for
                  // write_fd_
-  std::vector<unsigned char> read_buff_;
   const std::string path_;
 };
 
@@ -42,7 +51,7 @@ private:
 class FifoToUser
 {
 public:
-  FifoToUser(const std::string& path);
+  FifoToUser(const std::string& path, unsigned int pipe_size = 0);
   FifoToUser(FifoToUser&& other);
   FifoToUser& operator=(FifoToUser&& other);
   ~FifoToUser();
@@ -55,11 +64,13 @@ public:
   FifoToUser& operator=(const FifoToUser& other) = delete;
 
   std::pair<unsigned int,bool> write(const std::vector<unsigned char>& data);
+  std::pair<unsigned int,bool> write(const unsigned char* data, unsigned int count);
   int file_descriptor();
+  unsigned int pipe_size();
 
 private:
   int fd_;
-  static bool sigpipe_off_;
+  static std::atomic<bool> sigpipe_off_;
   const std::string path_;
 };
 
@@ -0,0 +1,211 @@
+#include "Fragmentation.h"
+
+#include <algorithm>
+#include <string>
+
+
+namespace
+{
+  /* put_uint24() writes the 3 byte little-endian number n at dest */
+  void put_uint24(unsigned char* dest, std::uint_least32_t n)
+  {
+    for(unsigned int i=0; i<3; i++){
+      dest[i] = (n >> (8*i)) & 0xff;
+    }
+  }
+
+
+  /* get_uint24() reads a 3 byte little-endian number from data */
+  std::uint_least32_t get_uint24(const unsigned char* data)
+  {
+    std::uint_least32_t n = 0;
+    for(unsigned int i=0; i<3; i++){
+      n |= static_cast<std::uint_least32_t>(data[i]) << (8*i);
+    }
+    return n;
+  }
+}
+
+
+/* Fragmenter::Fragmenter() takes the length of the longest message to be sent */
+Fragmenter::Fragmenter(unsigned int max_message_size):
+  buffer_(max_message_size),
+  length_(0),
+  sent_(0),
+  sending_(false),
+  fragmented_(false),
+  message_id_(0)
+{
+  if( (max_message_size == 0) or (max_message_size > max_max_message_size) ){
+    throw FragmentationError("Fragmenter: maximum message size out of range");
+  }
+}
+
+
+/* Fragmenter::buffer() gives the buffer which the next message to send is read into */
+std::vector<unsigned char>& Fragmenter::buffer()
+{ return buffer_; }
+
+
+/* Fragmenter::sending() reports whether there are packets of the current message still
+ * to be sent
+ */
+bool Fragmenter::sending()
+{ return sending_; }
+
+
+/* Fragmenter::start() begins the sending of the message of length bytes in buffer(), in
+ * packets with payloads of at most max_data_len bytes, and reports whether the message
+ * has to be sent in fragments
+ */
+bool Fragmenter::start(unsigned int length, unsigned int max_data_len)
+{
+  if(sending_){
+    throw FragmentationError("Fragmenter: previous message not sent yet");
+  }
+  if(length > buffer_.size()){
+    throw FragmentationError("Fragmenter: message too long");
+  }
+  fragmented_ = (length+1 > max_data_len);
+  if(fragmented_){
+    if(max_data_len <= fragment_header_len){
+      throw FragmentationError("Fragmenter: packets too small for fragments");
+    }
+    message_id_ = (message_id_+1) & 0xffffff;
+  }
+  length_ = length;
+  sent_ = 0;
+  sending_ = true;
+  return fragmented_;
+}
+
+
+/* Fragmenter::next_packet() puts the payload of the next packet of the current message
+ * into dest, starting at position offset, and returns its length, or 0 if there is
+ * nothing left to send. The payload is at most max_data_len bytes, which must be the
+ * value passed to start().
+ */
+unsigned int Fragmenter::next_packet(std::vector<unsigned char>& dest,
+                                     std::vector<unsigned char>::size_type offset,
+                                     unsigned int max_data_len)
+{
+  if(not sending_){
+    return 0;
+  }
+  if(dest.size() < offset+max_data_len){
+    throw FragmentationError("Fragmenter: no room in buffer for packet");
+  }
+
+  if(not fragmented_){
+    dest[offset] = whole_flag;
+    std::copy(buffer_.begin(),buffer_.begin()+length_,dest.begin()+offset+1);
+    sending_ = false;
+    return length_+1;
+  }
+
+  unsigned int len = std::min(length_-sent_,max_data_len-fragment_header_len);
+  dest[offset] = fragment_flag;
+  put_uint24(&dest[offset+1],message_id_);
+  put_uint24(&dest[offset+4],sent_);
+  put_uint24(&dest[offset+7],length_);
+  std::copy(buffer_.begin()+sent_,buffer_.begin()+sent_+len,
+            dest.begin()+offset+fragment_header_len);
+  sent_ += len;
+  if(sent_ == length_){
+    sending_ = false;
+  }
+  return len+fragment_header_len;
+}
+
+
+/* Reassembler::Reassembler() takes the length of the longest message to be received,
+ * the counter of partial messages discarded, and how long to wait for the rest of a
+ * message once its first fragment has arrived
+ */
+Reassembler::Reassembler(unsigned int max_message_size, MetricCounter& discards,
+                         unsigned int timeout_millis):
+  max_message_size_(max_message_size),
+  timeout_nanos_(static_cast<nanos_t>(timeout_millis)*1000000),
+  discards_(discards),
+  slots_(reassembly_slots)
+{
+  for(auto& slot : slots_){
+    slot.in_use = false;
+  }
+}
+
+
+/* Reassembler::add() takes the payload of a packet of count bytes which holds a fragment
+ * (one which does not start with Fragmenter::whole_flag). If that completes a message,
+ * the message is swapped into message and true is returned. A fragment which is not
+ * valid is discarded (and counted).
+ */
+bool Reassembler::add(const unsigned char* data, unsigned int count,
+                      std::vector<unsigned char>& message)
+{
+  if( (count <= Fragmenter::fragment_header_len) or (data[0] != Fragmenter::fragment_flag) ){
+    discards_.add();
+    return false;
+  }
+  std::uint_least32_t message_id = get_uint24(data+1);
+  unsigned int offset = get_uint24(data+4);
+  unsigned int length = get_uint24(data+7);
+  unsigned int len = count-Fragmenter::fragment_header_len;
+  if( (length > max_message_size_) or (offset+len > length) ){
+    discards_.add();
+    return false;
+  }
+
+  nanos_t now = monotonic_nanos();
+  Slot* found = nullptr;
+  Slot* free = nullptr;
+  Slot* oldest = nullptr;
+  for(auto& slot : slots_){
+    if(slot.in_use and (now-slot.started >= timeout_nanos_)){
+      discard(slot);
+    }
+    if(not slot.in_use){
+      free = free ? free : &slot;
+    }
+    else if(slot.message_id == message_id){
+      found = &slot;
+    }
+    else if( (oldest == nullptr) or (slot.started < oldest->started) ){
+      oldest = &slot;
+    }
+  }
+
+  if(found == nullptr){
+    if(free == nullptr){
+      discard(*oldest);
+      free = oldest;
+    }
+    found = free;
+    found->in_use = true;
+    found->message_id = message_id;
+    found->started = now;
+    found->received = 0;
+    found->buffer.resize(length);
+  }
+  else if(found->buffer.size() != length){
+    discard(*found);
+    return false;
+  }
+
+  std::copy(data+Fragmenter::fragment_header_len,data+count,found->buffer.begin()+offset);
+  found->received += len;
+  if(found->received < length){
+    return false;
+  }
+  message.swap(found->buffer);
+  found->in_use = false;
+  return true;
+}
+
+
+/* Reassembler::discard() gives up on the partial message in slot */
+void Reassembler::discard(Slot& slot)
+{
+  slot.in_use = false;
+  discards_.add();
+}
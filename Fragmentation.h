@@ -0,0 +1,103 @@
+/* Fragmentation lets the channels which keep message boundaries (the seqpacket, shm and
+ * local modes, see ChannelMode.h) carry messages which are too long for one packet. For a
+ * peer with a "max_message_size" (see the user manual), a Fragmenter splits each message
+ * from the user which does not fit in a packet into fragments which do, and the peer's
+ * Reassembler puts them back together, so that the user program at the other end still
+ * receives the message whole. This is better than sending packets larger than the path
+ * MTU and leaving the IP layer to fragment them, as the fragments are each encrypted and
+ * authenticated packets of their own, which middleboxes have no reason to drop.
+ *
+ * With fragmentation enabled, the payload of every packet on the channel starts with a
+ * header. A message which fits in one packet has a header of one byte, whole_flag. A
+ * fragment has a header of fragment_header_len bytes: fragment_flag, the message id (3
+ * bytes), the offset of the fragment's data in the message (3 bytes), and the length of
+ * the whole message (3 bytes), all using the little-endian convention. Fragments are
+ * placed by their offset, so they may arrive in any order, and fragments of different
+ * messages may be interleaved.
+ *
+ * The Reassembler keeps partial messages in a bounded arena of reassembly_slots slots.
+ * A partial message is discarded (and counted) if it has not been completed within the
+ * reassembly timeout, or if its slot is needed for a newer message when all are in use.
+ * As there is no retransmission of lost packets yet, the loss of a single fragment means
+ * that the message is lost, just as it would be if the IP layer had fragmented it, but
+ * the discard is visible in the metrics.
+ */
+
+#ifndef FRAGMENTATION_H
+#define FRAGMENTATION_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "LatencyHistogram.h"
+#include "Metrics.h"
+
+class Fragmenter
+{
+public:
+  Fragmenter(unsigned int max_message_size);
+
+  std::vector<unsigned char>& buffer();
+  bool sending();
+  bool start(unsigned int length, unsigned int max_data_len);
+  unsigned int next_packet(std::vector<unsigned char>& dest,
+                           std::vector<unsigned char>::size_type offset,
+                           unsigned int max_data_len);
+
+  constexpr static unsigned char whole_flag = 0;
+  constexpr static unsigned char fragment_flag = 1;
+  constexpr static unsigned int fragment_header_len = 10;
+  constexpr static unsigned int max_max_message_size = 0xffffff;
+
+private:
+  /* buffer_ holds the message being sent, of which the first sent_ of length_ bytes
+     have been sent if sending_ is set. message_id_ is the id of the latest message sent
+     in fragments. */
+  std::vector<unsigned char> buffer_;
+  unsigned int length_;
+  unsigned int sent_;
+  bool sending_;
+  bool fragmented_;
+  std::uint_least32_t message_id_;
+};
+
+
+class Reassembler
+{
+public:
+  Reassembler(unsigned int max_message_size, MetricCounter& discards,
+              unsigned int timeout_millis = default_timeout_millis);
+
+  bool add(const unsigned char* data, unsigned int count, std::vector<unsigned char>& message);
+
+  constexpr static unsigned int reassembly_slots = 4;
+  constexpr static unsigned int default_timeout_millis = 2000;
+
+private:
+  /* Slot holds a partial message if in_use is set, of which received bytes of the length
+     in buffer have arrived, the first of them at started */
+  struct Slot
+  {
+    bool in_use;
+    std::uint_least32_t message_id;
+    nanos_t started;
+    unsigned int received;
+    std::vector<unsigned char> buffer;
+  };
+
+  void discard(Slot& slot);
+
+  const unsigned int max_message_size_;
+  const nanos_t timeout_nanos_;
+  MetricCounter& discards_;
+  std::vector<Slot> slots_;
+};
+
+
+class FragmentationError: public std::runtime_error{
+public:
+  FragmentationError(const std::string& what_arg): runtime_error(what_arg){}
+};
+
+#endif
@@ -1,4 +1,4 @@
-/* A simple function to wrap OpenSSL's HKDF expand functionality. This function has been
+/* A simple function implementing HKDF expand with OpenSSL's HMAC. This function has been
  * separated into its own unit to allow it to have its own test suite, since it is vitally
  * important that this function works correctly to ensure crytographic security.
  */
@@ -0,0 +1,109 @@
+#include "LatencyHistogram.h"
+
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+
+
+nanos_t monotonic_nanos()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+LatencyHistogram::LatencyHistogram():
+  sum_(0)
+{
+  for(auto& c : counts_){
+    c.store(0,std::memory_order_relaxed);
+  }
+}
+
+
+/* LatencyHistogram::snapshot() copies out the bucket counts. As recording can continue
+ * while the counts are copied, the snapshot may include a value in sum but not in the
+ * bucket counts, or vice versa, but this is harmless for monitoring.
+ */
+HistogramSnapshot LatencyHistogram::snapshot() const
+{
+  HistogramSnapshot hs;
+  hs.counts.resize(num_buckets);
+  hs.count = 0;
+  for(unsigned int i=0; i<num_buckets; i++){
+    hs.counts[i] = counts_[i].load(std::memory_order_relaxed);
+    hs.count += hs.counts[i];
+  }
+  hs.sum = sum_.load(std::memory_order_relaxed);
+  return hs;
+}
+
+
+/* HistogramSnapshot::bucket_upper_bound() gives the largest value which is counted in
+ * the bucket with the given index (except for the last bucket, which also counts all
+ * larger values)
+ */
+nanos_t HistogramSnapshot::bucket_upper_bound(unsigned int index)
+{
+  constexpr unsigned int sub_buckets = LatencyHistogram::sub_buckets;
+  if(index < 2*sub_buckets){
+    return index;
+  }
+  nanos_t shift = (index/sub_buckets)-1;
+  nanos_t top_bits = (index%sub_buckets)+sub_buckets;
+  return ((top_bits+1) << shift)-1;
+}
+
+
+/* HistogramSnapshot::quantile() estimates the q-quantile (0 <= q <= 1) of the recorded
+ * values, as the upper bound of the bucket where it falls. This overestimates by at most
+ * 12.5%. If no values have been recorded, the result is 0.
+ */
+nanos_t HistogramSnapshot::quantile(double q) const
+{
+  if(count == 0){
+    return 0;
+  }
+  if( (q < 0) or (q > 1) ){
+    throw std::runtime_error("LatencyHistogram: quantile out of range");
+  }
+
+  /* find the first bucket at which the cumulative count reaches rank, the position
+     of the q-quantile among the recorded values in increasing order */
+  std::uint_least64_t rank = static_cast<std::uint_least64_t>(std::ceil(q*count));
+  if(rank == 0){
+    rank = 1;
+  }
+  std::uint_least64_t cumulative = 0;
+  for(unsigned int i=0; i<counts.size(); i++){
+    cumulative += counts[i];
+    if(cumulative >= rank){
+      return bucket_upper_bound(i);
+    }
+  }
+  return bucket_upper_bound(counts.size()-1);
+}
+
+
+std::string pipeline_stage_name(PipelineStage stage)
+{
+  switch(stage){
+  case PipelineStage::udp_dispatch:
+    return "udp_dispatch";
+  case PipelineStage::scheduler_wait:
+    return "scheduler_wait";
+  case PipelineStage::inbound_queue:
+    return "inbound_queue";
+  case PipelineStage::decrypt:
+    return "decrypt";
+  case PipelineStage::fifo_write:
+    return "fifo_write";
+  case PipelineStage::fifo_read:
+    return "fifo_read";
+  case PipelineStage::encrypt:
+    return "encrypt";
+  case PipelineStage::udp_send:
+    return "udp_send";
+  }
+  throw std::runtime_error("LatencyHistogram: unknown pipeline stage");
+}
@@ -0,0 +1,117 @@
+/* LatencyHistogram records the distribution of a latency, such as the time taken by
+ * one stage of the packet pipeline, in a log-linear ("HDR") histogram. Values are
+ * recorded in nanoseconds. Values below 16ns each get their own bucket, and above that
+ * each power of two is split into 8 equal buckets, so any recorded value is known to
+ * within 12.5%. Values up to 2^48ns (about 78 hours) are covered, and larger values are
+ * counted in the last bucket.
+ *
+ * LatencyHistogram::record() is lock-free: it finds the bucket with a few bit
+ * operations and increments it, and the running total, with relaxed atomic additions.
+ * A snapshot() can be taken at any time from any thread without disturbing recording.
+ *
+ * This file also defines PipelineStage, which names the stages of the packet pipeline
+ * whose latencies cryptocomms records, and PipelineLatencies, which holds a
+ * LatencyHistogram for each stage.
+ */
+
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+typedef std::uint_least64_t nanos_t;
+
+/* monotonic_nanos() returns the time in nanoseconds on a monotonic clock (with an
+   arbitrary starting point), for measuring latencies */
+nanos_t monotonic_nanos();
+
+
+/* HistogramSnapshot holds the bucket counts of a LatencyHistogram at some moment */
+struct HistogramSnapshot
+{
+  std::vector<std::uint_least64_t> counts;
+  std::uint_least64_t count; // the total of counts
+  nanos_t sum;               // the total of all the recorded values
+
+  nanos_t quantile(double q) const;
+  static nanos_t bucket_upper_bound(unsigned int index);
+};
+
+
+class LatencyHistogram
+{
+public:
+  constexpr static unsigned int sub_bucket_bits = 3;
+  constexpr static unsigned int sub_buckets = 1 << sub_bucket_bits;
+  constexpr static unsigned int max_msb = 47;
+  constexpr static unsigned int num_buckets = (max_msb-sub_bucket_bits+2)*sub_buckets;
+
+  LatencyHistogram();
+  void record(nanos_t value);
+  HistogramSnapshot snapshot() const;
+
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+  static unsigned int bucket_index(nanos_t value);
+
+private:
+  std::array<std::atomic<std::uint_least64_t>,num_buckets> counts_;
+  std::atomic<nanos_t> sum_;
+};
+
+
+/* LatencyHistogram::record() is defined here so that it can be inlined on the data path */
+inline unsigned int LatencyHistogram::bucket_index(nanos_t value)
+{
+  if(value < 2*sub_buckets){
+    return value;
+  }
+  unsigned int msb = 63 - __builtin_clzll(value);
+  if(msb > max_msb){
+    return num_buckets-1;
+  }
+  unsigned int shift = msb-sub_bucket_bits;
+  return (shift*sub_buckets) + (value >> shift);
+}
+
+inline void LatencyHistogram::record(nanos_t value)
+{
+  counts_[bucket_index(value)].fetch_add(1,std::memory_order_relaxed);
+  sum_.fetch_add(value,std::memory_order_relaxed);
+}
+
+
+/* PipelineStage names the stages of the packet pipeline which are timed. Inbound
+ * packets go through the first five, and outbound packets through the last three. */
+enum class PipelineStage
+{
+  udp_dispatch,   // from receipt by the UDP thread to being queued for a Connection
+  scheduler_wait, // from a Connection being queued to a worker thread taking it
+  inbound_queue,  // from receipt by the UDP thread to handle_message()
+  decrypt,        // authenticated decryption of one packet
+  fifo_write,     // writing one packet's data to the "to user" FIFO
+  fifo_read,      // reading one packet's worth of data from the "from user" FIFO
+  encrypt,        // creating and encrypting one packet
+  udp_send        // sending one packet on the UDP socket
+};
+
+constexpr unsigned int num_pipeline_stages = 8;
+
+std::string pipeline_stage_name(PipelineStage stage);
+
+
+/* PipelineLatencies holds one LatencyHistogram for each PipelineStage */
+struct PipelineLatencies
+{
+  std::array<LatencyHistogram,num_pipeline_stages> histograms;
+
+  void record(PipelineStage stage, nanos_t value)
+  { histograms[static_cast<unsigned int>(stage)].record(value); }
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include "LocalChannel.h"
+
+#include <algorithm>
+#include <string>
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+/* LocalChannel::LocalChannel() takes the size of the largest message which fits in one
+ * packet, and the capacity of each queue in bytes (0 for default_capacity)
+ */
+LocalChannel::LocalChannel(unsigned int max_message_size, unsigned int capacity):
+  max_message_size_(max_message_size),
+  capacity_( (capacity == 0) ? default_capacity : capacity ),
+  event_fd_(eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)),
+  outward_bytes_(0),
+  inward_bytes_(0),
+  connection_blocked_(false)
+{
+  if(event_fd_ == -1){
+    throw LocalChannelError("LocalChannel: could not create eventfd");
+  }
+}
+
+
+LocalChannel::~LocalChannel()
+{
+  close(event_fd_);
+}
+
+
+/* LocalChannel::send() passes a message of count bytes to the Connection, to be sent to
+ * the peer in one packet, waiting until there is room for it in the queue. A message
+ * longer than max_message_size() is an error.
+ */
+void LocalChannel::send(const unsigned char* data, unsigned int count)
+{
+  check_length(count);
+  std::unique_lock<std::mutex> queue_lock(queue_lock_);
+  outward_room_condvar_.wait(queue_lock,[&](){
+      return outward_.empty() or (outward_bytes_+count <= capacity_); });
+  bool was_empty = outward_.empty();
+  push_outward(data,count);
+  queue_lock.unlock();
+  if(was_empty){
+    ring_connection();
+  }
+}
+
+
+/* LocalChannel::try_send() is as send(), but returns false instead of waiting if there is
+ * no room for the message
+ */
+bool LocalChannel::try_send(const unsigned char* data, unsigned int count)
+{
+  check_length(count);
+  std::unique_lock<std::mutex> queue_lock(queue_lock_);
+  bool was_empty = outward_.empty();
+  if(not push_outward(data,count)){
+    return false;
+  }
+  queue_lock.unlock();
+  if(was_empty){
+    ring_connection();
+  }
+  return true;
+}
+
+
+/* LocalChannel::receive() takes the oldest message from the peer, waiting until there is
+ * one
+ */
+void LocalChannel::receive(std::vector<unsigned char>& message)
+{
+  std::unique_lock<std::mutex> queue_lock(queue_lock_);
+  inward_message_condvar_.wait(queue_lock,[&](){ return not inward_.empty(); });
+  take_inward(message);
+  bool wake_connection = connection_blocked_;
+  connection_blocked_ = false;
+  queue_lock.unlock();
+  if(wake_connection){
+    ring_connection();
+  }
+}
+
+
+/* LocalChannel::try_receive() is as receive(), but returns false instead of waiting if
+ * there is no message
+ */
+bool LocalChannel::try_receive(std::vector<unsigned char>& message)
+{
+  std::unique_lock<std::mutex> queue_lock(queue_lock_);
+  if(inward_.empty()){
+    return false;
+  }
+  take_inward(message);
+  bool wake_connection = connection_blocked_;
+  connection_blocked_ = false;
+  queue_lock.unlock();
+  if(wake_connection){
+    ring_connection();
+  }
+  return true;
+}
+
+
+/* LocalChannel::set_receive_callback() sets the function called with each message from
+ * the peer in place of queueing it. Any messages already queued are passed to the callback
+ * straight away, on the calling thread. Setting an empty callback goes back to queueing.
+ */
+void LocalChannel::set_receive_callback(receive_callback callback)
+{
+  const std::lock_guard<std::mutex> callback_lock_guard(callback_lock_);
+  callback_ = std::move(callback);
+  if(callback_){
+    std::vector<unsigned char> message;
+    while(try_receive(message)){
+      callback_(message.data(),message.size());
+    }
+  }
+}
+
+
+/* LocalChannel::max_message_size() gives the size of the largest message which send()
+ * and try_send() accept
+ */
+unsigned int LocalChannel::max_message_size()
+{ return max_message_size_; }
+
+
+/* LocalChannel::read_into() takes the oldest message from the application, if there is
+ * one, and copies it into dest, starting at position offset. The return value is as for
+ * SeqPacketEndpoint::read_into(), though as send() refuses messages which are too long
+ * for a packet, the second element is only true if count is less than max_message_size().
+ */
+std::pair<unsigned int,bool> LocalChannel::read_into(std::vector<unsigned char>& dest,
+                                                     std::vector<unsigned char>::size_type offset,
+                                                     unsigned int count)
+{
+  if(dest.size() < offset+count){
+    throw LocalChannelError("LocalChannel: no room in buffer for read");
+  }
+
+  std::unique_lock<std::mutex> queue_lock(queue_lock_);
+  std::pair<unsigned int,bool> result{0,false};
+  while( (not outward_.empty()) and (result.first == 0) and (not result.second) ){
+    std::vector<unsigned char>& message = outward_.front();
+    if(message.size() > count){
+      result.second = true;
+    }
+    else{
+      std::copy(message.begin(),message.end(),dest.begin()+offset);
+      result.first = message.size();
+    }
+    outward_bytes_ -= message.size();
+    outward_.pop_front();
+  }
+  queue_lock.unlock();
+  outward_room_condvar_.notify_all();
+  return result;
+}
+
+
+/* LocalChannel::write() passes a message of count bytes from the peer to the application,
+ * through the callback if there is one, or else through the queue. As for
+ * SeqPacketEndpoint::write(), the first element of the return value is count, or 0 if the
+ * queue is full. The second element is always false, as the application is always there.
+ */
+std::pair<unsigned int,bool> LocalChannel::write(const unsigned char* data, unsigned int count)
+{
+  /* callback_lock_ is held throughout, so that the callback cannot be set between
+     finding that there is none and queueing the message */
+  const std::lock_guard<std::mutex> callback_lock_guard(callback_lock_);
+  if(callback_){
+    callback_(data,count);
+    return {count,false};
+  }
+
+  std::unique_lock<std::mutex> queue_lock(queue_lock_);
+  if( (not inward_.empty()) and (inward_bytes_+count > capacity_) ){
+    connection_blocked_ = true;
+    return {0,false};
+  }
+  inward_.emplace_back(data,data+count);
+  inward_bytes_ += count;
+  queue_lock.unlock();
+  inward_message_condvar_.notify_one();
+  return {count,false};
+}
+
+
+/* LocalChannel::has_room() reports whether write() would accept a message of count bytes */
+bool LocalChannel::has_room(unsigned int count)
+{
+  const std::lock_guard<std::mutex> queue_lock_guard(queue_lock_);
+  return inward_.empty() or (inward_bytes_+count <= capacity_);
+}
+
+
+/* LocalChannel::data_waiting() reports whether there is a message for read_into() to
+ * take. It clears the eventfd first, so that the Connection is only woken again for
+ * changes after this check.
+ */
+bool LocalChannel::data_waiting()
+{
+  uint64_t discard;
+  while( (read(event_fd_,&discard,sizeof(discard)) == -1) and (errno == EINTR) ){}
+  const std::lock_guard<std::mutex> queue_lock_guard(queue_lock_);
+  return not outward_.empty();
+}
+
+
+/* LocalChannel::file_descriptor() gives the eventfd which wakes the Connection */
+int LocalChannel::file_descriptor()
+{ return event_fd_; }
+
+
+/* LocalChannel::push_outward() adds a message to outward_ if there is room for it, and
+ * reports whether there was. queue_lock_ must be held.
+ */
+bool LocalChannel::push_outward(const unsigned char* data, unsigned int count)
+{
+  if( (not outward_.empty()) and (outward_bytes_+count > capacity_) ){
+    return false;
+  }
+  outward_.emplace_back(data,data+count);
+  outward_bytes_ += count;
+  return true;
+}
+
+
+/* LocalChannel::check_length() throws if a message of count bytes is too long for
+ * send() or try_send()
+ */
+void LocalChannel::check_length(unsigned int count)
+{
+  if(count > max_message_size_){
+    throw LocalChannelError("LocalChannel: message of "+std::to_string(count)+
+                            " bytes is too long for a packet");
+  }
+}
+
+
+/* LocalChannel::take_inward() moves the oldest message in inward_, which must not be
+ * empty, into message. queue_lock_ must be held.
+ */
+void LocalChannel::take_inward(std::vector<unsigned char>& message)
+{
+  message = std::move(inward_.front());
+  inward_.pop_front();
+  inward_bytes_ -= message.size();
+}
+
+
+/* LocalChannel::ring_connection() makes file_descriptor() readable, to wake the
+ * Connection
+ */
+void LocalChannel::ring_connection()
+{
+  uint64_t one = 1;
+  while( (::write(event_fd_,&one,sizeof(one)) == -1) and (errno == EINTR) ){}
+}
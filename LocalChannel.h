@@ -0,0 +1,98 @@
+/* LocalChannel is the user's end of a channel in "local" mode (see ChannelMode.h), for an
+ * application which links in libcryptocomms and runs a Session itself, rather than running
+ * the cryptocomms binary. The application gets the channel's LocalChannel from
+ * Session::local_channel(), and exchanges messages with the Connection directly through a
+ * pair of queues in memory, one for each direction, with no fifos or other files involved.
+ * Messages keep their boundaries, as in "seqpacket" mode.
+ *
+ * The application uses the first group of public methods below, which are safe to call
+ * from any thread. Messages can be received either by calling receive() or try_receive(),
+ * or by setting a callback which the Connection calls with each message as it is decrypted.
+ * The callback runs on one of the Session's threads, so it must not block (in particular,
+ * it must not call send() ), and data passed to it is only valid during the call.
+ *
+ * The second group of public methods is used by the Connection, and offers the same
+ * operations as SeqPacketEndpoint. The Connection is woken through file_descriptor(), an
+ * eventfd which becomes readable when the application sends a message, or takes a message
+ * after the Connection has found the queue to the application full.
+ */
+
+#ifndef LOCALCHANNEL_H
+#define LOCALCHANNEL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+class LocalChannel
+{
+public:
+  typedef std::function<void(const unsigned char* data, unsigned int count)> receive_callback;
+
+  LocalChannel(unsigned int max_message_size, unsigned int capacity);
+  ~LocalChannel();
+
+  /* We do not allow copying of a LocalChannel, as it owns the eventfd, and the
+   * application and the Connection must share the same one.
+   */
+  LocalChannel(const LocalChannel& other) = delete;
+  LocalChannel& operator=(const LocalChannel& other) = delete;
+
+  /* used by the application */
+  void send(const unsigned char* data, unsigned int count);
+  bool try_send(const unsigned char* data, unsigned int count);
+  void receive(std::vector<unsigned char>& message);
+  bool try_receive(std::vector<unsigned char>& message);
+  void set_receive_callback(receive_callback callback);
+  unsigned int max_message_size();
+
+  /* used by the Connection */
+  std::pair<unsigned int,bool> read_into(std::vector<unsigned char>& dest,
+                                         std::vector<unsigned char>::size_type offset,
+                                         unsigned int count);
+  std::pair<unsigned int,bool> write(const unsigned char* data, unsigned int count);
+  bool has_room(unsigned int count);
+  bool data_waiting();
+  int file_descriptor();
+
+  constexpr static unsigned int default_capacity = 1048576;
+
+private:
+  void check_length(unsigned int count);
+  bool push_outward(const unsigned char* data, unsigned int count);
+  void take_inward(std::vector<unsigned char>& message);
+  void ring_connection();
+
+  const unsigned int max_message_size_;
+  /* the capacity, in bytes of message data, of each queue (a queue always accepts a
+     message when it is empty, whatever its size) */
+  const unsigned int capacity_;
+  int event_fd_;
+  std::mutex queue_lock_;
+  std::condition_variable outward_room_condvar_;
+  std::condition_variable inward_message_condvar_;
+  std::deque<std::vector<unsigned char>> outward_;
+  std::deque<std::vector<unsigned char>> inward_;
+  unsigned int outward_bytes_;
+  unsigned int inward_bytes_;
+  /* connection_blocked_ records that a write() from the Connection found no room, so the
+     Connection must be woken once the application takes a message */
+  bool connection_blocked_;
+  /* callback_lock_ is held while the callback is called or changed, and by write()
+     throughout, so that messages reach the application in order even while the callback
+     is being set (it is always taken before queue_lock_) */
+  std::mutex callback_lock_;
+  receive_callback callback_;
+};
+
+
+class LocalChannelError: public std::runtime_error{
+public:
+  LocalChannelError(const std::string& what_arg): runtime_error(what_arg){}
+};
+
+#endif
@@ -0,0 +1,40 @@
+#include "Metrics.h"
+
+
+/* ConnectionMetrics::snapshot() reads all of the counters into a
+ * ConnectionMetricsSnapshot. The Connection's queue depth is not a counter,
+ * so it is supplied by the caller, and the fifo capacities, the staged output, the
+ * packet size and the FEC group size are left as 0 for the caller to fill in.
+ */
+ConnectionMetricsSnapshot ConnectionMetrics::snapshot(metric_value_t queue_depth) const
+{
+  ConnectionMetricsSnapshot s;
+  s.packets_in = packets_in.value();
+  s.bytes_in = bytes_in.value();
+  s.packets_out = packets_out.value();
+  s.bytes_out = bytes_out.value();
+  s.auth_failures = auth_failures.value();
+  s.replays_rejected = replays_rejected.value();
+  s.bad_segnums = bad_segnums.value();
+  s.hello_packets_sent = hello_packets_sent.value();
+  s.fifo_short_writes = fifo_short_writes.value();
+  s.fifo_broken_pipes = fifo_broken_pipes.value();
+  s.messages_too_long = messages_too_long.value();
+  s.intake_pauses = intake_pauses.value();
+  s.coalesce_timeouts = coalesce_timeouts.value();
+  s.messages_fragmented = messages_fragmented.value();
+  s.reassembly_failures = reassembly_failures.value();
+  s.compression_bytes_in = compression_bytes_in.value();
+  s.compression_bytes_out = compression_bytes_out.value();
+  s.compression_nanos = compression_nanos.value();
+  s.fec_repairs_sent = fec_repairs_sent.value();
+  s.fec_packets_recovered = fec_packets_recovered.value();
+  s.messages_dropped = messages_dropped.value();
+  s.queue_depth = queue_depth;
+  s.outward_pipe_size = 0;
+  s.inward_pipe_size = 0;
+  s.pending_output = 0;
+  s.max_packet_size = 0;
+  s.fec_group_size = 0;
+  return s;
+}
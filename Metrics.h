@@ -0,0 +1,168 @@
+/* Metrics.h defines the counters which cryptocomms keeps to give visibility into what
+ * a running instance is doing, together with the plain structs used to report their
+ * values.
+ *
+ * The counters are updated on the data path, so they need to be cheap. Each one is a
+ * std::atomic updated with relaxed memory ordering, which on common hardware costs
+ * about the same as an ordinary increment when there is no contention (and there is
+ * little contention, since each Connection is only worked on by one thread at a time).
+ * Relaxed ordering means that a reader may see counters which are slightly out of date
+ * relative to each other, which is fine for monitoring purposes.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "IDTypes.h"
+#include "LatencyHistogram.h"
+
+typedef std::uint_least64_t metric_value_t;
+
+
+/* MetricCounter is a single monotonically increasing counter */
+class MetricCounter
+{
+public:
+  MetricCounter(): value_(0) {}
+  void add(metric_value_t n = 1)
+  { value_.fetch_add(n,std::memory_order_relaxed); }
+  metric_value_t value() const
+  { return value_.load(std::memory_order_relaxed); }
+
+  MetricCounter(const MetricCounter&) = delete;
+  MetricCounter& operator=(const MetricCounter&) = delete;
+
+private:
+  std::atomic<metric_value_t> value_;
+};
+
+
+/* ConnectionMetricsSnapshot holds the values of a Connection's counters at some moment,
+ * together with the length of its incoming message queue at that moment, the
+ * capacities of its fifos, the amount of data it has staged for its "to user" fifo, and
+ * the size of the packets it sends.
+ */
+struct ConnectionMetricsSnapshot
+{
+  metric_value_t packets_in;         // UDP packets passed to the Connection
+  metric_value_t bytes_in;           // total size of those packets
+  metric_value_t packets_out;        // UDP packets sent by the Connection
+  metric_value_t bytes_out;          // total size of those packets
+  metric_value_t auth_failures;      // packets which failed AEAD authentication
+  metric_value_t replays_rejected;   // packets rejected because their message number
+                                     // had already been seen
+  metric_value_t bad_segnums;        // packets rejected because of their segment numbers
+  metric_value_t hello_packets_sent; // "hello" packets sent to the peer
+  metric_value_t fifo_short_writes;  // writes to the "to user" fifo which did not write
+                                     // all the data because the fifo was full
+  metric_value_t fifo_broken_pipes;  // writes to the "to user" fifo which failed because
+                                     // the fifo was not open for reading
+  metric_value_t messages_too_long;  // messages from the user discarded because they
+                                     // were too long for a packet (seqpacket mode only)
+  metric_value_t intake_pauses;      // times the Connection stopped taking received
+                                     // messages off its queue because too much data was
+                                     // staged for the "to user" fifo
+  metric_value_t coalesce_timeouts;  // packets sent part-full because the data from the
+                                     // user had waited for the coalescing window
+  metric_value_t messages_fragmented; // messages from the user sent in fragments
+  metric_value_t reassembly_failures; // fragmented messages from the peer given up on
+                                      // because the rest of their fragments did not
+                                      // arrive in time, or were invalid
+  metric_value_t compression_bytes_in;  // data from the user passed to compression
+  metric_value_t compression_bytes_out; // payloads sent after compression
+  metric_value_t compression_nanos;     // time spent compressing data from the user and
+                                        // decompressing data from the peer
+  metric_value_t fec_repairs_sent;      // FEC repair packets sent to the peer
+  metric_value_t fec_packets_recovered; // lost packets from the peer rebuilt from its
+                                        // FEC repair packets
+  metric_value_t messages_dropped;   // received packets dropped because the incoming
+                                     // message queue was full, or intake was paused
+  metric_value_t queue_depth;        // messages waiting in the incoming message queue
+  metric_value_t outward_pipe_size;  // capacity of the "from user" fifo, in bytes
+  metric_value_t inward_pipe_size;   // capacity of the "to user" fifo, in bytes
+  metric_value_t pending_output;     // bytes staged for the "to user" fifo because it was
+                                     // full
+  metric_value_t max_packet_size;    // largest packet the Connection sends, in bytes, as
+                                     // found by path MTU discovery if it is enabled
+  metric_value_t fec_group_size;     // packets covered by each FEC repair packet, as
+                                     // adapted to the loss rate (0 if FEC is not in use)
+};
+
+
+/* ConnectionMetrics holds the counters kept by a Connection */
+struct ConnectionMetrics
+{
+  MetricCounter packets_in;
+  MetricCounter bytes_in;
+  MetricCounter packets_out;
+  MetricCounter bytes_out;
+  MetricCounter auth_failures;
+  MetricCounter replays_rejected;
+  MetricCounter bad_segnums;
+  MetricCounter hello_packets_sent;
+  MetricCounter fifo_short_writes;
+  MetricCounter fifo_broken_pipes;
+  MetricCounter messages_too_long;
+  MetricCounter intake_pauses;
+  MetricCounter coalesce_timeouts;
+  MetricCounter messages_fragmented;
+  MetricCounter reassembly_failures;
+  MetricCounter compression_bytes_in;
+  MetricCounter compression_bytes_out;
+  MetricCounter compression_nanos;
+  MetricCounter fec_repairs_sent;
+  MetricCounter fec_packets_recovered;
+  MetricCounter messages_dropped;
+
+  ConnectionMetricsSnapshot snapshot(metric_value_t queue_depth) const;
+};
+
+
+/* NamedConnectionMetrics identifies the Connection that a ConnectionMetricsSnapshot
+ * belongs to
+ */
+struct NamedConnectionMetrics
+{
+  std::string peer_name;
+  channel_id_type channel_id;
+  ConnectionMetricsSnapshot metrics;
+};
+
+
+/* NamedHistogram identifies what a HistogramSnapshot measures, such as the name of a
+ * PipelineStage
+ */
+struct NamedHistogram
+{
+  std::string name;
+  HistogramSnapshot histogram;
+};
+
+
+/* SessionMetrics reports the state of a Session and all of its Connections */
+struct SessionMetrics
+{
+  metric_value_t uptime_micros;         // time since the Session was created
+  metric_value_t startup_micros;        // time the Session took to start up
+  metric_value_t startup_connections_micros; // part of startup_micros spent creating the
+                                             // Connections
+  metric_value_t startup_threads;       // threads on which the Connections were created
+  metric_value_t num_connection_workers;
+  metric_value_t worker_busy_micros;    // total time the connection worker threads have
+                                        // spent moving data through Connections
+  metric_value_t worker_runs;           // number of times a connection worker thread has
+                                        // taken a Connection from the queue
+  metric_value_t queue_length;          // Connections waiting for a connection worker
+  metric_value_t connections_active;    // Connections being worked on right now
+  metric_value_t connections_dormant;   // Connections asleep (see Connection::hibernate() )
+  std::vector<NamedConnectionMetrics> connections;
+  std::vector<NamedHistogram> stage_latencies; // latencies (in nanoseconds) of the stages
+                                               // of the packet pipeline, for all Connections
+};
+
+#endif
@@ -0,0 +1,489 @@
+#include "MetricsServer.h"
+
+/* As in the other units which deal directly with sockets and pipes, we use the C POSIX
+ * interface for this functionality.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdexcept>
+
+namespace
+{
+  /* how long (in milliseconds) we wait for a client to send its request, or to accept
+     more of the reply, before giving up on it */
+  constexpr int client_timeout = 1000;
+
+  /* the longest request line we accept */
+  constexpr unsigned int max_request_len = 1024;
+
+
+  /* ConnectionMetricInfo describes one field of ConnectionMetricsSnapshot, for use in
+     formatting */
+  struct ConnectionMetricInfo
+  {
+    const char* name;
+    bool is_counter; // false means the field is a gauge
+    const char* help;
+    metric_value_t ConnectionMetricsSnapshot::* field;
+  };
+
+  const ConnectionMetricInfo connection_metric_info[] = {
+    {"packets_in", true, "UDP packets received for the channel",
+     &ConnectionMetricsSnapshot::packets_in},
+    {"bytes_in", true, "Bytes in UDP packets received for the channel",
+     &ConnectionMetricsSnapshot::bytes_in},
+    {"packets_out", true, "UDP packets sent for the channel",
+     &ConnectionMetricsSnapshot::packets_out},
+    {"bytes_out", true, "Bytes in UDP packets sent for the channel",
+     &ConnectionMetricsSnapshot::bytes_out},
+    {"auth_failures", true, "Packets which failed authentication",
+     &ConnectionMetricsSnapshot::auth_failures},
+    {"replays_rejected", true, "Packets rejected as replays of earlier message numbers",
+     &ConnectionMetricsSnapshot::replays_rejected},
+    {"bad_segnums", true, "Packets rejected because of their segment numbers",
+     &ConnectionMetricsSnapshot::bad_segnums},
+    {"hello_packets_sent", true, "Hello packets sent to the peer",
+     &ConnectionMetricsSnapshot::hello_packets_sent},
+    {"fifo_short_writes", true, "Writes to the inward FIFO cut short because it was full",
+     &ConnectionMetricsSnapshot::fifo_short_writes},
+    {"fifo_broken_pipes", true, "Writes to the inward FIFO which found no reader",
+     &ConnectionMetricsSnapshot::fifo_broken_pipes},
+    {"messages_too_long", true, "Messages from the user too long to send in one packet",
+     &ConnectionMetricsSnapshot::messages_too_long},
+    {"intake_pauses", true, "Times received packets were held back by a full inward FIFO",
+     &ConnectionMetricsSnapshot::intake_pauses},
+    {"coalesce_timeouts", true, "Packets sent part-full when the coalescing window ran out",
+     &ConnectionMetricsSnapshot::coalesce_timeouts},
+    {"messages_fragmented", true, "Messages from the user sent in fragments",
+     &ConnectionMetricsSnapshot::messages_fragmented},
+    {"reassembly_failures", true, "Fragmented messages from the peer which could not be reassembled",
+     &ConnectionMetricsSnapshot::reassembly_failures},
+    {"compression_in_bytes", true, "Bytes of data from the user passed to compression",
+     &ConnectionMetricsSnapshot::compression_bytes_in},
+    {"compression_out_bytes", true, "Bytes of packet payloads sent after compression",
+     &ConnectionMetricsSnapshot::compression_bytes_out},
+    {"compression_nanos", true, "Nanoseconds spent compressing and decompressing",
+     &ConnectionMetricsSnapshot::compression_nanos},
+    {"fec_repairs_sent", true, "FEC repair packets sent to the peer",
+     &ConnectionMetricsSnapshot::fec_repairs_sent},
+    {"fec_packets_recovered", true, "Lost packets from the peer rebuilt from FEC repair packets",
+     &ConnectionMetricsSnapshot::fec_packets_recovered},
+    {"messages_dropped", true, "Received packets dropped because the queue was full or intake was paused",
+     &ConnectionMetricsSnapshot::messages_dropped},
+    {"queue_depth", false, "Received packets waiting to be processed",
+     &ConnectionMetricsSnapshot::queue_depth},
+    {"outward_pipe_size_bytes", false, "Capacity of the outward FIFO",
+     &ConnectionMetricsSnapshot::outward_pipe_size},
+    {"inward_pipe_size_bytes", false, "Capacity of the inward FIFO",
+     &ConnectionMetricsSnapshot::inward_pipe_size},
+    {"pending_output_bytes", false, "Received data staged for the inward FIFO",
+     &ConnectionMetricsSnapshot::pending_output},
+    {"max_packet_size_bytes", false, "Largest packet sent, as found by path MTU discovery if enabled",
+     &ConnectionMetricsSnapshot::max_packet_size},
+    {"fec_group_size", false, "Packets covered by each FEC repair packet",
+     &ConnectionMetricsSnapshot::fec_group_size}
+  };
+
+
+  /* channel_id_hex() gives the hexadecimal representation of a channel id, as used in
+     the configuration file */
+  std::string channel_id_hex(const channel_id_type& channel_id)
+  {
+    const char hex_digits[] = "0123456789abcdef";
+    std::string hex;
+    for(unsigned char c : channel_id){
+      hex += hex_digits[c >> 4];
+      hex += hex_digits[c & 0x0f];
+    }
+    return hex;
+  }
+
+
+  /* escape_string() escapes the characters in str which need escaping in a Prometheus
+     label value (backslash, double quote and newline). These are also the characters
+     (along with other control characters, which cannot occur in peer names) which need
+     escaping in a JSON string. */
+  std::string escape_string(const std::string& str)
+  {
+    std::string escaped;
+    for(char c : str){
+      if( (c == '\\') or (c == '"') ){
+        escaped += '\\';
+        escaped += c;
+      }
+      else if(c == '\n'){
+        escaped += "\\n";
+      }
+      else{
+        escaped += c;
+      }
+    }
+    return escaped;
+  }
+
+
+  /* micros_to_seconds() formats a number of microseconds as a decimal number of seconds */
+  std::string micros_to_seconds(metric_value_t micros)
+  {
+    std::string fraction = std::to_string(micros % 1000000);
+    return std::to_string(micros / 1000000)+"."+std::string(6-fraction.size(),'0')+fraction;
+  }
+
+
+  /* nanos_to_seconds() formats a number of nanoseconds as a decimal number of seconds */
+  std::string nanos_to_seconds(metric_value_t nanos)
+  {
+    std::string fraction = std::to_string(nanos % 1000000000);
+    return std::to_string(nanos / 1000000000)+"."+std::string(9-fraction.size(),'0')+fraction;
+  }
+
+
+  /* the quantiles of the stage latencies which are reported, with their names */
+  struct QuantileInfo
+  {
+    double q;
+    const char* name;
+  };
+
+  const QuantileInfo latency_quantiles[] = {
+    {0.5, "0.5"}, {0.9, "0.9"}, {0.99, "0.99"}, {0.999, "0.999"}, {1.0, "1"}
+  };
+
+
+  /* prometheus_header() gives the HELP and TYPE lines for a metric */
+  std::string prometheus_header(const std::string& name, const std::string& help,
+                                bool is_counter)
+  {
+    return "# HELP "+name+" "+help+"\n# TYPE "+name+(is_counter ? " counter\n" : " gauge\n");
+  }
+
+
+  /* write_all() writes all of data to the (non-blocking) socket fd, giving up if the
+     client does not accept data for client_timeout milliseconds */
+  void write_all(int fd, const std::string& data)
+  {
+    std::string::size_type total_written = 0;
+    while(total_written < data.size()){
+      ssize_t ret = send(fd,data.data()+total_written,data.size()-total_written,MSG_NOSIGNAL);
+      if(ret == -1){
+        if(errno == EINTR){
+          continue;
+        }
+        if(errno == EAGAIN){
+          pollfd pfd{fd,POLLOUT,0};
+          if(poll(&pfd,1,client_timeout) <= 0){
+            return;
+          }
+          continue;
+        }
+        return; // the client has gone away, there is nothing more to do
+      }
+      total_written += ret;
+    }
+  }
+
+}
+
+
+/* format_metrics_prometheus() formats the metrics in sm in the Prometheus text exposition
+ * format. Per-Connection metrics are labelled with the peer's name and the channel id.
+ */
+std::string format_metrics_prometheus(const SessionMetrics& sm)
+{
+  std::string out;
+
+  out += prometheus_header("cryptocomms_uptime_seconds","Time since the session started",false);
+  out += "cryptocomms_uptime_seconds "+micros_to_seconds(sm.uptime_micros)+"\n";
+  out += prometheus_header("cryptocomms_startup_seconds",
+                           "Time the session took to start up",false);
+  out += "cryptocomms_startup_seconds "+micros_to_seconds(sm.startup_micros)+"\n";
+  out += prometheus_header("cryptocomms_startup_connections_seconds",
+                           "Part of the startup time spent creating the channels",false);
+  out += "cryptocomms_startup_connections_seconds "+
+    micros_to_seconds(sm.startup_connections_micros)+"\n";
+  out += prometheus_header("cryptocomms_startup_threads",
+                           "Number of threads on which the channels were created",false);
+  out += "cryptocomms_startup_threads "+std::to_string(sm.startup_threads)+"\n";
+  out += prometheus_header("cryptocomms_connection_workers",
+                           "Number of connection worker threads",false);
+  out += "cryptocomms_connection_workers "+std::to_string(sm.num_connection_workers)+"\n";
+  out += prometheus_header("cryptocomms_worker_busy_seconds_total",
+                           "Time connection worker threads have spent moving data",true);
+  out += "cryptocomms_worker_busy_seconds_total "+micros_to_seconds(sm.worker_busy_micros)+"\n";
+  out += prometheus_header("cryptocomms_worker_runs_total",
+                           "Times a connection worker thread has taken a channel to work on",true);
+  out += "cryptocomms_worker_runs_total "+std::to_string(sm.worker_runs)+"\n";
+  out += prometheus_header("cryptocomms_scheduler_queue_length",
+                           "Channels waiting for a connection worker thread",false);
+  out += "cryptocomms_scheduler_queue_length "+std::to_string(sm.queue_length)+"\n";
+  out += prometheus_header("cryptocomms_connections_active",
+                           "Channels being worked on by a connection worker thread",false);
+  out += "cryptocomms_connections_active "+std::to_string(sm.connections_active)+"\n";
+  out += prometheus_header("cryptocomms_connections_dormant",
+                           "Channels asleep, without their cipher contexts and buffers",false);
+  out += "cryptocomms_connections_dormant "+std::to_string(sm.connections_dormant)+"\n";
+
+  for(const ConnectionMetricInfo& info : connection_metric_info){
+    std::string name = std::string("cryptocomms_connection_")+info.name+
+      (info.is_counter ? "_total" : "");
+    out += prometheus_header(name,info.help,info.is_counter);
+    for(const NamedConnectionMetrics& ncm : sm.connections){
+      out += name+"{peer=\""+escape_string(ncm.peer_name)+"\",channel=\""+
+        channel_id_hex(ncm.channel_id)+"\"} "+std::to_string(ncm.metrics.*(info.field))+"\n";
+    }
+  }
+
+  /* the stage latencies are reported as a summary, with quantile 1 being the maximum
+     (all to within the 12.5% resolution of LatencyHistogram) */
+  std::string name = "cryptocomms_stage_latency_seconds";
+  out += "# HELP "+name+" Time taken by each stage of the packet pipeline\n";
+  out += "# TYPE "+name+" summary\n";
+  for(const NamedHistogram& nh : sm.stage_latencies){
+    std::string stage_label = "stage=\""+escape_string(nh.name)+"\"";
+    for(const QuantileInfo& qi : latency_quantiles){
+      out += name+"{"+stage_label+",quantile=\""+qi.name+"\"} "+
+        nanos_to_seconds(nh.histogram.quantile(qi.q))+"\n";
+    }
+    out += name+"_sum{"+stage_label+"} "+nanos_to_seconds(nh.histogram.sum)+"\n";
+    out += name+"_count{"+stage_label+"} "+std::to_string(nh.histogram.count)+"\n";
+  }
+
+  return out;
+}
+
+
+/* format_metrics_json() formats the metrics in sm as a JSON object. Times are given as
+ * whole numbers of microseconds, except for the stage latencies, which are in
+ * nanoseconds. For each stage, the non-empty buckets of the histogram are listed as
+ * pairs [upper bound, count].
+ */
+std::string format_metrics_json(const SessionMetrics& sm)
+{
+  std::string out = "{";
+  out += "\"uptime_micros\":"+std::to_string(sm.uptime_micros);
+  out += ",\"startup_micros\":"+std::to_string(sm.startup_micros);
+  out += ",\"startup_connections_micros\":"+std::to_string(sm.startup_connections_micros);
+  out += ",\"startup_threads\":"+std::to_string(sm.startup_threads);
+  out += ",\"num_connection_workers\":"+std::to_string(sm.num_connection_workers);
+  out += ",\"worker_busy_micros\":"+std::to_string(sm.worker_busy_micros);
+  out += ",\"worker_runs\":"+std::to_string(sm.worker_runs);
+  out += ",\"queue_length\":"+std::to_string(sm.queue_length);
+  out += ",\"connections_active\":"+std::to_string(sm.connections_active);
+  out += ",\"connections_dormant\":"+std::to_string(sm.connections_dormant);
+  out += ",\"connections\":[";
+  for(unsigned int i=0; i<sm.connections.size(); i++){
+    const NamedConnectionMetrics& ncm = sm.connections[i];
+    out += (i == 0) ? "{" : ",{";
+    out += "\"peer\":\""+escape_string(ncm.peer_name)+"\"";
+    out += ",\"channel\":\""+channel_id_hex(ncm.channel_id)+"\"";
+    for(const ConnectionMetricInfo& info : connection_metric_info){
+      out += std::string(",\"")+info.name+"\":"+std::to_string(ncm.metrics.*(info.field));
+    }
+    out += "}";
+  }
+  out += "],\"stage_latencies\":{";
+  for(unsigned int i=0; i<sm.stage_latencies.size(); i++){
+    const NamedHistogram& nh = sm.stage_latencies[i];
+    out += (i == 0) ? "\"" : ",\"";
+    out += escape_string(nh.name)+"\":{\"count\":"+std::to_string(nh.histogram.count);
+    out += ",\"sum_nanos\":"+std::to_string(nh.histogram.sum);
+    out += ",\"p50_nanos\":"+std::to_string(nh.histogram.quantile(0.5));
+    out += ",\"p90_nanos\":"+std::to_string(nh.histogram.quantile(0.9));
+    out += ",\"p99_nanos\":"+std::to_string(nh.histogram.quantile(0.99));
+    out += ",\"p999_nanos\":"+std::to_string(nh.histogram.quantile(0.999));
+    out += ",\"max_nanos\":"+std::to_string(nh.histogram.quantile(1.0));
+    out += ",\"buckets\":[";
+    bool first_bucket = true;
+    for(unsigned int j=0; j<nh.histogram.counts.size(); j++){
+      if(nh.histogram.counts[j] == 0){
+        continue;
+      }
+      out += first_bucket ? "[" : ",[";
+      out += std::to_string(HistogramSnapshot::bucket_upper_bound(j))+","+
+        std::to_string(nh.histogram.counts[j])+"]";
+      first_bucket = false;
+    }
+    out += "]}";
+  }
+  out += "}}\n";
+  return out;
+}
+
+
+/* MetricsServer::MetricsServer() creates and listens on a Unix-domain stream socket at
+ * socket_path, and starts the thread which serves requests. If there is already a socket
+ * at socket_path (left over from a previous run, say), it is replaced, but any other kind
+ * of file there is an error.
+ */
+MetricsServer::MetricsServer(const std::string& socket_path,
+                             const std::function<SessionMetrics()>& metrics_source):
+  socket_path_(socket_path),
+  metrics_source_(metrics_source)
+{
+  sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(socket_path_.size() >= sizeof(addr.sun_path)){
+    throw std::runtime_error("MetricsServer: socket path too long: "+socket_path_);
+  }
+  strcpy(addr.sun_path,socket_path_.c_str());
+
+  struct stat stat_info;
+  if(lstat(socket_path_.c_str(),&stat_info) == 0){
+    if(not S_ISSOCK(stat_info.st_mode)){
+      throw std::runtime_error("MetricsServer: "+socket_path_+" exists and is not a socket");
+    }
+    unlink(socket_path_.c_str());
+  }
+
+  listen_fd_ = socket(AF_UNIX,SOCK_STREAM,0);
+  if(listen_fd_ == -1){
+    throw std::runtime_error("MetricsServer: could not create socket");
+  }
+  if(bind(listen_fd_,(sockaddr*)&addr,sizeof(addr)) == -1){
+    close(listen_fd_);
+    throw std::runtime_error("MetricsServer: could not bind socket at "+socket_path_);
+  }
+  if(listen(listen_fd_,8) == -1){
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+    throw std::runtime_error("MetricsServer: could not listen on socket at "+socket_path_);
+  }
+
+  /* the pipe used to tell the server thread to exit */
+  int pipe_fds[2];
+  if(pipe(pipe_fds) == -1){
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+    throw std::runtime_error("MetricsServer: could not create internal pipe");
+  }
+  stop_read_fd_ = pipe_fds[0];
+  stop_write_fd_ = pipe_fds[1];
+
+  server_thread_ = std::thread(&MetricsServer::server_thread_func,this);
+}
+
+
+MetricsServer::~MetricsServer()
+{
+  /* wake the server thread and wait for it to exit */
+  char data = 1;
+  while( (write(stop_write_fd_,&data,1) == -1) and (errno == EINTR) ){}
+  server_thread_.join();
+
+  close(stop_read_fd_);
+  close(stop_write_fd_);
+  close(listen_fd_);
+  unlink(socket_path_.c_str());
+}
+
+
+/* MetricsServer::server_thread_func() is the function run by the server thread, which
+ * waits for clients and serves them one at a time until told to exit.
+ */
+void MetricsServer::server_thread_func()
+{
+  pollfd poll_fds[2];
+  poll_fds[0].fd = listen_fd_;
+  poll_fds[0].events = POLLIN;
+  poll_fds[1].fd = stop_read_fd_;
+  poll_fds[1].events = POLLIN;
+
+  while(true){
+    int ret = poll(poll_fds,2,-1);
+    if(ret == -1){
+      if( (errno == EINTR) or (errno == EAGAIN) ){
+        continue;
+      }
+      throw std::runtime_error("MetricsServer: poll() reported an error");
+    }
+
+    if(poll_fds[1].revents & POLLIN){
+      return;
+    }
+
+    if(poll_fds[0].revents & POLLIN){
+      int client_fd = accept(listen_fd_,nullptr,nullptr);
+      if(client_fd == -1){
+        continue; // the client may have given up already, which is no concern of ours
+      }
+      fcntl(client_fd,F_SETFL,O_NONBLOCK);
+      serve_client(client_fd);
+      close(client_fd);
+    }
+  }
+}
+
+
+/* MetricsServer::serve_client() reads the request line from a client, and replies with
+ * the metrics in the format requested (see the comment at the top of MetricsServer.h).
+ * Clients which do not send a complete request line within client_timeout milliseconds
+ * (or which close their end of the connection without finishing the line) are treated
+ * as having sent an empty line.
+ */
+void MetricsServer::serve_client(int client_fd)
+{
+  std::string request;
+  while(request.find('\n') == std::string::npos){
+    pollfd pfd{client_fd,POLLIN,0};
+    int ret = poll(&pfd,1,client_timeout);
+    if( (ret == -1) and (errno == EINTR) ){
+      continue;
+    }
+    if(ret <= 0){
+      break;
+    }
+
+    char buff[256];
+    ssize_t num_read = read(client_fd,buff,sizeof(buff));
+    if( (num_read == -1) and ( (errno == EINTR) or (errno == EAGAIN) ) ){
+      continue;
+    }
+    if(num_read <= 0){
+      break;
+    }
+    request.append(buff,num_read);
+    if(request.size() > max_request_len){
+      return;
+    }
+  }
+  request = request.substr(0,request.find('\n'));
+  if( (not request.empty()) and (request.back() == '\r') ){
+    request.pop_back();
+  }
+
+  bool http = (request.compare(0,4,"GET ") == 0);
+  bool json;
+  if(http){
+    std::string path = request.substr(4,request.find(' ',4)-4);
+    json = ( (path.size() >= 5) and (path.compare(path.size()-5,5,".json") == 0) ) or
+      (path.find("format=json") != std::string::npos);
+  }
+  else{
+    json = (request == "json");
+    if( (not json) and (not request.empty()) and (request != "prometheus") ){
+      write_all(client_fd,"error: unknown format \""+request+"\"\n");
+      return;
+    }
+  }
+
+  SessionMetrics sm = metrics_source_();
+  std::string body = json ? format_metrics_json(sm) : format_metrics_prometheus(sm);
+
+  if(http){
+    std::string content_type = json ? "application/json" : "text/plain; version=0.0.4";
+    write_all(client_fd,"HTTP/1.0 200 OK\r\nContent-Type: "+content_type+
+              "\r\nContent-Length: "+std::to_string(body.size())+"\r\n\r\n"+body);
+  }
+  else{
+    write_all(client_fd,body);
+  }
+}
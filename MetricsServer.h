@@ -0,0 +1,57 @@
+/* MetricsServer exposes the metrics of a running Session over a Unix-domain stream
+ * socket, so that they can be collected by a monitoring agent.
+ *
+ * A client connects to the socket and sends one line saying which format it wants,
+ * and the server replies with a snapshot of all the metrics in that format and closes
+ * the connection. The line "json" gets JSON, while "prometheus" (or an empty line)
+ * gets the Prometheus text exposition format. For the convenience of HTTP clients such
+ * as "curl --unix-socket", a request line of the form "GET <path> HTTP/1.x" is also
+ * accepted: the reply is then an HTTP response, holding JSON if <path> ends in ".json"
+ * or contains "format=json", and Prometheus text otherwise.
+ *
+ * The metrics are obtained by calling a function supplied to the constructor (usually
+ * one which calls Session::metrics() ), on the MetricsServer's own thread. The
+ * functions format_metrics_prometheus() and format_metrics_json() which produce the
+ * two formats are also available for use on their own.
+ */
+
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <string>
+#include <thread>
+#include <functional>
+
+#include "Metrics.h"
+
+std::string format_metrics_prometheus(const SessionMetrics& sm);
+std::string format_metrics_json(const SessionMetrics& sm);
+
+class MetricsServer
+{
+public:
+  MetricsServer(const std::string& socket_path,
+                const std::function<SessionMetrics()>& metrics_source);
+  ~MetricsServer();
+
+  /* a MetricsServer owns a thread which refers to it, so it can be neither copied
+   * nor moved
+   */
+  MetricsServer(const MetricsServer&) = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+  MetricsServer(MetricsServer&&) = delete;
+  MetricsServer& operator=(MetricsServer&&) = delete;
+
+private:
+  std::string socket_path_;
+  std::function<SessionMetrics()> metrics_source_;
+  int listen_fd_;
+  int stop_read_fd_;
+  int stop_write_fd_;
+  std::thread server_thread_;
+
+  void server_thread_func();
+  void serve_client(int client_fd);
+};
+
+#endif
@@ -0,0 +1,278 @@
+#include "PathProber.h"
+
+#include <algorithm>
+#include <string>
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+/* the reserved channel id of the probe Connection, which no ordinary channel to a peer
+ * with path MTU discovery enabled may use
+ */
+const channel_id_type PathProber::probe_channel_id{0xff,0xfe};
+
+
+/* PathProber::PathProber() takes the largest payload of a packet to the peer which is
+ * assumed to get through (from the configured maximum packet size), the largest payload
+ * to probe for, how long to wait for a probe to be acknowledged, and how often to confirm
+ * the size in use once the search is done
+ */
+PathProber::PathProber(unsigned int base_payload, unsigned int max_payload,
+                       unsigned int probe_timeout_millis,
+                       unsigned int confirm_interval_millis):
+  base_payload_(base_payload),
+  max_payload_(max_payload),
+  probe_timeout_nanos_(static_cast<nanos_t>(probe_timeout_millis)*1000000),
+  confirm_interval_nanos_(static_cast<nanos_t>(confirm_interval_millis)*1000000),
+  event_fd_(eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)),
+  payload_(base_payload),
+  search_high_(max_payload),
+  probe_size_(0),
+  probe_count_(0),
+  probe_outstanding_(false),
+  probe_num_(0),
+  probe_sent_at_(0),
+  next_probe_at_(0),
+  search_done_at_(0)
+{
+  if(max_payload_ <= base_payload_){
+    throw PathProberError("PathProber: the largest size to probe for must be larger than "
+                          "the maximum packet size");
+  }
+  if( (base_payload_ < ack_len) or (max_payload_ > 0xffff) ){
+    throw PathProberError("PathProber: packet sizes out of range");
+  }
+  if(event_fd_ == -1){
+    throw PathProberError("PathProber: could not create eventfd");
+  }
+  choose_probe(monotonic_nanos());
+}
+
+
+PathProber::~PathProber()
+{
+  close(event_fd_);
+}
+
+
+/* PathProber::max_payload() gives the largest payload which is known to get through to
+ * the peer
+ */
+unsigned int PathProber::max_payload()
+{ return payload_.load(std::memory_order_relaxed); }
+
+
+/* PathProber::read_into() puts the next packet payload for the probe Connection to send
+ * into dest, starting at position offset, and returns its length. This is an
+ * acknowledgement if there is one waiting, or else a probe if one is due, or else
+ * nothing. count must be at least the largest payload to probe for. As with
+ * Bundler::read_into(), the second element of the return value is always false.
+ */
+std::pair<unsigned int,bool> PathProber::read_into(std::vector<unsigned char>& dest,
+                                                   std::vector<unsigned char>::size_type offset,
+                                                   unsigned int count)
+{
+  if(dest.size() < offset+count){
+    throw PathProberError("PathProber: no room in buffer for read");
+  }
+
+  const std::lock_guard<std::mutex> state_lock_guard(state_lock_);
+  nanos_t now = monotonic_nanos();
+  update(now);
+
+  if(not acks_.empty()){
+    unsigned int length = acks_.front().size();
+    std::copy(acks_.front().begin(),acks_.front().end(),dest.begin()+offset);
+    acks_.pop_front();
+    return {length,false};
+  }
+
+  if(not probe_ready(now)){
+    return {0,false};
+  }
+  if(probe_size_ > count){
+    throw PathProberError("PathProber: no room in buffer for probe");
+  }
+  probe_num_++;
+  dest[offset] = probe_type;
+  for(unsigned int i=0; i<4; i++){
+    dest[offset+1+i] = (probe_num_ >> (8*i)) & 0xff;
+  }
+  std::fill(dest.begin()+offset+probe_header_len,dest.begin()+offset+probe_size_,0);
+  probe_outstanding_ = true;
+  probe_sent_at_ = now;
+  return {probe_size_,false};
+}
+
+
+/* PathProber::write() handles the payload of a packet of count bytes received by the
+ * probe Connection. A probe is acknowledged, and an acknowledgement of one of the
+ * probes of the size being tried means that the size gets through. Anything else is
+ * ignored. The return value is as for SeqPacketEndpoint::write(), and is always
+ * {count,false}.
+ */
+std::pair<unsigned int,bool> PathProber::write(const unsigned char* data, unsigned int count)
+{
+  if( (count >= probe_header_len) and (data[0] == probe_type) ){
+    std::array<unsigned char,ack_len> ack;
+    ack[0] = ack_type;
+    std::copy(data+1,data+probe_header_len,ack.begin()+1);
+    ack[probe_header_len] = count & 0xff;
+    ack[probe_header_len+1] = (count >> 8) & 0xff;
+    {
+      const std::lock_guard<std::mutex> state_lock_guard(state_lock_);
+      acks_.push_back(ack);
+    }
+    ring();
+  }
+  else if( (count == ack_len) and (data[0] == ack_type) ){
+    std::uint_least32_t num = 0;
+    for(unsigned int i=0; i<4; i++){
+      num |= static_cast<std::uint_least32_t>(data[1+i]) << (8*i);
+    }
+    unsigned int length = data[probe_header_len] | (data[probe_header_len+1] << 8);
+    const std::lock_guard<std::mutex> state_lock_guard(state_lock_);
+    /* the acknowledgement must be for one of the probes sent of the size being tried */
+    if( (probe_size_ != 0) and (length == probe_size_) and
+        (((probe_num_-num) & 0xffffffff) <= probe_count_) ){
+      probe_acked(monotonic_nanos());
+    }
+  }
+  return {count,false};
+}
+
+
+/* PathProber::data_waiting() reports whether there is an acknowledgement or a probe to
+ * send. It clears the eventfd first, so that the probe Connection is only woken again for
+ * acknowledgements queued after this check.
+ */
+bool PathProber::data_waiting()
+{
+  uint64_t discard;
+  while( (read(event_fd_,&discard,sizeof(discard)) == -1) and (errno == EINTR) ){}
+  const std::lock_guard<std::mutex> state_lock_guard(state_lock_);
+  nanos_t now = monotonic_nanos();
+  update(now);
+  return (not acks_.empty()) or probe_ready(now);
+}
+
+
+/* PathProber::file_descriptor() gives the eventfd which wakes the probe Connection */
+int PathProber::file_descriptor()
+{ return event_fd_; }
+
+
+/* PathProber::flush_due() returns the time (from monotonic_nanos() ) at which the probe
+ * Connection next has something to do: send a probe, or give up waiting for the
+ * acknowledgement of one
+ */
+nanos_t PathProber::flush_due()
+{
+  const std::lock_guard<std::mutex> state_lock_guard(state_lock_);
+  return probe_outstanding_ ? probe_sent_at_+probe_timeout_nanos_ : next_probe_at_;
+}
+
+
+/* PathProber::update() brings the state of the search up to time now, by dealing with a
+ * probe which has not been acknowledged in time, and with the timers which start a
+ * confirmation probe or a new search. state_lock_ must be held.
+ */
+void PathProber::update(nanos_t now)
+{
+  if(probe_outstanding_ and (now >= probe_sent_at_+probe_timeout_nanos_)){
+    probe_outstanding_ = false;
+    probe_count_++;
+    if(probe_count_ >= max_probes){
+      probe_failed(now);
+    }
+    else{
+      next_probe_at_ = now;
+    }
+  }
+
+  if( (probe_size_ == 0) and (now >= next_probe_at_) ){
+    if(now >= search_done_at_+raise_interval){
+      /* search again, in case larger packets now get through */
+      search_high_ = max_payload_;
+      search_done_at_ = 0;
+      choose_probe(now);
+    }
+    else if(payload_ > base_payload_){
+      /* confirm that the size in use still gets through */
+      probe_size_ = payload_;
+      probe_count_ = 0;
+      next_probe_at_ = now;
+    }
+    else{
+      next_probe_at_ = now+confirm_interval_nanos_;
+    }
+  }
+}
+
+
+/* PathProber::probe_acked() records that a probe of the size being tried got through.
+ * state_lock_ must be held.
+ */
+void PathProber::probe_acked(nanos_t now)
+{
+  if(probe_size_ > payload_){
+    payload_ = probe_size_;
+  }
+  choose_probe(now);
+}
+
+
+/* PathProber::probe_failed() records that max_probes probes of the size being tried were
+ * not acknowledged. If that was the size in use, the path no longer carries packets of
+ * that size, so we go back to the configured size and search again. state_lock_ must be
+ * held.
+ */
+void PathProber::probe_failed(nanos_t now)
+{
+  if(probe_size_ <= payload_){
+    payload_ = base_payload_;
+    search_done_at_ = 0;
+  }
+  search_high_ = probe_size_-1;
+  choose_probe(now);
+}
+
+
+/* PathProber::choose_probe() sets the size of the next probes in the binary search, or
+ * ends the search if it is done. state_lock_ must be held.
+ */
+void PathProber::choose_probe(nanos_t now)
+{
+  probe_count_ = 0;
+  probe_outstanding_ = false;
+  unsigned int payload = payload_;
+  if(search_high_ >= payload+search_granularity){
+    probe_size_ = payload+(search_high_-payload+1)/2;
+    next_probe_at_ = now;
+  }
+  else{
+    probe_size_ = 0;
+    if(search_done_at_ == 0){
+      search_done_at_ = now;
+    }
+    next_probe_at_ = now+confirm_interval_nanos_;
+  }
+}
+
+
+/* PathProber::probe_ready() reports whether a probe should be sent at time now.
+ * state_lock_ must be held.
+ */
+bool PathProber::probe_ready(nanos_t now)
+{ return (probe_size_ != 0) and (not probe_outstanding_) and (now >= next_probe_at_); }
+
+
+/* PathProber::ring() makes file_descriptor() readable, to wake the probe Connection */
+void PathProber::ring()
+{
+  uint64_t one = 1;
+  while( (::write(event_fd_,&one,sizeof(one)) == -1) and (errno == EINTR) ){}
+}
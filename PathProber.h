@@ -0,0 +1,129 @@
+/* A PathProber finds out how large the packets sent to one peer can be. The network path
+ * to a peer can carry packets up to some size (the path MTU), and that size is not known
+ * in advance: packets which are too small waste bandwidth on headers and encryption work
+ * on AEAD calls, while packets which are too large are fragmented, or silently dropped.
+ * For a peer with path MTU discovery enabled (see "probe_max_size" in the user manual),
+ * the Session creates a PathProber which starts from the configured maximum packet size,
+ * which is assumed to get through, and probes for larger sizes up to probe_max_size.
+ *
+ * The probing follows the packetization layer path MTU discovery of RFC 8899, in a
+ * simplified form. Probes are encrypted packets of the size being tried, which the peer's
+ * PathProber acknowledges in small packets of its own, so that a size is only used once a
+ * probe of that size is known to have got through, whatever the network does with ICMP
+ * messages. Sizes are tried in a binary search, and a size is given up on once max_probes
+ * probes of that size have gone unacknowledged for the probe timeout. Once the search is
+ * done, the size in use is confirmed by a probe every confirm interval, and if that fails
+ * (the path has changed to one with a smaller path MTU) the size in use falls back to the
+ * configured maximum packet size, and the search starts again. The search is also
+ * repeated every raise_interval, in case the path MTU has grown.
+ *
+ * The probes and acknowledgements travel on an extra Connection for the peer, on the
+ * reserved channel probe_channel_id in mode ChannelMode::probe, which uses the PathProber
+ * in the same way as a SeqPacketEndpoint (see Connection::read_from_user() etc.). Its
+ * packets are sent via a UDPSocket for which set_mtu_probing() has been called, so they
+ * are never fragmented. The peer's channels in fifo mode read the size in use from
+ * max_payload() each time they send data; channels in the other modes keep to the
+ * configured size, as that sets how long a message from the user may be. All of the
+ * methods are thread safe.
+ *
+ * The first byte of the payload of each packet is its type. A probe is the type
+ * (probe_type), a 4 byte probe number, and padding. An acknowledgement is the type
+ * (ack_type), the probe number, and the length of the probe's payload (2 bytes). The
+ * numbers use the little-endian convention.
+ */
+
+#ifndef PATHPROBER_H
+#define PATHPROBER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "IDTypes.h"
+#include "LatencyHistogram.h"
+
+class PathProber
+{
+public:
+  PathProber(unsigned int base_payload, unsigned int max_payload,
+             unsigned int probe_timeout_millis = default_probe_timeout_millis,
+             unsigned int confirm_interval_millis = default_confirm_interval_millis);
+  ~PathProber();
+
+  /* We do not allow copying of a PathProber, as it owns the eventfd */
+  PathProber(const PathProber& other) = delete;
+  PathProber& operator=(const PathProber& other) = delete;
+
+  /* used by the Connections of the peer's channels */
+  unsigned int max_payload();
+
+  /* used by the probe Connection */
+  std::pair<unsigned int,bool> read_into(std::vector<unsigned char>& dest,
+                                         std::vector<unsigned char>::size_type offset,
+                                         unsigned int count);
+  std::pair<unsigned int,bool> write(const unsigned char* data, unsigned int count);
+  bool data_waiting();
+  int file_descriptor();
+  nanos_t flush_due();
+
+  constexpr static unsigned char probe_type = 1;
+  constexpr static unsigned char ack_type = 2;
+  constexpr static unsigned int probe_header_len = 5;
+  constexpr static unsigned int ack_len = 7;
+  constexpr static unsigned int max_probes = 3;
+  /* the search is done once the largest size not known to fail is within this many bytes
+     of the size in use */
+  constexpr static unsigned int search_granularity = 16;
+  constexpr static unsigned int default_probe_timeout_millis = 1000;
+  constexpr static unsigned int default_confirm_interval_millis = 60000;
+  constexpr static nanos_t raise_interval = 600000000000; // 10 minutes
+  static const channel_id_type probe_channel_id;
+
+private:
+  void update(nanos_t now);
+  void probe_acked(nanos_t now);
+  void probe_failed(nanos_t now);
+  void choose_probe(nanos_t now);
+  bool probe_ready(nanos_t now);
+  void ring();
+
+  const unsigned int base_payload_;
+  const unsigned int max_payload_;
+  const nanos_t probe_timeout_nanos_;
+  const nanos_t confirm_interval_nanos_;
+  int event_fd_;
+  /* payload_ is the largest payload known to get through, which is read by the peer's
+     Connections without taking state_lock_ */
+  std::atomic<unsigned int> payload_;
+  std::mutex state_lock_;
+  /* the state of the search, guarded by state_lock_. search_high_ is the largest payload
+     not known to fail, probe_size_ is the payload of the probes being sent (0 if there is
+     no probing going on), probe_count_ is how many have been sent unacknowledged, and
+     probe_outstanding_ records that the latest of them (number probe_num_, sent at
+     probe_sent_at_) is waiting for its acknowledgement. Otherwise, the next probe is
+     due at next_probe_at_. search_done_at_ is when the search was last completed, or 0
+     if it is under way. */
+  unsigned int search_high_;
+  unsigned int probe_size_;
+  unsigned int probe_count_;
+  bool probe_outstanding_;
+  std::uint_least32_t probe_num_;
+  nanos_t probe_sent_at_;
+  nanos_t next_probe_at_;
+  nanos_t search_done_at_;
+  /* acks_ holds the acknowledgements waiting to be sent to the peer */
+  std::deque<std::array<unsigned char,ack_len>> acks_;
+};
+
+
+class PathProberError: public std::runtime_error{
+public:
+  PathProberError(const std::string& what_arg): runtime_error(what_arg){}
+};
+
+#endif
@@ -8,6 +8,19 @@ void PeerConfig::clear()
   ip_addr = "";
   port = 0;
   max_packet_size = -1;
+  cipher_suite = CipherSuite::aes_256_gcm;
+  pipe_size = 0;
+  channel_pipe_sizes = {};
+  channel_modes = {};
+  bundle_window_micros = 0;
+  coalesce_window_micros = 0;
+  channel_coalesce_windows = {};
+  probe_max_size = 0;
+  max_message_size = 0;
+  compression = false;
+  channel_compressions = {};
+  fec = false;
+  channel_fecs = {};
 
   for(int i=0; i<host_id_size; i++){
     id[i] = 0;
@@ -13,8 +13,15 @@
 
 #include "IDTypes.h"
 #include "SecretKey.h"
+#include "CipherSuite.h"
+#include "ChannelMode.h"
 
 typedef std::pair<channel_id_type,std::string> channel_spec;
+typedef std::pair<channel_id_type,unsigned int> channel_pipe_size_spec;
+typedef std::pair<channel_id_type,ChannelMode> channel_mode_spec;
+typedef std::pair<channel_id_type,unsigned int> channel_coalesce_window_spec;
+typedef std::pair<channel_id_type,bool> channel_compression_spec;
+typedef std::pair<channel_id_type,bool> channel_fec_spec;
 
 class PeerConfig
 {
@@ -26,6 +33,32 @@ public:
   std::string ip_addr;
   in_port_t port;
   int max_packet_size; // a value of -1 here indicates no max packet size set
+  CipherSuite cipher_suite;
+  unsigned int pipe_size; // a value of 0 here indicates no fifo pipe size set
+  std::vector<channel_pipe_size_spec> channel_pipe_sizes; // pipe sizes for single channels,
+                                                          // overriding pipe_size
+  std::vector<channel_mode_spec> channel_modes; // channels not in the default fifo mode
+  unsigned int bundle_window_micros; // a value of 0 here indicates that the channels'
+                                     // data is not bundled (see Bundler.h)
+  unsigned int coalesce_window_micros; // a value of 0 here indicates that data from the user
+                                       // is sent as soon as it is read
+  std::vector<channel_coalesce_window_spec> channel_coalesce_windows; // coalescing windows
+                                                                      // for single channels,
+                                                                      // overriding
+                                                                      // coalesce_window_micros
+  unsigned int probe_max_size; // the largest packet size to probe for, where a value of 0
+                               // here indicates no path MTU discovery (see PathProber.h)
+  unsigned int max_message_size; // the longest message on a channel which keeps message
+                                 // boundaries, where a value of 0 here indicates that
+                                 // messages are not fragmented (see Fragmentation.h)
+  bool compression; // whether the channels' payloads are compressed (see Compressor.h)
+  std::vector<channel_compression_spec> channel_compressions; // compression settings for
+                                                              // single channels,
+                                                              // overriding compression
+  bool fec; // whether the channels' packets are protected by forward error correction
+            // (see Fec.h)
+  std::vector<channel_fec_spec> channel_fecs; // fec settings for single channels,
+                                              // overriding fec
   void clear();
 };
 
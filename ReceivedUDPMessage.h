@@ -7,6 +7,7 @@
 #define RECEIVEDUDPMESSAGE_H
 
 #include <netinet/in.h>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -14,6 +15,11 @@
  * represents a real message or not. This allows a function which reads from
  * the network to return a ReceivedUDPMessage while cleanly communicating to
  * the caller that there was no message.
+ *
+ * The member "arrival_nanos" may be set by the receiver to the time (as given by
+ * monotonic_nanos(), see LatencyHistogram.h) at which the message was received, so that
+ * the time the message spends waiting to be processed can be measured. A value of 0
+ * means that the time was not recorded.
  */
 struct ReceivedUDPMessage
 {
@@ -21,6 +27,7 @@ struct ReceivedUDPMessage
   std::vector<unsigned char> data;
   std::string source_addr;
   in_port_t source_port;
+  std::uint_least64_t arrival_nanos = 0;
 };
 
 #endif
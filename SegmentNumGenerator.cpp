@@ -5,6 +5,14 @@
 #include <thread>
 #include <fstream>
 #include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <cstdlib>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "EpochTime.h"
 
@@ -28,8 +36,14 @@
  *  application will select some range of segment numbers to reserve for use, and will
  *  write the highest segment number reserved back to non-volatile storage, writing one
  *  of the files completely before writing the other, to ensure at least one file
- *  always contains a valid record. This allows recovery from unexpected shutdowns
- *  during these file writes (which might leave a file corrupted).
+ *  always contains a valid record. Each file is written by writing a new file beside it,
+ *  flushing that to storage, and renaming it over the old one, so that each file on its
+ *  own also holds either the old record or the new one. This allows recovery from
+ *  unexpected shutdowns during these file writes. The new file is named after the one it
+ *  replaces with a suffix of "." and six random characters. One left behind by an
+ *  unexpected shutdown is never read, and is not removed automatically (as it cannot be
+ *  told apart from one being written by another instance using the same files), so it may
+ *  be deleted by hand while Cryptocomms is not running.
  *
  *  Note that at least one segment number storage file must be initialized with a
  *  positive segment number before Cryptocomms runs for the first time. 1 is a good
@@ -45,6 +59,12 @@ namespace
   constexpr SegmentNumGenerator::segnum_t segnum_max = 281474976710655U;
 
 
+  /* the next range of segment numbers is reserved once no more than 1/low_water_fraction
+   * of the numbers reserved are left
+   */
+  constexpr unsigned int low_water_fraction = 4;
+
+
   /* get_saved_segnum() loads the stored segment number from a file. A return
    * value of 0 indicates an error (note that 0 is not a valid segment number).
    * See the comment at the top of the file for information on the format of the
@@ -130,48 +150,72 @@ namespace
 
   /* save_segnum() stores a segment number to the file at the given path. The number stored
    * represents the highest segment number which could already have been handed out by
-   * next_num(). save_segnum() makes some effort to ensure that the file has been written to
-   * permanent storage before returning. The argument segnum must not be 0, as 0 is not a
-   * valid segment number.
+   * next_num(). The number is written to a new file, which is flushed to permanent storage
+   * before being renamed over the old one, so that the file at path is never left holding
+   * a partly written record. The argument segnum must not be 0, as 0 is not a valid
+   * segment number.
    */
   void save_segnum(SegmentNumGenerator::segnum_t segnum, const std::string& path)
   {
+    /* see the comment at the top of the file for the format of the segment number file */
     std::string segnum_string = std::to_string(segnum);
-    SegmentNumGenerator::segnum_t reread_segnum;
-
-    /* In this loop, we try to write the new value to the file and check for
-     * a successful write by reading the value back from the file, retrying
-     * until we succeed.
-     */
-    while(true){
-      std::ofstream segnum_file(path,std::ios::trunc);
-      if(!segnum_file){
-        throw std::runtime_error("SegmentNumGenerator: could not open stored segment number file: "
-                                 +path);
-      }
-
-      /* see the comment at the top of the file for the format of the segment number file */
-      segnum_file << segnum_string << std::endl;
-      segnum_file << segnum_string;
-      segnum_file.close();
-
-      /* We want to be as sure as we can that the new value has been written to the file,
-       * so we read the value back from the file and check. This should work first time
-       * pretty much always...
-       */
-      reread_segnum = get_saved_segnum(path);
-      /* get_saved_segnum() returns 0 on error, but segnum will not be 0, so this is fine */
-      if(reread_segnum == segnum){
+    std::string contents = segnum_string+"\n"+segnum_string;
+
+    /* the new file is given a unique name, as another SegmentNumGenerator using the same
+       files could be writing one at the same time */
+    std::vector<char> new_path_chars(path.begin(),path.end());
+    const std::string suffix = ".XXXXXX";
+    new_path_chars.insert(new_path_chars.end(),suffix.begin(),suffix.end());
+    new_path_chars.push_back('\0');
+    int fd = mkostemp(new_path_chars.data(),O_CLOEXEC);
+    if(fd < 0){
+      throw std::runtime_error("SegmentNumGenerator: could not open stored segment number file: "
+                               +path+suffix);
+    }
+    std::string new_path(new_path_chars.data());
+
+    /* mkostemp() makes the file readable only by its owner, so it is given the permissions
+       of the file it replaces, if there is one */
+    struct stat old_stat;
+    if( (stat(path.c_str(),&old_stat) == 0) and
+        (fchmod(fd,old_stat.st_mode & 07777) != 0) ){
+      close(fd);
+      std::remove(new_path.c_str());
+      throw std::runtime_error("SegmentNumGenerator: could not set permissions of stored "
+                               "segment number file: "+new_path);
+    }
+    std::string::size_type written = 0;
+    while(written < contents.size()){
+      ssize_t n = write(fd,contents.data()+written,contents.size()-written);
+      if(n < 0){
+        if(errno == EINTR){
+          continue;
+        }
         break;
       }
+      written += n;
+    }
+    bool synced = (written == contents.size()) and (fsync(fd) == 0);
+    if( (close(fd) != 0) or (not synced) ){
+      std::remove(new_path.c_str());
+      throw std::runtime_error("SegmentNumGenerator: could not write stored segment number file: "
+                               +new_path);
+    }
 
-      /* ... but if it does not work then we just sleep for 0.1 second and try again. This
-       * is very crude but it's the only think I can think of other than just throwing an
-       * error. Since save_segnum() is called once at application start-up, and very
-       * infrequently (if ever) thereafter (assuming reserved_ is set to a reasonable value),
-       * this behaviour is acceptable.
-       */
-      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if(std::rename(new_path.c_str(),path.c_str()) != 0){
+      std::remove(new_path.c_str());
+      throw std::runtime_error("SegmentNumGenerator: could not replace stored segment number file: "
+                               +path);
+    }
+
+    /* the rename is only certain to survive a crash once the directory has been flushed
+       too, but not every file system can flush a directory, so failures are ignored */
+    std::string::size_type slash = path.rfind('/');
+    std::string dir_path = (slash == std::string::npos) ? "." : path.substr(0,slash+1);
+    int dir_fd = open(dir_path.c_str(),O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(dir_fd >= 0){
+      fsync(dir_fd);
+      close(dir_fd);
     }
   }
 
@@ -184,42 +228,124 @@ namespace
  */
 SegmentNumGenerator::SegmentNumGenerator(std::string path, unsigned int reserved):
   path_first_(path+"_FIRST"),
-  path_second_(path+"_SECOND")
+  path_second_(path+"_SECOND"),
+  next_num_(1),
+  range_first_(1),
+  new_reserve_needed_(1),
+  low_water_num_(0),
+  prefetch_wanted_(false),
+  prefetch_ready_(false),
+  prefetch_first_(0),
+  prefetch_end_(0),
+  stopping_(false)
 {
   set_reserved(reserved);
 
   /* Setting both next_num_ and new_reserve_needed_ to the same value will cause
-   * reserve_nums() to be called on the first invocation of next_num(). This allows
+   * a reservation of numbers on the first invocation of next_num(). This allows
    * set_reserve() to be called to set a better value for reserved_ before a
    * reservation of numbers happens. We do not use the segment number 0, as this
    * value is used internally to indicate that a segement number has not been set.
    */
-  next_num_ = 1;
-  new_reserve_needed_ = 1;
+  prefetch_thread_ = std::thread(&SegmentNumGenerator::prefetch_nums,this);
+}
+
+
+SegmentNumGenerator::~SegmentNumGenerator()
+{
+  {
+    const std::lock_guard<std::mutex> guard_for_lock(lock_);
+    stopping_ = true;
+  }
+  prefetch_condvar_.notify_all();
+  prefetch_thread_.join();
 }
 
 
-/* SegmentNumGenerator::next_num() returns a fresh segment number. The internal
- * state of SegmentNumGenerator is simple: the next segment number to be handed
- * out by next_num() is stored in next_num_, and the last segment number which
- * can be handed out before a new internal reservation of segment numbers is needed
- * is (new_reserve_needed_ - 1), so the condition for calling reserve_nums() is
- * (next_num_ == new_reserve_needed_).
+/* SegmentNumGenerator::next_num() returns a fresh segment number. The number is taken by
+ * incrementing next_num_, and it may be handed out if it lies in the current range, from
+ * range_first_ up to (but not including) new_reserve_needed_. Otherwise the range has run
+ * out, and next_range() switches to the next one, reserved in the background by
+ * prefetch_nums(), waiting for it if need be.
+ *
+ * A number may be taken while next_range() is switching ranges, so it is only handed out
+ * if it lies in the range given by a value of new_reserve_needed_ and a value of
+ * range_first_ read after it. As next_range() stores range_first_ before
+ * new_reserve_needed_, these are either from the same range or range_first_ is from a
+ * later one, and as the ranges are disjoint and increasing, the number is then certain
+ * to lie in a reserved range. As next_num_ never decreases, each number is taken once
+ * only, and numbers which are taken but not handed out are never used.
  */
 SegmentNumGenerator::segnum_t SegmentNumGenerator::next_num()
 {
-const std::lock_guard<std::mutex> guard_for_lock(lock_);
+  while(true){
+    segnum_t segnum = next_num_.fetch_add(1,std::memory_order_relaxed);
+    segnum_t limit = new_reserve_needed_.load(std::memory_order_acquire);
+    if( (segnum < limit) and (segnum >= range_first_.load(std::memory_order_relaxed)) ){
+      if(segnum == low_water_num_.load(std::memory_order_relaxed)){
+        start_prefetch();
+      }
+      return segnum;
+    }
+    next_range();
+  }
+}
+
+
+/* SegmentNumGenerator::next_range() switches to the range reserved in the background once
+ * the current one has run out, unless another thread has already done so, starting the
+ * reservation and waiting for it if need be
+ */
+void SegmentNumGenerator::next_range()
+{
+  std::unique_lock<std::mutex> guard_for_lock(lock_);
+
+  while(next_num_.load(std::memory_order_relaxed) >=
+        new_reserve_needed_.load(std::memory_order_relaxed)){
+    if(prefetch_ready_){
+      segnum_t current = next_num_.load(std::memory_order_relaxed);
+      while( (current < prefetch_first_) and
+             (not next_num_.compare_exchange_weak(current,prefetch_first_,
+                                                  std::memory_order_relaxed)) ){}
+      /* the next reservation starts once no more than 1/low_water_fraction of the
+         numbers are left */
+      segnum_t low_water_count = (prefetch_end_-prefetch_first_)/low_water_fraction;
+      range_first_.store(prefetch_first_,std::memory_order_relaxed);
+      low_water_num_.store(prefetch_end_-1-low_water_count,std::memory_order_relaxed);
+      new_reserve_needed_.store(prefetch_end_,std::memory_order_release);
+      prefetch_ready_ = false;
+    }
+    else if(prefetch_error_){
+      std::exception_ptr error = prefetch_error_;
+      prefetch_error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+    else{
+      if(not prefetch_wanted_){
+        prefetch_wanted_ = true;
+        prefetch_condvar_.notify_all();
+      }
+      prefetch_condvar_.wait(guard_for_lock);
+    }
+  }
+}
 
- if(next_num_ == new_reserve_needed_){
-   reserve_nums();
- }
 
- return next_num_++;
+/* SegmentNumGenerator::start_prefetch() asks prefetch_nums() to reserve the next range,
+ * unless it has already been reserved or is being reserved
+ */
+void SegmentNumGenerator::start_prefetch()
+{
+  const std::lock_guard<std::mutex> guard_for_lock(lock_);
+  if( (not prefetch_wanted_) and (not prefetch_ready_) and (not prefetch_error_) ){
+    prefetch_wanted_ = true;
+    prefetch_condvar_.notify_all();
+  }
 }
 
 
 /* SegmentNumGenerator::set_reserved() sets how many segment numbers to reserve at
- * each call of reserve_nums().
+ * each reservation.
  */
 void SegmentNumGenerator::set_reserved(unsigned int reserved)
 {
@@ -233,17 +359,58 @@ const std::lock_guard<std::mutex> guard_for_lock(lock_);
 }
 
 
+/* SegmentNumGenerator::prefetch_nums() is run by prefetch_thread_, and reserves a
+ * range of segment numbers whenever next_num() asks for one, without holding lock_ while
+ * it does so. The range is left for next_num() to take once the current one has run out,
+ * or if the reservation fails, the error is left for next_num() to throw.
+ */
+void SegmentNumGenerator::prefetch_nums()
+{
+  std::unique_lock<std::mutex> guard_for_lock(lock_);
+  while(true){
+    prefetch_condvar_.wait(guard_for_lock,[this](){ return stopping_ or prefetch_wanted_; });
+    if(stopping_){
+      return;
+    }
+
+    segnum_t floor = new_reserve_needed_.load(std::memory_order_relaxed);
+    unsigned int reserved = reserved_;
+    guard_for_lock.unlock();
+    segnum_t first = 0;
+    std::exception_ptr error;
+    try{
+      first = reserve_nums(floor,reserved);
+    }
+    catch(...){
+      error = std::current_exception();
+    }
+    guard_for_lock.lock();
+
+    if(error){
+      prefetch_error_ = error;
+    }
+    else{
+      prefetch_first_ = first;
+      prefetch_end_ = first+reserved;
+      prefetch_ready_ = true;
+    }
+    prefetch_wanted_ = false;
+    prefetch_condvar_.notify_all();
+  }
+}
+
 
 /* SegmentNumGenerator::reserve_nums() uses the system clock and the stored record
- * of which segment numbers have been used to reserve a range of fresh segment numbers
- * to be handed out by next_num(), and updates the stored record of used segment numbers
- * to mark all numbers in this reserved range as used.
+ * of which segment numbers have been used to reserve a range of "reserved" fresh segment
+ * numbers, all at least floor, and updates the stored record of used segment numbers
+ * to mark all numbers in this range as used. It returns the first number of the range.
  *
  * The generation of segment numbers is based on the number of milliseconds since the UNIX
  * epoch, combined with a record of used segment numbers on permanent storage to further
  * guard against reuse in the event of changes to the system clock.
  */
-void SegmentNumGenerator::reserve_nums()
+SegmentNumGenerator::segnum_t SegmentNumGenerator::reserve_nums(segnum_t floor,
+                                                                unsigned int reserved) const
 {
   /* Read from both of the segment number files, and take the higher. If reading both
      files returns an error, there is no usable record of segment numbers and we must
@@ -260,8 +427,8 @@ void SegmentNumGenerator::reserve_nums()
    * have generated from the system clock (assuming that the system clock has
    * always increased monotonically), so we ensure that we see an increment in
    * the generated segment number before using it. This is acceptable since
-   * reserve_nums() is called once at application start-up, and very infrequently
-   * (if ever) thereafter (assuming reserved_ is set to a reasonable value).
+   * reserve_nums() is only waited for on the first call of next_num(), and
+   * otherwise runs in the background.
    */
   segnum_t base_sysclock_segnum, sysclock_segnum;
   sysclock_segnum = base_sysclock_segnum = get_segnum_sysclock();
@@ -270,15 +437,14 @@ void SegmentNumGenerator::reserve_nums()
     sysclock_segnum = get_segnum_sysclock();
   }
 
-  /* calculate the next segment number, and update the upper limit on segment
-   * numbers before another reserve_nums() call is needed
+  /* calculate the first segment number of the range, and the upper limit on segment
+   * numbers before another reservation is needed
    */
-  next_num_ = std::max(saved_segnum+1,sysclock_segnum);
-  segnum_t next_new_reserve_needed = next_num_ + reserved_;
-  if(next_new_reserve_needed > segnum_max){
+  segnum_t first = std::max({saved_segnum+1,sysclock_segnum,floor});
+  segnum_t new_reserve_needed = first + reserved;
+  if(new_reserve_needed > segnum_max){
     throw std::runtime_error("SegmentNumGenerator: new upper segment number limit is too high");
   }
-  new_reserve_needed_ = next_new_reserve_needed;
 
   /* Write the segment number to the first file, and then write it to the second file.
      save_segnum() ensures that the write has been completed successfully before returning,
@@ -286,6 +452,7 @@ void SegmentNumGenerator::reserve_nums()
      number at least as great as any which has been returned from next_num(). This allows
      recovery from an unexpected shutdown during either of the calls to save_segnum() which
      leaves the file in a corrupt state. */
-  save_segnum(new_reserve_needed_-1,path_first_);
-  save_segnum(new_reserve_needed_-1,path_second_);
+  save_segnum(new_reserve_needed-1,path_first_);
+  save_segnum(new_reserve_needed-1,path_second_);
+  return first;
 }
@@ -5,14 +5,30 @@
  * unlikely as possible. The only public functionality exposed by this class
  * (aside from the constructor) are the functions next_num() and set_reserved(),
  * which are thread-safe.
+ *
+ * Segment numbers are handed out from a range which has been reserved (recorded on
+ * storage as used) beforehand. When fewer than a quarter of the numbers in the range are
+ * left, a thread belonging to the SegmentNumGenerator reserves the next range in the
+ * background, so that next_num() normally never waits for storage. It only waits if the
+ * range runs out before the next one has been reserved, which is always the case on its
+ * first call.
+ *
+ * Handing out a number from the current range is a single atomic increment, without
+ * taking lock_. The lock is only taken to switch to the next range once the current one
+ * has run out, and by the one call which hands out the number at which the next
+ * reservation is to start.
  */
 
 #ifndef SEGMENTNUMGENERATOR_H
 #define SEGMENTNUMGENERATOR_H
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
 #include <mutex>
 #include <string>
-#include <cstdint>
+#include <thread>
 
 class SegmentNumGenerator
 {
@@ -20,6 +36,7 @@ public:
   typedef std::uint_least64_t segnum_t;
 
   SegmentNumGenerator(std::string path, unsigned int reserved = 1000);
+  ~SegmentNumGenerator();
   segnum_t next_num();
   void set_reserved(unsigned int reserved);
 
@@ -37,10 +54,31 @@ private:
   std::string path_first_;
   std::string path_second_;
   std::mutex lock_;
+  std::condition_variable prefetch_condvar_;
   unsigned int reserved_;
-  segnum_t next_num_;
-  segnum_t new_reserve_needed_;
-  void reserve_nums();
+
+  /* the current range runs from range_first_ up to (but not including)
+     new_reserve_needed_, and its numbers are handed out by incrementing next_num_. Both
+     next_num_ and new_reserve_needed_ only ever increase. */
+  std::atomic<segnum_t> next_num_;
+  std::atomic<segnum_t> range_first_;
+  std::atomic<segnum_t> new_reserve_needed_;
+  std::atomic<segnum_t> low_water_num_; // the number whose caller starts the next reservation
+
+  /* the range reserved in the background, from prefetch_first_ up to (but not including)
+     prefetch_end_, once prefetch_ready_ is set */
+  bool prefetch_wanted_;
+  bool prefetch_ready_;
+  segnum_t prefetch_first_;
+  segnum_t prefetch_end_;
+  std::exception_ptr prefetch_error_; // the error from the last reservation, if it failed
+  bool stopping_;
+  std::thread prefetch_thread_;
+
+  void next_range();
+  void start_prefetch();
+  void prefetch_nums();
+  segnum_t reserve_nums(segnum_t floor, unsigned int reserved) const;
 };
 
 #endif
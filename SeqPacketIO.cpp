@@ -0,0 +1,252 @@
+#include "SeqPacketIO.h"
+
+/* As in FifoIO.cpp, we use the C POSIX interface exclusively in this file */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace
+{
+  /* the number of user programs which may wait to connect while another is being served */
+  constexpr int listen_backlog = 8;
+}
+
+
+/* SeqPacketEndpoint::SeqPacketEndpoint() creates a listening SOCK_SEQPACKET socket at path.
+ * If there is already a socket at path, it is assumed to be left over from an earlier run
+ * and is replaced, but any other kind of file at path is an error.
+ */
+SeqPacketEndpoint::SeqPacketEndpoint(const std::string& path):
+  listen_fd_(-1),
+  user_fd_(-1),
+  path_(path)
+{
+  sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(addr.sun_path)){
+    throw SeqPacketIOError("SeqPacketIO: socket path too long "+path);
+  }
+  strcpy(addr.sun_path,path.c_str());
+
+  /* check whether there is already a file at path, and remove it if it is a socket */
+  struct stat stat_info;
+  if(lstat(path.c_str(),&stat_info) == 0){
+    if(not S_ISSOCK(stat_info.st_mode)){
+      throw SeqPacketIOError("SeqPacketIO: "+path+" is not a socket");
+    }
+    if(unlink(path.c_str()) == -1){
+      throw SeqPacketIOError("SeqPacketIO: could not remove old socket at "+path);
+    }
+  }
+  else if(errno != ENOENT){
+    throw SeqPacketIOError("SeqPacketIO: could not stat file at "+path);
+  }
+
+  listen_fd_ = socket(AF_UNIX,SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+  if(listen_fd_ == -1){
+    throw SeqPacketIOError("SeqPacketIO: could not create socket for "+path);
+  }
+  if(bind(listen_fd_,(sockaddr*)&addr,sizeof(addr)) == -1){
+    close(listen_fd_);
+    throw SeqPacketIOError("SeqPacketIO: could not bind socket at "+path);
+  }
+  if(listen(listen_fd_,listen_backlog) == -1){
+    close(listen_fd_);
+    unlink(path.c_str());
+    throw SeqPacketIOError("SeqPacketIO: could not listen on socket at "+path);
+  }
+}
+
+
+SeqPacketEndpoint::~SeqPacketEndpoint()
+{
+  disconnect_user();
+  close(listen_fd_);
+  unlink(path_.c_str());
+}
+
+
+/* SeqPacketEndpoint::read_into() reads one message from the user program, if there is one
+ * waiting, into dest, starting at position offset. If no user program is connected, it
+ * first accepts one if there is one waiting.
+ *
+ * The first element of the return value is the length of the message read, with 0 meaning
+ * that there was none. Messages longer than count cannot be read in full, so they are
+ * discarded, and this is reported by the second element of the return value being true
+ * (the caller may then try again for the next message). Empty messages carry nothing and
+ * are skipped.
+ */
+std::pair<unsigned int,bool> SeqPacketEndpoint::read_into(std::vector<unsigned char>& dest,
+                                                          std::vector<unsigned char>::size_type offset,
+                                                          unsigned int count)
+{
+  if(dest.size() < offset+count){
+    throw SeqPacketIOError("SeqPacketIO: no room in buffer for read from "+path_);
+  }
+  if( (user_fd_ == -1) and (not accept_user()) ){
+    return {0,false};
+  }
+
+  /* recv() returns 0 both for an empty message and once the user program has disconnected
+     and all its messages have been read, so we only take a return of 0 to mean the latter
+     if it happens twice in a row and the socket reports a hang up */
+  bool empty_read = false;
+  while(true){
+    ssize_t ret = recv(user_fd_,dest.data()+offset,count,MSG_DONTWAIT|MSG_TRUNC);
+    if(ret == -1){
+      if(errno == EINTR){
+        continue;
+      }
+      if( (errno == EAGAIN) or (errno == EWOULDBLOCK) ){
+        return {0,false};
+      }
+      if(errno == ECONNRESET){
+        disconnect_user();
+        return {0,false};
+      }
+      throw SeqPacketIOError("SeqPacketIO: error reading from socket at "+path_);
+    }
+    if(ret == 0){
+      if(empty_read and user_hung_up()){
+        disconnect_user();
+        return {0,false};
+      }
+      empty_read = true;
+      continue;
+    }
+    /* with MSG_TRUNC, recv() gives the full length of the message even if it did not fit */
+    if(static_cast<unsigned long>(ret) > count){
+      return {0,true};
+    }
+    return {static_cast<unsigned int>(ret),false};
+  }
+}
+
+
+/* SeqPacketEndpoint::write() sends the count bytes at data to the user program as a single
+ * message. If no user program is connected, it first accepts one if there is one waiting.
+ *
+ * As for FifoToUser::write(), the return value is a pair. The first element is the number
+ * of bytes written, which is either count or (if the socket's buffer is full) 0, and the
+ * second reports whether the message could not be sent because no user program is
+ * connected.
+ */
+std::pair<unsigned int,bool> SeqPacketEndpoint::write(const unsigned char* data, unsigned int count)
+{
+  if( (user_fd_ == -1) and (not accept_user()) ){
+    return {0,true};
+  }
+
+  while(true){
+    ssize_t ret = send(user_fd_,data,count,MSG_DONTWAIT|MSG_NOSIGNAL);
+    if(ret == -1){
+      if(errno == EINTR){
+        continue;
+      }
+      if( (errno == EAGAIN) or (errno == EWOULDBLOCK) ){
+        return {0,false};
+      }
+      if( (errno == EPIPE) or (errno == ECONNRESET) ){
+        disconnect_user();
+        return {0,true};
+      }
+      throw SeqPacketIOError("SeqPacketIO: error writing to socket at "+path_);
+    }
+    return {static_cast<unsigned int>(ret),false};
+  }
+}
+
+
+/* SeqPacketEndpoint::file_descriptor() gives the file descriptor to poll() on for activity:
+ * the connection to the user program if there is one, or else the listening socket. This
+ * changes when a user program connects or disconnects, which only happens within
+ * read_into(), write() and data_waiting().
+ */
+int SeqPacketEndpoint::file_descriptor()
+{
+  return (user_fd_ != -1) ? user_fd_ : listen_fd_;
+}
+
+
+/* SeqPacketEndpoint::user_connected() reports whether a user program is connected */
+bool SeqPacketEndpoint::user_connected()
+{
+  return user_fd_ != -1;
+}
+
+
+/* SeqPacketEndpoint::data_waiting() reports whether there is anything for read_into() to
+ * read, after first accepting a connection from a user program if none is connected and
+ * there is one waiting. A user program disconnecting also counts, as read_into() needs to
+ * deal with it.
+ */
+bool SeqPacketEndpoint::data_waiting()
+{
+  if( (user_fd_ == -1) and (not accept_user()) ){
+    return false;
+  }
+
+  pollfd pfd;
+  pfd.fd = user_fd_;
+  pfd.events = POLLIN;
+  while(poll(&pfd,1,0) == -1){
+    if(errno != EINTR){
+      throw SeqPacketIOError("SeqPacketIO: poll() reported an error for "+path_);
+    }
+  }
+  return (pfd.revents & (POLLIN|POLLHUP)) != 0;
+}
+
+
+/* SeqPacketEndpoint::accept_user() accepts a connection from a user program if there is
+ * one waiting, and reports whether it did
+ */
+bool SeqPacketEndpoint::accept_user()
+{
+  while(true){
+    user_fd_ = accept4(listen_fd_,nullptr,nullptr,SOCK_NONBLOCK|SOCK_CLOEXEC);
+    if(user_fd_ != -1){
+      return true;
+    }
+    if(errno == EINTR){
+      continue;
+    }
+    if( (errno == EAGAIN) or (errno == EWOULDBLOCK) or (errno == ECONNABORTED) ){
+      return false;
+    }
+    throw SeqPacketIOError("SeqPacketIO: error accepting connection on socket at "+path_);
+  }
+}
+
+
+/* SeqPacketEndpoint::disconnect_user() closes the connection to the user program, if any */
+void SeqPacketEndpoint::disconnect_user()
+{
+  if(user_fd_ != -1){
+    close(user_fd_);
+    user_fd_ = -1;
+  }
+}
+
+
+/* SeqPacketEndpoint::user_hung_up() reports whether the user program has closed its end of
+ * the connection
+ */
+bool SeqPacketEndpoint::user_hung_up()
+{
+  pollfd pfd;
+  pfd.fd = user_fd_;
+  pfd.events = POLLRDHUP;
+  while(poll(&pfd,1,0) == -1){
+    if(errno != EINTR){
+      throw SeqPacketIOError("SeqPacketIO: poll() reported an error for "+path_);
+    }
+  }
+  return (pfd.revents & (POLLHUP|POLLRDHUP)) != 0;
+}
@@ -0,0 +1,57 @@
+/* SeqPacketEndpoint is the user's end of a channel in "seqpacket" mode (see ChannelMode.h),
+ * an alternative to the pair of fifos wrapped by FifoIO. The endpoint is a Unix domain
+ * socket of type SOCK_SEQPACKET, which a user program connects to in order to send and
+ * receive data. Unlike a fifo, such a socket preserves message boundaries: each message the
+ * user program sends is read as a whole by read_into(), and each call to write() is
+ * received by the user program as a single message.
+ *
+ * The endpoint listens on a socket at the path given to the constructor, and serves one
+ * user program at a time. Another program which connects while one is being served waits
+ * in the listen backlog until the first disconnects. All operations are non-blocking.
+ */
+
+#ifndef SEQPACKETIO_H
+#define SEQPACKETIO_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <utility>
+
+class SeqPacketEndpoint
+{
+public:
+  SeqPacketEndpoint(const std::string& path);
+  ~SeqPacketEndpoint();
+
+  /* We do not allow copying of a SeqPacketEndpoint, as the file descriptors are not
+   * shareable, and the socket file is removed when the SeqPacketEndpoint is destroyed.
+   */
+  SeqPacketEndpoint(const SeqPacketEndpoint& other) = delete;
+  SeqPacketEndpoint& operator=(const SeqPacketEndpoint& other) = delete;
+
+  std::pair<unsigned int,bool> read_into(std::vector<unsigned char>& dest,
+                                         std::vector<unsigned char>::size_type offset,
+                                         unsigned int count);
+  std::pair<unsigned int,bool> write(const unsigned char* data, unsigned int count);
+  int file_descriptor();
+  bool user_connected();
+  bool data_waiting();
+
+private:
+  bool accept_user();
+  void disconnect_user();
+  bool user_hung_up();
+
+  int listen_fd_;
+  int user_fd_; // -1 when no user program is connected
+  const std::string path_;
+};
+
+
+class SeqPacketIOError: public std::runtime_error{
+public:
+  SeqPacketIOError(const std::string& what_arg): runtime_error(what_arg){}
+};
+
+#endif
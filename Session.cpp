@@ -1,8 +1,11 @@
 #include "Session.h"
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <exception>
 #include <stdexcept>
+#include <system_error>
 #include <cerrno>
 
 #include <poll.h>
@@ -10,6 +13,7 @@
 #include <fcntl.h>
 
 #include "EpochTime.h"
+#include "Tracepoints.h"
 
 namespace
 {
@@ -72,20 +76,32 @@ namespace
   /* run_poll() calls poll() on the supplied list of file descriptors, retrying
    * until an event occurs, there is an unrecoverable error, or the timeout
    * expires. The timeout is given in milliseconds, with -1 meaning no timeout.
+   * If deadline is not 0, poll() also returns once monotonic_nanos() reaches
+   * it, which allows for waits shorter than a millisecond.
    */
-  void run_poll(pollfd* poll_fds, int num_poll_fds, int timeout)
+  void run_poll(pollfd* poll_fds, int num_poll_fds, int timeout, nanos_t deadline = 0)
   {
     int ret = 0;
-    millis_timestamp_t start_time = epoch_time_millis();
+    nanos_t start_time = monotonic_nanos();
+    nanos_t end_time = (timeout == -1) ? 0 : start_time+static_cast<nanos_t>(timeout)*1000000;
+    if( (deadline != 0) and ( (end_time == 0) or (deadline < end_time) ) ){
+      end_time = deadline;
+    }
 
     while(ret == 0){
-      millis_timestamp_t elapsed_time = epoch_time_millis() - start_time;
-      if( (timeout != -1) and (static_cast<int>(elapsed_time) >= timeout) ){
-        return;
+      timespec loop_timeout;
+      timespec* loop_timeout_ptr = nullptr; // null means no timeout
+      if(end_time != 0){
+        nanos_t now = monotonic_nanos();
+        if(now >= end_time){
+          return;
+        }
+        loop_timeout.tv_sec = (end_time-now)/1000000000;
+        loop_timeout.tv_nsec = (end_time-now)%1000000000;
+        loop_timeout_ptr = &loop_timeout;
       }
 
-      int loop_timeout = (timeout == -1) ? -1 : timeout - elapsed_time;
-      ret = poll(poll_fds,num_poll_fds,loop_timeout);
+      ret = ppoll(poll_fds,num_poll_fds,loop_timeout_ptr,nullptr);
       if(ret == -1){
         if((errno == EINTR) or (errno == EAGAIN)){ // recoverable error, try again
           ret = 0;
@@ -98,6 +114,46 @@ namespace
 
   }
 
+
+  /* constants used in choosing the number of threads on which the Connections are
+     created, where each thread is given at least min_jobs_per_startup_thread Connections,
+     as starting a thread costs about as much as creating a few Connections */
+  constexpr unsigned int max_startup_threads = 16;
+  constexpr unsigned int min_jobs_per_startup_thread = 64;
+
+
+  /* override_setting() applies each of the settings for single channels in overrides to
+   * the field of the settings of its channel, where positions maps the channel ids to
+   * their positions in settings
+   */
+  template<typename S, typename T, typename F>
+  void override_setting(std::vector<S>& settings,
+                        const std::map<channel_id_type,unsigned int>& positions,
+                        const std::vector<std::pair<channel_id_type,T>>& overrides,
+                        F S::* field)
+  {
+    for(auto const& o : overrides){
+      auto it = positions.find(o.first);
+      if(it != positions.end()){
+        settings[(*it).second].*field = o.second;
+      }
+    }
+  }
+
+
+  /* same_peer_settings() reports whether two configurations of a peer have the same
+   * settings for the peer as a whole, leaving aside those which only affect its channels
+   */
+  bool same_peer_settings(const PeerConfig& a, const PeerConfig& b)
+  {
+    return (a.name == b.name) and (a.id == b.id) and
+      std::equal(a.key.data(),a.key.data()+secret_key_size,b.key.data()) and
+      (a.ip_addr == b.ip_addr) and (a.port == b.port) and
+      (a.max_packet_size == b.max_packet_size) and (a.cipher_suite == b.cipher_suite) and
+      (a.bundle_window_micros == b.bundle_window_micros) and
+      (a.probe_max_size == b.probe_max_size) and (a.max_message_size == b.max_message_size);
+  }
+
 }
 
 
@@ -107,13 +163,25 @@ Session::Session(const host_id_type& self_id,
                  unsigned int default_max_packet_size,
                  const std::vector<PeerConfig>& peer_configs,
                  const std::string& segnum_file_path,
-                 unsigned int num_connection_workers):
+                 unsigned int num_connection_workers,
+                 unsigned int num_crypto_workers,
+                 const std::string& metrics_socket_path,
+                 unsigned int default_pipe_size,
+                 unsigned int hibernate_after_millis):
   self_id_(self_id),
+  self_ip_addr_(self_ip_addr),
   default_max_packet_size_(default_max_packet_size),
+  default_pipe_size_(default_pipe_size),
+  hibernate_after_nanos_(static_cast<nanos_t>(hibernate_after_millis)*1000000),
   udp_socket_(std::make_shared<UDPSocket>(self_ip_addr,self_port)),
   connection_dwell_loops_(dwell_max),
   stopping_(false),
-  active_(true)
+  active_(true),
+  start_time_(std::chrono::steady_clock::now()),
+  startup_micros_(0),
+  startup_connections_micros_(0),
+  startup_threads_(0),
+  latencies_(std::make_shared<PipelineLatencies>())
 {
   /* initialize the pipe used wake the thread that monitors the fifos of the Connections */
   pipe_ends pipes = make_internal_pipe();
@@ -132,46 +200,34 @@ Session::Session(const host_id_type& self_id,
   unsigned int num_connections = 0;
   for(auto const& peer_config : peer_configs){
     num_connections += peer_config.channels.size();
+    if(peer_config.bundle_window_micros != 0){
+      num_connections += 1; // for the peer's bundle Connection
+    }
+    if(peer_config.probe_max_size != 0){
+      num_connections += 1; // for the peer's probe Connection
+    }
   }
   segnumgen_ = std::make_shared<SegmentNumGenerator>(segnum_file_path,num_connections);
 
-  /* create the Connections */
-  for(auto const& peer_config : peer_configs){ // for each remote peer...
-    for(auto const& ch_spec : peer_config.channels){ // ...loop through all the channels for that
-                                                     // peer and create a Connection for each
-
-      // a value of -1 in peer_config.max_packet_size indicates that no maximum packet size
-      // was specified for this peer
-      unsigned int max_packet_size = (peer_config.max_packet_size == -1) ?
-        default_max_packet_size : peer_config.max_packet_size;
-
-      // concatenate the peer's host id and the channel id to create the full id for this
-      // Connection
-      connection_id_type full_id;
-      std::copy(peer_config.id.begin(),peer_config.id.end(),full_id.begin());
-      std::copy(ch_spec.first.begin(),ch_spec.first.end(),full_id.begin()+host_id_size);
-
-      connection_and_bool_type conn_and_bool{
-        std::make_unique<Connection>(self_id,
-                                     peer_config.name,
-                                     peer_config.id,
-                                     ch_spec.first,
-                                     ch_spec.second,
-                                     peer_config.key,
-                                     peer_config.ip_addr,
-                                     peer_config.port,
-                                     max_packet_size,
-                                     udp_socket_,
-                                     segnumgen_),
-        false
-      };
-
-      // add the new Connection's file descriptor to be monitored
-      monitor_fds_.insert({conn_and_bool.first->from_user_fifo_fd(),full_id});
+  /* If requested, create a pool of crypto workers, shared by all the Connections, so
+     that the packets of a single busy Connection can be encrypted and decrypted on
+     several cores at once */
+  if(num_crypto_workers > 0){
+    crypto_pool_ = std::make_shared<CryptoWorkerPool>(num_crypto_workers);
+  }
 
-      connections_.insert({full_id,std::move(conn_and_bool)});
-    }
+  /* create the Connections. The records, Bundlers and PathProbers are set up first, one
+     peer after another, and then the Connections themselves are created on several
+     threads at once, as each spends most of its creation deriving its keys and creating
+     its fifos, which the others do not depend on */
+  std::chrono::steady_clock::time_point connections_start = std::chrono::steady_clock::now();
+  std::vector<connection_job> jobs;
+  for(auto const& peer_config : peer_configs){
+    plan_peer(peer_config,jobs);
   }
+  startup_threads_ = run_jobs(jobs);
+  startup_connections_micros_ = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now()-connections_start).count();
 
   /* spawn all of the threads */
   for(unsigned int i=0; i<num_connection_workers; i++){
@@ -179,6 +235,14 @@ Session::Session(const host_id_type& self_id,
   }
   udp_socket_thread_ = std::thread(&Session::udp_socket_thread_func,this);
   fifo_monitor_thread_ = std::thread(&Session::fifo_monitor_thread_func,this);
+  startup_micros_ = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now()-start_time_).count();
+
+  /* if requested, serve metrics on a Unix-domain socket */
+  if(metrics_socket_path != ""){
+    metrics_server_ = std::make_unique<MetricsServer>(metrics_socket_path,
+                                                      [this](){ return metrics(); });
+  }
 
 }
 
@@ -202,6 +266,9 @@ Session::~Session()
  */
 void Session::stop()
 {
+  /* stop serving metrics first, as the metrics server reads from the Connections */
+  metrics_server_.reset();
+
   /* set stopping_ to true to signal the connection worker threads to shut down, and
      then wake up any that are waiting on session_condvar_ so that they see this
      signal */
@@ -267,32 +334,29 @@ void Session::udp_socket_thread_func()
     if(!msg.valid){
       continue;
     }
+    msg.arrival_nanos = monotonic_nanos();
 
     /* ignore messages which are too short to be valid */
-    if(msg.data.size() < connection_id_size){
+    if(msg.data.size() < ConnectionTable::connection_id_size){
       continue;
     }
 
     /* look up which Connection this message is for, based on the bytes at the start
-       of the message */
-    connection_id_type conn_id;
-    std::copy(msg.data.begin(),msg.data.begin()+connection_id_size,conn_id.begin());
-    auto it = connections_.find(conn_id);
-    if(it == connections_.end()){
-      continue; // ignore messages which don't have a valid Connection id
-    }
-
-    /* Add  the message to the Connection's message queue. Note that "it" is an iterator
-       whose value type is a std::pair with first-type connection_id_type and second-type
-       another std::pair, with first-type unique_ptr to a Connection and second-type bool */
-    (*it).second.first->add_message(msg);
-
-    /* add the Connection to the queue for a connection worker thread */
+       of the message, add the message to the Connection's message queue, and add the
+       Connection to the queue for a connection worker thread */
+    nanos_t arrival_nanos = msg.arrival_nanos;
     { // new block to limit scope of session_lock_guard
       const std::lock_guard<std::mutex> session_lock_guard(session_lock_);
-      enqueue_connection(conn_id);
+      connection_index_type conn_index = connections_.find(msg.data.data());
+      if( (conn_index == ConnectionTable::no_index) or (not connections_[conn_index].conn) ){
+        continue; // ignore messages which don't have a valid Connection id
+      }
+      TRACEPOINT1(udp_dispatch,static_cast<unsigned int>(msg.data.size()));
+      connections_[conn_index].conn->add_message(std::move(msg));
+      enqueue_connection(conn_index);
     }
     session_condvar_.notify_one();
+    latencies_->record(PipelineStage::udp_dispatch,monotonic_nanos()-arrival_nanos);
   }
 
 }
@@ -308,8 +372,13 @@ void Session::fifo_monitor_thread_func()
   /* poll_fds stores details of file descriptors for use in a call to poll()
      poll_fds[0] will always hold details of monitor_wake_read_fd_, the read
      end of a pipe which is used to wake the thread from a poll() call and to
-     pass it a message that it is time to exit */
-  std::vector<pollfd> poll_fds(connections_.size()+1);
+     pass it a message that it is time to exit.
+     As well as a Connection's fifo from the user, we may poll on its fifo to the user, to
+     find out when that can take data which the Connection has had to stage, so
+     poll_fd_keys[i] records the key in monitor_fds_ of the Connection which poll_fds[i]
+     was added for */
+  std::vector<pollfd> poll_fds((2*connections_.size())+1);
+  std::vector<int> poll_fd_keys((2*connections_.size())+1);
   poll_fds[0].fd = monitor_wake_read_fd_;
   poll_fds[0].events = POLLIN;
   poll_fds[0].revents = 0;
@@ -328,14 +397,19 @@ void Session::fifo_monitor_thread_func()
        positive value below. */
     int poll_timeout = -1;
 
+    /* flush_deadline is the earliest time (from monotonic_nanos() ) at which a Connection
+       must send data which it is holding back (see Connection::flush_due() ), or 0 if
+       there is no such time */
+    nanos_t flush_deadline = 0;
+
     {/* new block to limit the scope of session_lock_guard */
       const std::lock_guard<std::mutex> session_lock_guard(session_lock_);
 
-      /* enqueue any connections whose fifos have data to read */
+      /* enqueue any connections whose fifos have data to read, or can take staged data */
       for(unsigned int i=1; i<num_poll_fds; i++){
         //NB i starts at 1 to ignore monitor_wake_read_fd_
-        if(poll_fds[i].revents & POLLIN){
-          auto it = monitor_fds_.find(poll_fds[i].fd);
+        if(poll_fds[i].revents & (poll_fds[i].events | POLLERR)){
+          auto it = monitor_fds_.find(poll_fd_keys[i]);
           if(it == monitor_fds_.end()){
             /* this Connection has been enqueued since the last poll(), so there is nothing
                to do */
@@ -347,16 +421,19 @@ void Session::fifo_monitor_thread_func()
       }
 
       /* Ensure that there is enough space in poll_fds for all of the file descriptors
-         we might want to use. Note that this resize will never be called in the current
-         code, as the list of Connections does not change during the Session's lifetime.
-         However, this may change in the future, so we may as well cater for this now. */
-      if(poll_fds.size() < monitor_fds_.size()+1){
-        poll_fds.resize(monitor_fds_.size()+1);
+         we might want to use, as Connections may have been added by reload() */
+      if(poll_fds.size() < (2*monitor_fds_.size())+1){
+        poll_fds.resize((2*monitor_fds_.size())+1);
+        poll_fd_keys.resize((2*monitor_fds_.size())+1);
       }
 
       /* build the list of pollfd structs for the call to poll() */
       num_poll_fds = 1;
       millis_timestamp_t millis_since_epoch = epoch_time_millis();
+      nanos_t nanos_now = monotonic_nanos();
+      std::vector<connection_index_type> due_conn_indices; // Connections due to send a
+                                                           // "hello" packet or held-back
+                                                           // data, see below
       for(auto const& it : monitor_fds_){
         /* For each Connection whose fifo is in the list for monitoring, we check whether it
            is "open" or not, i.e. if it has a peer segment number that it can use to send
@@ -368,10 +445,76 @@ void Session::fifo_monitor_thread_func()
            on the call to poll() to ensure that the Connection will be able to send another
            "hello" packet after a suitable interval. */
 
-        /* Take a reference to the Connection which owns this fifo. The Connection objects live
-           until after all of the Session threads have exited, so this reference cannot become
-           dangling. */
-        Connection& conn = *((*connections_.find(it.second)).second.first);
+        /* Take a reference to the Connection which owns this fifo. We hold session_lock_,
+           and retire_connection() removes a retired Connection's fifo from monitor_fds_
+           under that lock before the Connection is destroyed, so this reference cannot
+           become dangling while it is used here. */
+        Connection& conn = *(connections_[it.second].conn);
+
+        /* If Connections hibernate, one which has not been moved for hibernate_after_nanos_
+           is put to sleep, as it is neither being worked on nor queued while its fifo is
+           monitored, and it wakes when it is next moved with something to do (see
+           Connection::move_data() ). Otherwise we make sure that poll()
+           returns by the time it is due, with some slack so that Connections falling due
+           at about the same time are put to sleep in a single pass. */
+        if( (hibernate_after_nanos_ != 0) and (not conn.dormant()) ){
+          nanos_t hibernate_due = connections_[it.second].last_moved+hibernate_after_nanos_;
+          if(hibernate_due <= nanos_now){
+            conn.hibernate();
+          }
+          else{
+            nanos_t hibernate_deadline = hibernate_due+hibernate_after_nanos_/8;
+            if( (flush_deadline == 0) or (hibernate_deadline < flush_deadline) ){
+              flush_deadline = hibernate_deadline;
+            }
+          }
+        }
+
+        /* If the Connection has data staged for its fifo to the user, we poll for that fifo
+           becoming writable, whatever the state of its fifo from the user */
+        if(conn.output_pending()){
+          poll_fds[num_poll_fds].fd = conn.to_user_fifo_fd();
+          poll_fds[num_poll_fds].events = POLLOUT;
+          poll_fd_keys[num_poll_fds] = it.first;
+          num_poll_fds += 1;
+        }
+
+        /* If the Connection is closed and is due to send a "hello" packet as part of a
+           handshake (even with no data on its fifo), we enqueue it once we have finished
+           building the list (as enqueueing it removes it from monitor_fds_). If such a
+           "hello" packet will be due later, we make sure that poll() times out by then. */
+        millis_timestamp_t handshake_due = conn.handshake_due();
+        if(handshake_due != 0){
+          if(handshake_due <= millis_since_epoch){
+            due_conn_indices.push_back(it.second);
+            continue;
+          }
+          int millis_to_handshake = static_cast<int>(handshake_due-millis_since_epoch);
+          if( (poll_timeout == -1) or (millis_to_handshake < poll_timeout) ){
+            poll_timeout = millis_to_handshake;
+          }
+        }
+
+        /* Likewise, if the Connection is holding back data to share a packet with more
+           data, we enqueue it once it should send it anyway, or make sure that poll()
+           returns by then */
+        nanos_t flush_due = conn.flush_due();
+        if(flush_due != 0){
+          if(flush_due <= monotonic_nanos()){
+            due_conn_indices.push_back(it.second);
+            continue;
+          }
+          if( (flush_deadline == 0) or (flush_due < flush_deadline) ){
+            flush_deadline = flush_due;
+          }
+        }
+
+        /* If the Connection's data goes in frames of bundle packets and the Bundler has no
+           room for more, there is nothing it can do with data on its fifo, so we don't poll
+           on it. The Bundler has the Connection enqueued once it has room. */
+        if(conn.user_input_blocked()){
+          continue;
+        }
 
         std::pair<bool,millis_timestamp_t> conn_status = conn.open_status();
         millis_timestamp_t millis_since_hello = millis_since_epoch - conn_status.second;
@@ -393,10 +536,16 @@ void Session::fifo_monitor_thread_func()
           /* add the Connection to the list for poll() */
           poll_fds[num_poll_fds].fd = it.first;
           poll_fds[num_poll_fds].events = POLLIN;
+          poll_fd_keys[num_poll_fds] = it.first;
           num_poll_fds += 1;
         }
       }
 
+      for(auto const& conn_index : due_conn_indices){
+        enqueue_connection(conn_index);
+        num_to_notify++;
+      }
+
     }
 
     /* notify session_condvar_ once for each Connection we enqueued */
@@ -405,7 +554,7 @@ void Session::fifo_monitor_thread_func()
     }
 
     /* call poll() on the list of pollfd structs */
-    run_poll(poll_fds.data(),num_poll_fds,poll_timeout);
+    run_poll(poll_fds.data(),num_poll_fds,poll_timeout,flush_deadline);
 
     /* Clear out any data from monitor_wake_read_fd_, as it has now served
        its purpose by waking the thread from poll() and we don't want it to
@@ -456,24 +605,31 @@ void Session::connection_worker_thread_func()
       return;
     }
 
-    /* take the first Connection id from the queue... */
-    connection_id_type conn_id = connection_queue_[0];
+    /* take the first Connection index from the queue... */
+    connection_index_type conn_index = connection_queue_[0].first;
+    nanos_t queue_wait = monotonic_nanos()-connection_queue_[0].second;
+    latencies_->record(PipelineStage::scheduler_wait,queue_wait);
+    TRACEPOINT1(connection_dequeue,queue_wait);
     connection_queue_.pop_front();
 
-    /* ... and find the associated Connection. We take a reference to this Connection
-       to avoid using complicated expressions to access it. The Connection objects all
-       live until after all threads in the Session have exited, so this reference cannot
-       become dangling. */
-    auto it = connections_.find(conn_id);
-    (*it).second.second = true; // mark the Connection as "being worked on"
-    Connection& conn = *((*it).second.first);
+    /* ... and find the associated Connection, passing over one which has been retired
+       since it was queued. We take a reference to this Connection to avoid using
+       complicated expressions to access it. A Connection which is being worked on is not
+       destroyed (see retire_connection() ), so this reference cannot become dangling. */
+    ConnectionTable::Record& record = connections_[conn_index];
+    record.queued = false;
+    if(record.retired){
+      continue;
+    }
+    record.working = true; // mark the Connection as "being worked on"
+    Connection& conn = *(record.conn);
 
     /* Update the number of loop passes which connection worker threads dwell on a single
        Connection. The algorithm is simple: if the total number of Connections currently being
        worked on and in the queue is greater than the number of worker threads, reduce the
        dwell time, and otherwise increase it, always staying in the range [dwell_min,dwell_max]. */
     unsigned int num_active_connections =
-      static_cast<unsigned int>(connections_.size()-monitor_fds_.size());
+      static_cast<unsigned int>(connections_.live()-monitor_fds_.size());
     if( (connection_dwell_loops_ > dwell_min) and
         (num_active_connections > connection_worker_threads_.size()) ){
       connection_dwell_loops_ -= 1;
@@ -483,19 +639,31 @@ void Session::connection_worker_thread_func()
     }
     int my_connection_dwell_loops = connection_dwell_loops_;
 
-    /* run the Connection's move_data() method while *not* holding session_lock_ */
+    /* run the Connection's move_data() method while *not* holding session_lock_, timing
+       it for the record of how busy the connection worker threads are */
     session_unique_lock.unlock();
+    auto move_start_time = std::chrono::steady_clock::now();
     conn.move_data(my_connection_dwell_loops);
+    auto move_duration = std::chrono::steady_clock::now()-move_start_time;
+    worker_busy_micros_.add(
+      std::chrono::duration_cast<std::chrono::microseconds>(move_duration).count());
+    worker_runs_.add();
     session_unique_lock.lock();
-
-    /* If there is more data to move on this Connection, enqueue it. Otherwise, add it
-       for monitoring by the fifo monitoring thread. */
-    (*it).second.second = false; // mark the Connection as "not being worked on"
-    if(conn.is_data()){
-      enqueue_connection(conn_id);
+    connections_[conn_index].last_moved = monotonic_nanos();
+
+    /* If the Connection has been retired meanwhile, wake reload() to destroy it. Otherwise,
+       if there is more data to move on this Connection, enqueue it, or else add it for
+       monitoring by the fifo monitoring thread. (The record is looked up afresh, as the
+       records may have moved while session_lock_ was released.) */
+    connections_[conn_index].working = false; // mark the Connection as "not being worked on"
+    if(connections_[conn_index].retired){
+      retire_condvar_.notify_all();
+    }
+    else if(conn.is_data()){
+      enqueue_connection(conn_index);
     }
     else{
-      monitor_fds_.insert({conn.from_user_fifo_fd(),conn_id});
+      monitor_fds_.insert({conn.from_user_fifo_fd(),conn_index});
       wake_monitor(false); // wake the fifo monitoring thread so that it will see that it
                            // needs to monitor this fifo
     }
@@ -505,6 +673,647 @@ void Session::connection_worker_thread_func()
 }
 
 
+/* Session::metrics() reports the Session's own counters, the state of the queue of
+ * Connections waiting for a connection worker thread, and the counters of all of the
+ * Connections. It is safe to call this from any thread while the Session is running.
+ * session_lock_ is held only to count the working records and to mark the live ones as
+ * being read, which keeps retire_connection() from taking their Connections away, so the
+ * Connections' counters are read without holding up the connection worker threads.
+ */
+SessionMetrics Session::metrics()
+{
+  SessionMetrics sm;
+  sm.uptime_micros = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now()-start_time_).count();
+  sm.startup_micros = startup_micros_;
+  sm.startup_connections_micros = startup_connections_micros_;
+  sm.startup_threads = startup_threads_;
+  sm.num_connection_workers = connection_worker_threads_.size();
+  sm.worker_busy_micros = worker_busy_micros_.value();
+  sm.worker_runs = worker_runs_.value();
+
+  std::vector<std::pair<connection_index_type,Connection*>> reading;
+  {// new block to limit the scope of session_lock_guard
+    const std::lock_guard<std::mutex> session_lock_guard(session_lock_);
+    sm.queue_length = connection_queue_.size();
+    sm.connections_active = 0;
+    for(connection_index_type i=0; i<connections_.size(); i++){
+      if(connections_[i].working){
+        sm.connections_active++;
+      }
+      if( connections_[i].conn and (not connections_[i].retired) ){
+        connections_[i].readers++;
+        reading.push_back({i,connections_[i].conn.get()});
+      }
+    }
+  }
+
+  sm.connections_dormant = 0;
+  for(auto const& r : reading){
+    Connection& conn = *(r.second);
+    if(conn.dormant()){
+      sm.connections_dormant++;
+    }
+    sm.connections.push_back(NamedConnectionMetrics{conn.peer_name(),
+                                                    conn.channel_id(),
+                                                    conn.metrics()});
+  }
+
+  {// new block to limit the scope of session_lock_guard
+    const std::lock_guard<std::mutex> session_lock_guard(session_lock_);
+    bool retired = false;
+    for(auto const& r : reading){
+      connections_[r.first].readers--;
+      retired = retired or connections_[r.first].retired;
+    }
+    if(retired){
+      retire_condvar_.notify_all(); // wake retire_connection(), which may be waiting for us
+    }
+  }
+
+  for(unsigned int i=0; i<num_pipeline_stages; i++){
+    sm.stage_latencies.push_back(
+      NamedHistogram{pipeline_stage_name(static_cast<PipelineStage>(i)),
+                     latencies_->histograms[i].snapshot()});
+  }
+
+  return sm;
+}
+
+
+/* Session::local_channel() returns the LocalChannel through which an application in the
+ * same process uses the channel with id channel_id to the peer with id peer_id, which must
+ * be in local mode (see ChannelMode.h). It is safe to call this from any thread.
+ */
+std::shared_ptr<LocalChannel> Session::local_channel(const host_id_type& peer_id,
+                                                     const channel_id_type& channel_id)
+{
+  std::shared_ptr<LocalChannel> channel;
+  {// new block to limit the scope of session_lock_guard
+    const std::lock_guard<std::mutex> session_lock_guard(session_lock_);
+    connection_index_type conn_index = connections_.find(ConnectionTable::make_id(peer_id,
+                                                                                  channel_id));
+    if( (conn_index == ConnectionTable::no_index) or (not connections_[conn_index].conn) ){
+      throw std::runtime_error("Session: no such channel for local_channel()");
+    }
+    channel = connections_[conn_index].conn->local_channel();
+  }
+  if(not channel){
+    throw std::runtime_error("Session: channel is not in local mode");
+  }
+  return channel;
+}
+
+
+/* Session::reload() brings the Session's Connections into line with a new list of peer
+ * configurations, such as one read afresh from the config file, while the Session runs.
+ * The Connections of peers which have gone, and of channels which have gone or whose
+ * settings have changed, are retired (once any connection worker thread has finished with
+ * them) and destroyed, and Connections are created for the peers and channels which are
+ * new or changed. Every other Connection carries on as it was, keeping its segment numbers
+ * and its handshake with the peer.
+ *
+ * A change to a peer's own settings (its address, key and so on) replaces all of its
+ * Connections, as does any change to the channels of a peer with bundling enabled, as
+ * they share a Bundler. The settings of the Session itself cannot be reloaded. If a
+ * Connection cannot be created, all of its peer's Connections are retired before the
+ * error is thrown, so that a later reload() will create them afresh.
+ *
+ * It is safe to call this from any thread, but not once stop() has been called.
+ */
+void Session::reload(const std::vector<PeerConfig>& peer_configs)
+{
+  const std::lock_guard<std::mutex> reload_lock_guard(reload_lock_);
+
+  std::set<host_id_type> peer_ids;
+  for(auto const& peer_config : peer_configs){
+    peer_ids.insert(peer_config.id);
+    auto it = peers_.find(peer_config.id);
+    if(it == peers_.end()){
+      add_peer(peer_config);
+      continue;
+    }
+
+    PeerConfig old_config = (*it).second.config;
+    try{
+      std::vector<ChannelSettings> old_settings = channel_settings(old_config,
+                                                                   default_pipe_size_);
+      std::vector<ChannelSettings> new_settings = channel_settings(peer_config,
+                                                                   default_pipe_size_);
+      if( (not same_peer_settings(old_config,peer_config)) or
+          ( (peer_config.bundle_window_micros != 0) and
+            (not std::equal(old_settings.begin(),old_settings.end(),
+                            new_settings.begin(),new_settings.end(),same_settings)) ) ){
+        retire_peer(old_config);
+        peers_.erase(it);
+        add_peer(peer_config);
+        continue;
+      }
+
+      std::map<channel_id_type,const ChannelSettings*> old_by_id;
+      for(auto const& settings : old_settings){
+        old_by_id[settings.id] = &settings;
+      }
+      std::map<channel_id_type,const ChannelSettings*> new_by_id;
+      for(auto const& settings : new_settings){
+        new_by_id[settings.id] = &settings;
+      }
+
+      /* retire the channels which have gone or changed, and only then create those which
+         are new or changed, as a changed channel's new Connection may use the same files */
+      for(auto const& settings : old_settings){
+        auto found = new_by_id.find(settings.id);
+        if( (found == new_by_id.end()) or (not same_settings(settings,*(*found).second)) ){
+          retire_connection(peer_config.id,settings.id);
+        }
+      }
+      std::vector<connection_job> jobs;
+      std::shared_ptr<PathProber> path_prober = (*it).second.path_prober;
+      for(auto const& settings : new_settings){
+        auto found = old_by_id.find(settings.id);
+        if( (found == old_by_id.end()) or (not same_settings(settings,*(*found).second)) ){
+          connection_index_type conn_index = insert_connection(peer_config.id,settings.id);
+          jobs.push_back([this,&peer_config,settings,conn_index,path_prober](){
+              add_channel(peer_config,settings,conn_index,nullptr,path_prober);
+            });
+        }
+      }
+      run_jobs(jobs);
+      (*it).second.config = peer_config;
+    }
+    catch(...){
+      retire_peer(old_config);
+      retire_peer(peer_config);
+      peers_.erase(peer_config.id);
+      throw;
+    }
+  }
+
+  /* retire the peers which have gone */
+  for(auto it = peers_.begin(); it != peers_.end(); ){
+    if(peer_ids.count((*it).first) == 0){
+      retire_peer((*it).second.config);
+      it = peers_.erase(it);
+    }
+    else{
+      ++it;
+    }
+  }
+
+  wake_monitor(false); // so that the fifo monitoring thread drops any retired fifos
+}
+
+
+/* Session::add_peer() creates the Connections for the channels to a peer, along with the
+ * peer's bundle and probe Connections if it has bundling or path MTU discovery enabled,
+ * and records the peer in peers_. If any of the Connections cannot be created, those which
+ * have been are retired before the error is thrown.
+ */
+void Session::add_peer(const PeerConfig& peer_config)
+{
+  try{
+    std::vector<connection_job> jobs;
+    plan_peer(peer_config,jobs);
+    run_jobs(jobs);
+  }
+  catch(...){
+    retire_peer(peer_config);
+    peers_.erase(peer_config.id);
+    throw;
+  }
+}
+
+
+/* Session::plan_peer() prepares for the Connections to a peer to be created, by giving
+ * each its record in connections_, creating the Bundler and PathProber which they share
+ * if the peer has bundling or path MTU discovery enabled, and recording the peer in
+ * peers_. The Connections themselves are left to the jobs which this adds to jobs, for
+ * run_jobs() to run, and peer_config must outlive them.
+ */
+void Session::plan_peer(const PeerConfig& peer_config, std::vector<connection_job>& jobs)
+{
+  // a value of -1 in peer_config.max_packet_size indicates that no maximum packet size
+  // was specified for this peer
+  unsigned int max_packet_size = (peer_config.max_packet_size == -1) ?
+    default_max_packet_size_ : peer_config.max_packet_size;
+
+  // give each of the peer's channels its record in connections_ first, so that the
+  // channels' Connections can be referred to by their indices from the start
+  std::vector<ChannelSettings> settings = channel_settings(peer_config,default_pipe_size_);
+  std::vector<connection_index_type> channel_indices;
+  for(auto const& channel : settings){
+    channel_indices.push_back(insert_connection(peer_config.id,channel.id));
+  }
+
+  // if the peer has bundling enabled, its channels share a Bundler (see Bundler.h)
+  std::shared_ptr<Bundler> bundler;
+  if(peer_config.bundle_window_micros != 0){
+    bundler = make_bundler(peer_config,max_packet_size,channel_indices);
+  }
+
+  // if the peer has path MTU discovery enabled, a PathProber finds the largest packets
+  // which get through to it (see PathProber.h), and the probes are sent via probe_socket_
+  std::shared_ptr<PathProber> path_prober;
+  if(peer_config.probe_max_size != 0){
+    path_prober = std::make_shared<PathProber>(Connection::max_data_len(max_packet_size),
+                                               Connection::max_data_len(peer_config.probe_max_size));
+    if(not probe_socket_){
+      probe_socket_ = std::make_shared<UDPSocket>(self_ip_addr_,0);
+      probe_socket_->set_mtu_probing();
+    }
+  }
+
+  // create a Connection for each of the peer's channels
+  for(unsigned int c=0; c<settings.size(); c++){
+    jobs.push_back([this,&peer_config,channel=settings[c],conn_index=channel_indices[c],
+                    bundler,path_prober](){
+        add_channel(peer_config,channel,conn_index,bundler,path_prober);
+      });
+  }
+
+  // create the bundle Connection, on the reserved channel id, which carries the Bundler's
+  // frames to and from the peer
+  if(bundler){
+    connection_index_type conn_index = insert_connection(peer_config.id,
+                                                         Bundler::bundle_channel_id);
+    jobs.push_back([this,&peer_config,max_packet_size,conn_index,bundler](){
+        ConnectionSettings conn_settings;
+        conn_settings.cipher_suite = peer_config.cipher_suite;
+        conn_settings.crypto_pool = crypto_pool_;
+        conn_settings.latencies = latencies_;
+        conn_settings.channel_mode = ChannelMode::bundle;
+        conn_settings.bundler = bundler;
+        install_connection(conn_index,
+                           std::make_unique<Connection>(self_id_,
+                                                        peer_config.name,
+                                                        peer_config.id,
+                                                        Bundler::bundle_channel_id,
+                                                        "",
+                                                        peer_config.key,
+                                                        peer_config.ip_addr,
+                                                        peer_config.port,
+                                                        max_packet_size,
+                                                        udp_socket_,
+                                                        segnumgen_,
+                                                        conn_settings),
+                           true);
+      });
+  }
+
+  // likewise create the probe Connection, on its reserved channel id, which carries the
+  // PathProber's probes and acknowledgements
+  if(path_prober){
+    connection_index_type conn_index = insert_connection(peer_config.id,
+                                                         PathProber::probe_channel_id);
+    jobs.push_back([this,&peer_config,conn_index,path_prober](){
+        ConnectionSettings conn_settings;
+        conn_settings.cipher_suite = peer_config.cipher_suite;
+        conn_settings.crypto_pool = crypto_pool_;
+        conn_settings.latencies = latencies_;
+        conn_settings.channel_mode = ChannelMode::probe;
+        conn_settings.path_prober = path_prober;
+        install_connection(conn_index,
+                           std::make_unique<Connection>(self_id_,
+                                                        peer_config.name,
+                                                        peer_config.id,
+                                                        PathProber::probe_channel_id,
+                                                        "",
+                                                        peer_config.key,
+                                                        peer_config.ip_addr,
+                                                        peer_config.port,
+                                                        peer_config.probe_max_size,
+                                                        probe_socket_,
+                                                        segnumgen_,
+                                                        conn_settings),
+                           true);
+      });
+  }
+
+  peers_[peer_config.id] = PeerState{peer_config,path_prober};
+}
+
+
+/* Session::run_jobs() runs jobs, each of which creates a Connection, spread over as many
+ * threads as there are cores (within limits), and returns the number of threads used.
+ * Creating a Connection mostly means deriving its keys and creating its fifos, which
+ * each Connection does independently of the others. If any job throws, the jobs not yet
+ * started are abandoned, and the first error is thrown once all the threads are done.
+ */
+unsigned int Session::run_jobs(const std::vector<connection_job>& jobs)
+{
+  std::size_t num_threads = std::max(1u,std::thread::hardware_concurrency());
+  num_threads = std::min<std::size_t>(num_threads,max_startup_threads);
+  num_threads = std::min<std::size_t>(num_threads,
+                                      (jobs.size()+min_jobs_per_startup_thread-1)/
+                                      min_jobs_per_startup_thread);
+
+  std::atomic<std::size_t> next_job(0);
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex error_lock;
+  auto run = [&](){
+    for(std::size_t j = next_job++; (j < jobs.size()) and (not failed); j = next_job++){
+      try{
+        jobs[j]();
+      }
+      catch(...){
+        const std::lock_guard<std::mutex> error_lock_guard(error_lock);
+        if(not error){
+          error = std::current_exception();
+        }
+        failed = true;
+      }
+    }
+  };
+
+  // the calling thread runs jobs too, so it is one of the threads
+  std::vector<std::thread> threads;
+  for(std::size_t i=1; i<num_threads; i++){
+    try{
+      threads.push_back(std::thread(run));
+    }
+    catch(const std::system_error&){
+      break; // make do with the threads there are
+    }
+  }
+  run();
+  for(auto& t : threads){
+    t.join();
+  }
+
+  if(error){
+    std::rethrow_exception(error);
+  }
+  return threads.size()+1;
+}
+
+
+/* Session::add_channel() creates the Connection for the channel with settings settings to
+ * the peer with configuration peer_config, in the record with index conn_index, which
+ * sends its data via bundler and path_prober if they are not null. It may be called from
+ * several threads at once.
+ */
+void Session::add_channel(const PeerConfig& peer_config,
+                          const ChannelSettings& settings,
+                          connection_index_type conn_index,
+                          const std::shared_ptr<Bundler>& bundler,
+                          const std::shared_ptr<PathProber>& path_prober)
+{
+  unsigned int max_packet_size = (peer_config.max_packet_size == -1) ?
+    default_max_packet_size_ : peer_config.max_packet_size;
+
+  /* a channel in fifo mode which is not bundled sends packets as large as the PathProber
+     finds will get through, so its buffers must allow for the largest */
+  unsigned int channel_max_packet_size =
+    (path_prober and (settings.mode == ChannelMode::fifo) and (not bundler)) ?
+    peer_config.probe_max_size : max_packet_size;
+
+  ConnectionSettings conn_settings;
+  conn_settings.cipher_suite = peer_config.cipher_suite;
+  conn_settings.crypto_pool = crypto_pool_;
+  conn_settings.latencies = latencies_;
+  conn_settings.fifo_pipe_size = settings.pipe_size;
+  conn_settings.channel_mode = settings.mode;
+  conn_settings.bundler = bundler;
+  conn_settings.coalesce_window_micros = settings.coalesce_window;
+  conn_settings.path_prober = path_prober;
+  /* messages longer than a packet can carry are sent in fragments if the peer has a
+     maximum message size, which only applies to the modes which keep message boundaries */
+  conn_settings.max_message_size =
+    ( (settings.mode == ChannelMode::seqpacket) or (settings.mode == ChannelMode::shm) or
+      (settings.mode == ChannelMode::local) ) ? peer_config.max_message_size : 0;
+  conn_settings.compression = settings.compression;
+  conn_settings.fec = settings.fec;
+
+  /* A bundled channel's data is sent by the bundle Connection, so it has no use for a
+     handshake of its own. Any other has its Connection exchange segment numbers with its
+     peer straight away, so that it is open before any data arrives on its fifo, unless
+     Connections hibernate, in which case it is left asleep until the channel is used. */
+  install_connection(conn_index,
+                     std::make_unique<Connection>(self_id_,
+                                                  peer_config.name,
+                                                  peer_config.id,
+                                                  settings.id,
+                                                  settings.path,
+                                                  peer_config.key,
+                                                  peer_config.ip_addr,
+                                                  peer_config.port,
+                                                  channel_max_packet_size,
+                                                  udp_socket_,
+                                                  segnumgen_,
+                                                  conn_settings),
+                     (not bundler) and (hibernate_after_nanos_ == 0));
+}
+
+
+/* Session::insert_connection() adds a record to connections_ for the Connection for the
+ * channel with id channel_id to the peer with id peer_id, which is yet to be created, and
+ * returns its index. Until install_connection() is called, the record is passed over by
+ * the Session's threads.
+ */
+Session::connection_index_type Session::insert_connection(const host_id_type& peer_id,
+                                                          const channel_id_type& channel_id)
+{
+  const std::lock_guard<std::mutex> session_lock_guard(session_lock_);
+  return connections_.insert(ConnectionTable::make_id(peer_id,channel_id));
+}
+
+
+/* Session::install_connection() puts a newly created Connection in its record in
+ * connections_, has it start a handshake with its peer if handshake is true, and hands its
+ * fifo to the fifo monitoring thread
+ */
+void Session::install_connection(connection_index_type conn_index,
+                                 std::unique_ptr<Connection> conn,
+                                 bool handshake)
+{
+  if(handshake){
+    conn->start_handshake();
+  }
+  {
+    const std::lock_guard<std::mutex> session_lock_guard(session_lock_);
+    monitor_fds_.insert({conn->from_user_fifo_fd(),conn_index});
+    connections_[conn_index].conn = std::move(conn);
+    connections_[conn_index].last_moved = monotonic_nanos();
+  }
+  if(fifo_monitor_thread_.joinable()){
+    wake_monitor(false);
+  }
+}
+
+
+/* Session::retire_peer() retires and destroys all of the Connections to the peer with
+ * configuration peer_config
+ */
+void Session::retire_peer(const PeerConfig& peer_config)
+{
+  for(auto const& ch_spec : peer_config.channels){
+    retire_connection(peer_config.id,ch_spec.first);
+  }
+  retire_connection(peer_config.id,Bundler::bundle_channel_id);
+  retire_connection(peer_config.id,PathProber::probe_channel_id);
+}
+
+
+/* Session::retire_connection() removes the Connection for the channel with id channel_id
+ * to the peer with id peer_id, if there is one, from connections_ and from the fifos being
+ * monitored, waiting for any connection worker thread which is working on it, and for any
+ * call of metrics() which is reading its counters, to finish.
+ * The Connection is returned, to be destroyed once session_lock_ has been released.
+ */
+std::unique_ptr<Connection> Session::retire_connection(const host_id_type& peer_id,
+                                                       const channel_id_type& channel_id)
+{
+  std::unique_lock<std::mutex> session_unique_lock(session_lock_);
+  connection_index_type conn_index = connections_.find(ConnectionTable::make_id(peer_id,
+                                                                                channel_id));
+  if(conn_index == ConnectionTable::no_index){
+    return nullptr;
+  }
+  connections_.remove(conn_index);
+  while( connections_[conn_index].working or (connections_[conn_index].readers != 0) ){
+    retire_condvar_.wait(session_unique_lock);
+  }
+
+  std::unique_ptr<Connection> conn = std::move(connections_[conn_index].conn);
+  if(conn){
+    auto it = monitor_fds_.find(conn->from_user_fifo_fd());
+    if( (it != monitor_fds_.end()) and ((*it).second == conn_index) ){
+      monitor_fds_.erase(it);
+    }
+  }
+  return conn;
+}
+
+
+/* Session::channel_settings() gives the settings of each of the channels to the peer with
+ * configuration peer_config, in the order of peer_config.channels, where
+ * default_pipe_size is the Session's default. The settings for single channels are
+ * applied through an index of the channels, so that this takes time in proportion to
+ * the number of channels even when most of them have settings of their own.
+ */
+std::vector<Session::ChannelSettings> Session::channel_settings(const PeerConfig& peer_config,
+                                                                unsigned int default_pipe_size)
+{
+  // the capacity of a channel's fifos is taken from a setting for the channel if there
+  // is one, or else for the peer, or else the default (a value of 0 in any of these
+  // means no setting, and a final value of 0 leaves the kernel's default); a channel is
+  // in fifo mode unless a different mode is set for it; data from the user is sent as
+  // soon as it is read unless a coalescing window is set for the channel or for the
+  // peer (only channels in fifo mode use it); and a channel's payloads are compressed,
+  // and its packets protected by forward error correction, if that is set for the
+  // channel, or else for the peer
+  std::vector<ChannelSettings> settings;
+  std::map<channel_id_type,unsigned int> positions;
+  for(auto const& ch_spec : peer_config.channels){
+    positions[ch_spec.first] = settings.size();
+    settings.push_back(ChannelSettings{ch_spec.first,
+                                       ch_spec.second,
+                                       (peer_config.pipe_size == 0) ?
+                                         default_pipe_size : peer_config.pipe_size,
+                                       ChannelMode::fifo,
+                                       peer_config.coalesce_window_micros,
+                                       peer_config.compression,
+                                       peer_config.fec});
+  }
+  override_setting(settings,positions,peer_config.channel_pipe_sizes,
+                   &ChannelSettings::pipe_size);
+  override_setting(settings,positions,peer_config.channel_modes,&ChannelSettings::mode);
+  override_setting(settings,positions,peer_config.channel_coalesce_windows,
+                   &ChannelSettings::coalesce_window);
+  override_setting(settings,positions,peer_config.channel_compressions,
+                   &ChannelSettings::compression);
+  override_setting(settings,positions,peer_config.channel_fecs,&ChannelSettings::fec);
+  return settings;
+}
+
+
+/* Session::same_settings() reports whether two channels have the same id and settings */
+bool Session::same_settings(const ChannelSettings& a, const ChannelSettings& b)
+{
+  return (a.id == b.id) and (a.path == b.path) and (a.pipe_size == b.pipe_size) and
+    (a.mode == b.mode) and (a.coalesce_window == b.coalesce_window) and
+    (a.compression == b.compression) and (a.fec == b.fec);
+}
+
+
+/* Session::make_bundler() creates the Bundler shared by the channels to the peer with
+ * configuration peer_config, which has bundling enabled, and whose Connections have the
+ * indices channel_indices in connections_. The frames which arrive for each
+ * channel are passed to the channel's Connection, which is then enqueued to write them to
+ * the user. The Connection is found from the frame's channel id through a map of the
+ * channels' indices made here, rather than by looking its id up in connections_. This
+ * never needs refreshing, as any change to the channels of a peer with bundling enabled
+ * replaces the Bundler along with all of the peer's Connections (see reload() ). A frame
+ * is ignored unless its channel is in the map and its record is live and holds a
+ * Connection built with this Bundler, as the frame's channel id comes from the peer (and
+ * may be that of the bundle or probe Connection), and a record may have been retired
+ * (and even used again) since. When the Connections of the channels have had to stop pushing frames
+ * because the Bundler was full, they are all enqueued once it has room again.
+ */
+std::shared_ptr<Bundler> Session::make_bundler(const PeerConfig& peer_config,
+                                               unsigned int max_packet_size,
+                                               const std::vector<connection_index_type>&
+                                                 channel_indices)
+{
+  std::map<channel_id_type,connection_index_type> indices_by_channel;
+  { // new block to limit scope of session_lock_guard
+    const std::lock_guard<std::mutex> session_lock_guard(session_lock_);
+    for(auto const& conn_index : channel_indices){
+      const ConnectionTable::connection_id_type& id = connections_[conn_index].id;
+      channel_id_type channel_id;
+      std::copy(id.begin()+host_id_size,id.end(),channel_id.begin());
+      indices_by_channel[channel_id] = conn_index;
+    }
+  }
+
+  /* the Bundler does not exist until the functions it is given have been made, so they
+     find it through this, which is set once it has been created */
+  auto self = std::make_shared<const Bundler*>(nullptr);
+
+  auto deliver = [this,indices_by_channel,self](const channel_id_type& channel_id,
+                                                const unsigned char* data,
+                                                unsigned int count){
+    auto found = indices_by_channel.find(channel_id);
+    if(found == indices_by_channel.end()){
+      return; // ignore frames which are not for one of the peer's channels
+    }
+    connection_index_type conn_index = (*found).second;
+    { // new block to limit scope of session_lock_guard
+      const std::lock_guard<std::mutex> session_lock_guard(session_lock_);
+      if( connections_[conn_index].retired or
+          (not connections_[conn_index].conn) or
+          (not connections_[conn_index].conn->uses_bundler(*self)) ){
+        return; // ignore frames which are not for one of this Bundler's channels
+      }
+      connections_[conn_index].conn->add_bundled_payload(data,count);
+      enqueue_connection(conn_index);
+    }
+    session_condvar_.notify_one();
+  };
+
+  auto wake_senders = [this,channel_indices,self](){
+    { // new block to limit scope of session_lock_guard
+      const std::lock_guard<std::mutex> session_lock_guard(session_lock_);
+      for(auto const& conn_index : channel_indices){
+        if( connections_[conn_index].conn and
+            connections_[conn_index].conn->uses_bundler(*self) ){
+          enqueue_connection(conn_index);
+        }
+      }
+    }
+    session_condvar_.notify_all();
+  };
+
+  std::shared_ptr<Bundler> bundler =
+    std::make_shared<Bundler>(Connection::max_data_len(max_packet_size),
+                              peer_config.bundle_window_micros,
+                              deliver,wake_senders);
+  *self = bundler.get();
+  return bundler;
+}
+
+
 /* Session::wake_monitor() writes to the internal fifo to break fifo_monitor_thread_func()
  * out of its poll() call to update the list of file descriptors it is monitoring. The actual
  * data written is a single char, which normally has value 0, but has value 1 if we wish the
@@ -517,36 +1326,27 @@ void Session::wake_monitor(bool stop_thread)
 }
 
 
-/* Session::enqueue_connection() adds a Connection's id to the queue for time on a
+/* Session::enqueue_connection() adds the index of a Connection to the queue for time on a
  * connection worker thread if it is not already in the queue, and removes the file
  * descriptor for the Connection's input fifo from the list of fds to be monitored.
  *
  * This method should *only* be called if you hold the Session's session_lock_
  */
-void Session::enqueue_connection(const connection_id_type& conn_id)
+void Session::enqueue_connection(connection_index_type conn_index)
 {
-  /* find the Connection for this id */
-  auto it = connections_.find(conn_id);
-  if(it == connections_.end()){
-    throw std::runtime_error("Session: unknown connection id passed to be enqueued");
-  }
-
-  /* if the Connection indexed by conn_id is already "being worked on", we have nothing
-   to do */
-  if((*it).second.second){
-    return;
-  }
+  ConnectionTable::Record& record = connections_[conn_index];
 
-  /* if conn_id is already in the queue, we have nothing to do */
-  if(std::find(connection_queue_.begin(),connection_queue_.end(),conn_id)
-     != connection_queue_.end()){
+  /* if the Connection is already "being worked on", or is already in the queue, or has
+     been retired or not yet installed, we have nothing to do */
+  if(record.working or record.queued or record.retired or (not record.conn)){
     return;
   }
 
-  /* put the conn_id in the queue */
-  connection_queue_.push_back(conn_id);
+  /* put the index in the queue, with the time for measuring how long it waits there */
+  record.queued = true;
+  connection_queue_.push_back({conn_index,monotonic_nanos()});
+  TRACEPOINT1(connection_enqueue,static_cast<unsigned int>(connection_queue_.size()));
 
   /* remove the Connection's fifo fd from monitor_fds_ */
-  int fifo_fd = (*it).second.first->from_user_fifo_fd();
-  monitor_fds_.erase(fifo_fd);
+  monitor_fds_.erase(record.conn->from_user_fifo_fd());
 }
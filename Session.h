@@ -1,6 +1,8 @@
 /* Session is the primary top-level object of the application, representing a
  * single running instance of cryptocomms. Session provides the interface via
- * which an instance of cryptocomms is created and run.
+ * which an instance of cryptocomms is created and run, either by the cryptocomms
+ * binary or by an application linked with libcryptocomms, which can use channels
+ * in local mode through local_channel().
  */
 
 /* This unit is currently under construction, and does not yet implement the
@@ -19,14 +21,21 @@
 #include <condition_variable>
 #include <memory>
 #include <thread>
+#include <chrono>
 #include <netinet/in.h> // for in_port_t
 #include <utility>
+#include <set>
+#include <functional>
 
 #include "IDTypes.h"
 #include "Connection.h"
+#include "ConnectionTable.h"
 #include "SegmentNumGenerator.h"
 #include "PeerConfig.h"
 #include "UDPSocket.h"
+#include "Metrics.h"
+#include "MetricsServer.h"
+#include "LatencyHistogram.h"
 
 class Session{
 public:
@@ -36,24 +45,75 @@ public:
           unsigned int default_max_packet_size,
           const std::vector<PeerConfig>& peer_configs,
           const std::string& segnum_file_path,
-          unsigned int num_connection_workers = 5);
+          unsigned int num_connection_workers = 5,
+          unsigned int num_crypto_workers = 0,
+          const std::string& metrics_socket_path = "",
+          unsigned int default_pipe_size = 0,
+          unsigned int hibernate_after_millis = 0);
   ~Session();
   void stop();
+  void reload(const std::vector<PeerConfig>& peer_configs);
+  SessionMetrics metrics();
+  std::shared_ptr<LocalChannel> local_channel(const host_id_type& peer_id,
+                                              const channel_id_type& channel_id);
 
 private:
-  constexpr static int connection_id_size =  host_id_size+channel_id_size;
-  typedef std::array<unsigned char,connection_id_size> connection_id_type;
-  typedef std::pair<std::unique_ptr<Connection>,bool> connection_and_bool_type;
+  typedef ConnectionTable::index_type connection_index_type;
+
+  /* PeerState records the configuration from which the Connections to a peer were
+     created, and the PathProber which they share, if any, for reload() to compare a new
+     configuration against */
+  struct PeerState
+  {
+    PeerConfig config;
+    std::shared_ptr<PathProber> path_prober;
+  };
+
+  /* ChannelSettings holds the settings of a channel, as they come from its peer's
+     configuration once any settings for the single channel have overridden the peer's */
+  struct ChannelSettings
+  {
+    channel_id_type id;
+    std::string path;
+    unsigned int pipe_size;
+    ChannelMode mode;
+    unsigned int coalesce_window;
+    bool compression;
+    bool fec;
+  };
+
+  /* a job creates one Connection, and the jobs of a startup or a reload are run on
+     several threads at once by run_jobs() */
+  typedef std::function<void()> connection_job;
 
   host_id_type self_id_;
+  std::string self_ip_addr_;
   unsigned int default_max_packet_size_;
+  unsigned int default_pipe_size_;
+  /* hibernate_after_nanos_ is how long a Connection is left unmoved before it is put to
+     sleep (see Connection::hibernate() ), where 0 means that Connections never sleep */
+  nanos_t hibernate_after_nanos_;
   std::shared_ptr<UDPSocket> udp_socket_;
+  /* probe_socket_ sends the packets of the probe Connections of peers with path MTU
+     discovery enabled (see PathProber.h), which must not be fragmented. It is null if no
+     peer has path MTU discovery enabled. */
+  std::shared_ptr<UDPSocket> probe_socket_;
   std::shared_ptr<SegmentNumGenerator> segnumgen_;
-  std::map<connection_id_type,connection_and_bool_type> connections_;
-  std::map<int,connection_id_type> monitor_fds_;
+  std::shared_ptr<CryptoWorkerPool> crypto_pool_;
+  /* connections_ holds the Connections, which are referred to everywhere else by their
+     indices in it, and monitor_fds_ maps the fifo fds being monitored to those indices */
+  ConnectionTable connections_;
+  std::map<int,connection_index_type> monitor_fds_;
+  std::map<host_id_type,PeerState> peers_;
   std::mutex session_lock_;
   std::condition_variable session_condvar_;
-  std::deque<connection_id_type> connection_queue_;
+  /* retire_condvar_ is notified when a connection worker thread or metrics() finishes with
+     a Connection which has been retired meanwhile, so that reload() can destroy it */
+  std::condition_variable retire_condvar_;
+  std::mutex reload_lock_; // held throughout reload(), so that reloads happen one at a time
+  /* connection_queue_ holds the indices of the Connections waiting for a connection
+     worker thread, each with the time (from monotonic_nanos()) at which it was queued */
+  std::deque<std::pair<connection_index_type,nanos_t>> connection_queue_;
   unsigned int connection_dwell_loops_;
   int monitor_wake_read_fd_;
   int monitor_wake_write_fd_;
@@ -61,6 +121,14 @@ private:
   int udp_thread_stop_write_fd_;
   bool stopping_;
   bool active_;
+  std::chrono::steady_clock::time_point start_time_;
+  metric_value_t startup_micros_; // time taken by the constructor
+  metric_value_t startup_connections_micros_; // part of that taken creating the Connections
+  metric_value_t startup_threads_; // threads which created the Connections
+  MetricCounter worker_busy_micros_;
+  MetricCounter worker_runs_;
+  std::shared_ptr<PipelineLatencies> latencies_;
+  std::unique_ptr<MetricsServer> metrics_server_;
 
   std::thread udp_socket_thread_;
   std::thread fifo_monitor_thread_;
@@ -70,8 +138,31 @@ private:
   void fifo_monitor_thread_func();
   void connection_worker_thread_func();
 
+  void add_peer(const PeerConfig& peer_config);
+  void plan_peer(const PeerConfig& peer_config, std::vector<connection_job>& jobs);
+  unsigned int run_jobs(const std::vector<connection_job>& jobs);
+  void add_channel(const PeerConfig& peer_config,
+                   const ChannelSettings& settings,
+                   connection_index_type conn_index,
+                   const std::shared_ptr<Bundler>& bundler,
+                   const std::shared_ptr<PathProber>& path_prober);
+  connection_index_type insert_connection(const host_id_type& peer_id,
+                                          const channel_id_type& channel_id);
+  void install_connection(connection_index_type conn_index,
+                          std::unique_ptr<Connection> conn,
+                          bool handshake);
+  void retire_peer(const PeerConfig& peer_config);
+  std::unique_ptr<Connection> retire_connection(const host_id_type& peer_id,
+                                                const channel_id_type& channel_id);
+  std::shared_ptr<Bundler> make_bundler(const PeerConfig& peer_config,
+                                        unsigned int max_packet_size,
+                                        const std::vector<connection_index_type>&
+                                          channel_indices);
+  static std::vector<ChannelSettings> channel_settings(const PeerConfig& peer_config,
+                                                       unsigned int default_pipe_size);
+  static bool same_settings(const ChannelSettings& a, const ChannelSettings& b);
   void wake_monitor(bool stop_thread);
-  void enqueue_connection(const connection_id_type& conn_id);
+  void enqueue_connection(connection_index_type conn_index);
 };
 
 #endif
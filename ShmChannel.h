@@ -0,0 +1,355 @@
+/* ShmChannel.h defines the shared memory used by a channel in "shm" mode (see ChannelMode.h),
+ * together with ShmChannelClient, which a user program on the same host includes to use such
+ * a channel. The header only depends on the C++ standard library and POSIX, so it can be
+ * copied into a user program's source tree as it is.
+ *
+ * The shared memory is a file (named with the suffix "_SHM" after the channel's base path)
+ * which holds a ShmChannelHeader followed by two ring buffers: the outward ring, which
+ * carries messages from the user program to cryptocomms, and the inward ring, which carries
+ * messages the other way. Each ring has a single producer and a single consumer, so it
+ * needs no locks, only atomic head and tail counters.
+ *
+ * Neither side spins waiting for the other. A consumer which finds its ring empty sets the
+ * ring's consumer_waiting flag (and then checks the ring again, so that a message pushed at
+ * the same moment is not missed), and a producer which pushes a message then clears the flag
+ * and rings the consumer's doorbell if it was set. A producer which finds the ring full
+ * likewise sets producer_waiting, for the consumer to ring the producer's doorbell once it
+ * has made room. The doorbells are the channel's two fifos, which carry only these wake-up
+ * bytes: cryptocomms waits on the "_OUTWARD" fifo and the user program on the "_INWARD"
+ * fifo. Since a doorbell is only rung when the other side is about to wait, a busy channel
+ * moves its data without any system calls.
+ *
+ * Messages keep their boundaries, as for a channel in "seqpacket" mode.
+ */
+
+#ifndef SHMCHANNEL_H
+#define SHMCHANNEL_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(sizeof(std::atomic<std::uint64_t>) == 8, "unsuitable std::atomic for shared memory");
+static_assert(sizeof(std::atomic<std::uint32_t>) == 4, "unsuitable std::atomic for shared memory");
+
+constexpr std::uint32_t shm_channel_magic = 0x4d484343; // "CCHM" in little-endian
+constexpr std::uint32_t shm_channel_version = 1;
+
+
+/* ShmRingControl holds the shared state of one ring. head and tail count the bytes
+ * which have ever been pushed and popped, and each is on its own cache line as it is
+ * written by a different side.
+ */
+struct ShmRingControl
+{
+  alignas(64) std::atomic<std::uint64_t> head;
+  alignas(64) std::atomic<std::uint64_t> tail;
+  alignas(64) std::atomic<std::uint32_t> consumer_waiting;
+  std::atomic<std::uint32_t> producer_waiting;
+};
+
+
+/* ShmChannelHeader is at the start of the shared memory. ring_capacity is the size in
+ * bytes of each ring's data area (a power of two), and the two data areas follow the
+ * header, outward first. user_attached is set while a ShmChannelClient is using the
+ * channel.
+ */
+struct ShmChannelHeader
+{
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::uint32_t ring_capacity;
+  std::atomic<std::uint32_t> user_attached;
+  ShmRingControl outward;
+  ShmRingControl inward;
+};
+
+
+/* shm_channel_size() gives the size of the shared memory for rings of the given capacity */
+inline std::size_t shm_channel_size(std::uint32_t ring_capacity)
+{ return sizeof(ShmChannelHeader)+(2*static_cast<std::size_t>(ring_capacity)); }
+
+
+/* ShmRing is one side's view of a ring. Each message is stored as a 4 byte length followed
+ * by the message itself, padded to a multiple of 8 bytes. A message never wraps around the
+ * end of the data area: if it would, the rest of the area is skipped, which is marked by a
+ * length of skip_marker. The largest message which can be pushed is max_message_size().
+ */
+class ShmRing
+{
+public:
+  ShmRing(ShmRingControl* control, unsigned char* data, std::uint32_t capacity):
+    control_(control), data_(data), capacity_(capacity) {}
+
+  std::uint32_t max_message_size() const
+  { return (capacity_/2)-8; }
+
+  /* push() copies a message into the ring, returning false if there is not room for it */
+  bool push(const unsigned char* message, std::uint32_t length)
+  {
+    std::uint64_t head = control_->head.load(std::memory_order_relaxed);
+    if(not fits(length,head)){
+      return false;
+    }
+    std::uint64_t record_size = record_size_for(length);
+    std::uint32_t pos = head & (capacity_-1);
+    std::uint32_t to_end = capacity_-pos;
+    if(record_size > to_end){
+      std::uint32_t skip = skip_marker;
+      std::memcpy(data_+pos,&skip,4);
+      head += to_end;
+      pos = 0;
+    }
+    std::memcpy(data_+pos,&length,4);
+    std::memcpy(data_+pos+4,message,length);
+    control_->head.store(head+record_size,std::memory_order_release);
+    return true;
+  }
+
+  /* has_room() reports whether push() would find room for a message of the given length */
+  bool has_room(std::uint32_t length) const
+  { return fits(length,control_->head.load(std::memory_order_relaxed)); }
+
+  /* front() finds the oldest message in the ring, returning false if there is none */
+  bool front(const unsigned char*& message, std::uint32_t& length)
+  {
+    std::uint64_t tail = control_->tail.load(std::memory_order_relaxed);
+    std::uint64_t head = control_->head.load(std::memory_order_acquire);
+    while(tail != head){
+      std::uint32_t pos = tail & (capacity_-1);
+      std::memcpy(&length,data_+pos,4);
+      if(length != skip_marker){
+        message = data_+pos+4;
+        return true;
+      }
+      tail += capacity_-pos;
+      control_->tail.store(tail,std::memory_order_release);
+    }
+    return false;
+  }
+
+  /* pop() removes the message found by front(), whose length is given */
+  void pop(std::uint32_t length)
+  {
+    std::uint64_t tail = control_->tail.load(std::memory_order_relaxed);
+    control_->tail.store(tail+record_size_for(length),std::memory_order_release);
+  }
+
+  bool empty() const
+  {
+    return control_->tail.load(std::memory_order_acquire) ==
+      control_->head.load(std::memory_order_acquire);
+  }
+
+  /* The waiting flags. arm_consumer_wait() and arm_producer_wait() are used before
+     checking the ring one last time before waiting, and take_consumer_wait() and
+     take_producer_wait() after pushing or popping, to find out whether to ring the
+     other side's doorbell. The sequentially consistent operations make sure that one
+     side or the other sees the change. */
+  void arm_consumer_wait()
+  {
+    control_->consumer_waiting.store(1,std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+  void arm_producer_wait()
+  {
+    control_->producer_waiting.store(1,std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+  bool take_consumer_wait()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return (control_->consumer_waiting.load(std::memory_order_seq_cst) != 0) and
+      (control_->consumer_waiting.exchange(0,std::memory_order_seq_cst) != 0);
+  }
+  bool take_producer_wait()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return (control_->producer_waiting.load(std::memory_order_seq_cst) != 0) and
+      (control_->producer_waiting.exchange(0,std::memory_order_seq_cst) != 0);
+  }
+
+  static constexpr std::uint32_t skip_marker = 0xffffffff;
+
+private:
+  static std::uint64_t record_size_for(std::uint32_t length)
+  { return (static_cast<std::uint64_t>(length)+4+7) & ~static_cast<std::uint64_t>(7); }
+
+  /* fits() reports whether a message of the given length can be pushed when the head
+     is at head, allowing for skipping the end of the data area */
+  bool fits(std::uint32_t length, std::uint64_t head) const
+  {
+    if(length > max_message_size()){
+      return false;
+    }
+    std::uint64_t record_size = record_size_for(length);
+    std::uint32_t to_end = capacity_-(head & (capacity_-1));
+    std::uint64_t needed = record_size + ( (record_size > to_end) ? to_end : 0 );
+    return head+needed-control_->tail.load(std::memory_order_acquire) <= capacity_;
+  }
+
+  ShmRingControl* control_;
+  unsigned char* data_;
+  std::uint32_t capacity_;
+};
+
+
+/* ShmChannelClient is the user program's end of a channel in "shm" mode. The constructor
+ * takes the channel's base path (as given in the cryptocomms configuration file), and
+ * cryptocomms must already be running, as it creates the shared memory. Only one
+ * ShmChannelClient may use a channel at a time. Errors are reported by throwing
+ * std::runtime_error.
+ *
+ * try_send() and try_receive() never block. When neither can make progress, wait() blocks
+ * until cryptocomms has pushed a message, or (if send_length is not 0) made room for a
+ * message of that length, or until timeout_millis have passed (-1 means no timeout).
+ */
+class ShmChannelClient
+{
+public:
+  explicit ShmChannelClient(const std::string& base_path):
+    shm_fd_(-1), doorbell_out_fd_(-1), doorbell_in_fd_(-1), header_(nullptr), map_size_(0),
+    outward_(nullptr,nullptr,0), inward_(nullptr,nullptr,0)
+  {
+    shm_fd_ = open((base_path+"_SHM").c_str(),O_RDWR|O_CLOEXEC);
+    struct stat stat_info;
+    if( (shm_fd_ == -1) or (fstat(shm_fd_,&stat_info) == -1) or
+        (static_cast<std::size_t>(stat_info.st_size) < sizeof(ShmChannelHeader)) ){
+      cleanup();
+      throw std::runtime_error("ShmChannelClient: could not open shared memory for "+base_path);
+    }
+    map_size_ = stat_info.st_size;
+    void* map = mmap(nullptr,map_size_,PROT_READ|PROT_WRITE,MAP_SHARED,shm_fd_,0);
+    if(map == MAP_FAILED){
+      cleanup();
+      throw std::runtime_error("ShmChannelClient: could not map shared memory for "+base_path);
+    }
+    header_ = static_cast<ShmChannelHeader*>(map);
+    if( (header_->magic != shm_channel_magic) or (header_->version != shm_channel_version) or
+        (map_size_ != shm_channel_size(header_->ring_capacity)) ){
+      cleanup();
+      throw std::runtime_error("ShmChannelClient: bad shared memory for "+base_path);
+    }
+    unsigned char* data = static_cast<unsigned char*>(map)+sizeof(ShmChannelHeader);
+    outward_ = ShmRing(&header_->outward,data,header_->ring_capacity);
+    inward_ = ShmRing(&header_->inward,data+header_->ring_capacity,header_->ring_capacity);
+
+    doorbell_out_fd_ = open((base_path+"_OUTWARD").c_str(),O_WRONLY|O_NONBLOCK|O_CLOEXEC);
+    doorbell_in_fd_ = open((base_path+"_INWARD").c_str(),O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+    if( (doorbell_out_fd_ == -1) or (doorbell_in_fd_ == -1) ){
+      cleanup();
+      throw std::runtime_error("ShmChannelClient: could not open doorbells for "+base_path);
+    }
+    header_->user_attached.store(1,std::memory_order_seq_cst);
+  }
+
+  ~ShmChannelClient()
+  {
+    if(header_ != nullptr){
+      header_->user_attached.store(0,std::memory_order_seq_cst);
+    }
+    cleanup();
+  }
+
+  ShmChannelClient(const ShmChannelClient&) = delete;
+  ShmChannelClient& operator=(const ShmChannelClient&) = delete;
+
+  std::uint32_t max_message_size() const
+  { return outward_.max_message_size(); }
+
+  bool try_send(const unsigned char* message, std::uint32_t length)
+  {
+    if(not outward_.push(message,length)){
+      return false;
+    }
+    if(outward_.take_consumer_wait()){
+      ring(doorbell_out_fd_);
+    }
+    return true;
+  }
+
+  bool try_receive(std::vector<unsigned char>& message)
+  {
+    const unsigned char* data;
+    std::uint32_t length;
+    if(not inward_.front(data,length)){
+      return false;
+    }
+    message.assign(data,data+length);
+    inward_.pop(length);
+    if(inward_.take_producer_wait()){
+      ring(doorbell_out_fd_);
+    }
+    return true;
+  }
+
+  void wait(int timeout_millis, std::uint32_t send_length = 0)
+  {
+    /* any rings so far are for changes which the checks below see */
+    unsigned char discard[64];
+    while(read(doorbell_in_fd_,discard,sizeof(discard)) > 0){}
+    inward_.arm_consumer_wait();
+    if(send_length != 0){
+      outward_.arm_producer_wait();
+    }
+    const unsigned char* data;
+    std::uint32_t length;
+    if(inward_.front(data,length)){
+      return;
+    }
+    if( (send_length != 0) and outward_.has_room(send_length) ){
+      return;
+    }
+    pollfd pfd;
+    pfd.fd = doorbell_in_fd_;
+    pfd.events = POLLIN;
+    while( (poll(&pfd,1,timeout_millis) == -1) and (errno == EINTR) ){}
+  }
+
+  /* doorbell_fd() gives a file descriptor which becomes readable when wait() would return,
+     for a user program which has its own poll() loop (after which it should call wait()
+     with a timeout of 0, which clears the doorbell, once it has run out of work) */
+  int doorbell_fd() const
+  { return doorbell_in_fd_; }
+
+private:
+  static void ring(int fd)
+  {
+    unsigned char b = 1;
+    while( (::write(fd,&b,1) == -1) and (errno == EINTR) ){}
+  }
+
+  void cleanup()
+  {
+    if(header_ != nullptr){
+      munmap(header_,map_size_);
+      header_ = nullptr;
+    }
+    for(int fd : {shm_fd_,doorbell_out_fd_,doorbell_in_fd_}){
+      if(fd != -1){
+        close(fd);
+      }
+    }
+    shm_fd_ = doorbell_out_fd_ = doorbell_in_fd_ = -1;
+  }
+
+  int shm_fd_;
+  int doorbell_out_fd_;
+  int doorbell_in_fd_;
+  ShmChannelHeader* header_;
+  std::size_t map_size_;
+  ShmRing outward_;
+  ShmRing inward_;
+};
+
+#endif
@@ -0,0 +1,233 @@
+#include "ShmIO.h"
+
+/* As in FifoIO.cpp, we use the C POSIX interface exclusively in this file */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace
+{
+  /* suffixes for the file names of the shared memory and of the two doorbell fifos */
+  constexpr char shm_suffix[] = "_SHM";
+  constexpr char doorbell_in_suffix[] = "_OUTWARD";
+  constexpr char doorbell_out_suffix[] = "_INWARD";
+
+  /* the largest ring capacity we allow, so that it fits in the 32 bit field in
+     ShmChannelHeader and the offsets within a ring fit in 32 bits */
+  constexpr unsigned int max_ring_capacity = 1u << 30;
+
+  /* round_ring_capacity() turns a requested ring capacity into the one which is used */
+  unsigned int round_ring_capacity(unsigned int requested, const std::string& path)
+  {
+    if(requested == 0){
+      return ShmEndpoint::default_ring_capacity;
+    }
+    if(requested > max_ring_capacity){
+      throw ShmIOError("ShmIO: ring capacity too large for "+path);
+    }
+    unsigned int capacity = ShmEndpoint::min_ring_capacity;
+    while(capacity < requested){
+      capacity *= 2;
+    }
+    return capacity;
+  }
+}
+
+
+/* ShmEndpoint::ShmEndpoint() creates the shared memory file for a channel, replacing any
+ * regular file left at that path by an earlier run (a user program still attached to the
+ * old one must start again), and initialises the header. The outward ring starts with its
+ * consumer_waiting flag set, so that the first message the user program pushes rings the
+ * doorbell.
+ */
+ShmEndpoint::ShmEndpoint(const std::string& base_path, unsigned int ring_capacity):
+  doorbell_in_(base_path+doorbell_in_suffix),
+  doorbell_out_(base_path+doorbell_out_suffix),
+  doorbell_buff_(64),
+  path_(base_path+shm_suffix),
+  shm_fd_(-1),
+  header_(nullptr),
+  map_size_(0),
+  outward_(nullptr,nullptr,0),
+  inward_(nullptr,nullptr,0)
+{
+  unsigned int capacity = round_ring_capacity(ring_capacity,path_);
+
+  struct stat stat_info;
+  if(lstat(path_.c_str(),&stat_info) == 0){
+    if(not S_ISREG(stat_info.st_mode)){
+      throw ShmIOError("ShmIO: "+path_+" is not a regular file");
+    }
+    if(unlink(path_.c_str()) == -1){
+      throw ShmIOError("ShmIO: could not remove old shared memory at "+path_);
+    }
+  }
+  else if(errno != ENOENT){
+    throw ShmIOError("ShmIO: could not stat file at "+path_);
+  }
+
+  shm_fd_ = open(path_.c_str(),O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC,S_IRUSR|S_IWUSR);
+  if(shm_fd_ == -1){
+    throw ShmIOError("ShmIO: could not create shared memory at "+path_);
+  }
+  map_size_ = shm_channel_size(capacity);
+  if(ftruncate(shm_fd_,map_size_) == -1){
+    close(shm_fd_);
+    unlink(path_.c_str());
+    throw ShmIOError("ShmIO: could not size shared memory at "+path_);
+  }
+  void* map = mmap(nullptr,map_size_,PROT_READ|PROT_WRITE,MAP_SHARED,shm_fd_,0);
+  if(map == MAP_FAILED){
+    close(shm_fd_);
+    unlink(path_.c_str());
+    throw ShmIOError("ShmIO: could not map shared memory at "+path_);
+  }
+
+  /* the file is freshly created, so it is all zeroes, which is the initial state of the
+     counters and flags */
+  header_ = static_cast<ShmChannelHeader*>(map);
+  header_->ring_capacity = capacity;
+  header_->version = shm_channel_version;
+  unsigned char* data = static_cast<unsigned char*>(map)+sizeof(ShmChannelHeader);
+  outward_ = ShmRing(&header_->outward,data,capacity);
+  inward_ = ShmRing(&header_->inward,data+capacity,capacity);
+  outward_.arm_consumer_wait();
+
+  /* the magic number goes in last, so that a user program never sees a header which is
+     only partly filled in */
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->magic = shm_channel_magic;
+}
+
+
+ShmEndpoint::~ShmEndpoint()
+{
+  munmap(header_,map_size_);
+  close(shm_fd_);
+  unlink(path_.c_str());
+}
+
+
+/* ShmEndpoint::read_into() takes one message pushed by the user program, if there is one,
+ * and copies it into dest, starting at position offset. The return value is as for
+ * SeqPacketEndpoint::read_into(): messages longer than count are discarded, which is
+ * reported by the second element being true, and empty messages are skipped. If the user
+ * program was waiting for room in the ring, its doorbell is rung.
+ */
+std::pair<unsigned int,bool> ShmEndpoint::read_into(std::vector<unsigned char>& dest,
+                                                    std::vector<unsigned char>::size_type offset,
+                                                    unsigned int count)
+{
+  if(dest.size() < offset+count){
+    throw ShmIOError("ShmIO: no room in buffer for read from "+path_);
+  }
+
+  std::pair<unsigned int,bool> result{0,false};
+  const unsigned char* message;
+  std::uint32_t length;
+  while(outward_.front(message,length)){
+    if(length > count){
+      result.second = true;
+    }
+    else if(length != 0){
+      memcpy(dest.data()+offset,message,length);
+      result.first = length;
+    }
+    outward_.pop(length);
+    if( (result.first != 0) or result.second ){
+      break;
+    }
+  }
+
+  if(outward_.take_producer_wait()){
+    ring_user();
+  }
+  return result;
+}
+
+
+/* ShmEndpoint::write() pushes the count bytes at data to the user program as a single
+ * message, ringing its doorbell if it is waiting for one. As for SeqPacketEndpoint::write(),
+ * the first element of the return value is count, or 0 if there is no room in the ring,
+ * and the second reports whether no user program is attached. If there is no room, the
+ * producer_waiting flag is set, so that the user program rings our doorbell once it has
+ * made some.
+ */
+std::pair<unsigned int,bool> ShmEndpoint::write(const unsigned char* data, unsigned int count)
+{
+  if(header_->user_attached.load(std::memory_order_acquire) == 0){
+    return {0,true};
+  }
+  if(count > inward_.max_message_size()){
+    throw ShmIOError("ShmIO: message too long for ring at "+path_);
+  }
+  if(not inward_.push(data,count)){
+    inward_.arm_producer_wait();
+    if(not inward_.push(data,count)){
+      return {0,false};
+    }
+  }
+  if(inward_.take_consumer_wait()){
+    ring_user();
+  }
+  return {count,false};
+}
+
+
+/* ShmEndpoint::has_room() reports whether write() would find room for a message of count
+ * bytes. This takes the place of polling a fifo to see whether it is writable.
+ */
+bool ShmEndpoint::has_room(unsigned int count)
+{ return inward_.has_room(count); }
+
+
+/* ShmEndpoint::data_waiting() reports whether there is a message for read_into() to take.
+ * It empties the doorbell fifo first, and if there is no message it sets the outward ring's
+ * consumer_waiting flag and checks again, so that the user program rings the doorbell when
+ * it next pushes a message. A ring from the user program when it has been given room in the
+ * inward ring is dealt with in the same way.
+ */
+bool ShmEndpoint::data_waiting()
+{
+  while(doorbell_in_.read_into(doorbell_buff_,0,doorbell_buff_.size()) != 0){}
+
+  const unsigned char* message;
+  std::uint32_t length;
+  if(outward_.front(message,length)){
+    return true;
+  }
+  outward_.arm_consumer_wait();
+  return outward_.front(message,length);
+}
+
+
+/* ShmEndpoint::file_descriptor() gives the file descriptor to poll() on for the doorbell */
+int ShmEndpoint::file_descriptor()
+{ return doorbell_in_.file_descriptor(); }
+
+
+/* ShmEndpoint::ring_capacity() gives the size in bytes of each of the two rings */
+unsigned int ShmEndpoint::ring_capacity()
+{ return header_->ring_capacity; }
+
+
+/* ShmEndpoint::max_message_size() gives the length of the longest message which write()
+ * can pass to the user program
+ */
+unsigned int ShmEndpoint::max_message_size()
+{ return inward_.max_message_size(); }
+
+
+/* ShmEndpoint::ring_user() rings the user program's doorbell. If the doorbell fifo is full
+ * the user program has plenty of wake-ups waiting already, and if it has no reader then no
+ * user program is waiting, so the result of the write does not matter.
+ */
+void ShmEndpoint::ring_user()
+{
+  unsigned char b = 1;
+  doorbell_out_.write(&b,1);
+}
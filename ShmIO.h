@@ -0,0 +1,69 @@
+/* ShmEndpoint is the user's end of a channel in "shm" mode (see ChannelMode.h), which
+ * passes messages to and from a user program on the same host through a pair of ring
+ * buffers in shared memory. The layout of the shared memory, and the protocol the two
+ * sides follow, are described in ShmChannel.h, which also provides the user program's
+ * end of the channel.
+ *
+ * ShmEndpoint creates the shared memory file (base path plus "_SHM") afresh, and the two
+ * doorbell fifos (base path plus "_OUTWARD" and "_INWARD") if necessary. The ring capacity
+ * is rounded up to a power of two, and to at least min_ring_capacity. It offers the same
+ * operations as SeqPacketEndpoint, so that Connection can treat the two alike.
+ */
+
+#ifndef SHMIO_H
+#define SHMIO_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <utility>
+
+#include "FifoIO.h"
+#include "ShmChannel.h"
+
+class ShmEndpoint
+{
+public:
+  ShmEndpoint(const std::string& base_path, unsigned int ring_capacity);
+  ~ShmEndpoint();
+
+  /* We do not allow copying of a ShmEndpoint, as it owns the mapping of the shared
+   * memory.
+   */
+  ShmEndpoint(const ShmEndpoint& other) = delete;
+  ShmEndpoint& operator=(const ShmEndpoint& other) = delete;
+
+  std::pair<unsigned int,bool> read_into(std::vector<unsigned char>& dest,
+                                         std::vector<unsigned char>::size_type offset,
+                                         unsigned int count);
+  std::pair<unsigned int,bool> write(const unsigned char* data, unsigned int count);
+  bool has_room(unsigned int count);
+  bool data_waiting();
+  int file_descriptor();
+  unsigned int ring_capacity();
+  unsigned int max_message_size();
+
+  constexpr static unsigned int min_ring_capacity = 262144;
+  constexpr static unsigned int default_ring_capacity = 1048576;
+
+private:
+  void ring_user();
+
+  FifoFromUser doorbell_in_;
+  FifoToUser doorbell_out_;
+  std::vector<unsigned char> doorbell_buff_;
+  const std::string path_;
+  int shm_fd_;
+  ShmChannelHeader* header_;
+  std::size_t map_size_;
+  ShmRing outward_;
+  ShmRing inward_;
+};
+
+
+class ShmIOError: public std::runtime_error{
+public:
+  ShmIOError(const std::string& what_arg): runtime_error(what_arg){}
+};
+
+#endif
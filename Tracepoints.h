@@ -0,0 +1,62 @@
+/* Tracepoints.h defines the macros used to place static tracing probes (USDT probes) at
+ * points of interest on the data path, so that tools such as perf and bpftrace can attach
+ * to a running instance of cryptocomms. For example,
+ *
+ *   bpftrace -e 'usdt:./cryptocomms:cryptocomms:auth_failure { @[arg0] = count(); }'
+ *
+ * The probes are created with the macros of <sys/sdt.h> (from SystemTap). A probe which
+ * nothing is attached to costs a single nop instruction, plus the (cheap) evaluation of
+ * its arguments, and is listed in the .note.stapsdt section of the binary.
+ *
+ * If <sys/sdt.h> is not available, or CRYPTOCOMMS_NO_TRACEPOINTS is defined (which can
+ * be done when building, with "make DEFINES=-DCRYPTOCOMMS_NO_TRACEPOINTS"), the macros
+ * expand to nothing, and the probes are removed entirely.
+ *
+ * All probes are in the provider "cryptocomms". The probes, and their arguments, are:
+ *
+ *   udp_dispatch(size)                   the UDP thread is passing a packet of size bytes
+ *                                        to its Connection
+ *   connection_enqueue(queue_length)     a Connection has been queued for a worker
+ *                                        thread, leaving queue_length in the queue
+ *   connection_dequeue(wait_nanos)       a worker thread has taken a Connection which had
+ *                                        been queued for wait_nanos nanoseconds
+ *   move_data_entry(loop_max)            a Connection's move_data() has started
+ *   move_data_exit(passes)               ... and has finished after passes loop passes
+ *   encrypt(size)                        a packet of size bytes has been encrypted
+ *   decrypt(size, good)                  a packet of size bytes has been decrypted, with
+ *                                        good being 1 if it was authentic and 0 if not
+ *   auth_failure(segnum, msgnum)         a packet failed authentication
+ *   segnum_confirmed(old_segnum, segnum) a Connection has confirmed a new segment number
+ *                                        for its peer
+ *   hello_sent(segnum)                   a Connection has sent a "hello" packet
+ *   hibernate(segnum)                    a Connection has been put to sleep
+ *   wake(segnum)                         ... and has been woken again
+ *
+ * Segment numbers and message numbers are passed as integers, while sizes and counts are
+ * passed as unsigned ints.
+ */
+
+#ifndef TRACEPOINTS_H
+#define TRACEPOINTS_H
+
+#if !defined(CRYPTOCOMMS_NO_TRACEPOINTS) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define CRYPTOCOMMS_HAVE_TRACEPOINTS
+#endif
+#endif
+
+#ifdef CRYPTOCOMMS_HAVE_TRACEPOINTS
+
+#include <sys/sdt.h>
+
+#define TRACEPOINT1(name,arg1) STAP_PROBE1(cryptocomms,name,arg1)
+#define TRACEPOINT2(name,arg1,arg2) STAP_PROBE2(cryptocomms,name,arg1,arg2)
+
+#else
+
+#define TRACEPOINT1(name,arg1) do{}while(0)
+#define TRACEPOINT2(name,arg1,arg2) do{}while(0)
+
+#endif
+
+#endif
@@ -226,3 +226,18 @@ in_port_t UDPSocket::bound_port()
 
 int UDPSocket::file_descriptor()
 {return socket_fd_;}
+
+
+/* UDPSocket::set_mtu_probing() makes every packet sent via the socket go out with the
+ * "don't fragment" bit set, regardless of any path MTU which the kernel has learned from
+ * ICMP messages, so that packets which are too large for the path are dropped rather than
+ * fragmented. This is for sending the probes of a PathProber (see PathProber.h). Note
+ * that the kernel refuses to send packets which are too large for the outgoing interface.
+ */
+void UDPSocket::set_mtu_probing()
+{
+  int val = IP_PMTUDISC_PROBE;
+  if(setsockopt(socket_fd_,IPPROTO_IP,IP_MTU_DISCOVER,&val,sizeof(val)) == -1){
+    throw std::runtime_error("UDPSocket: could not set IP_MTU_DISCOVER");
+  }
+}
@@ -25,6 +25,7 @@ public:
   const std::string& bound_addr();
   in_port_t bound_port();
   int file_descriptor();
+  void set_mtu_probing();
 
   UDPSocket (UDPSocket&&);
   UDPSocket& operator= (UDPSocket&&);
@@ -55,30 +55,35 @@ makefile_template_string = """\
 
 DBG := -g
 CHECKS := -Wall -Wpedantic
+DEFINES :=
 
 
-all: cryptocomms tester
+all: cryptocomms tester libcryptocomms.a
 
 clean:
-	rm *.o cryptocomms tester tester.cpp
+	rm *.o cryptocomms tester tester.cpp libcryptocomms.a
 
 
-## Rules for the cryptocomms executable and the tester ##
+## Rules for the cryptocomms executable, the library and the tester ##
 
 cryptocomms: main.o $ALL_UNIT_O_FILES
 	g++ $$(DBG) -pthread main.o $ALL_UNIT_O_FILES -lcrypto -o cryptocomms
 
+libcryptocomms.a: $ALL_UNIT_O_FILES
+	rm -f libcryptocomms.a
+	ar rcs libcryptocomms.a $ALL_UNIT_O_FILES
+
 tester: tester.o testsys.o $ALL_UNIT_O_FILES $ALL_TEST_O_FILES
 	g++ $$(DBG) -pthread tester.o testsys.o $ALL_UNIT_O_FILES $ALL_TEST_O_FILES -lcrypto -o tester
 
 main.o: main.cpp $MAIN_H_FILES
-	g++ $$(DBG) -std=c++14 $$(CHECKS) -c main.cpp
+	g++ $$(DBG) -std=c++14 $$(CHECKS) $$(DEFINES) -c main.cpp
 
 tester.o: tester.cpp
-	g++ $$(DBG) -std=c++14 $$(CHECKS) -c tester.cpp
+	g++ $$(DBG) -std=c++14 $$(CHECKS) $$(DEFINES) -c tester.cpp
 
 testsys.o: tests/testsys.cpp
-	g++ $$(DBG) -std=c++14 $$(CHECKS) -c tests/testsys.cpp
+	g++ $$(DBG) -std=c++14 $$(CHECKS) $$(DEFINES) -c tests/testsys.cpp
 
 tester.cpp: $ALL_TEST_CPP_FILES
 	./gen_tester.py
@@ -110,7 +115,7 @@ main_h_files = ' '.join(extract_quote_includes('main.cpp'))
 #     FILEPATH is the full path to the file relative to the main source directory
 rule_template_string = """\
 ${BASENAME}.o: ${FILEPATH} $H_FILES
-	g++ $$(DBG) -std=c++14 $$(CHECKS) -c ${FILEPATH}"""
+	g++ $$(DBG) -std=c++14 $$(CHECKS) $$(DEFINES) -c ${FILEPATH}"""
 rule_template = Template(rule_template_string)
 
 # generate the rules to compile all the non-test .cpp files, for the UNIT_O_FILE_RULES
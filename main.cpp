@@ -3,6 +3,8 @@
 #include <thread>
 #include <chrono>
 #include <string>
+#include <csignal>
+#include <exception>
 
 #include "FifoIO.h"
 #include "UDPSocket.h"
@@ -12,8 +14,19 @@
 #include "ConfigFileParser.h"
 #include "Session.h"
 
+namespace
+{
+  /* reload_requested is set when a SIGHUP signal asks for the config file to be read again */
+  volatile std::sig_atomic_t reload_requested = 0;
+
+  void handle_sighup(int)
+  { reload_requested = 1; }
+}
+
+
 /* A simple version of the main "cryptocomms" program, which just takes a config
- * file, sets a Session running, and then just idles.
+ * file, sets a Session running, and then just idles, reloading the peers and channels
+ * from the config file when it receives a SIGHUP signal.
  */
 int main(int argc, char** argv){
   if(argc != 2){
@@ -31,10 +44,26 @@ int main(int argc, char** argv){
                   default_max_packet_size,
                   cfp.peer_configs,
                   segnum_filepath,
-                  5);
+                  5,
+                  cfp.num_crypto_workers,
+                  cfp.metrics_socket_path,
+                  cfp.default_pipe_size,
+                  cfp.hibernate_after_seconds*1000);
 
-  while(true)
+  std::signal(SIGHUP,handle_sighup);
+  while(true){
     std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    if(reload_requested){
+      reload_requested = 0;
+      try{
+        ConfigFileParser new_cfp(argv[1]);
+        session.reload(new_cfp.peer_configs);
+      }
+      catch(const std::exception& e){
+        std::cerr << "Could not reload the config file: " << e.what() << "\n";
+      }
+    }
+  }
 
   return 0;
 }
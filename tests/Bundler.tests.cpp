@@ -0,0 +1,142 @@
+#include "testsys.h"
+#include "../Bundler.h"
+
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <poll.h>
+
+namespace
+{
+  /* readable() reports whether fd is readable */
+  bool readable(int fd)
+  {
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return (poll(&pfd,1,0) == 1) and ( (pfd.revents & POLLIN) != 0 );
+  }
+
+  /* ReceivedFrame records a frame passed to a Bundler's "deliver" function */
+  typedef std::pair<channel_id_type,std::vector<unsigned char>> ReceivedFrame;
+}
+
+
+/* test that frames are held back until there is a full packet's worth of them, that they
+ * are packed whole into packets, and that another Bundler unpacks them again
+ */
+TESTFUNC(Bundler_frames)
+{
+  std::vector<ReceivedFrame> received;
+  Bundler sender(100,1000000,nullptr,[](){});
+  Bundler receiver(100,1000000,
+                   [&](const channel_id_type& channel_id, const unsigned char* data,
+                       unsigned int count){
+                     received.emplace_back(channel_id,std::vector<unsigned char>(data,data+count));
+                   },
+                   [](){});
+  channel_id_type channel_one{0x01,0x02};
+  channel_id_type channel_two{0xa0,0x0b};
+  std::vector<unsigned char> data(96);
+  for(unsigned int i=0; i<data.size(); i++){
+    data[i] = i;
+  }
+  std::vector<unsigned char> packet(150,0);
+
+  TESTASSERT( sender.max_frame_data() == 96 );
+  TESTTHROW( sender.push(channel_one,data.data(),97), "too long" );
+  TESTASSERT( sender.flush_due() == 0 );
+  TESTASSERT( not readable(sender.file_descriptor()) );
+
+  /* the first frame wakes the bundle Connection, but is held back */
+  sender.push(channel_one,data.data(),30);
+  TESTASSERT( readable(sender.file_descriptor()) );
+  TESTASSERT( sender.flush_due() > monotonic_nanos() );
+  TESTASSERT( not sender.data_waiting() );
+  TESTASSERT( not readable(sender.file_descriptor()) );
+  TESTASSERT( sender.read_into(packet,20,100) == std::make_pair(0u,false) );
+
+  /* once there is a full packet's worth, as many whole frames as fit are sent */
+  sender.push(channel_two,data.data()+10,40);
+  sender.push(channel_one,data.data(),0);
+  TESTASSERT( not readable(sender.file_descriptor()) );
+  sender.push(channel_two,data.data(),96);
+  TESTASSERT( readable(sender.file_descriptor()) );
+  TESTASSERT( sender.data_waiting() );
+  TESTTHROW( sender.read_into(packet,60,100), "no room in buffer" );
+  TESTASSERT( sender.read_into(packet,20,100) == std::make_pair(82u,false) );
+  std::vector<unsigned char> second_packet(100,0);
+  TESTASSERT( sender.data_waiting() );
+  TESTASSERT( sender.read_into(second_packet,0,100) == std::make_pair(100u,false) );
+  TESTASSERT( not sender.data_waiting() );
+
+  TESTASSERT( receiver.write(packet.data()+20,82) == std::make_pair(82u,false) );
+  TESTASSERT( received.size() == 3 );
+  TESTASSERT( received[0] == ReceivedFrame(channel_one,
+                                           std::vector<unsigned char>(data.begin(),data.begin()+30)) );
+  TESTASSERT( received[1] == ReceivedFrame(channel_two,
+                                           std::vector<unsigned char>(data.begin()+10,data.begin()+50)) );
+  TESTASSERT( received[2] == ReceivedFrame(channel_one,std::vector<unsigned char>()) );
+  TESTASSERT( receiver.write(second_packet.data(),100) == std::make_pair(100u,false) );
+  TESTASSERT( received.size() == 4 );
+  TESTASSERT( received[3] == ReceivedFrame(channel_two,data) );
+
+  /* a truncated frame is dropped */
+  received.clear();
+  packet[20+2] = 90;
+  TESTASSERT( receiver.write(packet.data()+20,82) == std::make_pair(82u,false) );
+  TESTASSERT( received.empty() );
+}
+
+
+/* test that frames are sent once the oldest has waited for the bundle window */
+TESTFUNC(Bundler_window)
+{
+  Bundler bundler(100,2000,nullptr,[](){});
+  channel_id_type channel_id{0x01,0x02};
+  std::vector<unsigned char> data(10,7);
+  std::vector<unsigned char> packet(100,0);
+
+  nanos_t before = monotonic_nanos();
+  bundler.push(channel_id,data.data(),10);
+  nanos_t due = bundler.flush_due();
+  TESTASSERT( (due >= before+2000000) and (due <= monotonic_nanos()+2000000) );
+  bundler.push(channel_id,data.data(),5);
+  TESTASSERT( bundler.flush_due() == due );
+
+  while(monotonic_nanos() < due){
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+  TESTASSERT( bundler.data_waiting() );
+  TESTASSERT( bundler.read_into(packet,0,100) == std::make_pair(23u,false) );
+  TESTASSERT( bundler.flush_due() == 0 );
+  TESTASSERT( not bundler.data_waiting() );
+}
+
+
+/* test that has_room() reports when the Bundler is full, and that the senders are woken
+ * once it has room again
+ */
+TESTFUNC(Bundler_full)
+{
+  unsigned int wakes = 0;
+  Bundler bundler(100,1000000,nullptr,[&](){ wakes++; });
+  channel_id_type channel_id{0x01,0x02};
+  std::vector<unsigned char> data(96,3);
+  std::vector<unsigned char> packet(100,0);
+
+  unsigned int num_frames = 0;
+  while(bundler.has_room()){
+    bundler.push(channel_id,data.data(),96);
+    num_frames++;
+  }
+  TESTASSERT( num_frames == (Bundler::capacity+99)/100 );
+  TESTASSERT( wakes == 0 );
+
+  TESTASSERT( bundler.read_into(packet,0,100) == std::make_pair(100u,false) );
+  TESTASSERT( wakes == 1 );
+  TESTASSERT( bundler.has_room() );
+  TESTASSERT( bundler.read_into(packet,0,100) == std::make_pair(100u,false) );
+  TESTASSERT( wakes == 1 );
+}
@@ -0,0 +1,125 @@
+#include "testsys.h"
+#include "../Compressor.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+  /* round_trip() compresses data, checks that it decompresses to the same again, and
+     returns the compressed length (0 if it was not compressed) */
+  unsigned int round_trip(Compressor& compressor, const std::vector<unsigned char>& data)
+  {
+    std::vector<unsigned char> compressed(data.size());
+    unsigned int len = compressor.compress(data.data(),data.size(),compressed.data());
+    if(len != 0){
+      std::vector<unsigned char> decompressed(data.size()+100);
+      unsigned int decompressed_len = Compressor::decompress(compressed.data(),len,
+                                                             decompressed.data(),
+                                                             decompressed.size());
+      decompressed.resize(decompressed_len);
+      TESTASSERT( decompressed == data );
+    }
+    return len;
+  }
+
+
+  /* random_bytes() makes count random bytes */
+  std::vector<unsigned char> random_bytes(unsigned int count, std::mt19937& rng)
+  {
+    std::uniform_int_distribution<unsigned int> dist(0,255);
+    std::vector<unsigned char> bytes(count);
+    for(auto& b : bytes){
+      b = dist(rng);
+    }
+    return bytes;
+  }
+}
+
+
+/* test that compressible data is compressed and decompresses to the same again,
+ * including long runs and matches which overlap what they copy
+ */
+TESTFUNC(Compressor_round_trip)
+{
+  Compressor compressor;
+
+  std::string text;
+  for(unsigned int i=0; i<40; i++){
+    text += "{\"sensor\":"+std::to_string(i%7)+",\"temperature\":21."+std::to_string(i%10)+"}\n";
+  }
+  std::vector<unsigned char> data(text.begin(),text.end());
+  unsigned int len = round_trip(compressor,data);
+  TESTASSERT( (len > 0) and (len < data.size()/3) );
+
+  /* a long run is one literal and one overlapping match with extra length bytes */
+  data.assign(5000,'x');
+  len = round_trip(compressor,data);
+  TESTASSERT( (len > 0) and (len < 40) );
+
+  /* a mixture of random and repeated data, in payloads of all sizes */
+  std::mt19937 rng(1234);
+  for(unsigned int size=1; size<1500; size+=7){
+    std::vector<unsigned char> block = random_bytes(size/3+1,rng);
+    data = block;
+    data.insert(data.end(),block.begin(),block.end());
+    data.insert(data.end(),block.begin(),block.begin()+size/5);
+    round_trip(compressor,data);
+  }
+}
+
+
+/* test that data which does not compress is sent raw, and that after a few such payloads
+ * the Compressor stops trying for a while, for longer each time the data still does not
+ * compress, and goes back to compressing once the data compresses again
+ */
+TESTFUNC(Compressor_incompressible)
+{
+  Compressor compressor;
+  std::mt19937 rng(5678);
+  std::vector<unsigned char> compressible(1000,'a');
+  std::vector<unsigned char> scratch(1000);
+
+  /* after poor_samples_to_skip random payloads, even compressible payloads are sent raw
+     for min_skip payloads */
+  for(unsigned int i=0; i<Compressor::poor_samples_to_skip; i++){
+    TESTASSERT( round_trip(compressor,random_bytes(1000,rng)) == 0 );
+  }
+  for(unsigned int i=0; i<Compressor::min_skip; i++){
+    TESTASSERT( compressor.compress(compressible.data(),1000,scratch.data()) == 0 );
+  }
+
+  /* another random sample starts a pause twice as long */
+  TESTASSERT( round_trip(compressor,random_bytes(1000,rng)) == 0 );
+  for(unsigned int i=0; i<2*Compressor::min_skip; i++){
+    TESTASSERT( compressor.compress(compressible.data(),1000,scratch.data()) == 0 );
+  }
+
+  /* a sample which compresses ends the pauses */
+  TESTASSERT( round_trip(compressor,compressible) != 0 );
+  TESTASSERT( round_trip(compressor,random_bytes(1000,rng)) == 0 );
+  TESTASSERT( round_trip(compressor,compressible) != 0 );
+}
+
+
+/* test that decompress() rejects data which is not valid */
+TESTFUNC(Compressor_invalid)
+{
+  std::vector<unsigned char> dest(100);
+  /* the match offset goes back before the start */
+  std::vector<unsigned char> bad_offset{0x10,'a',0x02,0x00,0x00};
+  TESTASSERT( Compressor::decompress(bad_offset.data(),bad_offset.size(),dest.data(),100) == 0 );
+  /* the literals run past the end */
+  std::vector<unsigned char> short_literals{0x30,'a','b'};
+  TESTASSERT( Compressor::decompress(short_literals.data(),short_literals.size(),dest.data(),100) == 0 );
+  /* the offset is cut short */
+  std::vector<unsigned char> short_offset{0x10,'a',0x01};
+  TESTASSERT( Compressor::decompress(short_offset.data(),short_offset.size(),dest.data(),100) == 0 );
+  /* the result is too long for dest */
+  std::vector<unsigned char> too_long{0x1f,'a',0x01,0x00,0xff,0x00,0x00};
+  TESTASSERT( Compressor::decompress(too_long.data(),too_long.size(),dest.data(),100) == 0 );
+  dest.resize(1000);
+  TESTASSERT( Compressor::decompress(too_long.data(),too_long.size(),dest.data(),1000) == 1+15+255+4 );
+  TESTASSERT( dest[274] == 'a' );
+}
@@ -227,6 +227,9 @@ TESTFUNC(ConfigFileParser_example_simple)
   TESTASSERT(cfp.self_port == 1003);
   TESTASSERT(cfp.default_max_packet_size == -1);
   TESTASSERT(cfp.segnum_filepath == "");
+  TESTASSERT(cfp.num_crypto_workers == 0);
+  TESTASSERT(cfp.metrics_socket_path == "");
+  TESTASSERT(cfp.hibernate_after_seconds == 0);
 
   TESTASSERT(cfp.peer_configs.size() == 1);
 
@@ -369,3 +372,355 @@ TESTFUNC(ConfigFileParser_segment_number_file_error)
   TESTTHROW( ConfigFileParser cfp(config_path+"config-error-segnum"),
              "\"segment_number_file\" only allowed for \"self\"" );
 }
+
+
+/* check that the "cipher" option selects the cipher suite for a peer, and that peers
+ * without it get the default
+ */
+TESTFUNC(ConfigFileParser_cipher_example)
+{
+  ConfigFileParser cfp(config_path+"config-example-cipher");
+  TESTASSERT(cfp.peer_configs.size() == 2);
+  for(const PeerConfig& pc : cfp.peer_configs){
+    if(pc.name == "other_host"){
+      TESTASSERT(pc.cipher_suite == CipherSuite::chacha20_poly1305);
+    }
+    else{
+      TESTASSERT(pc.cipher_suite == CipherSuite::aes_256_gcm);
+    }
+  }
+}
+
+
+/* check that invalid uses of the "cipher" option give the correct errors */
+TESTFUNC(ConfigFileParser_cipher_errors)
+{
+  TESTTHROW(ConfigFileParser(config_path+"config-error-cipher-invalid"),
+            "invalid cipher suite \"aes-128-cbc\"");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-cipher-for-self"),
+            "\"cipher\" not allowed for \"self\"");
+}
+
+
+/* check that the "crypto_workers" option in "self" sets the number of crypto workers */
+TESTFUNC(ConfigFileParser_crypto_workers_example)
+{
+  ConfigFileParser cfp(config_path+"config-example-crypto-workers");
+  TESTASSERT(cfp.num_crypto_workers == 4);
+}
+
+
+/* check that invalid uses of the "crypto_workers" option give the correct errors */
+TESTFUNC(ConfigFileParser_crypto_workers_errors)
+{
+  TESTTHROW(ConfigFileParser(config_path+"config-error-crypto-workers-not-self"),
+            "\"crypto_workers\" only allowed for \"self\"");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-crypto-workers-invalid"),
+            "invalid crypto_workers");
+}
+
+
+/* check that the "metrics_socket" option in "self" sets the metrics socket path */
+TESTFUNC(ConfigFileParser_metrics_socket_example)
+{
+  ConfigFileParser cfp(config_path+"config-example-metrics-socket");
+  TESTASSERT(cfp.metrics_socket_path == "/run/cryptocomms/metrics.sock");
+}
+
+
+/* check that having a "metrics_socket" option not in "self" gives the correct error */
+TESTFUNC(ConfigFileParser_metrics_socket_error)
+{
+  TESTTHROW(ConfigFileParser(config_path+"config-error-metrics-socket-not-self"),
+            "\"metrics_socket\" only allowed for \"self\"");
+}
+
+
+/* check that the "hibernate_after" option in "self" sets the time after which unused
+ * channels are put to sleep
+ */
+TESTFUNC(ConfigFileParser_hibernate_after_example)
+{
+  ConfigFileParser cfp(config_path+"config-example-hibernate-after");
+  TESTASSERT(cfp.hibernate_after_seconds == 300);
+}
+
+
+/* check that invalid uses of the "hibernate_after" option give the correct errors */
+TESTFUNC(ConfigFileParser_hibernate_after_errors)
+{
+  TESTTHROW(ConfigFileParser(config_path+"config-error-hibernate-after-not-self"),
+            "\"hibernate_after\" only allowed for \"self\"");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-hibernate-after-invalid"),
+            "invalid hibernate_after");
+}
+
+
+/* check that the "pipe_size" and "channel_pipe_size" options set the fifo capacities */
+TESTFUNC(ConfigFileParser_pipe_size_example)
+{
+  ConfigFileParser cfp(config_path+"config-example-pipe-size");
+  TESTASSERT(cfp.default_pipe_size == 131072);
+  TESTASSERT(cfp.peer_configs.size() == 2);
+  for(const PeerConfig& pc : cfp.peer_configs){
+    if(pc.name == "other_host"){
+      TESTASSERT(pc.pipe_size == 262144);
+      std::vector<channel_pipe_size_spec> expected{
+        channel_pipe_size_spec({0x01,0x0a},1048576),
+        channel_pipe_size_spec({0x01,0x76},65536)
+      };
+      TESTASSERT(pc.channel_pipe_sizes == expected);
+    }
+    else{
+      TESTASSERT(pc.pipe_size == 0);
+      TESTASSERT(pc.channel_pipe_sizes.empty());
+    }
+  }
+}
+
+
+/* check that invalid uses of the "pipe_size" and "channel_pipe_size" options give the
+ * correct errors
+ */
+TESTFUNC(ConfigFileParser_pipe_size_errors)
+{
+  TESTTHROW(ConfigFileParser(config_path+"config-error-pipe-size-invalid"),
+            "invalid pipe_size");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-channel-pipe-size-for-self"),
+            "\"channel_pipe_size\" not allowed for \"self\"");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-channel-pipe-size-unknown-channel"),
+            "channel_pipe_size for unknown channel");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-channel-pipe-size-repeated"),
+            "duplicated channel_pipe_size");
+}
+
+
+/* check that the "channel_mode" option sets the modes of channels */
+TESTFUNC(ConfigFileParser_channel_mode_example)
+{
+  ConfigFileParser cfp(config_path+"config-example-channel-mode");
+  TESTASSERT(cfp.peer_configs.size() == 1);
+  std::vector<channel_mode_spec> expected{
+    channel_mode_spec({0x01,0x0a},ChannelMode::seqpacket),
+    channel_mode_spec({0x01,0x76},ChannelMode::fifo),
+    channel_mode_spec({0x23,0xab},ChannelMode::shm),
+    channel_mode_spec({0x0a,0x0b},ChannelMode::local)
+  };
+  TESTASSERT(cfp.peer_configs[0].channel_modes == expected);
+}
+
+
+/* check that invalid uses of the "channel_mode" option give the correct errors */
+TESTFUNC(ConfigFileParser_channel_mode_errors)
+{
+  TESTTHROW(ConfigFileParser(config_path+"config-error-channel-mode-invalid"),
+            "invalid channel mode \"datagram\"");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-channel-mode-for-self"),
+            "\"channel_mode\" not allowed for \"self\"");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-channel-mode-unknown-channel"),
+            "channel_mode for unknown channel");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-channel-mode-repeated"),
+            "duplicated channel_mode");
+}
+
+
+/* check that the "bundle_window" option enables bundling for a peer, and that the channel
+ * id reserved for bundle packets is only reserved for peers with bundling enabled
+ */
+TESTFUNC(ConfigFileParser_bundle_window_example)
+{
+  ConfigFileParser cfp(config_path+"config-example-bundle-window");
+  TESTASSERT(cfp.peer_configs.size() == 2);
+  for(const PeerConfig& pc : cfp.peer_configs){
+    if(pc.name == "other_host"){
+      TESTASSERT(pc.bundle_window_micros == 250);
+    }
+    else{
+      TESTASSERT(pc.bundle_window_micros == 0);
+      TESTASSERT(pc.channels[0].first == channel_id_type({0xff,0xff}));
+    }
+  }
+}
+
+
+/* check that invalid uses of the "bundle_window" option give the correct errors */
+TESTFUNC(ConfigFileParser_bundle_window_errors)
+{
+  TESTTHROW(ConfigFileParser(config_path+"config-error-bundle-window-invalid"),
+            "invalid bundle_window");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-bundle-window-for-self"),
+            "\"bundle_window\" not allowed for \"self\"");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-bundle-window-reserved-channel"),
+            "channel id ffff is reserved when bundling");
+}
+
+
+/* check that the "coalesce_window" and "channel_coalesce_window" options set the
+ * coalescing windows of channels
+ */
+TESTFUNC(ConfigFileParser_coalesce_window_example)
+{
+  ConfigFileParser cfp(config_path+"config-example-coalesce-window");
+  TESTASSERT(cfp.peer_configs.size() == 1);
+  TESTASSERT(cfp.peer_configs[0].coalesce_window_micros == 200);
+  std::vector<channel_coalesce_window_spec> expected{
+    channel_coalesce_window_spec({0x01,0x0a},0),
+    channel_coalesce_window_spec({0x01,0x76},5000)
+  };
+  TESTASSERT(cfp.peer_configs[0].channel_coalesce_windows == expected);
+}
+
+
+/* check that invalid uses of the "coalesce_window" and "channel_coalesce_window" options
+ * give the correct errors
+ */
+TESTFUNC(ConfigFileParser_coalesce_window_errors)
+{
+  TESTTHROW(ConfigFileParser(config_path+"config-error-coalesce-window-invalid"),
+            "invalid coalesce_window");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-coalesce-window-for-self"),
+            "\"coalesce_window\" not allowed for \"self\"");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-channel-coalesce-window-not-fifo"),
+            "channel_coalesce_window for channel not in fifo mode");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-channel-coalesce-window-repeated"),
+            "duplicated channel_coalesce_window");
+}
+
+
+/* check that the "probe_max_size" option enables path MTU discovery for a peer, and that
+ * the channel id reserved for probes is only reserved for peers with it enabled
+ */
+TESTFUNC(ConfigFileParser_probe_max_size_example)
+{
+  ConfigFileParser cfp(config_path+"config-example-probe-max-size");
+  TESTASSERT(cfp.peer_configs.size() == 2);
+  for(const PeerConfig& pc : cfp.peer_configs){
+    if(pc.name == "other_host"){
+      TESTASSERT(pc.max_packet_size == 1400);
+      TESTASSERT(pc.probe_max_size == 8972);
+    }
+    else{
+      TESTASSERT(pc.probe_max_size == 0);
+      TESTASSERT(pc.channels[0].first == channel_id_type({0xff,0xfe}));
+    }
+  }
+}
+
+
+/* check that invalid uses of the "probe_max_size" option give the correct errors */
+TESTFUNC(ConfigFileParser_probe_max_size_errors)
+{
+  TESTTHROW(ConfigFileParser(config_path+"config-error-probe-max-size-invalid"),
+            "invalid probe_max_size");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-probe-max-size-for-self"),
+            "\"probe_max_size\" not allowed for \"self\"");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-probe-max-size-too-small"),
+            "probe_max_size not larger than max_size");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-probe-max-size-reserved-channel"),
+            "channel id fffe is reserved when probing");
+}
+
+
+/* check that the "max_message_size" option enables fragmentation for a peer */
+TESTFUNC(ConfigFileParser_max_message_size_example)
+{
+  ConfigFileParser cfp(config_path+"config-example-max-message-size");
+  TESTASSERT(cfp.peer_configs.size() == 2);
+  for(const PeerConfig& pc : cfp.peer_configs){
+    if(pc.name == "other_host"){
+      TESTASSERT(pc.max_message_size == 1048576);
+    }
+    else{
+      TESTASSERT(pc.max_message_size == 0);
+    }
+  }
+}
+
+
+/* check that invalid uses of the "max_message_size" option give the correct errors */
+TESTFUNC(ConfigFileParser_max_message_size_errors)
+{
+  TESTTHROW(ConfigFileParser(config_path+"config-error-max-message-size-invalid"),
+            "invalid max_message_size");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-max-message-size-for-self"),
+            "\"max_message_size\" not allowed for \"self\"");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-max-message-size-with-bundle-window"),
+            "max_message_size not allowed with bundle_window");
+}
+
+
+/* check that the "compression" and "channel_compression" options set which channels are
+ * compressed
+ */
+TESTFUNC(ConfigFileParser_compression_example)
+{
+  ConfigFileParser cfp(config_path+"config-example-compression");
+  TESTASSERT(cfp.peer_configs.size() == 2);
+  for(const PeerConfig& pc : cfp.peer_configs){
+    if(pc.name == "other_host"){
+      TESTASSERT(pc.compression);
+      TESTASSERT(pc.channel_compressions.size() == 1);
+      TESTASSERT(pc.channel_compressions[0] == channel_compression_spec(channel_id_type({0x01,0x0a}),false));
+    }
+    else{
+      TESTASSERT(not pc.compression);
+      TESTASSERT(pc.channel_compressions.size() == 1);
+      TESTASSERT(pc.channel_compressions[0] == channel_compression_spec(channel_id_type({0x01,0xff}),true));
+    }
+  }
+}
+
+
+/* check that invalid uses of the "compression" and "channel_compression" options give
+ * the correct errors
+ */
+TESTFUNC(ConfigFileParser_compression_errors)
+{
+  TESTTHROW(ConfigFileParser(config_path+"config-error-compression-invalid"),
+            "invalid compression");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-compression-for-self"),
+            "\"compression\" not allowed for \"self\"");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-compression-with-bundle-window"),
+            "compression not allowed with bundle_window");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-channel-compression-unknown-channel"),
+            "channel_compression for unknown channel");
+}
+
+
+/* check that the "fec" and "channel_fec" options set which channels use forward error
+ * correction
+ */
+TESTFUNC(ConfigFileParser_fec_example)
+{
+  ConfigFileParser cfp(config_path+"config-example-fec");
+  TESTASSERT(cfp.peer_configs.size() == 2);
+  for(const PeerConfig& pc : cfp.peer_configs){
+    TESTASSERT(not pc.compression);
+    if(pc.name == "other_host"){
+      TESTASSERT(pc.fec);
+      TESTASSERT(pc.channel_fecs.size() == 1);
+      TESTASSERT(pc.channel_fecs[0] == channel_fec_spec(channel_id_type({0x01,0x0a}),false));
+    }
+    else{
+      TESTASSERT(not pc.fec);
+      TESTASSERT(pc.channel_fecs.size() == 1);
+      TESTASSERT(pc.channel_fecs[0] == channel_fec_spec(channel_id_type({0x01,0xff}),true));
+    }
+  }
+}
+
+
+/* check that invalid uses of the "fec" and "channel_fec" options give the correct
+ * errors
+ */
+TESTFUNC(ConfigFileParser_fec_errors)
+{
+  TESTTHROW(ConfigFileParser(config_path+"config-error-fec-invalid"),
+            "invalid fec");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-fec-for-self"),
+            "\"fec\" not allowed for \"self\"");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-fec-with-bundle-window"),
+            "fec not allowed with bundle_window");
+  TESTTHROW(ConfigFileParser(config_path+"config-error-channel-fec-unknown-channel"),
+            "channel_fec for unknown channel");
+}
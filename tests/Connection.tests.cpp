@@ -1,11 +1,15 @@
 #include "testsys.h"
 #include "../Connection.h"
+#include "../Bundler.h"
 #include "../CryptoUnit.h"
+#include "../CryptoWorkerPool.h"
+#include "../Fec.h"
 #include "../FifoIO.h"
 #include "../IDTypes.h"
 #include "../ReceivedUDPMessage.h"
 #include "../SecretKey.h"
 #include "../SegmentNumGenerator.h"
+#include "../ShmChannel.h"
 #include "../UDPSocket.h"
 #include "../HKDFUnit.h"
 
@@ -31,6 +35,7 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/types.h>
 
 
@@ -93,6 +98,7 @@ namespace
   {
     std::shared_ptr<Connection> conn;
     std::shared_ptr<CryptoUnit> crypto;
+    std::shared_ptr<CryptoUnit> fec_crypto;
     host_id_type conn_id;
     host_id_type peer_id;
     channel_id_type channel_id;
@@ -100,6 +106,7 @@ namespace
     int to_user_fifo_fd;
     int socket_fd;
     in_port_t socket_fd_bound_port;
+    std::shared_ptr<ShmChannelClient> shm_client;
     ConnectionAndRelated():
       from_user_fifo_fd(-1),
       to_user_fifo_fd(-1),
@@ -121,9 +128,20 @@ namespace
 
   /* create_connection() is a convenience function which prepares a Connection
    * for use in testing, and returns it together with related objects necessary
-   * for using it.
+   * for using it. The cipher_suite parameter selects the cipher suite used by both the
+   * Connection and the returned CryptoUnit, and crypto_pool is passed to the Connection.
+   * In seqpacket mode, from_user_fifo_fd and to_user_fifo_fd are both connections to the
+   * Connection's socket, and in shm mode the Connection's shared memory is used through
+   * shm_client instead. coalesce_window_micros, fec and bundler are passed to the Connection,
+   * and if fec is true, fec_crypto is a CryptoUnit with the keys of the peer's FEC report
+   * packets.
    */
-  ConnectionAndRelated create_connection()
+  ConnectionAndRelated create_connection(CipherSuite cipher_suite = CipherSuite::aes_256_gcm,
+                                         const std::shared_ptr<CryptoWorkerPool>& crypto_pool = nullptr,
+                                         ChannelMode channel_mode = ChannelMode::fifo,
+                                         unsigned int coalesce_window_micros = 0,
+                                         bool fec = false,
+                                         const std::shared_ptr<Bundler>& bundler = nullptr)
   {
     ConnectionAndRelated conn_etc;
 
@@ -185,6 +203,13 @@ namespace
       std::make_shared<UDPSocket>("127.0.0.1",0);
     std::shared_ptr<SegmentNumGenerator> segnumgen =
       std::make_shared<SegmentNumGenerator>(segnumfile_base_name,1);
+    ConnectionSettings conn_settings;
+    conn_settings.cipher_suite = cipher_suite;
+    conn_settings.crypto_pool = crypto_pool;
+    conn_settings.channel_mode = channel_mode;
+    conn_settings.bundler = bundler;
+    conn_settings.coalesce_window_micros = coalesce_window_micros;
+    conn_settings.fec = fec;
 
     conn_etc.conn = std::make_shared<Connection>(conn_etc.conn_id,
                                                  peer_name,
@@ -196,37 +221,75 @@ namespace
                                                  conn_etc.socket_fd_bound_port,
                                                  max_packet_size,
                                                  udp_socket,
-                                                 segnumgen);
+                                                 segnumgen,
+                                                 conn_settings);
 
     /* 4 - open the Connection's FIFOs
      * Note that the literal strings "_OUTWARD" and "_INWARD" need to be kept in sync
      * with the values in Connection.cpp (this is not good and should probably be fixed
      * somehow).
      */
-    std::string to_user_fifo_name(fifo_base_path+"_INWARD");
-    std::string from_user_fifo_name(fifo_base_path+"_OUTWARD");
-    conn_etc.to_user_fifo_fd = open(to_user_fifo_name.c_str(), O_RDONLY);
-    TESTASSERT( conn_etc.to_user_fifo_fd != -1 );
-    conn_etc.from_user_fifo_fd = open(from_user_fifo_name.c_str(), O_WRONLY);
-    TESTASSERT( conn_etc.from_user_fifo_fd != -1 );
-
-    /* 5 - create the CryptoUnit */
-    std::vector<unsigned char> enc_info( (2*host_id_size)+channel_id_size );
+    if(channel_mode == ChannelMode::seqpacket){
+      std::string socket_name(fifo_base_path+"_SOCKET");
+      conn_etc.to_user_fifo_fd = socket(AF_UNIX,SOCK_SEQPACKET,0);
+      TESTASSERT( conn_etc.to_user_fifo_fd != -1 );
+      sockaddr_un addr;
+      memset(&addr,0,sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strcpy(addr.sun_path,socket_name.c_str());
+      TESTASSERT( connect(conn_etc.to_user_fifo_fd,(sockaddr*)&addr,sizeof(addr)) == 0 );
+      conn_etc.from_user_fifo_fd = dup(conn_etc.to_user_fifo_fd);
+      TESTASSERT( conn_etc.from_user_fifo_fd != -1 );
+    }
+    else if(channel_mode == ChannelMode::shm){
+      conn_etc.shm_client = std::make_shared<ShmChannelClient>(fifo_base_path);
+    }
+    else{
+      std::string to_user_fifo_name(fifo_base_path+"_INWARD");
+      std::string from_user_fifo_name(fifo_base_path+"_OUTWARD");
+      conn_etc.to_user_fifo_fd = open(to_user_fifo_name.c_str(), O_RDONLY);
+      TESTASSERT( conn_etc.to_user_fifo_fd != -1 );
+      conn_etc.from_user_fifo_fd = open(from_user_fifo_name.c_str(), O_WRONLY);
+      TESTASSERT( conn_etc.from_user_fifo_fd != -1 );
+    }
+
+    /* 5 - create the CryptoUnit (non-default cipher suites append a suite identifier
+       byte to the HKDF "info", and 0x02 identifies ChaCha20-Poly1305) */
+    unsigned int info_len = (2*host_id_size)+channel_id_size;
+    if(cipher_suite == CipherSuite::chacha20_poly1305){
+      info_len += 1;
+    }
+    std::vector<unsigned char> enc_info(info_len);
     auto enc_info_start = enc_info.begin();
     std::copy(conn_etc.peer_id.begin(),conn_etc.peer_id.end(),enc_info_start);
     std::copy(conn_etc.conn_id.begin(),conn_etc.conn_id.end(),enc_info_start+host_id_size);
     std::copy(conn_etc.channel_id.begin(),conn_etc.channel_id.end(),
               enc_info_start+(2*host_id_size));
 
-    std::vector<unsigned char> dec_info( (2*host_id_size)+channel_id_size );
+    std::vector<unsigned char> dec_info(info_len);
     auto dec_info_start = dec_info.begin();
     std::copy(conn_etc.conn_id.begin(),conn_etc.conn_id.end(),dec_info_start);
     std::copy(conn_etc.peer_id.begin(),conn_etc.peer_id.end(),dec_info_start+host_id_size);
     std::copy(conn_etc.channel_id.begin(),conn_etc.channel_id.end(),
               dec_info_start+(2*host_id_size));
+    if(cipher_suite == CipherSuite::chacha20_poly1305){
+      enc_info.back() = dec_info.back() = 0x02;
+    }
 
     conn_etc.crypto = std::make_shared<CryptoUnit>(hkdf_expand(key,enc_info),
-                                                   hkdf_expand(key,dec_info));
+                                                   hkdf_expand(key,dec_info),
+                                                   cipher_suite);
+
+    /* 6 - create the CryptoUnit for FEC report packets, whose keys have "fec report"
+       appended to the HKDF "info" */
+    if(fec){
+      std::string label("fec report");
+      enc_info.insert(enc_info.end(),label.begin(),label.end());
+      dec_info.insert(dec_info.end(),label.begin(),label.end());
+      conn_etc.fec_crypto = std::make_shared<CryptoUnit>(hkdf_expand(key,enc_info),
+                                                         hkdf_expand(key,dec_info),
+                                                         cipher_suite);
+    }
 
     return conn_etc;
   }
@@ -536,16 +599,11 @@ namespace
   }
 
 
-  /* check_no_action() checks that the Connection conn_etc does not send any response
-   * packet or write anything to its output FIFO when it receives the packet packet_data
+  /* check_no_output() checks that the Connection conn_etc has not sent any packet or
+   * written anything to its output FIFO
    */
-  void check_no_action(const ConnectionAndRelated& conn_etc,
-                       const std::vector<unsigned char>& packet_data)
+  void check_no_output(const ConnectionAndRelated& conn_etc)
   {
-    /* put packet_data into the Connection's Message queue and call move_data() */
-    conn_etc.conn->add_message(ReceivedUDPMessage{true,packet_data,"127.0.0.1",
-                                                  conn_etc.socket_fd_bound_port});
-    conn_etc.conn->move_data(1);
     do_pause(); // pause to ensure that any response data has time to become readable
 
     std::vector<int> fds{conn_etc.to_user_fifo_fd,conn_etc.socket_fd};
@@ -573,6 +631,51 @@ namespace
     }
   }
 
+
+  /* check_no_action() checks that the Connection conn_etc does not send any response
+   * packet or write anything to its output FIFO when it receives the packet packet_data
+   */
+  void check_no_action(const ConnectionAndRelated& conn_etc,
+                       const std::vector<unsigned char>& packet_data)
+  {
+    /* put packet_data into the Connection's Message queue and call move_data() */
+    conn_etc.conn->add_message(ReceivedUDPMessage{true,packet_data,"127.0.0.1",
+                                                  conn_etc.socket_fd_bound_port});
+    conn_etc.conn->move_data(1);
+    check_no_output(conn_etc);
+  }
+
+
+  /* make_fec_report() makes an FEC report packet from the Connection's peer, with the given
+   * sender's segment number and report number, sealed with the peer's FEC report key
+   */
+  std::vector<unsigned char> make_fec_report(const ConnectionAndRelated& conn_etc,
+                                             SegmentNumGenerator::segnum_t segnum,
+                                             std::uint_least64_t report_num)
+  {
+    FecDecoder decoder(conn_etc.conn_id,conn_etc.channel_id);
+    std::vector<unsigned char> report = decoder.report_packet(segnum,report_num);
+    CryptoUnit::iv_t iv;
+    std::copy(report.begin()+FecEncoder::report_iv_offset,
+              report.begin()+FecEncoder::report_iv_offset+iv.size(),iv.begin());
+    std::vector<unsigned char> ad(report.begin(),
+                                  report.begin()+FecEncoder::report_header_len);
+    conn_etc.fec_crypto->encrypt_in_place(report,FecEncoder::report_header_len,0,ad,iv);
+    return report;
+  }
+
+
+  /* send_fec_report() puts an FEC report packet into the Connection's message queue and
+   * calls move_data()
+   */
+  void send_fec_report(const ConnectionAndRelated& conn_etc,
+                       const std::vector<unsigned char>& report)
+  {
+    conn_etc.conn->add_message(ReceivedUDPMessage{true,report,"127.0.0.1",
+                                                  conn_etc.socket_fd_bound_port});
+    conn_etc.conn->move_data(1);
+  }
+
 }
 
 
@@ -614,6 +717,406 @@ TESTFUNC(Connection_init_from_conn_and_talk)
 }
 
 
+/* test initiation of communication and a short exchange of packets using the
+ * ChaCha20-Poly1305 cipher suite
+ */
+TESTFUNC(Connection_chacha20_poly1305_talk)
+{
+  ConnectionAndRelated conn_etc = create_connection(CipherSuite::chacha20_poly1305);
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+
+  // the simulated peer uses segment number 1
+  init_from_peer(conn_etc, conn_state, conn_msgnums, 1);
+
+  for(int i=0; i<100; i++){
+    send_data_into_conn(conn_etc, conn_state,(i%30)+1);
+    send_data_from_conn(conn_etc, conn_state,conn_msgnums,(i%30)+1);
+  }
+}
+
+
+/* test initiation of communication and a short exchange of packets by a Connection
+ * which uses a CryptoWorkerPool
+ */
+TESTFUNC(Connection_crypto_pool_talk)
+{
+  ConnectionAndRelated conn_etc = create_connection(CipherSuite::aes_256_gcm,
+                                                    std::make_shared<CryptoWorkerPool>(3));
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+
+  // the simulated peer uses segment number 1
+  init_from_conn(conn_etc, conn_state, conn_msgnums, 1);
+
+  for(int i=0; i<100; i++){
+    send_data_into_conn(conn_etc, conn_state,(i%30)+1);
+    send_data_from_conn(conn_etc, conn_state,conn_msgnums,(i%30)+1);
+  }
+}
+
+
+/* test that a Connection which uses a CryptoWorkerPool keeps the data in order when
+ * it handles many packets in one call to move_data()
+ */
+TESTFUNC(Connection_crypto_pool_bulk)
+{
+  ConnectionAndRelated conn_etc = create_connection(CipherSuite::aes_256_gcm,
+                                                    std::make_shared<CryptoWorkerPool>(3));
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+
+  // the simulated peer uses segment number 1
+  init_from_peer(conn_etc, conn_state, conn_msgnums, 1);
+
+  /* queue up many packets of differing sizes, then check that the data all comes out
+     of the FIFO in the right order */
+  std::vector<unsigned char> sent_data;
+  for(int i=0; i<50; i++){
+    std::vector<unsigned char> data = make_data((i*37)%500+1);
+    sent_data.insert(sent_data.end(),data.begin(),data.end());
+    create_and_send_good_packet(conn_etc,conn_state,data,false);
+  }
+  conn_etc.conn->move_data(20);
+
+  std::vector<unsigned char> received_data;
+  while(received_data.size() < sent_data.size()){
+    std::vector<unsigned char> fifo_data =
+      read_from_fifo(conn_etc.to_user_fifo_fd,sent_data.size()-received_data.size());
+    TESTASSERT(fifo_data.size() > 0);
+    received_data.insert(received_data.end(),fifo_data.begin(),fifo_data.end());
+  }
+  TESTASSERT(received_data == sent_data);
+
+  /* write enough data into the FIFO to fill many packets (the Connection's maximum
+     payload is 1000-40 bytes), then check that the packets are sent in order of
+     message number and carry the data in order */
+  unsigned int max_payload = 1000-40;
+  sent_data = make_data(max_payload*30+123);
+  write_to_fifo(conn_etc.from_user_fifo_fd,sent_data);
+  conn_etc.conn->move_data(20);
+
+  received_data.clear();
+  CryptoMessageTracker::msgnum_t last_msgnum = 0;
+  while(received_data.size() < sent_data.size()){
+    OpenedPacket op = get_packet_from_socket(conn_etc,1000);
+    TESTASSERT(op.valid);
+    TESTASSERT(op.recv_segnum == conn_state.peer_segnum);
+    TESTASSERT(op.send_segnum == conn_state.conn_segnum);
+    TESTASSERT(op.msgnum > last_msgnum);
+    last_msgnum = op.msgnum;
+    received_data.insert(received_data.end(),op.contents.begin(),op.contents.end());
+  }
+  TESTASSERT(received_data == sent_data);
+}
+
+
+/* test that the Connection counts packets, bytes, and rejected packets correctly */
+TESTFUNC(Connection_metrics)
+{
+  ConnectionAndRelated conn_etc = create_connection();
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+
+  /* the Connection sends a 40 byte "hello" packet, we reply with a 40 byte empty packet,
+     and the Connection then sends 17 bytes of data in a 57 byte packet */
+  init_from_conn(conn_etc,conn_state,conn_msgnums,1);
+  ConnectionMetricsSnapshot cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.hello_packets_sent == 1);
+  TESTASSERT(cms.packets_out == 2);
+  TESTASSERT(cms.bytes_out == 40+57);
+  TESTASSERT(cms.packets_in == 1);
+  TESTASSERT(cms.bytes_in == 40);
+  TESTASSERT(cms.outward_pipe_size == 65536); // no pipe size given, so the kernel default
+  TESTASSERT(cms.inward_pipe_size == 65536);
+
+  /* send 21 bytes of data in a 61 byte packet */
+  send_data_into_conn(conn_etc,conn_state,21);
+  cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.packets_in == 2);
+  TESTASSERT(cms.bytes_in == 40+61);
+
+  /* replay the last packet */
+  check_no_action(conn_etc,make_packet(conn_etc.conn_id,conn_etc.channel_id,
+                                       conn_state.conn_segnum,conn_state.peer_segnum,
+                                       conn_state.peer_next_msgnum-1,make_data(21),
+                                       conn_etc.crypto));
+  cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.replays_rejected == 1);
+
+  /* send a packet with a corrupted AEAD tag */
+  std::vector<unsigned char> bad_packet =
+    make_packet(conn_etc.conn_id,conn_etc.channel_id,
+                conn_state.conn_segnum,conn_state.peer_segnum,
+                conn_state.peer_next_msgnum++,make_data(21),
+                conn_etc.crypto);
+  bad_packet.back() ^= 0x01;
+  check_no_action(conn_etc,bad_packet);
+  cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.auth_failures == 1);
+
+  /* send a packet with a sender segment number of 0 */
+  check_no_action(conn_etc,make_packet(conn_etc.conn_id,conn_etc.channel_id,
+                                       conn_state.conn_segnum,0,
+                                       conn_state.peer_next_msgnum++,make_data(21),
+                                       conn_etc.crypto));
+  cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.bad_segnums == 1);
+  TESTASSERT(cms.packets_in == 5);
+  TESTASSERT(cms.replays_rejected == 1);
+  TESTASSERT(cms.auth_failures == 1);
+  TESTASSERT(cms.fifo_short_writes == 0);
+  TESTASSERT(cms.fifo_broken_pipes == 0);
+
+  /* messages waiting to be handled show up in the queue depth */
+  TESTASSERT(cms.queue_depth == 0);
+  create_and_send_good_packet(conn_etc,conn_state,make_data(10),false);
+  create_and_send_good_packet(conn_etc,conn_state,make_data(10),false);
+  TESTASSERT(conn_etc.conn->metrics().queue_depth == 2);
+}
+
+
+/* test that when the reader of the Connection's output FIFO falls behind, the data which
+ * does not fit in the FIFO is staged and delivered later in order, and that once enough is
+ * staged the Connection leaves the packets already queued rather than losing their data,
+ * but drops any more which arrive
+ */
+TESTFUNC(Connection_slow_reader)
+{
+  ConnectionAndRelated conn_etc = create_connection();
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+  init_from_peer(conn_etc, conn_state, conn_msgnums, 1);
+
+  /* queue up much more data than the FIFO (64 KiB) and the staging buffer (1 MiB) can
+     hold between them, and let the Connection process as much as it can */
+  std::vector<unsigned char> sent_data;
+  for(int i=0; i<1300; i++){
+    std::vector<unsigned char> data = make_data(900);
+    data[0] = static_cast<unsigned char>(i); // so that the packets' data differs
+    sent_data.insert(sent_data.end(),data.begin(),data.end());
+    create_and_send_good_packet(conn_etc,conn_state,data,false);
+  }
+  conn_etc.conn->move_data(2000);
+
+  ConnectionMetricsSnapshot cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.fifo_short_writes == 1);
+  TESTASSERT(cms.pending_output >= 1048576);
+  TESTASSERT(cms.pending_output < 1048576+900);
+  TESTASSERT(cms.queue_depth > 0);
+  TESTASSERT(cms.intake_pauses == 1);
+  TESTASSERT(cms.messages_dropped == 0);
+  TESTASSERT(conn_etc.conn->output_pending());
+  TESTASSERT(not conn_etc.conn->is_data()); // nothing can be done until the reader reads
+
+  /* a packet arriving while intake is paused is queued rather than dropped, and passes of
+     the data loop while it stays paused are not counted as more pauses */
+  std::vector<unsigned char> data = make_data(900);
+  data[0] = 0xff;
+  sent_data.insert(sent_data.end(),data.begin(),data.end());
+  create_and_send_good_packet(conn_etc,conn_state,data,false);
+  conn_etc.conn->move_data(2000);
+  TESTASSERT(conn_etc.conn->metrics().queue_depth == cms.queue_depth+1);
+  cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.messages_dropped == 0);
+  TESTASSERT(cms.intake_pauses == 1);
+
+  /* read everything, letting the Connection move data whenever the FIFO has room */
+  std::vector<unsigned char> received_data;
+  while(received_data.size() < sent_data.size()){
+    std::vector<unsigned char> fifo_data = read_from_fifo(conn_etc.to_user_fifo_fd,65536);
+    received_data.insert(received_data.end(),fifo_data.begin(),fifo_data.end());
+    if(conn_etc.conn->is_data()){
+      conn_etc.conn->move_data(2000);
+    }
+  }
+  TESTASSERT(received_data == sent_data);
+
+  cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.pending_output == 0);
+  TESTASSERT(cms.queue_depth == 0);
+  TESTASSERT(cms.fifo_broken_pipes == 0);
+  TESTASSERT(not conn_etc.conn->output_pending());
+}
+
+
+/* test that the Connection's queue of received packets is bounded, so that packets which
+ * arrive faster than they are processed are dropped rather than held without limit
+ */
+TESTFUNC(Connection_queue_limit)
+{
+  ConnectionAndRelated conn_etc = create_connection();
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+  init_from_peer(conn_etc, conn_state, conn_msgnums, 1);
+
+  /* the queue holds 4 MiB of packets */
+  for(int i=0; i<5000; i++){
+    create_and_send_good_packet(conn_etc,conn_state,make_data(1000),false);
+  }
+  ConnectionMetricsSnapshot cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.messages_dropped > 0);
+  TESTASSERT(cms.queue_depth+cms.messages_dropped == 5000);
+  TESTASSERT(cms.queue_depth*1000 < 4194304);
+  TESTASSERT(cms.queue_depth*1100 > 4194304);
+
+  /* once the queue has been worked through, packets are accepted again */
+  while(conn_etc.conn->metrics().queue_depth > 0){
+    conn_etc.conn->move_data(100);
+    read_from_fifo(conn_etc.to_user_fifo_fd,65536);
+  }
+  create_and_send_good_packet(conn_etc,conn_state,make_data(10),false);
+  TESTASSERT(conn_etc.conn->metrics().queue_depth == 1);
+  TESTASSERT(conn_etc.conn->metrics().messages_dropped == cms.messages_dropped);
+}
+
+
+/* test that with a coalescing window, small writes to the Connection's input FIFO are
+ * held back and sent together once the window has passed, and that a full packet's worth
+ * of data is sent straight away
+ */
+TESTFUNC(Connection_coalescing)
+{
+  ConnectionAndRelated conn_etc = create_connection(CipherSuite::aes_256_gcm,nullptr,
+                                                    ChannelMode::fifo,200000);
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+  init_from_peer(conn_etc,conn_state,conn_msgnums,1);
+  send_data_into_conn(conn_etc,conn_state,10);
+  TESTASSERT(conn_etc.conn->flush_due() == 0);
+
+  /* three writes of 20 bytes are held back... */
+  std::vector<unsigned char> sent_data;
+  nanos_t first_write = monotonic_nanos();
+  for(int i=0; i<3; i++){
+    std::vector<unsigned char> data = make_data(20);
+    sent_data.insert(sent_data.end(),data.begin(),data.end());
+    write_to_fifo(conn_etc.from_user_fifo_fd,data);
+    conn_etc.conn->move_data(1);
+  }
+  check_no_output(conn_etc);
+  TESTASSERT(not conn_etc.conn->is_data());
+  nanos_t due = conn_etc.conn->flush_due();
+  TESTASSERT( (due >= first_write+200000000) and (due <= monotonic_nanos()+200000000) );
+
+  /* ...and sent in one packet once the window has passed */
+  while(monotonic_nanos() < due){
+    do_pause(10);
+  }
+  conn_etc.conn->move_data(1);
+  OpenedPacket op = get_packet_from_socket(conn_etc,1000);
+  check_packet(op,conn_etc,conn_state.peer_segnum,conn_state.conn_segnum,conn_msgnums,
+               sent_data);
+  TESTASSERT(conn_etc.conn->flush_due() == 0);
+  TESTASSERT(conn_etc.conn->metrics().coalesce_timeouts == 1);
+
+  /* full packets are sent straight away, and the rest is held back */
+  sent_data = make_data(2000);
+  write_to_fifo(conn_etc.from_user_fifo_fd,sent_data);
+  conn_etc.conn->move_data(5);
+  for(int i=0; i<2; i++){
+    op = get_packet_from_socket(conn_etc,1000);
+    check_packet(op,conn_etc,conn_state.peer_segnum,conn_state.conn_segnum,conn_msgnums,
+                 std::vector<unsigned char>(sent_data.begin()+960*i,
+                                            sent_data.begin()+960*(i+1)));
+  }
+  check_no_output(conn_etc);
+  TESTASSERT(conn_etc.conn->flush_due() != 0);
+  TESTASSERT(conn_etc.conn->metrics().coalesce_timeouts == 1);
+}
+
+
+/* test that in seqpacket mode each message from the user is sent in its own packet, that
+ * messages too long for a packet are discarded, and that the data from each packet
+ * received reaches the user as a single message
+ */
+TESTFUNC(Connection_seqpacket)
+{
+  ConnectionAndRelated conn_etc = create_connection(CipherSuite::aes_256_gcm,nullptr,
+                                                    ChannelMode::seqpacket);
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+  init_from_peer(conn_etc, conn_state, conn_msgnums, 1);
+
+  /* packets from the peer arrive as separate messages */
+  create_and_send_good_packet(conn_etc,conn_state,make_data(7),false);
+  create_and_send_good_packet(conn_etc,conn_state,make_data(9),false);
+  conn_etc.conn->move_data(10);
+  unsigned char buffer[100];
+  TESTASSERT( recv(conn_etc.to_user_fifo_fd,buffer,100,0) == 7 );
+  TESTASSERT( recv(conn_etc.to_user_fifo_fd,buffer,100,0) == 9 );
+  TESTASSERT( std::vector<unsigned char>(buffer,buffer+9) == make_data(9) );
+
+  /* the packets are 1000 bytes at most, so can carry messages of up to 960 bytes */
+  std::vector<std::vector<unsigned char>> messages{make_data(10),make_data(960),
+                                                   make_data(961),make_data(5)};
+  for(const auto& message : messages){
+    TESTASSERT( send(conn_etc.from_user_fifo_fd,message.data(),message.size(),0)
+                == static_cast<ssize_t>(message.size()) );
+  }
+  conn_etc.conn->move_data(10);
+  for(unsigned int i : {0,1,3}){
+    OpenedPacket op = get_packet_from_socket(conn_etc,1000);
+    check_packet(op,conn_etc,conn_state.peer_segnum,conn_state.conn_segnum,
+                 conn_msgnums,messages[i]);
+  }
+  check_no_output(conn_etc);
+  TESTASSERT( conn_etc.conn->metrics().messages_too_long == 1 );
+}
+
+
+/* test that a Connection in shm mode passes messages through its shared memory, and
+ * that a message pushed while the Connection is idle rings its doorbell
+ */
+TESTFUNC(Connection_shm)
+{
+  ConnectionAndRelated conn_etc = create_connection(CipherSuite::aes_256_gcm,nullptr,
+                                                    ChannelMode::shm);
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+  init_from_peer(conn_etc, conn_state, conn_msgnums, 1);
+
+  /* packets from the peer arrive as separate messages */
+  create_and_send_good_packet(conn_etc,conn_state,make_data(7),false);
+  create_and_send_good_packet(conn_etc,conn_state,make_data(9),false);
+  conn_etc.conn->move_data(10);
+  std::vector<unsigned char> received;
+  TESTASSERT( conn_etc.shm_client->try_receive(received) );
+  TESTASSERT( received == make_data(7) );
+  TESTASSERT( conn_etc.shm_client->try_receive(received) );
+  TESTASSERT( received == make_data(9) );
+  TESTASSERT( not conn_etc.shm_client->try_receive(received) );
+
+  /* once the Connection has nothing to do, a message from the user program makes its
+     doorbell readable */
+  TESTASSERT( not conn_etc.conn->is_data() );
+  pollfd pfd;
+  pfd.fd = conn_etc.conn->from_user_fifo_fd();
+  pfd.events = POLLIN;
+  TESTASSERT( poll(&pfd,1,0) == 0 );
+  std::vector<std::vector<unsigned char>> messages{make_data(10),make_data(960),
+                                                   make_data(961),make_data(5)};
+  for(const auto& message : messages){
+    TESTASSERT( conn_etc.shm_client->try_send(message.data(),message.size()) );
+  }
+  TESTASSERT( poll(&pfd,1,0) == 1 );
+  TESTASSERT( conn_etc.conn->is_data() );
+
+  /* as in seqpacket mode, a message too long for one packet is discarded */
+  conn_etc.conn->move_data(10);
+  for(unsigned int i : {0,1,3}){
+    OpenedPacket op = get_packet_from_socket(conn_etc,1000);
+    check_packet(op,conn_etc,conn_state.peer_segnum,conn_state.conn_segnum,
+                 conn_msgnums,messages[i]);
+  }
+  check_no_output(conn_etc);
+  TESTASSERT( conn_etc.conn->metrics().messages_too_long == 1 );
+  TESTASSERT( conn_etc.conn->metrics().outward_pipe_size == ShmEndpoint::default_ring_capacity );
+  TESTASSERT( not conn_etc.conn->is_data() );
+  TESTASSERT( poll(&pfd,1,0) == 0 );
+}
+
+
 /* test that the Connection can correctly accept packets which arrive out
  * of order (by message number)
  */
@@ -818,6 +1321,96 @@ TESTFUNC(Connection_hello_resend)
 }
 
 
+/* test that a Connection which has had start_handshake() called sends "hello"
+ * packets with no data waiting, spaced out by a growing interval, and that it
+ * replies to the peer's response so that the peer can confirm its segment number
+ */
+TESTFUNC(Connection_handshake_without_data)
+{
+  ConnectionAndRelated conn_etc = create_connection();
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+
+  conn_state.conn_segnum=0;
+  conn_state.peer_segnum=1;
+  conn_state.peer_next_msgnum=1;
+
+  /* without start_handshake(), no "hello" packet is wanted */
+  TESTASSERT(conn_etc.conn->handshake_due() == 0);
+  conn_etc.conn->start_handshake();
+  TESTASSERT(conn_etc.conn->handshake_due() != 0);
+  TESTASSERT(conn_etc.conn->handshake_due() <= epoch_time_millis());
+
+  /* the Connection should send a "hello" packet straight away... */
+  conn_etc.conn->move_data(1);
+  OpenedPacket op = get_packet_from_socket(conn_etc,100);
+  check_packet(op,conn_etc,0,0,conn_msgnums,{});
+  conn_state.conn_segnum = op.send_segnum;
+
+  /* ...but not another one until the (doubled) interval has passed */
+  millis_timestamp_t last_hello = conn_etc.conn->open_status().second;
+  TESTASSERT(conn_etc.conn->handshake_due() == last_hello+200);
+  conn_etc.conn->move_data(1);
+  check_no_output(conn_etc);
+
+  do_pause(conn_etc.conn->handshake_due()-epoch_time_millis()+10);
+  conn_etc.conn->move_data(1);
+  op = get_packet_from_socket(conn_etc,100);
+  check_packet(op,conn_etc,0,conn_state.conn_segnum,conn_msgnums,{});
+  TESTASSERT(conn_etc.conn->handshake_due() == conn_etc.conn->open_status().second+400);
+
+  /* respond to the "hello" packet, and check that the Connection replies with an
+     empty packet even though it has no data to send */
+  create_and_send_good_packet(conn_etc,conn_state,{});
+  op = get_packet_from_socket(conn_etc,100);
+  check_packet(op,conn_etc,conn_state.peer_segnum,conn_state.conn_segnum,
+               conn_msgnums,{});
+  TESTASSERT(conn_etc.conn->open_status().first);
+  TESTASSERT(conn_etc.conn->handshake_due() == 0);
+
+  /* the empty packet from the Connection needs no reply */
+  conn_etc.conn->move_data(1);
+  check_no_output(conn_etc);
+
+  /* talk back and forth a bit */
+  for(int i=0; i<20; i++){
+    send_data_from_conn(conn_etc, conn_state,conn_msgnums,(i%30)+1);
+    send_data_into_conn(conn_etc, conn_state,(i%30)+1);
+  }
+}
+
+
+/* test that when the peer restarts, and neither side has data to send, the Connection
+ * sends the peer a packet to let it confirm the Connection's segment number
+ */
+TESTFUNC(Connection_peer_restart_without_data)
+{
+  ConnectionAndRelated conn_etc = create_connection();
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+
+  // initiate the communication with the simulated peer using segment number 1
+  init_from_peer(conn_etc,conn_state,conn_msgnums,1);
+  for(int i=0; i<10; i++){
+    send_data_into_conn(conn_etc, conn_state,(i%30)+1);
+    send_data_from_conn(conn_etc, conn_state,conn_msgnums,(i%30)+1);
+  }
+
+  /* re-initiate communication as if we've restarted, then send the empty packet
+     which a restarted peer sends when it confirms the Connection's segment number */
+  init_from_peer(conn_etc,conn_state,conn_msgnums,2);
+  create_and_send_good_packet(conn_etc,conn_state,{});
+
+  /* the Connection should reply using our new segment number */
+  OpenedPacket op = get_packet_from_socket(conn_etc,100);
+  check_packet(op,conn_etc,2,conn_state.conn_segnum,conn_msgnums,{});
+
+  /* check that data flows in both directions */
+  send_data_from_conn(conn_etc, conn_state,conn_msgnums,21);
+  send_data_into_conn(conn_etc,conn_state,21);
+}
+
+
 /* check that Connection::move_data() functions correctly during an initiation
  * of communication from the peer and subsequent data exchanges
  */
@@ -1181,3 +1774,140 @@ TESTFUNC(Connection_packet_replay)
     check_no_action(conn_etc,packet_data);
   }
 }
+
+
+/* test that a Connection is dormant until it is first moved, that hibernate() only puts
+ * it to sleep when it has nothing in hand, and that once woken it carries on with the
+ * same segment numbers, still rejecting packets replayed from before it slept
+ */
+TESTFUNC(Connection_hibernate)
+{
+  ConnectionAndRelated conn_etc = create_connection();
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+  TESTASSERT(conn_etc.conn->dormant());
+
+  init_from_peer(conn_etc,conn_state,conn_msgnums,1);
+  TESTASSERT(not conn_etc.conn->dormant());
+  send_data_into_conn(conn_etc,conn_state,17);
+  send_data_from_conn(conn_etc,conn_state,conn_msgnums,17);
+
+  /* a Connection with a message waiting does not sleep */
+  std::vector<unsigned char> data = make_data(23);
+  std::vector<unsigned char> packet_data = make_packet(conn_etc.conn_id,
+                                                       conn_etc.channel_id,
+                                                       conn_state.conn_segnum,
+                                                       conn_state.peer_segnum,
+                                                       conn_state.peer_next_msgnum++,
+                                                       data,
+                                                       conn_etc.crypto);
+  conn_etc.conn->add_message(ReceivedUDPMessage{true,packet_data,"127.0.0.1",
+                                                conn_etc.socket_fd_bound_port});
+  TESTASSERT(not conn_etc.conn->hibernate());
+  conn_etc.conn->move_data(1);
+  TESTASSERT(read_from_fifo(conn_etc.to_user_fifo_fd,data.size()) == data);
+
+  /* once asleep, a packet received before is still rejected, as is a forged one, and
+     neither wakes the Connection, while new ones in either direction are carried with the
+     same segment numbers */
+  TESTASSERT(conn_etc.conn->hibernate());
+  TESTASSERT(conn_etc.conn->dormant());
+  check_no_action(conn_etc,packet_data);
+  TESTASSERT(conn_etc.conn->dormant());
+  std::vector<unsigned char> forged_packet =
+    make_packet(conn_etc.conn_id,conn_etc.channel_id,conn_state.conn_segnum,
+                conn_state.peer_segnum,conn_state.peer_next_msgnum,data,conn_etc.crypto);
+  forged_packet.back() ^= 0x01;
+  check_no_action(conn_etc,forged_packet);
+  TESTASSERT(conn_etc.conn->dormant());
+  ConnectionMetricsSnapshot cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.replays_rejected == 1);
+  TESTASSERT(cms.auth_failures == 1);
+  send_data_into_conn(conn_etc,conn_state,31);
+  TESTASSERT(not conn_etc.conn->dormant());
+  TESTASSERT(conn_etc.conn->hibernate());
+  send_data_from_conn(conn_etc,conn_state,conn_msgnums,31);
+}
+
+
+/* test that the frames from bundle packets waiting to be written out by a bundled
+ * Connection count towards the limit on its queue, beyond which they are dropped
+ */
+TESTFUNC(Connection_bundled_queue_limit)
+{
+  std::shared_ptr<Bundler> bundler =
+    std::make_shared<Bundler>(Connection::max_data_len(1000),500,
+                              [](const channel_id_type&,const unsigned char*,unsigned int){},
+                              [](){});
+  ConnectionAndRelated conn_etc =
+    create_connection(CipherSuite::aes_256_gcm,nullptr,ChannelMode::fifo,0,false,bundler);
+  TESTASSERT(conn_etc.conn->uses_bundler(bundler.get()));
+  TESTASSERT(not conn_etc.conn->uses_bundler(nullptr));
+
+  /* 4 MiB of frames are kept */
+  std::vector<unsigned char> frame = make_data(1000);
+  for(int i=0; i<5000; i++){
+    conn_etc.conn->add_bundled_payload(frame.data(),frame.size());
+  }
+  ConnectionMetricsSnapshot cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.messages_dropped == 5000-4194304/1000);
+
+  /* once they have been written out, frames are accepted again */
+  std::size_t num_read = 0;
+  while(num_read < (4194304/1000)*1000){
+    conn_etc.conn->move_data(100);
+    num_read += read_from_fifo(conn_etc.to_user_fifo_fd,65536).size();
+  }
+  TESTASSERT(num_read == (4194304/1000)*1000);
+  conn_etc.conn->add_bundled_payload(frame.data(),10);
+  conn_etc.conn->move_data(1);
+  TESTASSERT(read_from_fifo(conn_etc.to_user_fifo_fd,65536).size() == 10);
+  TESTASSERT(conn_etc.conn->metrics().messages_dropped == cms.messages_dropped);
+}
+
+
+/* test that a Connection using FEC only accepts report packets from its peer which are
+ * authenticated, carry the peer's current segment number, and are not replayed
+ */
+TESTFUNC(Connection_fec_reports)
+{
+  ConnectionAndRelated conn_etc =
+    create_connection(CipherSuite::aes_256_gcm,nullptr,ChannelMode::fifo,0,true);
+  ConnState conn_state;
+  std::set<CryptoMessageTracker::msgnum_t> conn_msgnums;
+
+  /* reports are ignored by a dormant Connection, and not accepted by an awake one before
+     it is open (it is woken to send a "hello" packet, which we discard) */
+  send_fec_report(conn_etc,make_fec_report(conn_etc,1,1));
+  TESTASSERT(conn_etc.conn->dormant());
+  TESTASSERT(conn_etc.conn->metrics().bad_segnums == 0);
+  conn_etc.conn->start_handshake();
+  send_fec_report(conn_etc,make_fec_report(conn_etc,1,1));
+  TESTASSERT(not conn_etc.conn->dormant());
+  TESTASSERT(conn_etc.conn->metrics().bad_segnums == 1);
+  get_packet_from_socket(conn_etc,100);
+
+  init_from_peer(conn_etc,conn_state,conn_msgnums,1);
+  send_data_into_conn(conn_etc,conn_state,17);
+
+  /* a report with a bad tag, or another segment number, is rejected */
+  std::vector<unsigned char> report = make_fec_report(conn_etc,1,1);
+  report.back() ^= 0x01;
+  send_fec_report(conn_etc,report);
+  send_fec_report(conn_etc,make_fec_report(conn_etc,2,1));
+  ConnectionMetricsSnapshot cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.auth_failures == 1);
+  TESTASSERT(cms.bad_segnums == 2);
+
+  /* a good report is accepted once, and only later reports after it */
+  report = make_fec_report(conn_etc,1,2);
+  send_fec_report(conn_etc,report);
+  send_fec_report(conn_etc,report);
+  send_fec_report(conn_etc,make_fec_report(conn_etc,1,1));
+  send_fec_report(conn_etc,make_fec_report(conn_etc,1,3));
+  cms = conn_etc.conn->metrics();
+  TESTASSERT(cms.auth_failures == 1);
+  TESTASSERT(cms.bad_segnums == 2);
+  TESTASSERT(cms.replays_rejected == 2);
+  TESTASSERT(cms.packets_in == 10);
+}
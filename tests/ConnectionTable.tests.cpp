@@ -0,0 +1,119 @@
+#include "testsys.h"
+#include "../ConnectionTable.h"
+
+#include <vector>
+
+namespace
+{
+  /* make_test_id() makes a distinct Connection id for each n, with ids for many channels
+     to each of a few peers */
+  ConnectionTable::connection_id_type make_test_id(unsigned int n)
+  {
+    host_id_type peer_id{0x0a,0x0b,0x0c,static_cast<unsigned char>(n % 7)};
+    channel_id_type channel_id{static_cast<unsigned char>(n >> 8),
+                               static_cast<unsigned char>(n & 0xff)};
+    return ConnectionTable::make_id(peer_id,channel_id);
+  }
+}
+
+
+/* test that the records inserted keep their indices, and can be found by their ids, as
+ * the hash table grows
+ */
+TESTFUNC(ConnectionTable_insert_find)
+{
+  ConnectionTable table;
+  TESTASSERT( table.size() == 0 );
+  TESTASSERT( table.find(make_test_id(0)) == ConnectionTable::no_index );
+
+  const unsigned int num_ids = 1000;
+  for(unsigned int n=0; n<num_ids; n++){
+    ConnectionTable::index_type index = table.insert(make_test_id(n));
+    TESTASSERT( index == n );
+    TESTASSERT( table.size() == n+1 );
+    TESTASSERT( table[index].id == make_test_id(n) );
+    TESTASSERT( not table[index].conn );
+    TESTASSERT( (not table[index].working) and (not table[index].queued) );
+    TESTASSERT( table[index].readers == 0 );
+  }
+
+  for(unsigned int n=0; n<num_ids; n++){
+    TESTASSERT( table.find(make_test_id(n)) == n );
+  }
+  TESTASSERT( table.find(make_test_id(num_ids)) == ConnectionTable::no_index );
+  TESTASSERT( table.find(make_test_id(num_ids+100)) == ConnectionTable::no_index );
+
+  /* an id can be found from the start of a packet */
+  std::vector<unsigned char> packet(100,0xee);
+  ConnectionTable::connection_id_type id = make_test_id(321);
+  std::copy(id.begin(),id.end(),packet.begin());
+  TESTASSERT( table.find(packet.data()) == 321 );
+
+  TESTTHROW( table.insert(make_test_id(5)), "inserted twice" );
+  TESTASSERT( table.size() == num_ids );
+}
+
+
+/* test that make_id() puts the peer's host id before the channel id */
+TESTFUNC(ConnectionTable_make_id)
+{
+  ConnectionTable::connection_id_type id = ConnectionTable::make_id({1,2,3,4},{5,6});
+  TESTASSERT( (id == ConnectionTable::connection_id_type{1,2,3,4,5,6}) );
+}
+
+
+/* test that removed records can no longer be found, while the others still can, and that
+ * an id which has been removed can be inserted again, taking the index of a removed record
+ * once that record is neither queued, nor being worked on, nor being read
+ */
+TESTFUNC(ConnectionTable_remove)
+{
+  ConnectionTable table;
+  const unsigned int num_ids = 300;
+  for(unsigned int n=0; n<num_ids; n++){
+    table.insert(make_test_id(n));
+  }
+  for(unsigned int n=0; n<num_ids; n+=3){
+    table.remove(n);
+    TESTASSERT( table[n].retired );
+  }
+  table.remove(0); // removing twice does nothing
+  TESTASSERT( table.live() == num_ids-num_ids/3 );
+  TESTASSERT( table.size() == num_ids );
+
+  for(unsigned int n=0; n<num_ids; n++){
+    TESTASSERT( table.find(make_test_id(n)) == ( (n%3 == 0) ? ConnectionTable::no_index : n ) );
+  }
+
+  /* the oldest removed records are used first, passing over those still queued, being
+     worked on or being read, and once there are none left, records are added */
+  table[0].queued = true;
+  table[3].working = true;
+  table[6].readers = 1;
+  for(unsigned int n=0; n<num_ids; n+=3){
+    TESTASSERT( table.insert(make_test_id(n)) ==
+                ( (n+9 < num_ids) ? n+9 : num_ids+(n+9-num_ids)/3 ) );
+  }
+  for(unsigned int n=0; n<num_ids; n++){
+    ConnectionTable::index_type index = table.find(make_test_id(n));
+    TESTASSERT( (index == n) or (n%3 == 0) );
+    TESTASSERT( table[index].id == make_test_id(n) );
+  }
+  TESTASSERT( table.live() == num_ids );
+  TESTASSERT( table.size() == num_ids+3 );
+
+  /* once they have been released, those records are used again */
+  table[0].queued = false;
+  table[3].working = false;
+  table[6].readers = 0;
+  table.remove(table.find(make_test_id(6)));
+  TESTASSERT( table.insert(make_test_id(num_ids)) == 0 );
+  TESTASSERT( table.insert(make_test_id(num_ids+1)) == 3 );
+  TESTASSERT( table.insert(make_test_id(num_ids+2)) == 6 );
+  TESTASSERT( table.insert(make_test_id(num_ids+3)) == 15 );
+  TESTASSERT( (table[0].id == make_test_id(num_ids)) and (not table[0].retired) );
+  TESTASSERT( table.find(make_test_id(6)) == ConnectionTable::no_index );
+  TESTASSERT( table.find(make_test_id(num_ids+3)) == 15 );
+  TESTASSERT( table.live() == num_ids+3 );
+  TESTASSERT( table.size() == num_ids+3 );
+}
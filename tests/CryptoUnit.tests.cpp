@@ -52,11 +52,12 @@ void run_test_vector(const std::string& key_str,
                      const std::string& iv_str,
                      const std::string& ciphertext_str,
                      const std::string& tag_str,
-                     unsigned int ciphertext_offset = 0)
+                     unsigned int ciphertext_offset = 0,
+                     CipherSuite suite = CipherSuite::aes_256_gcm)
 {
   SecretKey secret_key(key_str);
-  CryptoUnit crypto_unit_enc(secret_key,unused_key);
-  CryptoUnit crypto_unit_dec(unused_key,secret_key);
+  CryptoUnit crypto_unit_enc(secret_key,unused_key,suite);
+  CryptoUnit crypto_unit_dec(unused_key,secret_key,suite);
 
   typedef std::vector<unsigned char> bytes_t;
 
@@ -87,6 +88,16 @@ void run_test_vector(const std::string& key_str,
   TESTASSERT(trial_tagged_ciphertext == tagged_ciphertext);
   TESTASSERT(tag_valid);
   TESTASSERT(trial_plaintext == plaintext);
+
+  /* check that encrypting and decrypting in place give the same results */
+  bytes_t buffer(ciphertext_offset+plaintext.size()+16);
+  std::copy(plaintext.begin(),plaintext.end(),buffer.begin()+ciphertext_offset);
+  crypto_unit_enc.encrypt_in_place(buffer,ciphertext_offset,plaintext.size(),additional,iv);
+  TESTASSERT(bytes_t(buffer.begin()+ciphertext_offset,buffer.end()) ==
+             bytes_t(tagged_ciphertext.begin()+ciphertext_offset,tagged_ciphertext.end()));
+  TESTASSERT(crypto_unit_dec.decrypt_in_place(buffer,ciphertext_offset,plaintext.size()+16,
+                                              additional,iv));
+  TESTASSERT(bytes_t(buffer.begin()+ciphertext_offset,buffer.end()-16) == plaintext);
 }
 
 
@@ -95,10 +106,11 @@ void check_tamper_detected(const std::string& key_str,
                            const std::string& additional_str,
                            const std::string& iv_str,
                            const std::string& ciphertext_str,
-                           const std::string& tag_str)
+                           const std::string& tag_str,
+                           CipherSuite suite = CipherSuite::aes_256_gcm)
 {
   SecretKey secret_key(key_str);
-  CryptoUnit crypto_unit(unused_key,secret_key);
+  CryptoUnit crypto_unit(unused_key,secret_key,suite);
 
   typedef std::vector<unsigned char> bytes_t;
 
@@ -120,6 +132,9 @@ void check_tamper_detected(const std::string& key_str,
 
   TESTASSERT(not tag_valid);
   TESTASSERT(trial_plaintext == bytes_t());
+
+  TESTASSERT(not crypto_unit.decrypt_in_place(tagged_ciphertext,0,tagged_ciphertext.size(),
+                                              additional,iv));
 }
 
 
@@ -305,3 +320,76 @@ TESTFUNC(CryptoUnit_offset)
   run_test_vector(key_str,plaintext_str,additional_str,
                   iv_str,ciphertext_str,tag_str,17);
 }
+
+
+/* check the ChaCha20-Poly1305 cipher suite against the AEAD test vector given in section
+   2.8.2 of IETF RFC 8439 */
+TESTFUNC(CryptoUnit_RFC8439_chacha20_poly1305)
+{
+  CipherSuite suite = CipherSuite::chacha20_poly1305;
+  std::string key_str = "808182838485868788898a8b8c8d8e8f"\
+                        "909192939495969798999a9b9c9d9e9f";
+  std::string plaintext_str = "4c616469657320616e642047656e746c"\
+                              "656d656e206f662074686520636c6173"\
+                              "73206f66202739393a20496620492063"\
+                              "6f756c64206f6666657220796f75206f"\
+                              "6e6c79206f6e652074697020666f7220"\
+                              "746865206675747572652c2073756e73"\
+                              "637265656e20776f756c642062652069"\
+                              "742e";
+  std::string additional_str = "50515253c0c1c2c3c4c5c6c7";
+  std::string iv_str = "070000004041424344454647";
+  std::string ciphertext_str = "d31a8d34648e60db7b86afbc53ef7ec2"\
+                               "a4aded51296e08fea9e2b5a736ee62d6"\
+                               "3dbea45e8ca9671282fafb69da92728b"\
+                               "1a71de0a9e060b2905d6a5b67ecd3b36"\
+                               "92ddbd7f2d778b8c9803aee328091b58"\
+                               "fab324e4fad675945585808b4831d7bc"\
+                               "3ff4def08e4b7a9de576d26586cec64b"\
+                               "6116";
+  std::string tag_str = "1ae10b594f09e26a7e902ecbd0600691";
+
+  run_test_vector(key_str,plaintext_str,additional_str,
+                  iv_str,ciphertext_str,tag_str,0,suite);
+  run_test_vector(key_str,plaintext_str,additional_str,
+                  iv_str,ciphertext_str,tag_str,17,suite);
+
+  std::string bad_tag_str = tag_str;
+  bad_tag_str[5] = '0';
+  check_tamper_detected(key_str, additional_str, iv_str, ciphertext_str,
+                        bad_tag_str, suite);
+
+  std::string bad_ciphertext_str = ciphertext_str;
+  bad_ciphertext_str[30] = '0';
+  check_tamper_detected(key_str, additional_str, iv_str, bad_ciphertext_str,
+                        tag_str, suite);
+
+  std::string bad_additional_str = additional_str;
+  bad_additional_str[3] = '0';
+  check_tamper_detected(key_str, bad_additional_str, iv_str, ciphertext_str,
+                        tag_str, suite);
+
+  /* the same packet must not authenticate under the other cipher suite */
+  check_tamper_detected(key_str, additional_str, iv_str, ciphertext_str,
+                        tag_str, CipherSuite::aes_256_gcm);
+}
+
+
+/* check that CryptoUnit refuses to read or write outside the buffers it is given */
+TESTFUNC(CryptoUnit_bounds)
+{
+  CryptoUnit crypto_unit(unused_key,unused_key);
+  std::vector<unsigned char> additional;
+  CryptoUnit::iv_t iv{};
+  std::vector<unsigned char> buffer(40);
+  bool tag_valid;
+
+  TESTTHROW(crypto_unit.encrypt(std::vector<unsigned char>(30),additional,iv,buffer,0),
+            "no room for the ciphertext and tag");
+  TESTTHROW(crypto_unit.encrypt_in_place(buffer,10,20,additional,iv),
+            "no room for the ciphertext and tag");
+  TESTTHROW(crypto_unit.decrypt(buffer,additional,iv,30,20,tag_valid),
+            "ciphertext and tag out of range");
+  TESTTHROW(crypto_unit.decrypt_in_place(buffer,0,15,additional,iv),
+            "ciphertext and tag out of range");
+}
@@ -0,0 +1,95 @@
+#include "testsys.h"
+#include "../CryptoWorkerPool.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+
+/* test that run() calls the task exactly once for each index, for various numbers
+ * of tasks and worker threads
+ */
+TESTFUNC(CryptoWorkerPool_runs_each_task_once)
+{
+  for(unsigned int num_workers : {0,1,3,8}){
+    CryptoWorkerPool pool(num_workers);
+    TESTASSERT(pool.num_lanes() == num_workers+1);
+
+    for(unsigned int num_tasks : {0,1,2,5,64}){
+      std::vector<std::atomic<int>> counts(num_tasks);
+      for(auto& c : counts){
+        c = 0;
+      }
+      pool.run(num_tasks,[&](unsigned int i){ counts[i]++; });
+      for(auto& c : counts){
+        TESTASSERT(c == 1);
+      }
+    }
+  }
+}
+
+
+/* test that run() spreads tasks across more than one thread */
+TESTFUNC(CryptoWorkerPool_uses_workers)
+{
+  CryptoWorkerPool pool(3);
+  std::mutex ids_lock;
+  std::set<std::thread::id> thread_ids;
+
+  /* each task sleeps briefly, so that the calling thread cannot finish them all
+     before the workers wake up */
+  pool.run(4,[&](unsigned int i){
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      const std::lock_guard<std::mutex> ids_lock_guard(ids_lock);
+      thread_ids.insert(std::this_thread::get_id());
+    });
+  TESTASSERT(thread_ids.size() > 1);
+}
+
+
+/* test that several threads can use the same pool at once */
+TESTFUNC(CryptoWorkerPool_concurrent_callers)
+{
+  CryptoWorkerPool pool(2);
+  std::atomic<int> total(0);
+  std::vector<std::thread> callers;
+
+  for(int i=0; i<4; i++){
+    callers.push_back(std::thread([&](){
+          for(int j=0; j<200; j++){
+            pool.run(7,[&](unsigned int k){ total += k; });
+          }
+        }));
+  }
+  for(auto& t : callers){
+    t.join();
+  }
+
+  TESTASSERT(total == 4*200*21);
+}
+
+
+/* test that an exception thrown by a task is reported by run(), and that the pool
+ * is still usable afterwards
+ */
+TESTFUNC(CryptoWorkerPool_task_throws)
+{
+  CryptoWorkerPool pool(2);
+  std::atomic<int> count(0);
+
+  TESTTHROW(pool.run(10,[&](unsigned int i){
+        count++;
+        if(i == 3){
+          throw std::runtime_error("task failed");
+        }
+      }),"a task threw");
+  TESTASSERT(count == 10);
+
+  count = 0;
+  pool.run(10,[&](unsigned int i){ count++; });
+  TESTASSERT(count == 10);
+}
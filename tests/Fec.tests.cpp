@@ -0,0 +1,225 @@
+#include "testsys.h"
+#include "../Fec.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace
+{
+  const host_id_type sender_id{0x01,0x02,0x03,0x04};
+  const channel_id_type channel_id{0x05,0x06};
+
+
+  /* make_packet() makes a packet with the header of one from sender_id on channel_id,
+     with the given sender's segment number and message number, and length bytes in all
+     (with contents depending on the message number) */
+  std::vector<unsigned char> make_packet(std::uint_least64_t segnum, std::uint_least64_t msgnum,
+                                         unsigned int length)
+  {
+    std::vector<unsigned char> packet(length);
+    std::copy(sender_id.begin(),sender_id.end(),packet.begin());
+    std::copy(channel_id.begin(),channel_id.end(),packet.begin()+host_id_size);
+    for(unsigned int i=0; i<6; i++){
+      packet[6+i] = (i == 0) ? 9 : 0;
+      packet[12+i] = (segnum >> (8*i)) & 0xff;
+      packet[18+i] = (msgnum >> (8*i)) & 0xff;
+    }
+    for(unsigned int i=24; i<length; i++){
+      packet[i] = (i*13+msgnum*7) & 0xff;
+    }
+    return packet;
+  }
+
+
+  /* Link simulates sending packets through an encoder and a decoder which are joined by
+     a link which loses every loss_interval-th packet (or none, if loss_interval is 0).
+     Repair and report packets are never lost, so that the test is predictable. */
+  struct Link
+  {
+    FecEncoder encoder{1000};
+    FecDecoder decoder{sender_id,channel_id};
+    std::vector<std::vector<unsigned char>> sent;
+    unsigned int num_lost = 0;
+    unsigned int num_recovered = 0;
+    std::uint_least64_t num_reports = 0;
+
+    void run(unsigned int num_packets, unsigned int loss_interval)
+    {
+      for(unsigned int i=0; i<num_packets; i++){
+        std::uint_least64_t msgnum = sent.size()+1;
+        sent.push_back(make_packet(7,msgnum,100+(msgnum*37)%800));
+        if( (loss_interval != 0) and (msgnum % loss_interval == 0) ){
+          num_lost++;
+        }
+        else{
+          decoder.add(sent.back());
+        }
+        if(encoder.add(sent.back())){
+          std::vector<unsigned char> recovered;
+          if(decoder.recover(encoder.repair_packet(),recovered)){
+            std::uint_least64_t recovered_msgnum = 0;
+            for(unsigned int j=0; j<6; j++){
+              recovered_msgnum |= static_cast<std::uint_least64_t>(recovered[18+j]) << (8*j);
+            }
+            TESTASSERT( (recovered_msgnum > 0) and (recovered_msgnum <= sent.size()) );
+            TESTASSERT( recovered == sent[recovered_msgnum-1] );
+            decoder.add(recovered);
+            num_recovered++;
+          }
+          if(decoder.report_due()){
+            TESTASSERT( encoder.report(decoder.report_packet(7,++num_reports)) );
+          }
+        }
+      }
+    }
+  };
+}
+
+
+/* test that a repair packet lets the decoder rebuild any single packet of its group, and
+ * only when a single packet is missing
+ */
+TESTFUNC(Fec_recovery)
+{
+  FecEncoder encoder(1000);
+  TESTASSERT( encoder.group_size() == FecEncoder::max_group_size );
+  TESTASSERT( encoder.flush_due() == 0 );
+
+  std::vector<std::vector<unsigned char>> group;
+  for(unsigned int i=0; i<FecEncoder::max_group_size; i++){
+    group.push_back(make_packet(7,i+1,(i == 3) ? 1000 : 40+i*11));
+    bool complete = encoder.add(group.back());
+    TESTASSERT( complete == (i+1 == FecEncoder::max_group_size) );
+    TESTASSERT( encoder.flush_due() != 0 );
+  }
+  std::vector<unsigned char> repair = encoder.repair_packet();
+  TESTASSERT( encoder.flush_due() == 0 );
+  TESTASSERT( repair.size() == 1000+FecEncoder::fec_overhead );
+  TESTASSERT( FecDecoder::is_fec_packet(repair) );
+  TESTASSERT( FecDecoder::packet_type(repair) == FecEncoder::repair_type );
+  TESTASSERT( not FecDecoder::is_fec_packet(group[0]) );
+
+  /* each packet can be rebuilt from the others, including the longest */
+  for(unsigned int lost=0; lost<group.size(); lost++){
+    FecDecoder decoder(sender_id,channel_id);
+    for(unsigned int i=0; i<group.size(); i++){
+      if(i != lost){
+        decoder.add(group[i]);
+      }
+    }
+    std::vector<unsigned char> recovered;
+    TESTASSERT( decoder.recover(repair,recovered) );
+    TESTASSERT( recovered == group[lost] );
+  }
+
+  /* there is nothing to rebuild if no packet is missing, and nothing can be rebuilt if
+     two are, or if the repair packet is for another segment number */
+  FecDecoder decoder(sender_id,channel_id);
+  std::vector<unsigned char> recovered;
+  for(unsigned int i=0; i<group.size(); i++){
+    decoder.add(group[i]);
+  }
+  TESTASSERT( not decoder.recover(repair,recovered) );
+  decoder.add(make_packet(8,3,100));
+  decoder.add(make_packet(8,4,100));
+  TESTASSERT( not decoder.recover(repair,recovered) );
+  decoder.add(group[3]);
+  TESTASSERT( decoder.recover(repair,recovered) );
+  TESTASSERT( recovered == group[2] );
+  TESTASSERT( not decoder.recover(std::vector<unsigned char>(repair.begin(),repair.begin()+34),
+                                  recovered) );
+
+  /* a change of segment number starts a new group */
+  TESTASSERT( not encoder.add(make_packet(7,100,100)) );
+  for(unsigned int i=0; i+1<FecEncoder::max_group_size; i++){
+    TESTASSERT( not encoder.add(make_packet(9,i+1,100)) );
+  }
+  TESTASSERT( encoder.add(make_packet(9,FecEncoder::max_group_size,100)) );
+}
+
+
+/* test that the group size adapts to the losses reported by the decoder, and that the
+ * packets lost are rebuilt
+ */
+TESTFUNC(Fec_adaptation)
+{
+  Link link;
+
+  /* with no losses, the groups stay as large as they can be */
+  link.run(1000,0);
+  TESTASSERT( link.encoder.group_size() == FecEncoder::max_group_size );
+  TESTASSERT( link.num_recovered == 0 );
+
+  /* a loss in 50 packets has groups sized to lose a quarter of a packet each, and as
+     no group loses more than one packet, every loss is made good */
+  link.run(5000,50);
+  TESTASSERT( (link.encoder.group_size() >= 9) and (link.encoder.group_size() <= 13) );
+  TESTASSERT( link.num_recovered+1 >= link.num_lost ); // the last group may be unfinished
+
+  /* heavy losses bring the groups down to the smallest size */
+  link.run(2000,4);
+  TESTASSERT( link.encoder.group_size() == FecEncoder::min_group_size );
+
+  /* and once the losses stop, the groups grow back */
+  link.run(5000,0);
+  TESTASSERT( link.encoder.group_size() == FecEncoder::max_group_size );
+
+  /* invalid reports are ignored */
+  link.decoder.report_packet(7,++link.num_reports);
+  std::vector<unsigned char> report = link.decoder.report_packet(7,++link.num_reports);
+  TESTASSERT( FecDecoder::packet_type(report) == FecEncoder::report_type );
+  TESTASSERT( report.size() == FecEncoder::report_len );
+  TESTASSERT( not link.encoder.report(report) ); // no packets
+  report.pop_back();
+  TESTASSERT( not link.encoder.report(report) );
+  TESTASSERT( link.encoder.group_size() == FecEncoder::max_group_size );
+}
+
+
+/* test that only repair packets for new groups which hold a packet which has been added
+ * are counted towards a report
+ */
+TESTFUNC(Fec_counting)
+{
+  FecEncoder encoder(1000);
+  std::vector<std::vector<unsigned char>> repairs;
+  std::vector<std::vector<unsigned char>> packets;
+  for(unsigned int i=0; i<FecDecoder::report_groups*FecEncoder::max_group_size; i++){
+    packets.push_back(make_packet(7,i+1,100));
+    if(encoder.add(packets.back())){
+      repairs.push_back(encoder.repair_packet());
+    }
+  }
+  TESTASSERT( repairs.size() == FecDecoder::report_groups );
+
+  /* none of the packets were added, as if the repair packets had been forged */
+  FecDecoder decoder(sender_id,channel_id);
+  std::vector<unsigned char> recovered;
+  for(const auto& repair : repairs){
+    TESTASSERT( not decoder.recover(repair,recovered) );
+  }
+  TESTASSERT( not decoder.report_due() );
+
+  /* replayed repair packets are not counted again */
+  unsigned int group_size = FecEncoder::max_group_size;
+  for(unsigned int i=0; i<repairs.size(); i++){
+    for(unsigned int j=0; j<group_size; j++){
+      decoder.add(packets[i*group_size+j]);
+    }
+    if(i+1 == repairs.size()){
+      decoder.recover(repairs[0],recovered);
+      TESTASSERT( not decoder.report_due() );
+    }
+    decoder.recover(repairs[i],recovered);
+    decoder.recover(repairs[i],recovered);
+  }
+  TESTASSERT( decoder.report_due() );
+
+  std::vector<unsigned char> report = decoder.report_packet(7,1);
+  std::uint_least64_t num_packets = 0;
+  for(unsigned int j=0; j<4; j++){
+    num_packets |= static_cast<std::uint_least64_t>(report[31+j]) << (8*j);
+  }
+  TESTASSERT( num_packets == packets.size() );
+  TESTASSERT( not decoder.report_due() );
+}
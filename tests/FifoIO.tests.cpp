@@ -115,6 +115,45 @@ TESTFUNC(FifoIO_fifo_read_and_write)
 }
 
 
+/* check that reading into a buffer at an offset, and writing from a pointer, work
+ * correctly
+ */
+TESTFUNC(FifoIO_read_into_and_write_pointer)
+{
+  std::string fifo_name = "testfifo";
+  FifoFromUser ffu{fifo_name};
+  FifoToUser ftu{fifo_name};
+
+  std::vector<unsigned char> data1 = {9,1,2,3,4,5,9};
+  std::pair<unsigned int, bool> write_res = ftu.write(data1.data()+1,5);
+  TESTASSERT( write_res.first == 5 );
+  TESTASSERT( write_res.second == false );
+
+  std::vector<unsigned char> buffer(10,0);
+  TESTTHROW( ffu.read_into(buffer,3,8), "no room in buffer" );
+  TESTASSERT( ffu.read_into(buffer,3,7) == 5 );
+  TESTASSERT( buffer == std::vector<unsigned char>({0,0,0,1,2,3,4,5,0,0}) );
+  TESTASSERT( ffu.read_into(buffer,0,10) == 0 );
+}
+
+
+/* check that the pipe size of a fifo can be set, and is reported correctly */
+TESTFUNC(FifoIO_pipe_size)
+{
+  FifoFromUser ffu_default{"fifo_default"};
+  TESTASSERT( ffu_default.pipe_size() == 65536 );
+
+  FifoFromUser ffu{"fifo_one",262144};
+  TESTASSERT( ffu.pipe_size() == 262144 );
+  FifoToUser ftu{"fifo_two",131072};
+  TESTASSERT( ftu.pipe_size() == 131072 );
+
+  /* the kernel rounds up to a power of two number of pages */
+  FifoToUser ftu_rounded{"fifo_three",100000};
+  TESTASSERT( ftu_rounded.pipe_size() == 131072 );
+}
+
+
 /* test that reading from a disconnected FifoFromUser works as expected */
 TESTFUNC(FifoIO_read_disconn_fifo)
 {
@@ -0,0 +1,144 @@
+#include "testsys.h"
+#include "../Fragmentation.h"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace
+{
+  /* fragment() has fragmenter send the message, in packets with payloads of at most
+     max_data_len bytes, and returns the payloads */
+  std::vector<std::vector<unsigned char>> fragment(Fragmenter& fragmenter,
+                                                   const std::vector<unsigned char>& message,
+                                                   unsigned int max_data_len)
+  {
+    std::copy(message.begin(),message.end(),fragmenter.buffer().begin());
+    fragmenter.start(message.size(),max_data_len);
+    std::vector<std::vector<unsigned char>> payloads;
+    std::vector<unsigned char> packet(max_data_len+24);
+    while(fragmenter.sending()){
+      unsigned int len = fragmenter.next_packet(packet,24,max_data_len);
+      TESTASSERT( (len > 0) and (len <= max_data_len) );
+      payloads.emplace_back(packet.begin()+24,packet.begin()+24+len);
+    }
+    return payloads;
+  }
+
+
+  /* test_message() makes a message of length bytes with contents depending on seed */
+  std::vector<unsigned char> test_message(unsigned int length, unsigned int seed)
+  {
+    std::vector<unsigned char> message(length);
+    for(unsigned int i=0; i<length; i++){
+      message[i] = (i*31+seed) & 0xff;
+    }
+    return message;
+  }
+}
+
+
+/* test that messages are sent whole if they fit in a packet, and otherwise in fragments
+ * which are reassembled whatever order they arrive in, even with the fragments of
+ * several messages interleaved
+ */
+TESTFUNC(Fragmentation_round_trip)
+{
+  TESTTHROW( Fragmenter(0), "out of range" );
+  TESTTHROW( Fragmenter(Fragmenter::max_max_message_size+1), "out of range" );
+
+  Fragmenter fragmenter(10000);
+  MetricCounter discards;
+  Reassembler reassembler(10000,discards);
+  std::vector<unsigned char> received;
+  TESTTHROW( fragmenter.start(10001,100), "too long" );
+
+  /* a message which fits goes in one packet with a one byte header */
+  std::vector<unsigned char> message = test_message(99,1);
+  std::vector<std::vector<unsigned char>> payloads = fragment(fragmenter,message,100);
+  TESTASSERT( payloads.size() == 1 );
+  TESTASSERT( payloads[0][0] == Fragmenter::whole_flag );
+  TESTASSERT( std::vector<unsigned char>(payloads[0].begin()+1,payloads[0].end()) == message );
+
+  /* a longer one is fragmented, and reassembled in reverse order */
+  message = test_message(100,2);
+  payloads = fragment(fragmenter,message,100);
+  TESTASSERT( payloads.size() == 2 );
+  TESTASSERT( payloads[0][0] == Fragmenter::fragment_flag );
+  TESTASSERT( payloads[0].size() == 100 );
+  TESTASSERT( payloads[1].size() == Fragmenter::fragment_header_len+10 );
+  TESTASSERT( not reassembler.add(payloads[1].data(),payloads[1].size(),received) );
+  TESTASSERT( reassembler.add(payloads[0].data(),payloads[0].size(),received) );
+  TESTASSERT( received == message );
+
+  /* the fragments of several messages may be interleaved */
+  std::vector<std::vector<unsigned char>> messages;
+  std::vector<std::vector<std::vector<unsigned char>>> fragments;
+  for(unsigned int i=0; i<Reassembler::reassembly_slots; i++){
+    messages.push_back(test_message(1000*(i+1)+i,i));
+    fragments.push_back(fragment(fragmenter,messages.back(),200));
+  }
+  unsigned int num_received = 0;
+  for(unsigned int j=0; j<fragments.back().size(); j++){
+    for(unsigned int i=0; i<fragments.size(); i++){
+      if( (j < fragments[i].size()) and
+          reassembler.add(fragments[i][j].data(),fragments[i][j].size(),received) ){
+        TESTASSERT( received == messages[i] );
+        num_received++;
+      }
+    }
+  }
+  TESTASSERT( num_received == Reassembler::reassembly_slots );
+  TESTASSERT( discards.value() == 0 );
+}
+
+
+/* test that partial messages are discarded when they time out, or when their slot is
+ * needed for a newer message, and that invalid fragments are discarded
+ */
+TESTFUNC(Fragmentation_discards)
+{
+  Fragmenter fragmenter(10000);
+  MetricCounter discards;
+  Reassembler reassembler(5000,discards,50);
+  std::vector<unsigned char> received;
+
+  /* a fragment for a message longer than the maximum is discarded, as is one which
+     overruns its message */
+  std::vector<std::vector<unsigned char>> payloads = fragment(fragmenter,test_message(6000,1),1000);
+  TESTASSERT( not reassembler.add(payloads[0].data(),payloads[0].size(),received) );
+  TESTASSERT( discards.value() == 1 );
+  payloads = fragment(fragmenter,test_message(3000,2),1000);
+  payloads[1][6] = 0xff;
+  TESTASSERT( not reassembler.add(payloads[1].data(),payloads[1].size(),received) );
+  TESTASSERT( discards.value() == 2 );
+  TESTASSERT( not reassembler.add(payloads[1].data(),Fragmenter::fragment_header_len,received) );
+  TESTASSERT( discards.value() == 3 );
+
+  /* a message whose fragments do not all arrive in time is discarded once another
+     fragment arrives */
+  payloads = fragment(fragmenter,test_message(3000,3),1000);
+  TESTASSERT( not reassembler.add(payloads[0].data(),payloads[0].size(),received) );
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  std::vector<unsigned char> message = test_message(1500,4);
+  std::vector<std::vector<unsigned char>> other_payloads = fragment(fragmenter,message,1000);
+  TESTASSERT( not reassembler.add(other_payloads[0].data(),other_payloads[0].size(),received) );
+  TESTASSERT( discards.value() == 4 );
+  TESTASSERT( not reassembler.add(payloads[1].data(),payloads[1].size(),received) );
+  TESTASSERT( reassembler.add(other_payloads[1].data(),other_payloads[1].size(),received) );
+  TESTASSERT( received == message );
+  TESTASSERT( discards.value() == 4 );
+
+  /* when all the slots are in use, the oldest partial message makes way for a new one
+     (the first to go being the one left over from above) */
+  std::vector<std::vector<std::vector<unsigned char>>> fragments;
+  for(unsigned int i=0; i<=Reassembler::reassembly_slots; i++){
+    fragments.push_back(fragment(fragmenter,test_message(2000,i),1500));
+    TESTASSERT( not reassembler.add(fragments[i][0].data(),fragments[i][0].size(),received) );
+  }
+  TESTASSERT( discards.value() == 6 );
+  TESTASSERT( not reassembler.add(fragments[0][1].data(),fragments[0][1].size(),received) );
+  TESTASSERT( discards.value() == 7 );
+  TESTASSERT( reassembler.add(fragments[2][1].data(),fragments[2][1].size(),received) );
+  TESTASSERT( received == test_message(2000,2) );
+}
@@ -0,0 +1,90 @@
+#include "testsys.h"
+#include "../LatencyHistogram.h"
+
+#include <thread>
+#include <vector>
+
+
+/* test that every value falls in a bucket whose bounds contain it, that the buckets are
+ * in order, and that each bucket is at most 12.5% wide
+ */
+TESTFUNC(LatencyHistogram_buckets)
+{
+  std::vector<nanos_t> values;
+  for(nanos_t v=0; v<5000; v++){
+    values.push_back(v);
+  }
+  for(unsigned int shift=12; shift<48; shift++){
+    values.push_back((nanos_t(1) << shift)-1);
+    values.push_back(nanos_t(1) << shift);
+    values.push_back((nanos_t(1) << shift)+12345);
+  }
+
+  for(nanos_t v : values){
+    unsigned int index = LatencyHistogram::bucket_index(v);
+    TESTASSERT(index < LatencyHistogram::num_buckets);
+    TESTASSERT(v <= HistogramSnapshot::bucket_upper_bound(index));
+    if(index > 0){
+      TESTASSERT(v > HistogramSnapshot::bucket_upper_bound(index-1));
+    }
+    TESTASSERT(HistogramSnapshot::bucket_upper_bound(index)-v <= v/8);
+  }
+
+  /* values beyond the range of the histogram go in the last bucket */
+  TESTASSERT(LatencyHistogram::bucket_index(nanos_t(1) << 48) == LatencyHistogram::num_buckets-1);
+  TESTASSERT(LatencyHistogram::bucket_index(~nanos_t(0)) == LatencyHistogram::num_buckets-1);
+}
+
+
+/* test that snapshots and quantiles report what was recorded */
+TESTFUNC(LatencyHistogram_quantiles)
+{
+  LatencyHistogram histogram;
+  HistogramSnapshot empty = histogram.snapshot();
+  TESTASSERT(empty.count == 0);
+  TESTASSERT(empty.sum == 0);
+  TESTASSERT(empty.quantile(0.5) == 0);
+
+  for(nanos_t v=1; v<=1000; v++){
+    histogram.record(v*1000);
+  }
+  HistogramSnapshot hs = histogram.snapshot();
+  TESTASSERT(hs.count == 1000);
+  TESTASSERT(hs.sum == 500500000);
+
+  /* each quantile must be within the 12.5% resolution of the histogram */
+  auto near = [](nanos_t estimate, nanos_t exact)
+    { return (estimate >= exact) and (estimate-exact <= exact/8); };
+  TESTASSERT(near(hs.quantile(0.5),500000));
+  TESTASSERT(near(hs.quantile(0.9),900000));
+  TESTASSERT(near(hs.quantile(0.99),990000));
+  TESTASSERT(near(hs.quantile(1.0),1000000));
+  TESTASSERT(near(hs.quantile(0.0),1000));
+
+  TESTTHROW(hs.quantile(1.5),"quantile out of range");
+}
+
+
+/* test that recording from several threads at once loses no values */
+TESTFUNC(LatencyHistogram_threads)
+{
+  PipelineLatencies latencies;
+  std::vector<std::thread> threads;
+  for(int i=0; i<8; i++){
+    threads.push_back(std::thread([&](){
+          for(nanos_t j=0; j<100000; j++){
+            latencies.record(PipelineStage::decrypt,j % 3000);
+          }
+        }));
+  }
+  for(auto& t : threads){
+    t.join();
+  }
+
+  HistogramSnapshot hs =
+    latencies.histograms[static_cast<unsigned int>(PipelineStage::decrypt)].snapshot();
+  TESTASSERT(hs.count == 8*100000);
+  TESTASSERT(hs.counts[0] == 8*(100000/3000+1));
+  TESTASSERT(latencies.histograms[0].snapshot().count == 0);
+  TESTASSERT(pipeline_stage_name(PipelineStage::decrypt) == "decrypt");
+}
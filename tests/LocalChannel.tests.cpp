@@ -0,0 +1,115 @@
+#include "testsys.h"
+#include "../LocalChannel.h"
+
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <poll.h>
+
+namespace
+{
+  /* readable() reports whether fd is readable */
+  bool readable(int fd)
+  {
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return (poll(&pfd,1,0) == 1) and ( (pfd.revents & POLLIN) != 0 );
+  }
+}
+
+
+/* test that messages from the application reach the Connection whole and in order, that
+ * the Connection is woken when the first arrives, and that the queue's capacity is kept to
+ */
+TESTFUNC(LocalChannel_outward)
+{
+  LocalChannel channel(100,250);
+  std::vector<unsigned char> data(100);
+  for(unsigned int i=0; i<data.size(); i++){
+    data[i] = i;
+  }
+  std::vector<unsigned char> buffer(200,0);
+
+  TESTASSERT( not readable(channel.file_descriptor()) );
+  TESTASSERT( not channel.data_waiting() );
+  TESTTHROW( channel.try_send(data.data(),101), "too long for a packet" );
+  TESTASSERT( channel.try_send(data.data(),100) );
+  TESTASSERT( readable(channel.file_descriptor()) );
+  TESTASSERT( channel.try_send(data.data(),100) );
+  TESTASSERT( not channel.try_send(data.data(),100) );
+  TESTASSERT( channel.try_send(data.data(),0) );
+  TESTASSERT( channel.try_send(data.data()+5,20) );
+
+  TESTASSERT( channel.data_waiting() );
+  TESTASSERT( not readable(channel.file_descriptor()) );
+  TESTTHROW( channel.read_into(buffer,150,100), "no room in buffer" );
+  TESTASSERT( channel.read_into(buffer,50,100) == std::make_pair(100u,false) );
+  TESTASSERT( std::vector<unsigned char>(buffer.begin()+50,buffer.begin()+150) == data );
+  TESTASSERT( channel.read_into(buffer,50,100) == std::make_pair(100u,false) );
+  TESTASSERT( channel.read_into(buffer,50,10) == std::make_pair(0u,true) );
+  TESTASSERT( channel.read_into(buffer,50,100) == std::make_pair(0u,false) );
+  TESTASSERT( not channel.data_waiting() );
+
+  /* send() waits for the Connection to make room */
+  TESTASSERT( channel.try_send(data.data(),100) );
+  TESTASSERT( channel.try_send(data.data(),100) );
+  std::thread reader([&](){
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      channel.read_into(buffer,0,100);
+    });
+  channel.send(data.data(),100);
+  reader.join();
+  TESTASSERT( channel.read_into(buffer,0,100) == std::make_pair(100u,false) );
+  TESTASSERT( channel.read_into(buffer,0,100) == std::make_pair(100u,false) );
+  TESTASSERT( not channel.data_waiting() );
+}
+
+
+/* test that messages from the Connection reach the application through the queue or the
+ * callback, and that the Connection is woken once a full queue has room
+ */
+TESTFUNC(LocalChannel_inward)
+{
+  LocalChannel channel(100,150);
+  std::vector<unsigned char> data{1,2,3,4,5,6,7,8,9,10};
+  std::vector<unsigned char> message;
+
+  TESTASSERT( not channel.try_receive(message) );
+  TESTASSERT( channel.write(data.data(),10) == std::make_pair(10u,false) );
+  TESTASSERT( channel.has_room(140) );
+  TESTASSERT( not channel.has_room(141) );
+  TESTASSERT( channel.write(data.data()+2,3) == std::make_pair(3u,false) );
+  TESTASSERT( channel.write(data.data(),10).first == 10 );
+  TESTASSERT( channel.write(std::vector<unsigned char>(128).data(),128) == std::make_pair(0u,false) );
+  TESTASSERT( not readable(channel.file_descriptor()) );
+
+  channel.receive(message);
+  TESTASSERT( message == data );
+  TESTASSERT( readable(channel.file_descriptor()) );
+  TESTASSERT( channel.has_room(128) );
+  TESTASSERT( channel.try_receive(message) );
+  TESTASSERT( message == std::vector<unsigned char>({3,4,5}) );
+
+  /* setting a callback first passes it the queued message, then later ones */
+  std::vector<std::vector<unsigned char>> received;
+  channel.set_receive_callback([&](const unsigned char* d, unsigned int count){
+      received.emplace_back(d,d+count);
+    });
+  TESTASSERT( received.size() == 1 );
+  TESTASSERT( channel.write(data.data()+7,3) == std::make_pair(3u,false) );
+  TESTASSERT( received.size() == 2 );
+  TESTASSERT( received[1] == std::vector<unsigned char>({8,9,10}) );
+  TESTASSERT( not channel.try_receive(message) );
+
+  /* receive() waits for a message */
+  channel.set_receive_callback(nullptr);
+  std::thread writer([&](){
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      channel.write(data.data(),4);
+    });
+  channel.receive(message);
+  writer.join();
+  TESTASSERT( message == std::vector<unsigned char>({1,2,3,4}) );
+}
@@ -0,0 +1,58 @@
+#include "testsys.h"
+#include "../Metrics.h"
+
+#include <thread>
+#include <vector>
+
+
+/* test that a MetricCounter adds up correctly when updated from several threads */
+TESTFUNC(Metrics_counter_threads)
+{
+  MetricCounter counter;
+  TESTASSERT(counter.value() == 0);
+
+  std::vector<std::thread> threads;
+  for(int i=0; i<8; i++){
+    threads.push_back(std::thread([&](){
+          for(int j=0; j<100000; j++){
+            counter.add();
+          }
+          counter.add(5);
+        }));
+  }
+  for(auto& t : threads){
+    t.join();
+  }
+
+  TESTASSERT(counter.value() == 8*(100000+5));
+}
+
+
+/* test that ConnectionMetrics::snapshot() copies each counter to the right field */
+TESTFUNC(Metrics_connection_snapshot)
+{
+  ConnectionMetrics cm;
+  cm.packets_in.add(1);
+  cm.bytes_in.add(2);
+  cm.packets_out.add(3);
+  cm.bytes_out.add(4);
+  cm.auth_failures.add(5);
+  cm.replays_rejected.add(6);
+  cm.bad_segnums.add(7);
+  cm.hello_packets_sent.add(8);
+  cm.fifo_short_writes.add(9);
+  cm.fifo_broken_pipes.add(10);
+
+  ConnectionMetricsSnapshot cms = cm.snapshot(11);
+  TESTASSERT(cms.packets_in == 1);
+  TESTASSERT(cms.bytes_in == 2);
+  TESTASSERT(cms.packets_out == 3);
+  TESTASSERT(cms.bytes_out == 4);
+  TESTASSERT(cms.auth_failures == 5);
+  TESTASSERT(cms.replays_rejected == 6);
+  TESTASSERT(cms.bad_segnums == 7);
+  TESTASSERT(cms.hello_packets_sent == 8);
+  TESTASSERT(cms.fifo_short_writes == 9);
+  TESTASSERT(cms.fifo_broken_pipes == 10);
+  TESTASSERT(cms.queue_depth == 11);
+}
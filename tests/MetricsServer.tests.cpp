@@ -0,0 +1,200 @@
+#include "testsys.h"
+#include "../MetricsServer.h"
+
+#include <fstream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace
+{
+  /* make_metrics() creates a SessionMetrics with two Connections for testing */
+  SessionMetrics make_metrics()
+  {
+    SessionMetrics sm;
+    sm.uptime_micros = 12345678;
+    sm.startup_micros = 420000;
+    sm.startup_connections_micros = 310005;
+    sm.startup_threads = 4;
+    sm.num_connection_workers = 5;
+    sm.worker_busy_micros = 2000001;
+    sm.worker_runs = 77;
+    sm.queue_length = 2;
+    sm.connections_active = 1;
+    sm.connections_dormant = 3;
+
+    ConnectionMetricsSnapshot cms{1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27};
+    sm.connections.push_back(NamedConnectionMetrics{"host A",{0xa5,0x07},cms});
+    cms.packets_in = 100;
+    sm.connections.push_back(NamedConnectionMetrics{"odd \"name\"",{0x00,0x1f},cms});
+
+    LatencyHistogram histogram;
+    histogram.record(100);
+    histogram.record(100);
+    histogram.record(1000);
+    sm.stage_latencies.push_back(NamedHistogram{"decrypt",histogram.snapshot()});
+    return sm;
+  }
+
+
+  /* request_metrics() connects to the metrics socket at path, sends request, and
+     returns everything the server sends back */
+  std::string request_metrics(const std::string& path, const std::string& request)
+  {
+    int fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if(fd == -1){
+      TESTERROR("could not create socket");
+    }
+    sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,path.c_str());
+    if(connect(fd,(sockaddr*)&addr,sizeof(addr)) == -1){
+      close(fd);
+      TESTERROR("could not connect to metrics socket");
+    }
+
+    if(write(fd,request.data(),request.size()) != static_cast<ssize_t>(request.size())){
+      close(fd);
+      TESTERROR("could not write request");
+    }
+
+    std::string reply;
+    char buff[1024];
+    ssize_t ret;
+    while( (ret = read(fd,buff,sizeof(buff))) > 0 ){
+      reply.append(buff,ret);
+    }
+    close(fd);
+    return reply;
+  }
+}
+
+
+/* check that the Prometheus text format contains the expected lines */
+TESTFUNC(MetricsServer_format_prometheus)
+{
+  std::string text = format_metrics_prometheus(make_metrics());
+
+  TESTASSERT(text.find("# TYPE cryptocomms_uptime_seconds gauge\n") != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_uptime_seconds 12.345678\n") != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_startup_seconds 0.420000\n") != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_startup_connections_seconds 0.310005\n")
+             != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_startup_threads 4\n") != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_worker_busy_seconds_total 2.000001\n") != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_worker_runs_total 77\n") != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_scheduler_queue_length 2\n") != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_connections_dormant 3\n") != std::string::npos);
+  TESTASSERT(text.find("# TYPE cryptocomms_connection_packets_in_total counter\n")
+             != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_connection_packets_in_total{peer=\"host A\",channel=\"a507\"} 1\n")
+             != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_connection_packets_in_total{peer=\"odd \\\"name\\\"\",channel=\"001f\"} 100\n")
+             != std::string::npos);
+  TESTASSERT(text.find("# TYPE cryptocomms_connection_queue_depth gauge\n") != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_connection_queue_depth{peer=\"host A\",channel=\"a507\"} 22\n")
+             != std::string::npos);
+  TESTASSERT(text.find("# TYPE cryptocomms_connection_pending_output_bytes gauge\n")
+             != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_connection_intake_pauses_total{peer=\"host A\",channel=\"a507\"} 12\n")
+             != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_connection_messages_dropped_total{peer=\"host A\",channel=\"a507\"} 21\n")
+             != std::string::npos);
+  TESTASSERT(text.find("# TYPE cryptocomms_stage_latency_seconds summary\n") != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_stage_latency_seconds{stage=\"decrypt\",quantile=\"0.5\"} 0.000000103\n")
+             != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_stage_latency_seconds{stage=\"decrypt\",quantile=\"1\"} 0.000001023\n")
+             != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_stage_latency_seconds_sum{stage=\"decrypt\"} 0.000001200\n")
+             != std::string::npos);
+  TESTASSERT(text.find("\ncryptocomms_stage_latency_seconds_count{stage=\"decrypt\"} 3\n")
+             != std::string::npos);
+}
+
+
+/* check that the JSON format is as expected */
+TESTFUNC(MetricsServer_format_json)
+{
+  std::string json = format_metrics_json(make_metrics());
+  std::string connection_fields =
+    "\"bytes_in\":2,\"packets_out\":3,\"bytes_out\":4,\"auth_failures\":5,"
+    "\"replays_rejected\":6,\"bad_segnums\":7,\"hello_packets_sent\":8,"
+    "\"fifo_short_writes\":9,\"fifo_broken_pipes\":10,\"messages_too_long\":11,"
+    "\"intake_pauses\":12,\"coalesce_timeouts\":13,\"messages_fragmented\":14,"
+    "\"reassembly_failures\":15,\"compression_in_bytes\":16,\"compression_out_bytes\":17,"
+    "\"compression_nanos\":18,\"fec_repairs_sent\":19,\"fec_packets_recovered\":20,"
+    "\"messages_dropped\":21,\"queue_depth\":22,\"outward_pipe_size_bytes\":23,"
+    "\"inward_pipe_size_bytes\":24,\"pending_output_bytes\":25,\"max_packet_size_bytes\":26,"
+    "\"fec_group_size\":27}";
+  std::string expected =
+    "{\"uptime_micros\":12345678,\"startup_micros\":420000,"
+    "\"startup_connections_micros\":310005,\"startup_threads\":4,"
+    "\"num_connection_workers\":5,\"worker_busy_micros\":2000001,"
+    "\"worker_runs\":77,\"queue_length\":2,\"connections_active\":1,"
+    "\"connections_dormant\":3,\"connections\":["
+    "{\"peer\":\"host A\",\"channel\":\"a507\",\"packets_in\":1,"+connection_fields+","
+    "{\"peer\":\"odd \\\"name\\\"\",\"channel\":\"001f\",\"packets_in\":100,"+connection_fields+
+    "],\"stage_latencies\":{\"decrypt\":{\"count\":3,\"sum_nanos\":1200,\"p50_nanos\":103,"
+    "\"p90_nanos\":1023,\"p99_nanos\":1023,\"p999_nanos\":1023,\"max_nanos\":1023,"
+    "\"buckets\":[[103,2],[1023,1]]}}}\n";
+  TESTASSERT(json == expected);
+}
+
+
+/* check that the server replies to requests in each format */
+TESTFUNC(MetricsServer_requests)
+{
+  std::string path = "metrics.sock";
+  MetricsServer server(path,make_metrics);
+  std::string json = format_metrics_json(make_metrics());
+  std::string text = format_metrics_prometheus(make_metrics());
+
+  TESTASSERT(request_metrics(path,"json\n") == json);
+  TESTASSERT(request_metrics(path,"prometheus\n") == text);
+  TESTASSERT(request_metrics(path,"\n") == text);
+  TESTASSERT(request_metrics(path,"xml\n").find("unknown format") != std::string::npos);
+
+  std::string reply = request_metrics(path,"GET /metrics HTTP/1.1\r\nHost: x\r\n\r\n");
+  TESTASSERT(reply.compare(0,17,"HTTP/1.0 200 OK\r\n") == 0);
+  TESTASSERT(reply.find("Content-Length: "+std::to_string(text.size())+"\r\n") != std::string::npos);
+  TESTASSERT(reply.compare(reply.size()-text.size(),text.size(),text) == 0);
+
+  reply = request_metrics(path,"GET /metrics.json HTTP/1.1\r\n\r\n");
+  TESTASSERT(reply.find("Content-Type: application/json\r\n") != std::string::npos);
+  TESTASSERT(reply.compare(reply.size()-json.size(),json.size(),json) == 0);
+}
+
+
+/* check that the server replaces a stale socket, but refuses to replace other files,
+ * and removes its socket when it is destroyed
+ */
+TESTFUNC(MetricsServer_socket_file)
+{
+  std::string path = "metrics.sock";
+  {
+    MetricsServer server(path,make_metrics);
+  }
+  TESTASSERT(access(path.c_str(),F_OK) == -1);
+
+  /* leave a socket behind by binding without a MetricsServer */
+  int fd = socket(AF_UNIX,SOCK_STREAM,0);
+  sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path,path.c_str());
+  TESTASSERT(bind(fd,(sockaddr*)&addr,sizeof(addr)) == 0);
+  close(fd);
+  {
+    MetricsServer server(path,make_metrics);
+    TESTASSERT(request_metrics(path,"json\n") == format_metrics_json(make_metrics()));
+  }
+
+  std::ofstream regular_file("not_a_socket");
+  regular_file << "data";
+  regular_file.close();
+  TESTTHROW(MetricsServer("not_a_socket",make_metrics),"exists and is not a socket");
+}
@@ -0,0 +1,117 @@
+#include "testsys.h"
+#include "../PathProber.h"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <poll.h>
+
+namespace
+{
+  /* readable() reports whether fd is readable */
+  bool readable(int fd)
+  {
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return (poll(&pfd,1,0) == 1) and ( (pfd.revents & POLLIN) != 0 );
+  }
+
+
+  /* exchange() passes everything which each of two PathProbers has to send to the other,
+   * as their probe Connections would, except that packets with payloads larger than
+   * path_payload are lost on the way
+   */
+  void exchange(PathProber& a, PathProber& b, unsigned int path_payload)
+  {
+    std::vector<unsigned char> packet(10000);
+    for(PathProber* from : {&a,&b}){
+      PathProber* to = (from == &a) ? &b : &a;
+      while(true){
+        unsigned int len = from->read_into(packet,0,packet.size()).first;
+        if(len == 0){
+          break;
+        }
+        if(len <= path_payload){
+          to->write(packet.data(),len);
+        }
+      }
+    }
+  }
+
+
+  /* run_probing() keeps two PathProbers exchanging packets for the given time */
+  void run_probing(PathProber& a, PathProber& b, unsigned int path_payload,
+                   unsigned int millis)
+  {
+    nanos_t end = monotonic_nanos()+static_cast<nanos_t>(millis)*1000000;
+    while(monotonic_nanos() < end){
+      exchange(a,b,path_payload);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+}
+
+
+/* test that a probe is acknowledged, and that the search settles on the largest payload
+ * which gets through, to within the search granularity
+ */
+TESTFUNC(PathProber_search)
+{
+  TESTTHROW( PathProber(1000,1000), "must be larger" );
+
+  PathProber a(1000,9000,20);
+  PathProber b(1000,9000,20);
+  TESTASSERT( a.max_payload() == 1000 );
+  TESTASSERT( a.data_waiting() );
+  TESTASSERT( a.flush_due() <= monotonic_nanos() );
+
+  /* the first probe is half way between the two sizes, and is acknowledged */
+  std::vector<unsigned char> packet(9000,0xaa);
+  TESTTHROW( a.read_into(packet,10,9000), "no room in buffer" );
+  TESTASSERT( a.read_into(packet,0,9000) == std::make_pair(5000u,false) );
+  TESTASSERT( packet[0] == PathProber::probe_type );
+  TESTASSERT( packet[4999] == 0 );
+  TESTASSERT( not a.data_waiting() );
+  TESTASSERT( a.flush_due() > monotonic_nanos() );
+  TESTASSERT( not readable(b.file_descriptor()) );
+  TESTASSERT( b.write(packet.data(),5000) == std::make_pair(5000u,false) );
+  TESTASSERT( readable(b.file_descriptor()) );
+  TESTASSERT( b.data_waiting() );
+  TESTASSERT( b.read_into(packet,0,9000) == std::make_pair(7u,false) );
+  TESTASSERT( packet[0] == PathProber::ack_type );
+  a.write(packet.data(),PathProber::ack_len);
+  TESTASSERT( a.max_payload() == 5000 );
+
+  /* an acknowledgement which does not match the probe is ignored */
+  TESTASSERT( a.read_into(packet,0,9000).first == 7000 );
+  packet[0] = PathProber::ack_type;
+  packet[5] = 7000 & 0xff;
+  packet[6] = 7000 >> 8;
+  packet[1] ^= 1;
+  a.write(packet.data(),PathProber::ack_len);
+  TESTASSERT( a.max_payload() == 5000 );
+
+  /* the larger probes are lost, so the search settles just below the path's limit */
+  run_probing(a,b,6543,1000);
+  TESTASSERT( (a.max_payload() <= 6543) and (a.max_payload() > 6543-PathProber::search_granularity) );
+  TESTASSERT( (b.max_payload() <= 6543) and (b.max_payload() > 6543-PathProber::search_granularity) );
+  TESTASSERT( a.flush_due() > monotonic_nanos()+1000000000 );
+}
+
+
+/* test that if the size in use stops getting through, the PathProber falls back to the
+ * base size and searches again
+ */
+TESTFUNC(PathProber_black_hole)
+{
+  PathProber a(1000,9000,20,100);
+  PathProber b(1000,9000,20,100);
+  run_probing(a,b,4000,1000);
+  TESTASSERT( (a.max_payload() <= 4000) and (a.max_payload() > 4000-PathProber::search_granularity) );
+
+  /* the path changes to one which only carries smaller packets, which the confirmation
+     probes find out */
+  run_probing(a,b,2000,1000);
+  TESTASSERT( (a.max_payload() <= 2000) and (a.max_payload() > 2000-PathProber::search_granularity) );
+}
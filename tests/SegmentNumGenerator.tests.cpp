@@ -6,6 +6,10 @@
 #include <set>
 #include <fstream>
 #include <iostream>
+#include <chrono>
+#include <algorithm>
+
+#include <sys/stat.h>
 
 void stress_test_segnumgen_uniqueness_thread_func(std::vector<SegmentNumGenerator::segnum_t>& segnums,
                                                   SegmentNumGenerator& sng)
@@ -308,3 +312,85 @@ TESTFUNC(SegmentNumGenerator_set_reserved_with_zero){
   SegmentNumGenerator sng("testfile");
   TESTTHROW(sng.set_reserved(0),"SegmentNumGenerator: set_reserved called with 0");
 }
+
+
+/* Check that the next range of segment numbers is reserved in the background once the
+ * current range runs low, so that the stored record is always ahead of the numbers handed
+ * out, and that the files are replaced whole
+ */
+TESTFUNC(SegmentNumGenerator_prefetch)
+{
+  std::vector<std::string> testfile_names{"testfile_FIRST","testfile_SECOND"};
+  for(const std::string& testfile_name : testfile_names){
+    std::ofstream segnum_file(testfile_name,std::ios::trunc);
+    if(!segnum_file){
+      TESTERROR("could not open \""+testfile_name+"\"");
+    }
+    segnum_file << "1\n1";
+    segnum_file.close();
+  }
+
+  /* read_stored() gives the number stored in a file, or 0 if it can't be read */
+  auto read_stored = [](const std::string& path){
+    std::ifstream segnum_file(path);
+    std::string line_1, line_2;
+    std::getline(segnum_file,line_1);
+    std::getline(segnum_file,line_2);
+    if( line_1.empty() or (line_1 != line_2) ){
+      return SegmentNumGenerator::segnum_t(0);
+    }
+    return SegmentNumGenerator::segnum_t(std::stoull(line_1));
+  };
+
+  SegmentNumGenerator sng("testfile",10);
+  SegmentNumGenerator::segnum_t first = sng.next_num();
+  TESTASSERT( read_stored("testfile_FIRST") == first+9 );
+  TESTASSERT( read_stored("testfile_SECOND") == first+9 );
+
+  /* a quarter of the range left brings on the next reservation */
+  for(int i=1; i<9; i++){
+    TESTASSERT( sng.next_num() == first+i );
+  }
+  SegmentNumGenerator::segnum_t stored = 0;
+  for(int i=0; (i<5000) and (stored <= first+9); i++){
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    stored = std::min(read_stored("testfile_FIRST"),read_stored("testfile_SECOND"));
+  }
+  TESTASSERT( stored > first+9 );
+
+  /* the rest of the range is used up before the new one is started (the number taken by
+     the call which found the range used up may be skipped) */
+  TESTASSERT( sng.next_num() == first+9 );
+  SegmentNumGenerator::segnum_t next_first = sng.next_num();
+  TESTASSERT( (next_first >= stored-9) and (next_first <= stored-8) );
+  for(int i=1; i<8; i++){
+    TESTASSERT( sng.next_num() == next_first+i );
+  }
+  TESTASSERT( std::min(read_stored("testfile_FIRST"),read_stored("testfile_SECOND"))
+              >= next_first+7 );
+}
+
+
+/* Check that a stored segment number file keeps its permissions when it is replaced */
+TESTFUNC(SegmentNumGenerator_file_permissions)
+{
+  std::vector<std::string> testfile_names{"testfile_FIRST","testfile_SECOND"};
+  std::vector<mode_t> modes{0640,0604};
+  for(unsigned int i=0; i<testfile_names.size(); i++){
+    std::ofstream segnum_file(testfile_names[i],std::ios::trunc);
+    if(!segnum_file){
+      TESTERROR("could not open \""+testfile_names[i]+"\"");
+    }
+    segnum_file << "1\n1";
+    segnum_file.close();
+    TESTASSERT( chmod(testfile_names[i].c_str(),modes[i]) == 0 );
+  }
+
+  SegmentNumGenerator sng("testfile",10);
+  TESTASSERT( sng.next_num() > 1 );
+  for(unsigned int i=0; i<testfile_names.size(); i++){
+    struct stat file_stat;
+    TESTASSERT( stat(testfile_names[i].c_str(),&file_stat) == 0 );
+    TESTASSERT( (file_stat.st_mode & 07777) == modes[i] );
+  }
+}
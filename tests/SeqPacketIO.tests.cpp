@@ -0,0 +1,129 @@
+#include "testsys.h"
+#include "../SeqPacketIO.h"
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace
+{
+  /* connect_to() connects a SOCK_SEQPACKET socket to the socket at path, as a user
+     program would */
+  int connect_to(const std::string& path)
+  {
+    int fd = socket(AF_UNIX,SOCK_SEQPACKET,0);
+    if(fd == -1){
+      TESTERROR("could not create socket");
+    }
+    sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,path.c_str());
+    if(connect(fd,(sockaddr*)&addr,sizeof(addr)) == -1){
+      close(fd);
+      TESTERROR("could not connect to "+path);
+    }
+    return fd;
+  }
+}
+
+
+/* test that a file which is not a socket where the socket should be, or a path which
+ * is too long for a socket, generates the correct error
+ */
+TESTFUNC(SeqPacketIO_bad_path)
+{
+  std::string filename = "test_not_socket";
+  int fd = open(filename.c_str(), O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR);
+  if(fd == -1){
+    TESTERROR("could not create file "+filename);
+  }
+  close(fd);
+
+  TESTTHROW(SeqPacketEndpoint{filename},"is not a socket");
+  TESTTHROW(SeqPacketEndpoint{std::string(200,'x')},"socket path too long");
+}
+
+
+/* test that messages are passed in both directions with their boundaries intact */
+TESTFUNC(SeqPacketIO_messages)
+{
+  std::string path = "test_socket";
+  SeqPacketEndpoint spe{path};
+  std::vector<unsigned char> buffer(20,0);
+
+  /* with no user program connected, there is nothing to read and nowhere to write */
+  TESTASSERT( spe.read_into(buffer,0,20) == std::make_pair(0u,false) );
+  std::vector<unsigned char> data = {1,2,3,4,5,6,7,8};
+  TESTASSERT( spe.write(data.data(),3) == std::make_pair(0u,true) );
+  TESTASSERT( not spe.user_connected() );
+
+  /* each message from the user program is read separately, and one which is too long
+     is discarded */
+  int user_fd = connect_to(path);
+  TESTASSERT( send(user_fd,data.data(),3,0) == 3 );
+  TESTASSERT( send(user_fd,data.data(),8,0) == 8 );
+  TESTASSERT( send(user_fd,data.data()+5,2,0) == 2 );
+  TESTTHROW( spe.read_into(buffer,15,6), "no room in buffer" );
+  TESTASSERT( spe.read_into(buffer,4,6) == std::make_pair(3u,false) );
+  TESTASSERT( spe.user_connected() );
+  TESTASSERT( std::vector<unsigned char>(buffer.begin(),buffer.begin()+8) ==
+              std::vector<unsigned char>({0,0,0,0,1,2,3,0}) );
+  TESTASSERT( spe.read_into(buffer,4,6) == std::make_pair(0u,true) );
+  TESTASSERT( spe.read_into(buffer,12,6) == std::make_pair(2u,false) );
+  TESTASSERT( buffer[12] == 6 );
+  TESTASSERT( buffer[13] == 7 );
+  TESTASSERT( spe.read_into(buffer,0,20) == std::make_pair(0u,false) );
+
+  /* each write reaches the user program as one message */
+  TESTASSERT( spe.write(data.data(),5) == std::make_pair(5u,false) );
+  TESTASSERT( spe.write(data.data()+5,3) == std::make_pair(3u,false) );
+  unsigned char user_buffer[20];
+  TESTASSERT( recv(user_fd,user_buffer,20,0) == 5 );
+  TESTASSERT( recv(user_fd,user_buffer,20,0) == 3 );
+  TESTASSERT( user_buffer[0] == 6 );
+
+  /* messages sent just before the user program disconnects are still read, and empty
+     messages are skipped */
+  TESTASSERT( send(user_fd,data.data(),0,0) == 0 );
+  TESTASSERT( send(user_fd,data.data(),4,0) == 4 );
+  close(user_fd);
+  TESTASSERT( spe.read_into(buffer,0,20) == std::make_pair(4u,false) );
+  TESTASSERT( spe.read_into(buffer,0,20) == std::make_pair(0u,false) );
+  TESTASSERT( not spe.user_connected() );
+
+  /* another user program can then connect */
+  user_fd = connect_to(path);
+  TESTASSERT( spe.write(data.data(),2) == std::make_pair(2u,false) );
+  TESTASSERT( recv(user_fd,user_buffer,20,0) == 2 );
+  close(user_fd);
+}
+
+
+/* test that a socket left behind at the path is replaced, and that the socket is removed
+ * when the SeqPacketEndpoint is destroyed
+ */
+TESTFUNC(SeqPacketIO_replace_and_remove)
+{
+  std::string path = "test_socket";
+  int fd = socket(AF_UNIX,SOCK_SEQPACKET,0);
+  sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path,path.c_str());
+  if( (fd == -1) or (bind(fd,(sockaddr*)&addr,sizeof(addr)) == -1) ){
+    TESTERROR("could not create socket at "+path);
+  }
+  close(fd);
+
+  {
+    SeqPacketEndpoint spe{path};
+    TESTASSERT( access(path.c_str(),F_OK) == 0 );
+  }
+  TESTASSERT( access(path.c_str(),F_OK) == -1 );
+}
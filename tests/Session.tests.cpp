@@ -3,6 +3,7 @@
 #include "../IDTypes.h"
 #include "../PeerConfig.h"
 #include "../SecretKey.h"
+#include "../Fec.h"
 
 #include <string>
 #include <memory>
@@ -12,6 +13,9 @@
 #include <thread>
 #include <fstream>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -41,14 +45,17 @@ struct SessionAndFDs
 };
 
 
-/* convenience method for making a Session and opening its fifos */
+/* convenience method for making a Session and opening its fifos (except for channels in
+   local mode, which have none) */
 SessionAndFDs make_session(const host_id_type& self_id,
                            const std::string& self_ip_addr,
                            in_port_t self_port,
                            unsigned int default_max_packet_size,
                            const std::vector<PeerConfig>& peer_configs,
                            const std::string& segnum_file_path,
-                           unsigned int num_connection_workers)
+                           unsigned int num_connection_workers,
+                           unsigned int default_pipe_size = 0,
+                           unsigned int hibernate_after_millis = 0)
 {
   /* create the segment number files */
   std::string segnum_string("1\n1");
@@ -62,7 +69,9 @@ SessionAndFDs make_session(const host_id_type& self_id,
   SessionAndFDs session_and_fds;
   session_and_fds.sess = std::make_unique<Session>(self_id, self_ip_addr, self_port,
                                                    default_max_packet_size, peer_configs,
-                                                   segnum_file_path, num_connection_workers);
+                                                   segnum_file_path, num_connection_workers,
+                                                   0, "", default_pipe_size,
+                                                   hibernate_after_millis);
 
   /* open the fifos for the session
    * note that the hard-coded "_OUTWARD" and "_INWARD" here need to be kept in sync with
@@ -70,6 +79,10 @@ SessionAndFDs make_session(const host_id_type& self_id,
    */
   for(const PeerConfig& pc : peer_configs){
     for(const channel_spec& cs: pc.channels){
+      if(std::find(pc.channel_modes.begin(),pc.channel_modes.end(),
+                   channel_mode_spec{cs.first,ChannelMode::local}) != pc.channel_modes.end()){
+        continue;
+      }
       std::string from_user_fifo_name = cs.second+"_OUTWARD";
       int from_user_fifo_fd = open(from_user_fifo_name.c_str(),O_WRONLY);
       TESTASSERT( from_user_fifo_fd != -1 );
@@ -272,6 +285,10 @@ TESTFUNC(Session_one_channel)
                                 host_B_port,
                                 max_packet_size};
 
+  /* host A's fifos get their capacity from the peer's pipe size, and host B's from its
+     default pipe size */
+  host_B_peer_config.pipe_size = 262144;
+
   SessionAndFDs host_A = make_session(host_A_id,
                                       ip_addr,host_A_port,
                                       max_packet_size,
@@ -283,7 +300,8 @@ TESTFUNC(Session_one_channel)
                                       max_packet_size,
                                       {host_A_peer_config},
                                       segnum_file_name,
-                                      5);
+                                      5,
+                                      131072);
 
   int write_fifo_fd = host_A.from_user_fifos[channel_id];
   int read_fifo_fd = host_B.to_user_fifos[channel_id];
@@ -303,6 +321,42 @@ TESTFUNC(Session_one_channel)
     TESTASSERT( move_data(write_fifo_fd,read_fifo_fd,num_bytes,chunk_size) );
   }
 
+  /* check that the metrics reflect the data which has been moved */
+  SessionMetrics sm_A = host_A.sess->metrics();
+  SessionMetrics sm_B = host_B.sess->metrics();
+  TESTASSERT(sm_A.num_connection_workers == 5);
+  TESTASSERT(sm_A.worker_runs > 0);
+  TESTASSERT(sm_A.uptime_micros > 0);
+  TESTASSERT(sm_A.startup_threads == 1); // too few Connections for more than one thread
+  TESTASSERT(sm_A.startup_connections_micros <= sm_A.startup_micros);
+  TESTASSERT(sm_A.startup_micros <= sm_A.uptime_micros);
+  TESTASSERT(sm_A.connections.size() == 1);
+  TESTASSERT(sm_A.connections[0].peer_name == host_B_name);
+  TESTASSERT(sm_A.connections[0].channel_id == channel_id);
+  TESTASSERT(sm_A.connections[0].metrics.bytes_out > 100*490'000);
+  TESTASSERT(sm_B.connections.size() == 1);
+  TESTASSERT(sm_B.connections[0].metrics.packets_in > 0);
+  TESTASSERT(sm_B.connections[0].metrics.auth_failures == 0);
+  TESTASSERT(sm_A.connections[0].metrics.outward_pipe_size == 262144);
+  TESTASSERT(sm_A.connections[0].metrics.inward_pipe_size == 262144);
+  TESTASSERT(sm_B.connections[0].metrics.outward_pipe_size == 131072);
+
+  /* check that each stage of the packet pipeline has been timed on the side where it
+     happens */
+  auto stage_count = [](const SessionMetrics& sm, PipelineStage stage)
+    { return sm.stage_latencies[static_cast<unsigned int>(stage)].histogram.count; };
+  TESTASSERT(sm_A.stage_latencies.size() == num_pipeline_stages);
+  TESTASSERT(sm_A.stage_latencies[static_cast<unsigned int>(PipelineStage::encrypt)].name
+             == "encrypt");
+  TESTASSERT(stage_count(sm_A,PipelineStage::fifo_read) > 0);
+  TESTASSERT(stage_count(sm_A,PipelineStage::encrypt) > 0);
+  TESTASSERT(stage_count(sm_A,PipelineStage::udp_send) > 0);
+  TESTASSERT(stage_count(sm_B,PipelineStage::udp_dispatch) > 0);
+  TESTASSERT(stage_count(sm_B,PipelineStage::scheduler_wait) > 0);
+  TESTASSERT(stage_count(sm_B,PipelineStage::inbound_queue) > 0);
+  TESTASSERT(stage_count(sm_B,PipelineStage::decrypt) > 0);
+  TESTASSERT(stage_count(sm_B,PipelineStage::fifo_write) > 0);
+
   host_A.close_all();
   host_B.close_all();
 }
@@ -416,3 +470,672 @@ TESTFUNC(Session_many_channels)
   host_A.close_all();
   host_B.close_all();
 }
+
+
+/* this test creates two Sessions, as an application linked with libcryptocomms would, and
+   checks that they can exchange messages on a channel in local mode with each of the ways
+   of sending and receiving */
+TESTFUNC(Session_local_channel)
+{
+  /* parameters for the two sessions */
+  host_id_type host_A_id{0x01,0xab,0x00,0x53};
+  host_id_type host_B_id{0x21,0x03,0x82,0x0f};
+  channel_id_type channel_id{0xa5,0x07};
+  std::string ip_addr("127.0.0.1");
+  in_port_t host_A_port = 12991;
+  in_port_t host_B_port = 12992;
+  int max_packet_size = 1000;
+  std::string segnum_file_name = "segnumfile";
+  SecretKey key("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+
+  PeerConfig host_A_peer_config{"host A",host_A_id,key,{channel_spec{channel_id,"unused"}},
+                                ip_addr,host_A_port,max_packet_size};
+  PeerConfig host_B_peer_config{"host B",host_B_id,key,{channel_spec{channel_id,"unused"}},
+                                ip_addr,host_B_port,max_packet_size};
+  host_A_peer_config.channel_modes.push_back({channel_id,ChannelMode::local});
+  host_B_peer_config.channel_modes.push_back({channel_id,ChannelMode::local});
+
+  SessionAndFDs host_A = make_session(host_A_id,ip_addr,host_A_port,max_packet_size,
+                                      {host_B_peer_config},segnum_file_name,5);
+  SessionAndFDs host_B = make_session(host_B_id,ip_addr,host_B_port,max_packet_size,
+                                      {host_A_peer_config},segnum_file_name,5);
+
+  TESTTHROW( host_A.sess->local_channel(host_A_id,channel_id), "no such channel" );
+  std::shared_ptr<LocalChannel> channel_A = host_A.sess->local_channel(host_B_id,channel_id);
+  std::shared_ptr<LocalChannel> channel_B = host_B.sess->local_channel(host_A_id,channel_id);
+  TESTASSERT( channel_A->max_message_size() == 960 );
+  TESTTHROW( channel_A->send(std::vector<unsigned char>(961).data(),961), "too long" );
+
+  /* messages sent with send() arrive whole and in order for receive() (they are sent in
+     bursts, so that none are lost for lack of room in the receiving UDP socket's buffer) */
+  TestBytes test_bytes;
+  std::vector<unsigned char> message;
+  for(unsigned int burst=0; burst<30; burst++){
+    for(unsigned int i=burst*10; i<(burst+1)*10; i++){
+      std::vector<unsigned char> sent = test_bytes.take_bytes((i*37)%960+1);
+      channel_A->send(sent.data(),sent.size());
+    }
+    for(unsigned int i=burst*10; i<(burst+1)*10; i++){
+      channel_B->receive(message);
+      TESTASSERT( message.size() == (i*37)%960+1 );
+      TESTASSERT( test_bytes.give_bytes(message) );
+    }
+  }
+
+  /* and likewise in the other direction with try_send() and try_receive() */
+  std::vector<unsigned char> reply{1,2,3};
+  TESTASSERT( channel_B->try_send(reply.data(),reply.size()) );
+  auto deadline = std::chrono::steady_clock::now()+std::chrono::seconds(5);
+  while( (not channel_A->try_receive(message)) and (std::chrono::steady_clock::now() < deadline) ){
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  TESTASSERT( message == reply );
+
+  /* with a callback set, messages are passed to it instead of being queued */
+  std::mutex received_lock;
+  std::condition_variable received_condvar;
+  std::vector<std::vector<unsigned char>> received;
+  channel_B->set_receive_callback([&](const unsigned char* data, unsigned int count){
+      const std::lock_guard<std::mutex> received_lock_guard(received_lock);
+      received.emplace_back(data,data+count);
+      received_condvar.notify_one();
+    });
+  for(unsigned int i=1; i<=50; i++){
+    std::vector<unsigned char> sent = test_bytes.take_bytes(i);
+    channel_A->send(sent.data(),sent.size());
+  }
+  {
+    std::unique_lock<std::mutex> received_unique_lock(received_lock);
+    TESTASSERT( received_condvar.wait_for(received_unique_lock,std::chrono::seconds(5),
+                                          [&](){ return received.size() == 50; }) );
+  }
+  for(const auto& m : received){
+    TESTASSERT( test_bytes.give_bytes(m) );
+  }
+  TESTASSERT( not channel_B->try_receive(message) );
+  channel_B->set_receive_callback(nullptr);
+}
+
+
+/* test that messages longer than a packet can carry are sent in fragments on a channel
+ * in local mode when the peers have a max_message_size, and arrive whole
+ */
+TESTFUNC(Session_fragmented_messages)
+{
+  /* parameters for the two sessions */
+  host_id_type host_A_id{0x01,0xab,0x00,0x53};
+  host_id_type host_B_id{0x21,0x03,0x82,0x0f};
+  channel_id_type channel_id{0xa5,0x07};
+  std::string ip_addr("127.0.0.1");
+  in_port_t host_A_port = 12991;
+  in_port_t host_B_port = 12992;
+  int max_packet_size = 1000;
+  std::string segnum_file_name = "segnumfile";
+  SecretKey key("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+
+  PeerConfig host_A_peer_config{"host A",host_A_id,key,{channel_spec{channel_id,"unused"}},
+                                ip_addr,host_A_port,max_packet_size};
+  PeerConfig host_B_peer_config{"host B",host_B_id,key,{channel_spec{channel_id,"unused"}},
+                                ip_addr,host_B_port,max_packet_size};
+  host_A_peer_config.channel_modes.push_back({channel_id,ChannelMode::local});
+  host_B_peer_config.channel_modes.push_back({channel_id,ChannelMode::local});
+  host_A_peer_config.max_message_size = 30000;
+  host_B_peer_config.max_message_size = 30000;
+
+  SessionAndFDs host_A = make_session(host_A_id,ip_addr,host_A_port,max_packet_size,
+                                      {host_B_peer_config},segnum_file_name,5);
+  SessionAndFDs host_B = make_session(host_B_id,ip_addr,host_B_port,max_packet_size,
+                                      {host_A_peer_config},segnum_file_name,5);
+
+  std::shared_ptr<LocalChannel> channel_A = host_A.sess->local_channel(host_B_id,channel_id);
+  std::shared_ptr<LocalChannel> channel_B = host_B.sess->local_channel(host_A_id,channel_id);
+  TESTASSERT( channel_A->max_message_size() == 30000 );
+
+  /* messages of all sizes arrive whole and in order (they are sent one at a time, so
+     that none of the fragments are lost for lack of room in the receiving UDP socket's
+     buffer) */
+  TestBytes test_bytes;
+  std::vector<unsigned char> message;
+  for(unsigned int i=0; i<40; i++){
+    unsigned int size = (i*7919)%30000+1;
+    std::vector<unsigned char> sent = test_bytes.take_bytes(size);
+    channel_A->send(sent.data(),sent.size());
+    channel_B->receive(message);
+    TESTASSERT( message.size() == size );
+    TESTASSERT( test_bytes.give_bytes(message) );
+  }
+
+  for(auto const& ncm : host_A.sess->metrics().connections){
+    TESTASSERT( ncm.metrics.messages_fragmented > 30 );
+  }
+  for(auto const& ncm : host_B.sess->metrics().connections){
+    TESTASSERT( ncm.metrics.reassembly_failures == 0 );
+  }
+}
+
+
+/* test that the data of the channels to a peer with bundling enabled arrives in order on
+ * each channel, and is carried in bundle packets rather than in packets of the channels'
+ * own
+ */
+TESTFUNC(Session_bundled_channels)
+{
+  /* parameters for the two sessions */
+  host_id_type host_A_id{0x01,0xab,0x00,0x53};
+  host_id_type host_B_id{0x21,0x03,0x82,0x0f};
+  std::vector<channel_id_type> channel_ids{{0xa5,0x07},{0x00,0x01},{0x31,0xc2}};
+  std::string ip_addr("127.0.0.1");
+  in_port_t host_A_port = 12993;
+  in_port_t host_B_port = 12994;
+  int max_packet_size = 1000;
+  std::string segnum_file_name = "segnumfile";
+  SecretKey key("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+
+  PeerConfig host_A_peer_config{"host A",host_A_id,key,{},ip_addr,host_A_port,max_packet_size};
+  PeerConfig host_B_peer_config{"host B",host_B_id,key,{},ip_addr,host_B_port,max_packet_size};
+  for(auto const& channel_id : channel_ids){
+    for(PeerConfig* pc : {&host_A_peer_config,&host_B_peer_config}){
+      pc->channels.push_back(channel_spec{channel_id,"unused"});
+      pc->channel_modes.push_back({channel_id,ChannelMode::local});
+    }
+  }
+  host_A_peer_config.bundle_window_micros = 500;
+  host_B_peer_config.bundle_window_micros = 500;
+
+  SessionAndFDs host_A = make_session(host_A_id,ip_addr,host_A_port,max_packet_size,
+                                      {host_B_peer_config},segnum_file_name,5);
+  SessionAndFDs host_B = make_session(host_B_id,ip_addr,host_B_port,max_packet_size,
+                                      {host_A_peer_config},segnum_file_name,5);
+
+  std::vector<std::shared_ptr<LocalChannel>> channels_A;
+  std::vector<std::shared_ptr<LocalChannel>> channels_B;
+  for(auto const& channel_id : channel_ids){
+    channels_A.push_back(host_A.sess->local_channel(host_B_id,channel_id));
+    channels_B.push_back(host_B.sess->local_channel(host_A_id,channel_id));
+  }
+  TESTASSERT( channels_A[0]->max_message_size() == 956 );
+
+  /* send bursts of small messages on all of the channels, and check that they arrive whole
+     and in order on each */
+  unsigned int num_messages = 0;
+  std::vector<unsigned char> message;
+  std::vector<TestBytes> test_bytes(channel_ids.size());
+  for(unsigned int burst=0; burst<20; burst++){
+    for(unsigned int i=0; i<10; i++){
+      for(unsigned int j=0; j<channel_ids.size(); j++){
+        std::vector<unsigned char> sent = test_bytes[j].take_bytes((i*7+j)%40+1);
+        channels_A[j]->send(sent.data(),sent.size());
+        num_messages++;
+      }
+    }
+    for(unsigned int i=0; i<10; i++){
+      for(unsigned int j=0; j<channel_ids.size(); j++){
+        channels_B[j]->receive(message);
+        TESTASSERT( message.size() == (i*7+j)%40+1 );
+        TESTASSERT( test_bytes[j].give_bytes(message) );
+      }
+    }
+  }
+
+  /* a lone message in the other direction is sent once the bundle window has passed */
+  std::vector<unsigned char> reply{1,2,3};
+  channels_B[1]->send(reply.data(),reply.size());
+  channels_A[1]->receive(message);
+  TESTASSERT( message == reply );
+
+  /* the channels' own Connections have not sent any data packets, and the bundle
+     Connection has sent fewer packets than there were messages */
+  SessionMetrics sm = host_A.sess->metrics();
+  TESTASSERT( sm.connections.size() == 4 );
+  for(auto const& ncm : sm.connections){
+    if(ncm.channel_id == Bundler::bundle_channel_id){
+      TESTASSERT( ncm.metrics.packets_out < num_messages );
+    }
+    else{
+      TESTASSERT( ncm.metrics.packets_out == 0 );
+    }
+  }
+}
+
+
+/* test that with a coalescing window, small writes to a channel's fifo are sent together
+ * in fewer packets, and that data held back is sent once the window has passed even when
+ * nothing more is written
+ */
+TESTFUNC(Session_coalescing)
+{
+  /* parameters for the two sessions */
+  host_id_type host_A_id{0x01,0xab,0x00,0x53};
+  host_id_type host_B_id{0x21,0x03,0x82,0x0f};
+  channel_id_type channel_id{0xa5,0x07};
+  std::string ip_addr("127.0.0.1");
+  in_port_t host_A_port = 12991;
+  in_port_t host_B_port = 12992;
+  int max_packet_size = 1000;
+  std::string segnum_file_name = "segnumfile";
+  SecretKey key("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+
+  PeerConfig host_A_peer_config{"host A",host_A_id,key,{channel_spec{channel_id,"host_B_fifo"}},
+                                ip_addr,host_A_port,max_packet_size};
+  PeerConfig host_B_peer_config{"host B",host_B_id,key,{channel_spec{channel_id,"host_A_fifo"}},
+                                ip_addr,host_B_port,max_packet_size};
+  host_B_peer_config.coalesce_window_micros = 2000;
+
+  SessionAndFDs host_A = make_session(host_A_id,ip_addr,host_A_port,max_packet_size,
+                                      {host_B_peer_config},segnum_file_name,5);
+  SessionAndFDs host_B = make_session(host_B_id,ip_addr,host_B_port,max_packet_size,
+                                      {host_A_peer_config},segnum_file_name,5);
+  int write_fifo_fd = host_A.from_user_fifos[channel_id];
+  int read_fifo_fd = host_B.to_user_fifos[channel_id];
+
+  /* write 100 records of 20 bytes, a little at a time */
+  TestBytes test_bytes;
+  for(int i=0; i<100; i++){
+    std::vector<unsigned char> record = test_bytes.take_bytes(20);
+    TESTASSERT( write(write_fifo_fd,record.data(),record.size()) == 20 );
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+
+  unsigned int num_received = 0;
+  std::vector<unsigned char> buff(2000);
+  while(num_received < 2000){
+    ssize_t ret = read(read_fifo_fd,buff.data(),2000-num_received);
+    if( (ret == -1) and (errno == EINTR) ){
+      continue;
+    }
+    TESTASSERT( ret > 0 );
+    TESTASSERT( test_bytes.give_bytes(std::vector<unsigned char>(buff.begin(),buff.begin()+ret)) );
+    num_received += ret;
+  }
+
+  /* the records went in far fewer packets than there were records (allowing for "hello"
+     and empty packets) */
+  SessionMetrics sm = host_A.sess->metrics();
+  TESTASSERT( sm.connections[0].metrics.packets_out < 50 );
+  TESTASSERT( sm.connections[0].metrics.coalesce_timeouts > 0 );
+
+  host_A.close_all();
+  host_B.close_all();
+}
+
+
+/* test that with compression enabled, compressible data is compressed on its way through
+ * a channel, and arrives intact, and that the metrics report how well it compressed
+ */
+TESTFUNC(Session_compression)
+{
+  /* parameters for the two sessions */
+  host_id_type host_A_id{0x01,0xab,0x00,0x53};
+  host_id_type host_B_id{0x21,0x03,0x82,0x0f};
+  channel_id_type channel_id{0xa5,0x07};
+  std::string ip_addr("127.0.0.1");
+  in_port_t host_A_port = 12991;
+  in_port_t host_B_port = 12992;
+  int max_packet_size = 1000;
+  std::string segnum_file_name = "segnumfile";
+  SecretKey key("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+
+  PeerConfig host_A_peer_config{"host A",host_A_id,key,{channel_spec{channel_id,"host_B_fifo"}},
+                                ip_addr,host_A_port,max_packet_size};
+  PeerConfig host_B_peer_config{"host B",host_B_id,key,{channel_spec{channel_id,"host_A_fifo"}},
+                                ip_addr,host_B_port,max_packet_size};
+  host_A_peer_config.compression = true;
+  host_B_peer_config.channel_compressions.push_back({channel_id,true});
+
+  SessionAndFDs host_A = make_session(host_A_id,ip_addr,host_A_port,max_packet_size,
+                                      {host_B_peer_config},segnum_file_name,5);
+  SessionAndFDs host_B = make_session(host_B_id,ip_addr,host_B_port,max_packet_size,
+                                      {host_A_peer_config},segnum_file_name,5);
+  int write_fifo_fd = host_A.from_user_fifos[channel_id];
+  int read_fifo_fd = host_B.to_user_fifos[channel_id];
+
+  /* write some telemetry-like text */
+  std::string text;
+  for(unsigned int i=0; text.size()<20000; i++){
+    text += "{\"sensor\":"+std::to_string(i%13)+",\"reading\":"+std::to_string(i%101)+"}\n";
+  }
+  TESTASSERT( write(write_fifo_fd,text.data(),text.size()) == static_cast<ssize_t>(text.size()) );
+  std::string received;
+  std::vector<char> buff(text.size());
+  while(received.size() < text.size()){
+    ssize_t ret = read(read_fifo_fd,buff.data(),text.size()-received.size());
+    if( (ret == -1) and (errno == EINTR) ){
+      continue;
+    }
+    TESTASSERT( ret > 0 );
+    received.append(buff.data(),ret);
+  }
+  TESTASSERT( received == text );
+
+  ConnectionMetricsSnapshot cms = host_A.sess->metrics().connections[0].metrics;
+  TESTASSERT( cms.compression_bytes_in == text.size() );
+  TESTASSERT( cms.compression_bytes_out < text.size()/2 );
+  TESTASSERT( cms.compression_nanos > 0 );
+  TESTASSERT( host_B.sess->metrics().connections[0].metrics.compression_nanos > 0 );
+
+  host_A.close_all();
+  host_B.close_all();
+}
+
+
+/* test that with forward error correction enabled, data arrives intact through a channel
+ * with repair packets sent alongside it, and that with no losses on the way the groups
+ * stay as large as they can be
+ */
+TESTFUNC(Session_fec)
+{
+  /* parameters for the two sessions */
+  host_id_type host_A_id{0x01,0xab,0x00,0x53};
+  host_id_type host_B_id{0x21,0x03,0x82,0x0f};
+  channel_id_type channel_id{0xa5,0x07};
+  std::string ip_addr("127.0.0.1");
+  in_port_t host_A_port = 12991;
+  in_port_t host_B_port = 12992;
+  int max_packet_size = 1000;
+  std::string segnum_file_name = "segnumfile";
+  SecretKey key("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+
+  PeerConfig host_A_peer_config{"host A",host_A_id,key,{channel_spec{channel_id,"host_B_fifo"}},
+                                ip_addr,host_A_port,max_packet_size};
+  PeerConfig host_B_peer_config{"host B",host_B_id,key,{channel_spec{channel_id,"host_A_fifo"}},
+                                ip_addr,host_B_port,max_packet_size};
+  host_A_peer_config.fec = true;
+  host_B_peer_config.channel_fecs.push_back({channel_id,true});
+
+  SessionAndFDs host_A = make_session(host_A_id,ip_addr,host_A_port,max_packet_size,
+                                      {host_B_peer_config},segnum_file_name,5);
+  SessionAndFDs host_B = make_session(host_B_id,ip_addr,host_B_port,max_packet_size,
+                                      {host_A_peer_config},segnum_file_name,5);
+  int write_fifo_fd = host_A.from_user_fifos[channel_id];
+  int read_fifo_fd = host_B.to_user_fifos[channel_id];
+
+  std::vector<char> data(100000);
+  for(unsigned int i=0; i<data.size(); i++){
+    data[i] = (i*7) % 251;
+  }
+  std::vector<char> received;
+  std::vector<char> buff(data.size());
+  for(unsigned int sent=0; sent<data.size(); sent+=10000){
+    TESTASSERT( write(write_fifo_fd,data.data()+sent,10000) == 10000 );
+    while(received.size() < sent+10000){
+      ssize_t ret = read(read_fifo_fd,buff.data(),sent+10000-received.size());
+      if( (ret == -1) and (errno == EINTR) ){
+        continue;
+      }
+      TESTASSERT( ret > 0 );
+      received.insert(received.end(),buff.begin(),buff.begin()+ret);
+    }
+  }
+  TESTASSERT( received == data );
+
+  /* the last group is closed once it has waited long enough */
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ConnectionMetricsSnapshot cms = host_A.sess->metrics().connections[0].metrics;
+  TESTASSERT( cms.fec_repairs_sent > 0 );
+  TESTASSERT( cms.fec_repairs_sent < cms.packets_out/4 );
+  TESTASSERT( cms.fec_group_size == FecEncoder::max_group_size );
+  TESTASSERT( cms.max_packet_size == static_cast<unsigned int>(max_packet_size) );
+
+  host_A.close_all();
+  host_B.close_all();
+}
+
+
+/* test that with path MTU discovery enabled, a channel in fifo mode goes on to send
+ * packets as large as the path (here the loopback interface) allows, up to
+ * probe_max_size, and that the metrics report the size in use
+ */
+TESTFUNC(Session_path_mtu_discovery)
+{
+  /* parameters for the two sessions */
+  host_id_type host_A_id{0x01,0xab,0x00,0x53};
+  host_id_type host_B_id{0x21,0x03,0x82,0x0f};
+  channel_id_type channel_id{0xa5,0x07};
+  std::string ip_addr("127.0.0.1");
+  in_port_t host_A_port = 12991;
+  in_port_t host_B_port = 12992;
+  int max_packet_size = 1000;
+  std::string segnum_file_name = "segnumfile";
+  SecretKey key("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+
+  PeerConfig host_A_peer_config{"host A",host_A_id,key,{channel_spec{channel_id,"host_B_fifo"}},
+                                ip_addr,host_A_port,max_packet_size};
+  PeerConfig host_B_peer_config{"host B",host_B_id,key,{channel_spec{channel_id,"host_A_fifo"}},
+                                ip_addr,host_B_port,max_packet_size};
+  host_A_peer_config.probe_max_size = 9000;
+  host_B_peer_config.probe_max_size = 9000;
+
+  SessionAndFDs host_A = make_session(host_A_id,ip_addr,host_A_port,max_packet_size,
+                                      {host_B_peer_config},segnum_file_name,5);
+  SessionAndFDs host_B = make_session(host_B_id,ip_addr,host_B_port,max_packet_size,
+                                      {host_A_peer_config},segnum_file_name,5);
+  int write_fifo_fd = host_A.from_user_fifos[channel_id];
+  int read_fifo_fd = host_B.to_user_fifos[channel_id];
+
+  /* max_packet_size_of() finds the packet size in use by host A's Connection for a
+     channel */
+  auto max_packet_size_of = [&](const channel_id_type& ch_id){
+    for(auto const& ncm : host_A.sess->metrics().connections){
+      if(ncm.channel_id == ch_id){
+        return ncm.metrics.max_packet_size;
+      }
+    }
+    return metric_value_t(0);
+  };
+
+  /* wait for the search to settle */
+  for(int i=0; (i<200) and (max_packet_size_of(channel_id) < 9000-PathProber::search_granularity); i++){
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  TESTASSERT( max_packet_size_of(channel_id) > 9000-PathProber::search_granularity );
+  TESTASSERT( max_packet_size_of(channel_id) <= 9000 );
+  TESTASSERT( max_packet_size_of(PathProber::probe_channel_id) == max_packet_size_of(channel_id) );
+
+  /* data written to the fifo goes in the larger packets */
+  SessionMetrics sm = host_A.sess->metrics();
+  metric_value_t packets_before = 0;
+  for(auto const& ncm : sm.connections){
+    if(ncm.channel_id == channel_id){
+      packets_before = ncm.metrics.packets_out;
+    }
+  }
+  TestBytes test_bytes;
+  std::vector<unsigned char> sent = test_bytes.take_bytes(20000);
+  TESTASSERT( write(write_fifo_fd,sent.data(),sent.size()) == 20000 );
+  unsigned int num_received = 0;
+  std::vector<unsigned char> buff(20000);
+  while(num_received < 20000){
+    ssize_t ret = read(read_fifo_fd,buff.data(),20000-num_received);
+    if( (ret == -1) and (errno == EINTR) ){
+      continue;
+    }
+    TESTASSERT( ret > 0 );
+    TESTASSERT( test_bytes.give_bytes(std::vector<unsigned char>(buff.begin(),buff.begin()+ret)) );
+    num_received += ret;
+  }
+  sm = host_A.sess->metrics();
+  for(auto const& ncm : sm.connections){
+    if(ncm.channel_id == channel_id){
+      TESTASSERT( ncm.metrics.packets_out-packets_before < 10 );
+    }
+  }
+
+  host_A.close_all();
+  host_B.close_all();
+}
+
+
+/* test that reload() adds and retires channels and peers while the Session runs, and
+ * leaves the channels which have not changed as they were
+ */
+TESTFUNC(Session_reload)
+{
+  /* parameters for the two sessions */
+  host_id_type host_A_id{0x01,0xab,0x00,0x53};
+  host_id_type host_B_id{0x21,0x03,0x82,0x0f};
+  host_id_type host_C_id{0x77,0x10,0x00,0x02};
+  channel_id_type kept_id{0xa5,0x07};
+  channel_id_type dropped_id{0xa5,0x08};
+  channel_id_type added_id{0xa5,0x09};
+  std::string ip_addr("127.0.0.1");
+  in_port_t host_A_port = 12991;
+  in_port_t host_B_port = 12992;
+  int max_packet_size = 1000;
+  std::string segnum_file_name = "segnumfile";
+  SecretKey key("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+
+  PeerConfig host_A_peer_config{"host A",host_A_id,key,{channel_spec{kept_id,"unused"},
+                                                        channel_spec{dropped_id,"unused"}},
+                                ip_addr,host_A_port,max_packet_size};
+  PeerConfig host_B_peer_config{"host B",host_B_id,key,{channel_spec{kept_id,"unused"},
+                                                        channel_spec{dropped_id,"unused"}},
+                                ip_addr,host_B_port,max_packet_size};
+  for(auto const& ch_id : {kept_id,dropped_id,added_id}){
+    host_A_peer_config.channel_modes.push_back({ch_id,ChannelMode::local});
+    host_B_peer_config.channel_modes.push_back({ch_id,ChannelMode::local});
+  }
+
+  SessionAndFDs host_A = make_session(host_A_id,ip_addr,host_A_port,max_packet_size,
+                                      {host_B_peer_config},segnum_file_name,5);
+  SessionAndFDs host_B = make_session(host_B_id,ip_addr,host_B_port,max_packet_size,
+                                      {host_A_peer_config},segnum_file_name,5);
+
+  /* check_channel() sends a message from host A to host B on a channel, and reports
+     whether it arrives */
+  auto check_channel = [&](const channel_id_type& ch_id){
+    std::vector<unsigned char> sent{1,2,3,4,5};
+    host_A.sess->local_channel(host_B_id,ch_id)->send(sent.data(),sent.size());
+    std::vector<unsigned char> message;
+    auto deadline = std::chrono::steady_clock::now()+std::chrono::seconds(5);
+    while(std::chrono::steady_clock::now() < deadline){
+      if(host_B.sess->local_channel(host_A_id,ch_id)->try_receive(message)){
+        return message == sent;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+  };
+  auto packets_out_of = [&](const channel_id_type& ch_id){
+    for(auto const& ncm : host_A.sess->metrics().connections){
+      if(ncm.channel_id == ch_id){
+        return ncm.metrics.packets_out;
+      }
+    }
+    return metric_value_t(0);
+  };
+
+  TESTASSERT( check_channel(kept_id) );
+  TESTASSERT( check_channel(dropped_id) );
+  std::shared_ptr<LocalChannel> kept_channel = host_A.sess->local_channel(host_B_id,kept_id);
+  metric_value_t kept_packets_out = packets_out_of(kept_id);
+
+  /* swap one channel for another on both sides, and add a peer on one side */
+  host_A_peer_config.channels[1] = channel_spec{added_id,"unused"};
+  host_B_peer_config.channels[1] = channel_spec{added_id,"unused"};
+  PeerConfig host_C_peer_config{"host C",host_C_id,key,{channel_spec{kept_id,"unused"}},
+                                ip_addr,12993,max_packet_size};
+  host_C_peer_config.channel_modes.push_back({kept_id,ChannelMode::local});
+  host_A.sess->reload({host_B_peer_config,host_C_peer_config});
+  host_B.sess->reload({host_A_peer_config});
+
+  TESTASSERT( host_A.sess->metrics().connections.size() == 3 );
+  TESTTHROW( host_A.sess->local_channel(host_B_id,dropped_id), "no such channel" );
+  TESTASSERT( host_A.sess->local_channel(host_C_id,kept_id) );
+  TESTASSERT( check_channel(added_id) );
+  TESTASSERT( host_A.sess->local_channel(host_B_id,kept_id) == kept_channel );
+  TESTASSERT( packets_out_of(kept_id) >= kept_packets_out );
+  TESTASSERT( check_channel(kept_id) );
+
+  /* a change to a channel's settings replaces its Connection, and dropping a peer retires
+     its Connections */
+  host_A_peer_config.channel_pipe_sizes.push_back({kept_id,65536});
+  host_B_peer_config.channel_pipe_sizes.push_back({kept_id,65536});
+  host_A.sess->reload({host_B_peer_config});
+  host_B.sess->reload({host_A_peer_config});
+  TESTASSERT( host_A.sess->metrics().connections.size() == 2 );
+  TESTTHROW( host_A.sess->local_channel(host_C_id,kept_id), "no such channel" );
+  TESTASSERT( host_A.sess->local_channel(host_B_id,kept_id) != kept_channel );
+  TESTASSERT( check_channel(kept_id) );
+  TESTASSERT( check_channel(added_id) );
+
+  /* a change to a peer's own settings replaces all of its Connections */
+  std::shared_ptr<LocalChannel> added_channel = host_A.sess->local_channel(host_B_id,added_id);
+  host_B_peer_config.name = "host B renamed";
+  host_A.sess->reload({host_B_peer_config});
+  TESTASSERT( host_A.sess->local_channel(host_B_id,added_id) != added_channel );
+  TESTASSERT( host_A.sess->metrics().connections[0].peer_name == "host B renamed" );
+  TESTASSERT( check_channel(added_id) );
+}
+
+
+/* test that with hibernation enabled, channels are left asleep until they are used, and
+ * are put back to sleep once they have been unused for a while, still carrying data
+ * between the hosts whenever they are woken
+ */
+TESTFUNC(Session_hibernation)
+{
+  /* parameters for the two sessions */
+  host_id_type host_A_id{0x01,0xab,0x00,0x53};
+  host_id_type host_B_id{0x21,0x03,0x82,0x0f};
+  channel_id_type channel_id{0xa5,0x07};
+  std::string ip_addr("127.0.0.1");
+  in_port_t host_A_port = 12994;
+  in_port_t host_B_port = 12995;
+  int max_packet_size = 1000;
+  std::string segnum_file_name = "segnumfile";
+  SecretKey key("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+  unsigned int hibernate_after_millis = 200;
+
+  PeerConfig host_A_peer_config{"host A",host_A_id,key,{channel_spec{channel_id,"unused"}},
+                                ip_addr,host_A_port,max_packet_size};
+  PeerConfig host_B_peer_config{"host B",host_B_id,key,{channel_spec{channel_id,"unused"}},
+                                ip_addr,host_B_port,max_packet_size};
+  host_A_peer_config.channel_modes.push_back({channel_id,ChannelMode::local});
+  host_B_peer_config.channel_modes.push_back({channel_id,ChannelMode::local});
+
+  SessionAndFDs host_A = make_session(host_A_id,ip_addr,host_A_port,max_packet_size,
+                                      {host_B_peer_config},segnum_file_name,5,0,
+                                      hibernate_after_millis);
+  SessionAndFDs host_B = make_session(host_B_id,ip_addr,host_B_port,max_packet_size,
+                                      {host_A_peer_config},segnum_file_name,5,0,
+                                      hibernate_after_millis);
+  TESTASSERT( host_A.sess->metrics().connections_dormant == 1 );
+  TESTASSERT( host_B.sess->metrics().connections_dormant == 1 );
+
+  /* check_channel() sends a message from host A to host B, and reports whether it
+     arrives */
+  auto check_channel = [&](){
+    std::vector<unsigned char> sent{1,2,3,4,5};
+    host_A.sess->local_channel(host_B_id,channel_id)->send(sent.data(),sent.size());
+    std::vector<unsigned char> message;
+    auto deadline = std::chrono::steady_clock::now()+std::chrono::seconds(5);
+    while(std::chrono::steady_clock::now() < deadline){
+      if(host_B.sess->local_channel(host_A_id,channel_id)->try_receive(message)){
+        return message == sent;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+  };
+  /* both_dormant() waits for the channel to be asleep on both hosts */
+  auto both_dormant = [&](){
+    auto deadline = std::chrono::steady_clock::now()+std::chrono::seconds(5);
+    while(std::chrono::steady_clock::now() < deadline){
+      if( (host_A.sess->metrics().connections_dormant == 1) and
+          (host_B.sess->metrics().connections_dormant == 1) ){
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+  };
+
+  TESTASSERT( check_channel() );
+  TESTASSERT( host_B.sess->metrics().connections_dormant == 0 );
+  TESTASSERT( both_dormant() );
+  for(int i=0; i<3; i++){
+    TESTASSERT( check_channel() );
+    TESTASSERT( both_dormant() );
+  }
+  TESTASSERT( host_A.sess->metrics().connections[0].metrics.hello_packets_sent >= 1 );
+}
@@ -0,0 +1,193 @@
+#include "testsys.h"
+#include "../ShmIO.h"
+#include "../ShmChannel.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+  /* make_message() makes a message of the given length, with contents depending on seed */
+  std::vector<unsigned char> make_message(unsigned int length, unsigned char seed)
+  {
+    std::vector<unsigned char> message(length);
+    for(unsigned int i=0; i<length; i++){
+      message[i] = seed+i;
+    }
+    return message;
+  }
+
+
+  /* readable() reports whether fd is readable */
+  bool readable(int fd)
+  {
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return (poll(&pfd,1,0) == 1) and ( (pfd.revents & POLLIN) != 0 );
+  }
+}
+
+
+/* test that a ShmRing keeps messages in order as it wraps around, skipping the end of
+ * its data area where a message would not fit, and that it refuses messages when full
+ */
+TESTFUNC(ShmIO_ring)
+{
+  ShmRingControl control{};
+  std::vector<unsigned char> data(256);
+  ShmRing ring(&control,data.data(),256);
+  TESTASSERT( ring.max_message_size() == 120 );
+  TESTASSERT( ring.empty() );
+  TESTASSERT( not ring.push(data.data(),121) );
+
+  /* each message of 50 bytes takes 56 bytes, so four fill all but 32 bytes */
+  for(unsigned char i=0; i<4; i++){
+    TESTASSERT( ring.push(make_message(50,i).data(),50) );
+  }
+  TESTASSERT( not ring.has_room(50) );
+  TESTASSERT( ring.has_room(28) );
+
+  /* after two are taken, another fits only by skipping the 32 bytes at the end */
+  const unsigned char* message;
+  std::uint32_t length;
+  for(unsigned char i=0; i<2; i++){
+    TESTASSERT( ring.front(message,length) );
+    TESTASSERT( std::vector<unsigned char>(message,message+length) == make_message(50,i) );
+    ring.pop(length);
+  }
+  TESTASSERT( ring.push(make_message(50,4).data(),50) );
+  TESTASSERT( ring.has_room(50) );
+  TESTASSERT( not ring.has_room(60) );
+  for(unsigned char i=2; i<5; i++){
+    TESTASSERT( ring.front(message,length) );
+    TESTASSERT( std::vector<unsigned char>(message,message+length) == make_message(50,i) );
+    ring.pop(length);
+  }
+  TESTASSERT( not ring.front(message,length) );
+  TESTASSERT( ring.empty() );
+
+  /* a waiting flag is only taken once */
+  TESTASSERT( not ring.take_consumer_wait() );
+  ring.arm_consumer_wait();
+  TESTASSERT( ring.take_consumer_wait() );
+  TESTASSERT( not ring.take_consumer_wait() );
+}
+
+
+/* test that a file which is not a regular file where the shared memory should be, or a
+ * client with nothing to attach to, generates the correct error
+ */
+TESTFUNC(ShmIO_bad_path)
+{
+  std::string base_path = "test_shm_bad";
+  unlink((base_path+"_SHM").c_str());
+  TESTTHROW(ShmChannelClient{base_path},"could not open shared memory");
+  if(mkfifo((base_path+"_SHM").c_str(),S_IRUSR|S_IWUSR) == -1){
+    TESTERROR("could not create fifo for "+base_path);
+  }
+  TESTTHROW(ShmEndpoint(base_path,0),"is not a regular file");
+  TESTTHROW(ShmEndpoint("test_shm",2000000000),"ring capacity too large");
+}
+
+
+/* test that messages are passed in both directions between a ShmEndpoint and a
+ * ShmChannelClient, and that each side's doorbell is rung only when it is waiting
+ */
+TESTFUNC(ShmIO_messages)
+{
+  std::string base_path = "test_shm";
+  ShmEndpoint endpoint(base_path,300000);
+  TESTASSERT( endpoint.ring_capacity() == 524288 );
+  std::vector<unsigned char> buffer(2000,0);
+
+  /* with no user program attached, writes are reported as having nowhere to go */
+  std::vector<unsigned char> message = make_message(100,1);
+  TESTASSERT( endpoint.write(message.data(),100) == std::make_pair(0u,true) );
+  TESTASSERT( not endpoint.data_waiting() );
+
+  ShmChannelClient client(base_path);
+  TESTASSERT( client.max_message_size() == 262136 );
+
+  /* the first message from the user program rings the endpoint's doorbell, as does the
+     next one after the endpoint has found nothing to read, but not any in between */
+  TESTASSERT( not readable(endpoint.file_descriptor()) );
+  TESTASSERT( client.try_send(message.data(),100) );
+  TESTASSERT( readable(endpoint.file_descriptor()) );
+  TESTASSERT( client.try_send(message.data(),0) );
+  TESTASSERT( client.try_send(message.data(),30) );
+  TESTASSERT( client.try_send(message.data(),1500) );
+  TESTASSERT( endpoint.data_waiting() );
+  TESTASSERT( not readable(endpoint.file_descriptor()) );
+  TESTTHROW( endpoint.read_into(buffer,1000,1500), "no room in buffer" );
+  TESTASSERT( endpoint.read_into(buffer,10,1000) == std::make_pair(100u,false) );
+  TESTASSERT( std::vector<unsigned char>(buffer.begin()+10,buffer.begin()+110) == message );
+  TESTASSERT( endpoint.read_into(buffer,10,1000) == std::make_pair(30u,false) );
+  TESTASSERT( endpoint.read_into(buffer,10,1000) == std::make_pair(0u,true) );
+  TESTASSERT( endpoint.read_into(buffer,10,1000) == std::make_pair(0u,false) );
+  TESTASSERT( not endpoint.data_waiting() );
+  TESTASSERT( client.try_send(message.data(),2) );
+  TESTASSERT( readable(endpoint.file_descriptor()) );
+  TESTASSERT( endpoint.read_into(buffer,0,1000) == std::make_pair(2u,false) );
+
+  /* messages from the endpoint keep their boundaries, and ring the user program's
+     doorbell only once it has waited */
+  std::vector<unsigned char> received;
+  TESTASSERT( endpoint.write(message.data(),100) == std::make_pair(100u,false) );
+  TESTASSERT( not readable(client.doorbell_fd()) );
+  TESTASSERT( client.try_receive(received) );
+  TESTASSERT( received == message );
+  TESTASSERT( not client.try_receive(received) );
+  client.wait(0);
+  TESTASSERT( endpoint.write(message.data()+50,20) == std::make_pair(20u,false) );
+  TESTASSERT( readable(client.doorbell_fd()) );
+  client.wait(0);
+  TESTASSERT( not readable(client.doorbell_fd()) );
+  TESTASSERT( client.try_receive(received) );
+  TESTASSERT( received == std::vector<unsigned char>(message.begin()+50,message.begin()+70) );
+
+  /* when the inward ring is full, the endpoint is rung once the user program makes room */
+  std::vector<unsigned char> big_message = make_message(60000,3);
+  unsigned int pushed = 0;
+  while(endpoint.has_room(60000)){
+    TESTASSERT( endpoint.write(big_message.data(),60000) == std::make_pair(60000u,false) );
+    pushed++;
+  }
+  TESTASSERT( pushed == 8 );
+  TESTASSERT( endpoint.write(big_message.data(),60000) == std::make_pair(0u,false) );
+  TESTASSERT( not endpoint.data_waiting() );
+  TESTASSERT( client.try_receive(received) );
+  TESTASSERT( received == big_message );
+  TESTASSERT( readable(endpoint.file_descriptor()) );
+  TESTASSERT( endpoint.has_room(60000) );
+  TESTASSERT( not endpoint.data_waiting() );
+  TESTASSERT( not readable(endpoint.file_descriptor()) );
+}
+
+
+/* test that the shared memory is removed when the ShmEndpoint is destroyed, and that
+ * writes are refused once the user program has detached
+ */
+TESTFUNC(ShmIO_detach_and_remove)
+{
+  std::string base_path = "test_shm";
+  {
+    ShmEndpoint endpoint(base_path,0);
+    TESTASSERT( endpoint.ring_capacity() == ShmEndpoint::default_ring_capacity );
+    {
+      ShmChannelClient client(base_path);
+      std::vector<unsigned char> message = make_message(10,0);
+      TESTASSERT( endpoint.write(message.data(),10) == std::make_pair(10u,false) );
+    }
+    std::vector<unsigned char> message = make_message(10,0);
+    TESTASSERT( endpoint.write(message.data(),10) == std::make_pair(0u,true) );
+    TESTASSERT( access((base_path+"_SHM").c_str(),F_OK) == 0 );
+  }
+  TESTASSERT( access((base_path+"_SHM").c_str(),F_OK) == -1 );
+}